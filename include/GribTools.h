@@ -7,10 +7,12 @@
 #ifndef GRIBTOOLS_H
 #define GRIBTOOLS_H
 
+#include <newbase/NFmiDataMatrix.h>
 #include <newbase/NFmiLevel.h>
 #include <newbase/NFmiParam.h>
 
 #include <grib_api.h>
+#include <cstddef>
 #include <string>
 #include <vector>
 
@@ -30,6 +32,14 @@ void gset(grib_handle *g, const char *name, int value);
 void gset(grib_handle *g, const char *name, const char *value);
 void gset(grib_handle *g, const char *name, const std::string &value);
 
+// Decoded values to a grid in newbase order (x-major, south to north)
+
+void UnpackGribValues(const double *theValues,
+                      std::size_t theCount,
+                      long theScanningMode,
+                      double theMissingValue,
+                      NFmiDataMatrix<float> &theMatrix);
+
 // grib.conf reader
 
 struct ParamChangeItem
@@ -0,0 +1,94 @@
+// ======================================================================
+/*!
+ * \file
+ * \brief Interface of the LocationCacheStore class
+ */
+// ======================================================================
+/*!
+ * \class LocationCacheStore
+ *
+ * Stores the location of each target grid point in source grid
+ * coordinates, as calculated by NFmiGrid::CalcLatlonCachePoints, for
+ * every source and target grid pair used in a reprojection.
+ *
+ * The store is thread safe and returns references to the caches, which
+ * stay valid for the lifetime of the store. Each cache is calculated only
+ * once even if several threads request it at the same time.
+ *
+ * If a directory is set, the caches are also saved there, named by a
+ * hash of both grids. Later runs memory map the saved files instead of
+ * calling CalcLatlonCachePoints again. The files are in native byte
+ * order and are validated against the grid descriptions they were made
+ * for, so a stale or foreign file is simply recalculated.
+ */
+// ======================================================================
+
+#ifndef LOCATIONCACHESTORE_H
+#define LOCATIONCACHESTORE_H
+
+#include <boost/iostreams/device/mapped_file.hpp>
+#include <boost/thread.hpp>
+#include <newbase/NFmiPoint.h>
+
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+class NFmiGrid;
+
+// Target grid points in source grid coordinates for one grid pair
+class LocationCache
+{
+ public:
+  std::size_t size() const { return itsSize; }
+
+  // The index is that of NFmiGrid::Index() in the target grid
+  NFmiPoint gridPoint(std::size_t theTargetIndex) const
+  {
+    const double *p = itsPoints + 2 * theTargetIndex;
+    return NFmiPoint(p[0], p[1]);
+  }
+
+  bool mapped() const { return itsFile.is_open(); }
+
+ private:
+  friend class LocationCacheStore;
+
+  std::once_flag itsOnceFlag;
+  std::size_t itsSize = 0;
+  const double *itsPoints = nullptr;
+  std::vector<double> itsMemory;                  // calculated points
+  boost::iostreams::mapped_file_source itsFile;  // or points loaded from disk
+};
+
+class LocationCacheStore
+{
+ public:
+  LocationCacheStore() = default;
+
+  void directory(const std::string &theDirectory);
+  const std::string &directory() const { return itsDirectory; }
+
+  const LocationCache &find(const NFmiGrid &theSourceGrid, const NFmiGrid &theTargetGrid);
+
+ private:
+  LocationCacheStore(const LocationCacheStore &theOther);
+  LocationCacheStore &operator=(const LocationCacheStore &theOther);
+
+  void calculate(LocationCache &theCache,
+                 const NFmiGrid &theSourceGrid,
+                 const NFmiGrid &theTargetGrid) const;
+  bool load(LocationCache &theCache, const std::string &theKey, std::size_t theSize) const;
+  void save(const LocationCache &theCache, const std::string &theKey) const;
+  std::string filename(const std::string &theKey) const;
+
+  boost::mutex itsMutex;
+  std::string itsDirectory;
+  std::map<std::string, std::unique_ptr<LocationCache> > itsCaches;
+};
+
+#endif  // LOCATIONCACHESTORE_H
+
+// ======================================================================
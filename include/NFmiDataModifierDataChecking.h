@@ -20,12 +20,12 @@ class NFmiDataModifierDataChecking : public NFmiDataModifier
   int CheckedDataCount(void) { return itsCheckedDataCount; }
   int FoundDataCount(void) { return itsFoundDataCount; }
   using NFmiDataModifier::CalculationResult;
-  float CalculationResult(void)
+  float CalculationResult(void) { return Percentage(itsFoundDataCount, itsCheckedDataCount); };
+  static float Percentage(long theFoundDataCount, long theCheckedDataCount)
   {
-    float result =
-        itsCheckedDataCount ? itsFoundDataCount / float(itsCheckedDataCount) * 100 : kFloatMissing;
-    return result;
-  };
+    return theCheckedDataCount ? theFoundDataCount / float(theCheckedDataCount) * 100
+                               : kFloatMissing;
+  }
 
  protected:
   int itsCheckedDataCount;
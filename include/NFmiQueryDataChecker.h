@@ -86,16 +86,13 @@ class NFmiQueryDataChecker
   const std::vector<int>& RandomLocationIndexies(void) const { return itsRandomLocationIndexies; }
   void DoIndexRandomizing(bool value) { fDoIndexRandomizing = value; }
   bool DoIndexRandomizing(void) { return fDoIndexRandomizing; }
+  // tarkistuksen sikeiden mr (oletus 1), tulokset eivt riipu siit
+  void ThreadCount(unsigned int value) { itsThreadCount = value; }
+  unsigned int ThreadCount(void) const { return itsThreadCount; }
 
  private:
-  bool DoMissingDataCheck(void);
-  bool DoStraightDataCheck(void);
-  bool DoOutOfLimitsDataCheck(void);
   void MakeRandomLocationIndexies(void);
-  bool GoThroughData(NFmiDataModifier* theModifier);
-  bool GoThroughLocationDataDataInTime(NFmiDataModifier* theModifier);
-  bool GoThroughRandomLocationsDataInTime(NFmiDataModifier* theModifier);
-  bool GoThroughAllLocationsDataInTime(NFmiDataModifier* theModifier);
+  bool GoThroughData(void);
   void CheckOutOfLimitsTerms(NFmiParamCheckData& theParamCheckData, NFmiDataModifier* theModifier);
 
   // Tarkastettavat parametrit pit olla aktiivisia.
@@ -129,8 +126,6 @@ class NFmiQueryDataChecker
 
   NFmiOhjausData*
       itsOhjausData;  // (ei omista) tnne talletetaan parametrikohtaiset tiedost tarkastelusta
-  int itsCheckOperationIndex;  // 1=missing, 2=straight, 4=out-of-limit. ohjausdata rakennetta
-                               // pivitetn operaation mukaan
-  int itsParamIdIndex;         // ohjausdata rakennetta pivitetn parametrin mukaan
+  unsigned int itsThreadCount;  // parametrit ja paikkojen lohkot tarkistetaan rinnakkain
 };
 #endif
@@ -11,12 +11,16 @@
  * querydata sources simultaneously, and to return the queryinfo
  * containing the desired station number or coordinate.
  *
+ * Coordinates are searched from point data with a StationIndex built
+ * once per file when first needed.
+ *
  */
 // ======================================================================
 
 #ifndef QUERYDATAMANAGER_H
 #define QUERYDATAMANAGER_H
 
+#include "StationIndex.h"
 #include <boost/tuple/tuple.hpp>
 #include <newbase/NFmiFastQueryInfo.h>
 
@@ -31,7 +35,17 @@ class QueryDataManager
   ~QueryDataManager();
   QueryDataManager();
 
+  // Where a coordinate was found in the data, see locate()
+  struct Position
+  {
+    NFmiPoint lonlat;
+    int file = -1;               // index of the data, or -1 if not found
+    unsigned long location = 0;  // location index in the data
+    double distance = -1;        // distance to the data if not found
+  };
+
   void multimode() { itsMultiMode = true; }
+  void memorymap(bool theFlag) { itsMemoryMap = theFlag; }
   std::set<int> stations();
 
   void searchpath(const std::string &theSearchPath);
@@ -40,6 +54,10 @@ class QueryDataManager
 
   void setstation(int theWmoNumber);
   void setpoint(const NFmiPoint &thePoint, double theMaxDistance);
+  void setposition(const Position &thePosition);
+
+  Position locate(const NFmiPoint &theLonLat, double theMaxDistance);
+  std::vector<Position> locate(const std::vector<NFmiPoint> &theLonLats, double theMaxDistance);
 
   bool isset() const;
   NFmiFastQueryInfo &info() const;
@@ -55,14 +73,18 @@ class QueryDataManager
 
   std::string itsSearchPath;
   bool itsMultiMode;
+  bool itsMemoryMap;
 
-  typedef boost::tuple<std::string, NFmiQueryData *, NFmiFastQueryInfo *> value_type;
+  typedef boost::tuple<std::string, NFmiQueryData *, NFmiFastQueryInfo *, StationIndex *>
+      value_type;
 
   typedef std::vector<value_type> storage_type;
   storage_type itsData;
   storage_type::const_iterator itsCurrentData;
 
   NFmiFastQueryInfo &require(storage_type::iterator it);
+  const StationIndex &index(storage_type::iterator it);
+  bool find(storage_type::iterator it, Position &thePosition, double theMaxDistance);
 
 };  // class QueryDataManager
 
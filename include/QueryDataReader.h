@@ -0,0 +1,51 @@
+// ======================================================================
+/*!
+ * \file
+ * \brief Interface of namespace QueryDataReader
+ */
+// ======================================================================
+/*!
+ * \namespace QueryDataReader
+ *
+ * Common input handling for tools reading querydata. Regular files are
+ * memory mapped by default so that only the pages actually accessed are
+ * read from disk, and the data does not need a heap copy of its own.
+ * Standard input, pipes and other unseekable inputs are always read into
+ * memory, as are compressed files which newbase must decompress first.
+ *
+ * Tools which know which values they need may advise the kernel to read
+ * those parts of the file in advance with prefetch. This is only a hint
+ * given with posix_fadvise, the kernel may read more or less than asked.
+ * The ranges are value indices as returned by NFmiFastQueryInfo::Index.
+ */
+// ======================================================================
+
+#ifndef QUERYDATAREADER_H
+#define QUERYDATAREADER_H
+
+#include <cstddef>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+class NFmiQueryData;
+
+namespace QueryDataReader
+{
+// Value index ranges [first, last) in increasing order
+typedef std::vector<std::pair<std::size_t, std::size_t>> IndexRanges;
+
+bool mappable(const std::string& theFile);
+
+std::unique_ptr<NFmiQueryData> read(const std::string& theFile, bool theMemoryMap = true);
+
+bool prefetch(const std::string& theFile, const IndexRanges& theRanges);
+
+std::size_t residentMemory();
+
+}  // namespace QueryDataReader
+
+#endif  // QUERYDATAREADER_H
+
+// ======================================================================
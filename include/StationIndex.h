@@ -0,0 +1,74 @@
+// ======================================================================
+/*!
+ * \file
+ * \brief Interface of the StationIndex class
+ */
+// ======================================================================
+/*!
+ * \class StationIndex
+ *
+ * A k-d tree of point locations for finding the stations nearest to a
+ * coordinate in logarithmic time.
+ *
+ * The points are placed on the unit sphere, where the chord length is
+ * monotonic in the great circle distance. Hence the ordering of the
+ * results is that of the great circle distances, and the distance
+ * limit is applied conservatively. Callers needing exact newbase
+ * semantics should check the distances of the returned stations with
+ * NFmiLocation::Distance.
+ *
+ * Stations at equal distances are ordered by their index, so the
+ * results are deterministic.
+ */
+// ======================================================================
+
+#ifndef STATIONINDEX_H
+#define STATIONINDEX_H
+
+#include <newbase/NFmiPoint.h>
+
+#include <cstddef>
+#include <vector>
+
+class NFmiFastQueryInfo;
+
+class StationIndex
+{
+ public:
+  explicit StationIndex(const std::vector<NFmiPoint> &theLonLats);
+  explicit StationIndex(NFmiFastQueryInfo &theInfo);
+
+  std::size_t size() const { return itsNodes.size(); }
+
+  std::vector<unsigned long> nearest(const NFmiPoint &theLonLat,
+                                     std::size_t theMaxNumber,
+                                     double theMaxDistance) const;
+
+  std::vector<unsigned long> within(const NFmiPoint &theLonLat, double theMaxDistance) const;
+
+ private:
+  struct Node
+  {
+    double xyz[3];
+    unsigned long index;
+    int axis;
+  };
+
+  // Squared chord length and index of a found station
+  typedef std::pair<double, unsigned long> Candidate;
+
+  void build(const std::vector<NFmiPoint> &theLonLats);
+  void split(std::size_t theFirst, std::size_t theLast);
+  void search(std::size_t theFirst,
+              std::size_t theLast,
+              const double *theXYZ,
+              std::size_t theMaxNumber,
+              double theLimit,
+              std::vector<Candidate> &theHeap) const;
+
+  std::vector<Node> itsNodes;
+};
+
+#endif  // STATIONINDEX_H
+
+// ======================================================================
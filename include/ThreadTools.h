@@ -0,0 +1,162 @@
+// ======================================================================
+/*!
+ * \file
+ * \brief Interface of namespace ThreadTools
+ */
+// ======================================================================
+
+#ifndef THREADTOOLS_H
+#define THREADTOOLS_H
+
+#include <boost/thread.hpp>
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <deque>
+#include <exception>
+#include <string>
+#include <vector>
+
+namespace ThreadTools
+{
+unsigned int threadCount(const std::string& theOption);
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Call theTask(i) for i=0..theCount-1 using at most theThreadCount threads
+ *
+ * Tasks are handed out in index order. If a task throws, the remaining tasks
+ * are still run and the exception of the lowest failed index is rethrown once
+ * all threads have finished, so error reporting matches a serial loop.
+ */
+// ----------------------------------------------------------------------
+
+template <typename Task>
+void parallelFor(std::size_t theCount, unsigned int theThreadCount, Task theTask)
+{
+  if (theThreadCount <= 1 || theCount <= 1)
+  {
+    for (std::size_t i = 0; i < theCount; i++)
+      theTask(i);
+    return;
+  }
+
+  std::atomic<std::size_t> next{0};
+  std::vector<std::exception_ptr> errors(theCount);
+
+  auto worker = [&]()
+  {
+    for (std::size_t i = next++; i < theCount; i = next++)
+    {
+      try
+      {
+        theTask(i);
+      }
+      catch (...)
+      {
+        errors[i] = std::current_exception();
+      }
+    }
+  };
+
+  boost::thread_group threads;
+  const std::size_t n = std::min<std::size_t>(theThreadCount, theCount);
+  for (std::size_t t = 0; t < n; t++)
+    threads.create_thread(worker);
+  threads.join_all();
+
+  for (const auto& error : errors)
+    if (error)
+      std::rethrow_exception(error);
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief A blocking first-in first-out queue with a maximum size
+ *
+ * Used for connecting the stages of a producer/consumer pipeline. The
+ * producer blocks while the queue is full, which bounds the memory held
+ * by work not yet consumed. The depth of the queue is sampled on every
+ * push for statistics.
+ */
+// ----------------------------------------------------------------------
+
+template <typename T>
+class BoundedQueue
+{
+ public:
+  explicit BoundedQueue(std::size_t theCapacity)
+      : itsCapacity(std::max<std::size_t>(1, theCapacity))
+  {
+  }
+
+  // Blocks while the queue is full
+  void push(T theItem)
+  {
+    boost::unique_lock<boost::mutex> lock(itsMutex);
+    while (itsItems.size() >= itsCapacity)
+      itsNotFull.wait(lock);
+    itsItems.push_back(std::move(theItem));
+    itsMaxDepth = std::max(itsMaxDepth, itsItems.size());
+    itsDepthSum += itsItems.size();
+    ++itsPushCount;
+    itsNotEmpty.notify_one();
+  }
+
+  // Blocks while the queue is empty. Returns false once closed and drained.
+  bool pop(T& theItem)
+  {
+    boost::unique_lock<boost::mutex> lock(itsMutex);
+    while (itsItems.empty() && !itsClosed)
+      itsNotEmpty.wait(lock);
+    if (itsItems.empty())
+      return false;
+    theItem = std::move(itsItems.front());
+    itsItems.pop_front();
+    itsNotFull.notify_one();
+    return true;
+  }
+
+  // No more items will be pushed
+  void close()
+  {
+    boost::unique_lock<boost::mutex> lock(itsMutex);
+    itsClosed = true;
+    itsNotEmpty.notify_all();
+  }
+
+  std::size_t capacity() const { return itsCapacity; }
+
+  std::size_t maxDepth() const
+  {
+    boost::unique_lock<boost::mutex> lock(itsMutex);
+    return itsMaxDepth;
+  }
+
+  double meanDepth() const
+  {
+    boost::unique_lock<boost::mutex> lock(itsMutex);
+    return (itsPushCount == 0 ? 0.0 : static_cast<double>(itsDepthSum) / itsPushCount);
+  }
+
+ private:
+  BoundedQueue(const BoundedQueue& theOther);
+  BoundedQueue& operator=(const BoundedQueue& theOther);
+
+  const std::size_t itsCapacity;
+  std::deque<T> itsItems;
+  bool itsClosed = false;
+  std::size_t itsMaxDepth = 0;
+  std::size_t itsDepthSum = 0;
+  std::size_t itsPushCount = 0;
+
+  mutable boost::mutex itsMutex;
+  boost::condition_variable itsNotEmpty;
+  boost::condition_variable itsNotFull;
+};
+
+}  // namespace ThreadTools
+
+#endif  // THREADTOOLS_H
+
+// ======================================================================
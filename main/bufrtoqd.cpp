@@ -14,10 +14,12 @@
                                            // warnings that e.g. MSVC++ 2012 generates
 #endif
 
+#include "ThreadTools.h"
 #include <boost/algorithm/string/classification.hpp>
 #include <boost/algorithm/string/erase.hpp>
 #include <boost/algorithm/string/join.hpp>
 #include <boost/algorithm/string/split.hpp>
+#include <boost/container/flat_map.hpp>
 #include <boost/filesystem/operations.hpp>
 #include <boost/program_options.hpp>
 #include <fmt/format.h>
@@ -38,9 +40,13 @@
 #include <newbase/NFmiTimeList.h>
 #include <newbase/NFmiVPlaceDescriptor.h>
 #include <smarttools/NFmiAviationStationInfoSystem.h>
+#include <atomic>
+#include <cstdint>
+#include <deque>
 #include <fstream>
 #include <functional>
 #include <iostream>
+#include <sstream>
 #include <stdexcept>
 #include <string>
 #include <unordered_map>
@@ -248,6 +254,8 @@ struct Options
   int maxdurationhours = 2;                                        // -M --maxdurationhours
   bool totalcloudoctas = false;                                    // -t --totalcloudoctas
   bool forcepressurechangesign = false;                            // -f --forcepressurechangesign
+  bool streaming = false;                                          //    --streaming
+  unsigned int threadcount = 1;                                    // -j --threads
 };
 
 Options options;
@@ -378,6 +386,7 @@ bool parse_options(int argc, char* argv[], Options& options)
   namespace po = boost::program_options;
 
   std::string producerinfo;
+  std::string threads = "1";
 
   std::string msg1 = "BUFR parameter configuration file (default='" + options.conffile + "')";
   std::string msg2 = "stations CSV file (default='" + options.stationsfile + "')";
@@ -435,7 +444,13 @@ bool parse_options(int argc, char* argv[], Options& options)
       "disable octas to percentage conversion for TotalCloudCover")(
       "forcepressurechangesign,f",
       po::bool_switch(&options.forcepressurechangesign),
-      "Set PressureChange sign to match PressureTendency value");
+      "Set PressureChange sign to match PressureTendency value")(
+      "streaming",
+      po::bool_switch(&options.streaming),
+      "read the input twice instead of holding all the messages in memory")(
+      "threads,j",
+      po::value(&threads),
+      "number of decoding threads, or a percentage of the cores, 0 for all (default=1)");
 
   po::positional_options_description p;
   p.add("infile", 1);
@@ -487,7 +502,11 @@ bool parse_options(int argc, char* argv[], Options& options)
            "with the same name can be discerned. The old behaviour can be restored using the\n"
            "option --usebufrname.\n\n"
            "New amdar processing (which handles data levels/altitudes) must be enabled with "
-           "-I option, other related (-r, -N, -M) settings have no effect without it\n";
+           "-I option, other related (-r, -N, -M) settings have no effect without it\n\n"
+           "Option --streaming first reads the input once to build the querydata descriptors\n"
+           "and then a second time to copy the values, decoding only one BUFR message at a time.\n"
+           "The memory use is then bounded by the size of the output instead of the input.\n"
+           "The option is ignored if -I is used, since the messages must then be sorted.\n";
 
     return false;
   }
@@ -525,6 +544,8 @@ bool parse_options(int argc, char* argv[], Options& options)
     options.producername = parts[1];
   }
 
+  options.threadcount = ThreadTools::threadCount(threads);
+
   // Handle amdar/sounding bufr code remapping
 
   if (options.requireident)
@@ -612,6 +633,121 @@ std::list<std::string> expand_input_files()
   return files;
 }
 
+// ----------------------------------------------------------------------
+/*!
+ * \brief Table of the distinct element names and units
+ *
+ * Every string is stored only once and referred to by its index. Only the
+ * names and units are interned, their number is limited by the element
+ * tables. Each thread keeps its own cache of the indices it has seen so
+ * that the lock is taken only on a cache miss. Lookups are not
+ * synchronized, the strings are stored in blocks which never move once
+ * allocated, and an index can only be obtained after its string has been
+ * stored.
+ */
+// ----------------------------------------------------------------------
+
+class StringTable
+{
+ public:
+  StringTable() { intern(std::string()); }  // index 0 is the empty string
+
+  ~StringTable()
+  {
+    for (auto& block : itsBlocks)
+      delete[] block.load();
+  }
+
+  std::uint32_t intern(const std::string& str)
+  {
+    thread_local std::unordered_map<std::string, std::uint32_t> cache;
+    auto pos = cache.find(str);
+    if (pos != cache.end())
+      return pos->second;
+
+    const std::uint32_t id = insert(str);
+    cache.emplace(str, id);
+    return id;
+  }
+
+  const std::string& str(std::uint32_t id) const
+  {
+    return itsBlocks[id / block_size].load(std::memory_order_acquire)[id % block_size];
+  }
+
+ private:
+  std::uint32_t insert(const std::string& str)
+  {
+    boost::mutex::scoped_lock lock(itsMutex);
+    auto pos = itsIndex.find(str);
+    if (pos != itsIndex.end())
+      return pos->second;
+
+    const std::uint32_t id = itsCount;
+    if (id >= max_blocks * block_size)
+      throw std::runtime_error("Too many distinct element names in the BUFR messages");
+
+    std::string* block = itsBlocks[id / block_size].load(std::memory_order_relaxed);
+    if (block == nullptr)
+    {
+      block = new std::string[block_size];
+      itsBlocks[id / block_size].store(block, std::memory_order_release);
+    }
+    block[id % block_size] = str;
+
+    itsIndex.emplace(str, id);
+    ++itsCount;
+    return id;
+  }
+
+  static const std::uint32_t block_size = 4096;
+  static const std::uint32_t max_blocks = 4096;
+
+  std::atomic<std::string*> itsBlocks[max_blocks] = {};
+  std::unordered_map<std::string, std::uint32_t> itsIndex;
+  std::uint32_t itsCount = 0;
+  boost::mutex itsMutex;
+};
+
+StringTable string_table;
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief An interned string in the string table
+ *
+ * Behaves mostly like a const std::string, but takes only four bytes.
+ */
+// ----------------------------------------------------------------------
+
+class ElementString
+{
+ public:
+  ElementString() = default;
+  ElementString(const std::string& str) : itsId(string_table.intern(str)) {}
+  ElementString(const char* str) : itsId(string_table.intern(str)) {}
+
+  const std::string& str() const { return string_table.str(itsId); }
+  operator const std::string&() const { return str(); }
+  const char* c_str() const { return str().c_str(); }
+
+  std::uint32_t id() const { return itsId; }
+  bool empty() const { return itsId == 0; }
+  void clear() { itsId = 0; }
+
+  bool operator==(const ElementString& other) const { return itsId == other.itsId; }
+  bool operator!=(const ElementString& other) const { return itsId != other.itsId; }
+  bool operator==(const char* other) const { return str() == other; }
+  bool operator!=(const char* other) const { return str() != other; }
+
+ private:
+  std::uint32_t itsId = 0;
+};
+
+std::ostream& operator<<(std::ostream& out, const ElementString& str)
+{
+  return out << str.str();
+}
+
 // ----------------------------------------------------------------------
 /*!
  * \brief Information collected from the bufr
@@ -620,12 +756,10 @@ std::list<std::string> expand_input_files()
 
 struct record
 {
-  std::string name;
-  std::string units;
-  double value;
+  double value = std::numeric_limits<double>::quiet_NaN();
+  ElementString name;
+  ElementString units;
   std::string svalue;
-
-  record() : name(), units(), value(std::numeric_limits<double>::quiet_NaN()), svalue() {}
 };
 
 std::ostream& operator<<(std::ostream& out, const record& rec)
@@ -634,7 +768,8 @@ std::ostream& operator<<(std::ostream& out, const record& rec)
   return out;
 }
 
-typedef std::map<int, record> Message;
+// The records of one subset are stored contiguously in code order
+typedef boost::container::flat_map<int, record> Message;
 typedef std::list<Message> Messages;
 
 typedef std::map<std::string, Messages> IdentMessageMap;
@@ -669,8 +804,8 @@ struct BufrElement
 {
   int code = -1;                     // BUFR descriptor, e.g. 4001 for 004001
   int type = 0;                      // GRIB_TYPE_LONG / GRIB_TYPE_DOUBLE / GRIB_TYPE_STRING
-  std::string name;                  // eccodes element name (rank prefix stripped)
-  std::string units;                 // eccodes element units
+  ElementString name;                // eccodes element name (rank prefix stripped)
+  ElementString units;               // eccodes element units
   std::vector<double> values;        // numeric values (size 1 or nsubsets)
   std::vector<std::string> svalues;  // string values (size 1 or nsubsets)
 };
@@ -772,10 +907,12 @@ std::vector<BufrElement> extract_elements(codes_handle* h)
     size_t ulen = sizeof(units);
     if (codes_get_string(h, attrkey.c_str(), units, &ulen) == CODES_SUCCESS)
       e.units = units;
+    else
+      units[0] = '\0';
 
     // Character (CCITT IA5) elements are the only string-valued ones; deciding
     // from the unit avoids a codes_get_native_type() key lookup per element.
-    bool is_string = (e.units.find("CCITT") != std::string::npos);
+    bool is_string = (strstr(units, "CCITT") != nullptr);
 
     if (is_string)
     {
@@ -1029,13 +1166,17 @@ std::vector<SubsetRange> subset_ranges(const std::vector<BufrElement>& elements,
 void append_message(Messages& messages,
                     const std::vector<BufrElement>& elements,
                     long nsubsets,
-                    bool compressed)
+                    bool compressed,
+                    std::ostream& log)
 {
   std::vector<SubsetRange> ranges = subset_ranges(elements, nsubsets, compressed);
 
   for (const SubsetRange& range : ranges)
   {
+    // Reserved for all the descriptors so that the inserts never reallocate
+    const std::size_t max_records = range.end - range.begin;
     Message message;
+    message.reserve(max_records);
 
     // Replication state is reset for every subset
     bool replicating = false;    // set to true if a class 31 descriptor is encountered
@@ -1044,7 +1185,7 @@ void append_message(Messages& messages,
     Message replicated_message;  // the message when replication starts
 
     if (options.debug)
-      std::cout << "Subset has " << (range.end - range.begin) << " descriptors" << std::endl;
+      log << "Subset has " << (range.end - range.begin) << " descriptors" << std::endl;
 
     // Loop over the expanded descriptors of this subset
 
@@ -1094,6 +1235,7 @@ void append_message(Messages& messages,
         }
 
         message = replicated_message;
+        message.reserve(max_records);
         message[desc] = rec;
 
         if (--replication_count <= 0)
@@ -1120,180 +1262,386 @@ void append_message(Messages& messages,
 
 // ----------------------------------------------------------------------
 /*!
- * \brief Read one bufr message
+ * \brief A BUFR message read from a file and the result of decoding it
+ *
+ * Decoding may happen in a worker thread, hence any output is collected
+ * here and printed only when the message is handed out in input order.
+ */
+// ----------------------------------------------------------------------
+
+struct DecodedMessage
+{
+  codes_handle* handle = nullptr;
+  int number = 0;        // message number within the file
+  std::string filename;  // file the message was read from
+  int category = -1;     // data category, -1 if not read
+  bool unsupported = false;
+  bool decoded = false;
+  Messages messages;
+  std::string log;       // standard output, including output from reading the message
+  std::string warnings;  // standard error, including output from reading the message
+};
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Sequential reader for the BUFR messages of a list of files
+ *
+ * Each call to next() returns the records of one BUFR message, so that
+ * the callers may either collect all of them or process them one message
+ * at a time with bounded memory.
+ *
+ * With several threads the messages are read from the files in batches
+ * and decoded in parallel, each message with its own eccodes handle.
+ * The messages and any output are still returned in input order, so the
+ * result is identical to decoding in a single thread.
  */
 // ----------------------------------------------------------------------
 
-void read_message(const std::string& filename,
-                  Messages& messages,
-                  std::set<int>& datacategories,
-                  std::set<int>& skipped_categories)
+class BufrReader
 {
-  // Open the file
+ public:
+  explicit BufrReader(const std::list<std::string>& files, bool report = true);
+  ~BufrReader();
 
-  FILE* bufr = fopen(filename.c_str(),
-                     "rb");  // VC++ vaatii että avataan binäärisenä (Linuxissa se on default)
-  if (bufr == nullptr)
-  {
-    throw std::runtime_error("Could not open BUFR file '" + filename + "' reading");
-  }
+  bool next(Messages& messages);
+  BufrDataCategory category() const;
+  BufrDataCategory message_category() const { return itsMessageCategory; }
 
-  if (options.debug)
-    std::cout << "Processing file '" << filename << "'" << std::endl;
+ private:
+  BufrReader(const BufrReader& other) = delete;
+  BufrReader& operator=(const BufrReader& other) = delete;
+
+  bool open_next_file();
+  void close_file();
+  bool read_batch();
+  void decode(DecodedMessage& msg) const;
+  bool accept(DecodedMessage& msg);
 
-  // Read the messages one by one
+  std::list<std::string> itsFiles;
+  std::list<std::string>::const_iterator itsNextFile;
+  std::string itsFilename;
+  FILE* itsFile = nullptr;
+  int itsCount = 0;
 
-  int count = 0;
-  int err = CODES_SUCCESS;
-  codes_handle* h = nullptr;
+  // Messages decoded but not yet returned
+  std::deque<DecodedMessage> itsDecoded;
 
-  while ((h = codes_handle_new_from_file(nullptr, bufr, PRODUCT_BUFR, &err)) != nullptr)
+  // Warnings and progress are not repeated when reading the files a second time
+  bool itsReport;
+
+  // Output from reading the files, printed with the next message in input order
+  std::ostringstream itsLog;
+  std::ostringstream itsWarnings;
+
+  // We verify that there is only one type of message
+  std::set<int> itsDataCategories;
+
+  // Categories that were seen but skipped because the tool cannot handle them
+  std::set<int> itsSkippedCategories;
+
+  // Category of the message last returned by next()
+  BufrDataCategory itsMessageCategory = kBufrLandSurface;
+
+  int itsSuccesfulParseEvents = 0;
+  int itsErrorneousParseEvents = 0;
+};
+
+BufrReader::BufrReader(const std::list<std::string>& files, bool report)
+    : itsFiles(files), itsNextFile(itsFiles.begin()), itsReport(report)
+{
+}
+
+BufrReader::~BufrReader()
+{
+  for (DecodedMessage& msg : itsDecoded)
+    if (msg.handle != nullptr)
+      codes_handle_delete(msg.handle);
+
+  if (itsFile != nullptr)
+    fclose(itsFile);
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Open the next file which can be opened
+ */
+// ----------------------------------------------------------------------
+
+bool BufrReader::open_next_file()
+{
+  while (itsNextFile != itsFiles.end())
   {
-    ++count;
+    itsFilename = *itsNextFile++;
+    itsCount = 0;
 
-    // If a particular message is wanted, skip all other messages
-    if (options.messagenumber != 0 && count != options.messagenumber)
+    itsFile = fopen(itsFilename.c_str(),
+                    "rb");  // VC++ vaatii että avataan binäärisenä (Linuxissa se on default)
+    if (itsFile != nullptr)
     {
-      codes_handle_delete(h);
-      if (options.debug)
-        std::cout << "Skipping message number " << count << std::endl;
-      continue;
+      if (options.debug && itsReport)
+        itsLog << "Processing file '" << itsFilename << "'" << std::endl;
+      return true;
     }
 
-    // Try to parse a single message. If it fails, skip to the next one.
+    itsErrorneousParseEvents++;
+    if (itsReport)
+      itsWarnings << "Warning: Could not open BUFR file '" + itsFilename + "' reading" << std::endl;
+  }
+  return false;
+}
 
-    try
-    {
-      // Data category lives in section 1 and can be read without unpacking
+// ----------------------------------------------------------------------
+/*!
+ * \brief Close the current file
+ */
+// ----------------------------------------------------------------------
 
-      long msg_type = -1;
-      codes_get_long(h, "dataCategory", &msg_type);
+void BufrReader::close_file()
+{
+  fclose(itsFile);
+  itsFile = nullptr;
+}
 
-      // Skip messages of a non-requested category (when -C is used)
+// ----------------------------------------------------------------------
+/*!
+ * \brief Read the next bufr message
+ *
+ * \return False once all the files have been read
+ */
+// ----------------------------------------------------------------------
 
-      if (!options.category.empty() &&
-          static_cast<int>(msg_type) != data_category(options.category))
-      {
-        codes_handle_delete(h);
-        if (options.debug)
-          std::cout << "Message " << count << " in " << filename << " is not of desired category"
-                    << std::endl;
-        continue;
-      }
+bool BufrReader::next(Messages& messages)
+{
+  messages.clear();
 
-      // Skip categories the tool cannot handle *before* the expensive decode.
-      // Doing this after unpacking would fully expand large multi-subset
-      // messages (e.g. satellite soundings) only to reject them later.
+  while (!itsDecoded.empty() || read_batch())
+  {
+    DecodedMessage msg = std::move(itsDecoded.front());
+    itsDecoded.pop_front();
+    if (accept(msg))
+    {
+      messages.swap(msg.messages);
+      return true;
+    }
+  }
 
-      if (!supported_category(BufrDataCategory(msg_type)))
-      {
-        skipped_categories.insert(static_cast<int>(msg_type));
-        codes_handle_delete(h);
-        if (options.debug)
-          std::cout << "Message " << count << " in " << filename << " has unsupported category "
-                    << msg_type << std::endl;
-        continue;
-      }
+  // Output from reading the files after the last message
+  if (itsReport)
+  {
+    std::cout << itsLog.str() << std::flush;
+    std::cerr << itsWarnings.str() << std::flush;
+  }
+  itsLog.str("");
+  itsWarnings.str("");
+
+  return false;
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Read and decode the next batch of messages
+ *
+ * A single thread reads one message at a time, several threads read a
+ * few messages per thread to keep them all busy.
+ *
+ * \return False once all the files have been read
+ */
+// ----------------------------------------------------------------------
 
-      datacategories.insert(static_cast<int>(msg_type));
+bool BufrReader::read_batch()
+{
+  const std::size_t batchsize = (options.threadcount > 1 ? 4 * options.threadcount : 1);
 
-      long nsubsets = 1;
-      codes_get_long(h, "numberOfSubsets", &nsubsets);
-      long compressed = 0;
-      codes_get_long(h, "compressedData", &compressed);
+  while (itsDecoded.size() < batchsize && (itsFile != nullptr || open_next_file()))
+  {
+    int err = CODES_SUCCESS;
+    codes_handle* h = codes_handle_new_from_file(nullptr, itsFile, PRODUCT_BUFR, &err);
 
-      if (options.verbose)
+    if (h == nullptr)
+    {
+      close_file();
+      if (err == CODES_SUCCESS)
+        itsSuccesfulParseEvents++;
+      else
       {
-        long version = -1;
-        codes_get_long(h, "masterTablesVersionNumber", &version);
-        std::cout << "MESSAGE NUMBER " << count << " (data category " << msg_type << ", "
-                  << nsubsets << " subsets, " << (compressed ? "compressed" : "uncompressed")
-                  << ", master table version " << version << ")" << std::endl;
+        itsErrorneousParseEvents++;
+        if (itsReport)
+          itsWarnings << "Warning: Error reading BUFR file '" + itsFilename +
+                             "': " + codes_get_error_message(err)
+                      << std::endl;
       }
+      continue;
+    }
 
-      // Decode (expand and unpack) the message
-
-      int rc = codes_set_long(h, "unpack", 1);
-      if (rc != CODES_SUCCESS)
-        throw std::runtime_error("Message number " + Fmi::to_string(count) +
-                                 " could not be decoded: " + codes_get_error_message(rc));
-
-      std::vector<BufrElement> elements = extract_elements(h);
+    ++itsCount;
 
-      append_message(messages, elements, nsubsets, compressed != 0);
-    }
-    catch (std::exception& e)
+    // If a particular message is wanted, skip all other messages
+    if (options.messagenumber != 0 && itsCount != options.messagenumber)
     {
-      std::cerr << "Warning: " << e.what() << "  ...skipping to next message in '" << filename
-                << "'" << std::endl;
+      if (options.debug && itsReport)
+        itsLog << "Skipping message number " << itsCount << std::endl;
+      codes_handle_delete(h);
+      continue;
     }
 
-    codes_handle_delete(h);
+    DecodedMessage msg;
+    msg.handle = h;
+    msg.number = itsCount;
+    msg.filename = itsFilename;
+    msg.log = itsLog.str();
+    msg.warnings = itsWarnings.str();
+    itsLog.str("");
+    itsWarnings.str("");
+    itsDecoded.push_back(std::move(msg));
   }
 
-  fclose(bufr);
+  if (itsDecoded.empty())
+    return false;
 
-  if (err != CODES_SUCCESS)
-    throw std::runtime_error("Error reading BUFR file '" + filename +
-                             "': " + codes_get_error_message(err));
+  ThreadTools::parallelFor(itsDecoded.size(),
+                           options.threadcount,
+                           [this](std::size_t i)
+                           {
+                             DecodedMessage& msg = itsDecoded[i];
+                             decode(msg);
+                             codes_handle_delete(msg.handle);
+                             msg.handle = nullptr;
+                           });
+  return true;
 }
 
 // ----------------------------------------------------------------------
 /*!
- * \brief Read all bufr messages
+ * \brief Decode one bufr message
+ *
+ * Touches no state shared with other messages, so that messages can be
+ * decoded in parallel.
  */
 // ----------------------------------------------------------------------
 
-std::pair<BufrDataCategory, Messages> read_messages(const std::list<std::string>& files)
+void BufrReader::decode(DecodedMessage& msg) const
 {
-  Messages messages;
+  std::ostringstream log;
+  codes_handle* h = msg.handle;
 
-  // We verify that there is only one type of message
-  std::set<int> datacategories;
+  // Try to parse a single message. If it fails, skip to the next one.
 
-  // Categories that were seen but skipped because the tool cannot handle them
-  std::set<int> skipped_categories;
+  try
+  {
+    // Data category lives in section 1 and can be read without unpacking
 
-  // eccodes manages its own BUFR table definitions (selected per message from
-  // the master/local table version numbers), so the local table options are
-  // no longer used.
+    long msg_type = -1;
+    codes_get_long(h, "dataCategory", &msg_type);
 
-  if (!options.localtableB.empty() || !options.localtableD.empty())
-    std::cerr << "Warning: options -B/--localtableB and -D/--localtableD are ignored; "
-                 "eccodes uses its own BUFR table definitions (set ECCODES_DEFINITION_PATH "
-                 "to use custom tables)"
-              << std::endl;
+    // Skip messages of a non-requested category (when -C is used)
 
-  // Process the files
+    if (!options.category.empty() && static_cast<int>(msg_type) != data_category(options.category))
+    {
+      if (options.debug)
+        log << "Message " << msg.number << " in " << msg.filename << " is not of desired category"
+            << std::endl;
+      msg.log += log.str();
+      return;
+    }
 
-  int succesful_parse_events = 0;
-  int errorneous_parse_events = 0;
+    msg.category = static_cast<int>(msg_type);
 
-  for (const std::string& file : files)
-  {
-    try
+    // Skip categories the tool cannot handle *before* the expensive decode.
+    // Doing this after unpacking would fully expand large multi-subset
+    // messages (e.g. satellite soundings) only to reject them later.
+
+    if (!supported_category(BufrDataCategory(msg_type)))
     {
-      read_message(file, messages, datacategories, skipped_categories);
-      succesful_parse_events++;
+      msg.unsupported = true;
+      if (options.debug)
+        log << "Message " << msg.number << " in " << msg.filename << " has unsupported category "
+            << msg_type << std::endl;
+      msg.log += log.str();
+      return;
     }
-    catch (std::exception& e)
+
+    long nsubsets = 1;
+    codes_get_long(h, "numberOfSubsets", &nsubsets);
+    long compressed = 0;
+    codes_get_long(h, "compressedData", &compressed);
+
+    if (options.verbose)
     {
-      errorneous_parse_events++;
-      std::cerr << "Warning: " << e.what() << std::endl;
+      long version = -1;
+      codes_get_long(h, "masterTablesVersionNumber", &version);
+      log << "MESSAGE NUMBER " << msg.number << " (data category " << msg_type << ", " << nsubsets
+          << " subsets, " << (compressed ? "compressed" : "uncompressed")
+          << ", master table version " << version << ")" << std::endl;
     }
-    catch (...)
+
+    // Decode (expand and unpack) the message
+
+    int rc = codes_set_long(h, "unpack", 1);
+    if (rc != CODES_SUCCESS)
+      throw std::runtime_error("Message number " + Fmi::to_string(msg.number) +
+                               " could not be decoded: " + codes_get_error_message(rc));
+
+    std::vector<BufrElement> elements = extract_elements(h);
+
+    append_message(msg.messages, elements, nsubsets, compressed != 0, log);
+    msg.decoded = true;
+  }
+  catch (std::exception& e)
+  {
+    msg.messages.clear();
+    msg.warnings += std::string("Warning: ") + e.what() + "  ...skipping to next message in '" +
+                    msg.filename + "'\n";
+  }
+
+  msg.log += log.str();
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Print the output of a decoded message and record its category
+ *
+ * \return False if the message was skipped
+ */
+// ----------------------------------------------------------------------
+
+bool BufrReader::accept(DecodedMessage& msg)
+{
+  if (itsReport)
+  {
+    std::cout << msg.log << std::flush;
+    std::cerr << msg.warnings << std::flush;
+  }
+
+  if (msg.category >= 0)
+  {
+    if (msg.unsupported)
+      itsSkippedCategories.insert(msg.category);
+    else
     {
-      errorneous_parse_events++;
-      std::cerr << "Warning: Failed to interpret message '" << file << "'" << std::endl;
+      itsDataCategories.insert(msg.category);
+      itsMessageCategory = BufrDataCategory(msg.category);
     }
   }
 
-  if (datacategories.size() == 0)
+  return msg.decoded;
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief The data category of the messages read
+ *
+ * Should be called after all the messages have been read.
+ */
+// ----------------------------------------------------------------------
+
+BufrDataCategory BufrReader::category() const
+{
+  if (itsDataCategories.size() == 0)
   {
-    if (!skipped_categories.empty())
+    if (!itsSkippedCategories.empty())
     {
       std::list<std::string> names;
-      for (int tmp : skipped_categories)
+      for (int tmp : itsSkippedCategories)
         names.push_back(data_category_name(BufrDataCategory(tmp)));
       throw std::runtime_error("Cannot handle data category: " +
                                boost::algorithm::join(names, ","));
@@ -1301,10 +1649,10 @@ std::pair<BufrDataCategory, Messages> read_messages(const std::list<std::string>
     throw std::runtime_error("Failed to find any bufr data categories");
   }
 
-  if (options.verbose && !skipped_categories.empty())
+  if (options.verbose && !itsSkippedCategories.empty())
   {
     std::list<std::string> names;
-    for (int tmp : skipped_categories)
+    for (int tmp : itsSkippedCategories)
       names.push_back(data_category_name(BufrDataCategory(tmp)));
     std::cout << "Skipped unsupported data categories: " << boost::algorithm::join(names, ",")
               << std::endl;
@@ -1312,10 +1660,10 @@ std::pair<BufrDataCategory, Messages> read_messages(const std::list<std::string>
 
   // Cannot handle soundings and other data simultaneously
 
-  if (datacategories.size() > 1)
+  if (itsDataCategories.size() > 1)
   {
     std::list<std::string> names;
-    for (int tmp : datacategories)
+    for (int tmp : itsDataCategories)
       names.push_back(data_category_name(BufrDataCategory(tmp)));
     throw std::runtime_error("BURF messages contain multiple data categories (" +
                              boost::algorithm::join(names, ",") +
@@ -1324,12 +1672,51 @@ std::pair<BufrDataCategory, Messages> read_messages(const std::list<std::string>
 
   if (options.verbose)
   {
-    std::cout << "Examined " << files.size() << " files" << std::endl
-              << "Succesfully parsed " << succesful_parse_events << " files" << std::endl
-              << "Failed to parse " << errorneous_parse_events << " files" << std::endl;
+    std::cout << "Examined " << itsFiles.size() << " files" << std::endl
+              << "Succesfully parsed " << itsSuccesfulParseEvents << " files" << std::endl
+              << "Failed to parse " << itsErrorneousParseEvents << " files" << std::endl;
   }
 
-  return std::make_pair(BufrDataCategory(*datacategories.begin()), messages);
+  return BufrDataCategory(*itsDataCategories.begin());
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Warn about options eccodes does not need
+ */
+// ----------------------------------------------------------------------
+
+void check_table_options()
+{
+  // eccodes manages its own BUFR table definitions (selected per message from
+  // the master/local table version numbers), so the local table options are
+  // no longer used.
+
+  if (!options.localtableB.empty() || !options.localtableD.empty())
+    std::cerr << "Warning: options -B/--localtableB and -D/--localtableD are ignored; "
+                 "eccodes uses its own BUFR table definitions (set ECCODES_DEFINITION_PATH "
+                 "to use custom tables)"
+              << std::endl;
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Read all bufr messages
+ */
+// ----------------------------------------------------------------------
+
+std::pair<BufrDataCategory, Messages> read_messages(const std::list<std::string>& files)
+{
+  check_table_options();
+
+  Messages messages;
+  Messages fragment;
+
+  BufrReader reader(files);
+  while (reader.next(fragment))
+    messages.splice(messages.end(), fragment);
+
+  return std::make_pair(reader.category(), messages);
 }
 
 // ----------------------------------------------------------------------
@@ -1344,9 +1731,12 @@ std::set<std::string> collect_names(const Messages& messages)
 
   if (options.usebufrname)
   {
+    // Interned names are equal only if their indices are
+    std::set<std::uint32_t> ids;
     for (const Message &msg : messages)
       for (const Message::value_type &value : msg)
-        names.insert(value.second.name);
+        if (ids.insert(value.second.name.id()).second)
+          names.insert(value.second.name.str());
     return names;
   }
 
@@ -1543,12 +1933,10 @@ NFmiParamDescriptor create_pdesc(const NameMap& namemap, BufrDataCategory catego
  */
 // ----------------------------------------------------------------------
 
-int count_sounding_levels(const Messages& messages)
+class SoundingLevelCounter
 {
-  int wmo_station = 0;
-  int max_levels = 0;
-  int levels = 0;
-  for (const Message& msg : messages)
+ public:
+  void add(const Message& msg)
   {
     ++levels;
 
@@ -1567,9 +1955,20 @@ int count_sounding_levels(const Messages& messages)
     }
   }
 
-  max_levels = std::max(max_levels, levels);
+  int count() const { return std::max(max_levels, levels); }
 
-  return max_levels;
+ private:
+  int wmo_station = 0;
+  int max_levels = 0;
+  int levels = 0;
+};
+
+int count_sounding_levels(const Messages& messages)
+{
+  SoundingLevelCounter counter;
+  for (const Message& msg : messages)
+    counter.add(msg);
+  return counter.count();
 }
 
 // ----------------------------------------------------------------------
@@ -1579,7 +1978,7 @@ int count_sounding_levels(const Messages& messages)
  */
 // ----------------------------------------------------------------------
 
-NFmiVPlaceDescriptor create_vdesc(const Messages& messages,
+NFmiVPlaceDescriptor create_vdesc(int soundinglevels,
                                   BufrDataCategory category,
                                   size_t levelcount)
 {
@@ -1616,13 +2015,11 @@ NFmiVPlaceDescriptor create_vdesc(const Messages& messages,
       // We number the levels sequentially. The number
       // with most measurements determines the total number of levels.
 
-      int levels = count_sounding_levels(messages);
-
-      if (levels == 0)
+      if (soundinglevels == 0)
         return NFmiVPlaceDescriptor();
 
       NFmiLevelBag lbag;
-      for (int i = 1; i <= levels; ++i)
+      for (int i = 1; i <= soundinglevels; ++i)
         lbag.AddLevel(NFmiLevel(kFmiSoundingLevel, "SoundingLevel", static_cast<float>(i)));
 
       return NFmiVPlaceDescriptor(lbag);
@@ -1643,6 +2040,14 @@ NFmiVPlaceDescriptor create_vdesc(const Messages& messages,
   }
 }
 
+NFmiVPlaceDescriptor create_vdesc(const Messages& messages,
+                                  BufrDataCategory category,
+                                  size_t levelcount)
+{
+  int soundinglevels = (category == kBufrSounding ? count_sounding_levels(messages) : 0);
+  return create_vdesc(soundinglevels, category, levelcount);
+}
+
 // ----------------------------------------------------------------------
 /*!
  * \brief Definition of the dummy AMDAR (airplane) station
@@ -1695,61 +2100,56 @@ NFmiHPlaceDescriptor create_hdesc_amdar()
  */
 // ----------------------------------------------------------------------
 
-NFmiHPlaceDescriptor create_hdesc_buoy_ship(const Messages& messages)
-{
-  // First list all unique station IDs
+typedef std::map<std::string, NFmiPoint> BuoyShipStations;
 
-  typedef std::map<std::string, NFmiPoint> Stations;
-  Stations stations;
+void collect_station_buoy_ship(const Message& msg, BuoyShipStations& stations)
+{
+  Message::const_iterator p_id = msg.find(1005);
+  if (p_id == msg.end())
+    p_id = msg.find(1011);
 
-  for (const Message& msg : messages)
+  if (p_id != msg.end())
   {
-    Message::const_iterator p_id = msg.find(1005);
-    if (p_id == msg.end())
-      p_id = msg.find(1011);
+    const std::string name = p_id->second.svalue;
 
-    if (p_id != msg.end())
-    {
-      const std::string name = p_id->second.svalue;
-
-      float lon = kFloatMissing, lat = kFloatMissing;
+    float lon = kFloatMissing, lat = kFloatMissing;
 
-      p_id = msg.find(5001);
-      if (p_id == msg.end())
-        p_id = msg.find(5002);
-      if (p_id != msg.end())
-        lat = static_cast<float>(p_id->second.value);
+    p_id = msg.find(5001);
+    if (p_id == msg.end())
+      p_id = msg.find(5002);
+    if (p_id != msg.end())
+      lat = static_cast<float>(p_id->second.value);
 
-      p_id = msg.find(6001);
-      if (p_id == msg.end())
-        p_id = msg.find(6002);
-      if (p_id != msg.end())
-        lon = static_cast<float>(p_id->second.value);
+    p_id = msg.find(6001);
+    if (p_id == msg.end())
+      p_id = msg.find(6002);
+    if (p_id != msg.end())
+      lon = static_cast<float>(p_id->second.value);
 
-      if (lon != kFloatMissing && (lon < -180 || lon > 180))
-      {
-        if (options.debug)
-          std::cerr << "Warning: BUFR message contains a station with longitude out of bounds "
-                       "[-180,180]: "
-                    << lon << std::endl;
-      }
-      else if (lat != kFloatMissing && (lat < -90 || lat > 90))
-      {
-        if (options.debug)
-          std::cerr
-              << "Warning: BUFR message contains a station with latitude out of bounds [-90,90]: "
-              << lat << std::endl;
-      }
-      else
-        stations.insert(std::make_pair(name, NFmiPoint(lon, lat)));
+    if (lon != kFloatMissing && (lon < -180 || lon > 180))
+    {
+      if (options.debug)
+        std::cerr << "Warning: BUFR message contains a station with longitude out of bounds "
+                     "[-180,180]: "
+                  << lon << std::endl;
     }
+    else if (lat != kFloatMissing && (lat < -90 || lat > 90))
+    {
+      if (options.debug)
+        std::cerr
+            << "Warning: BUFR message contains a station with latitude out of bounds [-90,90]: "
+            << lat << std::endl;
+    }
+    else
+      stations.insert(std::make_pair(name, NFmiPoint(lon, lat)));
   }
+}
 
-  // Then build the descriptor
-
+NFmiHPlaceDescriptor create_hdesc_buoy_ship(const BuoyShipStations& stations)
+{
   NFmiLocationBag lbag;
   int number = 0;
-  for (const Stations::value_type& name_coord : stations)
+  for (const BuoyShipStations::value_type& name_coord : stations)
   {
     ++number;
 
@@ -1760,6 +2160,19 @@ NFmiHPlaceDescriptor create_hdesc_buoy_ship(const Messages& messages)
   return NFmiHPlaceDescriptor(lbag);
 }
 
+NFmiHPlaceDescriptor create_hdesc_buoy_ship(const Messages& messages)
+{
+  // First list all unique station IDs
+
+  BuoyShipStations stations;
+  for (const Message& msg : messages)
+    collect_station_buoy_ship(msg, stations);
+
+  // Then build the descriptor
+
+  return create_hdesc_buoy_ship(stations);
+}
+
 // ----------------------------------------------------------------------
 /*!
  * \brief Extract station from a record
@@ -1831,46 +2244,34 @@ int accuracy_estimate(const NFmiPoint& coord)
  */
 // ----------------------------------------------------------------------
 
-NFmiHPlaceDescriptor create_hdesc(const Messages& messages,
-                                  NFmiAviationStationInfoSystem& stationinfos,
-                                  BufrDataCategory category)
-{
-  // AMDAR descriptor is special (airplane measurements)
-
-  if (category == kBufrUpperAirLevel)
-    return create_hdesc_amdar();
-
-  if (category == kBufrSeaSurface)
-    return create_hdesc_buoy_ship(messages);
-
-  // First list all unique stations
+typedef std::map<long, NFmiStation> StationMap;
 
-  std::map<long, NFmiStation> stations;
+void collect_station(const Message& msg, StationMap& stations)
+{
+  NFmiStation station = get_station(msg);
 
-  for (const Message& msg : messages)
+  if (station.GetLongitude() != kFloatMissing && station.GetLatitude() != kFloatMissing)
   {
-    NFmiStation station = get_station(msg);
-
-    if (station.GetLongitude() != kFloatMissing && station.GetLatitude() != kFloatMissing)
+    auto pos = stations.insert(std::make_pair(station.GetIdent(), station));
+    // Handle stations with different coordinates
+    auto& iter = pos.first;
+    if (!pos.second && iter->second.GetLocation() != station.GetLocation())
     {
-      auto pos = stations.insert(std::make_pair(station.GetIdent(), station));
-      // Handle stations with different coordinates
-      auto& iter = pos.first;
-      if (!pos.second && iter->second.GetLocation() != station.GetLocation())
-      {
-        auto& oldstation = iter->second;
-        auto acc1 = accuracy_estimate(oldstation.GetLocation());
-        auto acc2 = accuracy_estimate(station.GetLocation());
-        // Use the one which seems to have more significant decimals
-        if (acc1 < acc2)
-          oldstation = station;
-      }
+      auto& oldstation = iter->second;
+      auto acc1 = accuracy_estimate(oldstation.GetLocation());
+      auto acc2 = accuracy_estimate(station.GetLocation());
+      // Use the one which seems to have more significant decimals
+      if (acc1 < acc2)
+        oldstation = station;
     }
   }
+}
 
-  // Then build the descriptor. The message may contain no name for the
-  // station, hence we use the stations file to name the stations if
-  // possible.
+NFmiHPlaceDescriptor create_hdesc(const StationMap& stations,
+                                  NFmiAviationStationInfoSystem& stationinfos)
+{
+  // The message may contain no name for the station, hence we use the
+  // stations file to name the stations if possible.
 
   NFmiLocationBag lbag;
   for (const auto& id_station : stations)
@@ -1899,6 +2300,27 @@ NFmiHPlaceDescriptor create_hdesc(const Messages& messages,
   return NFmiHPlaceDescriptor(lbag);
 }
 
+NFmiHPlaceDescriptor create_hdesc(const Messages& messages,
+                                  NFmiAviationStationInfoSystem& stationinfos,
+                                  BufrDataCategory category)
+{
+  // AMDAR descriptor is special (airplane measurements)
+
+  if (category == kBufrUpperAirLevel)
+    return create_hdesc_amdar();
+
+  if (category == kBufrSeaSurface)
+    return create_hdesc_buoy_ship(messages);
+
+  // First list all unique stations, then build the descriptor
+
+  StationMap stations;
+  for (const Message& msg : messages)
+    collect_station(msg, stations);
+
+  return create_hdesc(stations, stationinfos);
+}
+
 // ----------------------------------------------------------------------
 /*!
  * \brief Extract valid time from a message
@@ -2113,10 +2535,19 @@ NFmiTimeDescriptor create_tdesc_ident(const Messages& messages,
  */
 // ----------------------------------------------------------------------
 
-NFmiTimeDescriptor create_tdesc_amdar(const Messages& messages)
+NFmiTimeDescriptor create_tdesc(const std::set<NFmiMetTime>& validtimes)
 {
   NFmiTimeList tlist;
+  for (const NFmiMetTime& t : validtimes)
+  {
+    tlist.Add(new NFmiMetTime(t));
+  }
+  NFmiMetTime origintime;
+  return NFmiTimeDescriptor(origintime, tlist);
+}
 
+NFmiTimeDescriptor create_tdesc_amdar(const Messages& messages)
+{
   // Times used so far
 
   std::set<NFmiMetTime> validtimes;
@@ -2130,13 +2561,25 @@ NFmiTimeDescriptor create_tdesc_amdar(const Messages& messages)
 
   // Then the final timelist
 
-  for (const NFmiMetTime& t : validtimes)
+  return create_tdesc(validtimes);
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Collect the valid time of a message, if it has a valid one
+ */
+// ----------------------------------------------------------------------
+
+void collect_validtime(const Message& msg, std::set<NFmiMetTime>& validtimes)
+{
+  try
   {
-    tlist.Add(new NFmiMetTime(t));
+    validtimes.insert(get_validtime(msg));
+  }
+  catch (const std::exception& e)
+  {
+    std::cerr << "Skipping errorneous valid time: " << e.what() << std::endl;
   }
-
-  NFmiMetTime origintime;
-  return NFmiTimeDescriptor(origintime, tlist);
 }
 
 // ----------------------------------------------------------------------
@@ -2161,24 +2604,9 @@ NFmiTimeDescriptor create_tdesc(const Messages& messages,
 
   std::set<NFmiMetTime> validtimes;
   for (const Message& msg : messages)
-  {
-    try
-    {
-      validtimes.insert(get_validtime(msg));
-    }
-    catch (const std::exception& e)
-    {
-      std::cerr << "Skipping errorneous valid time: " << e.what() << std::endl;
-    }
-  }
+    collect_validtime(msg, validtimes);
 
-  NFmiTimeList tlist;
-  for (const NFmiMetTime& t : validtimes)
-  {
-    tlist.Add(new NFmiMetTime(t));
-  }
-  NFmiMetTime origintime;
-  return NFmiTimeDescriptor(origintime, tlist);
+  return create_tdesc(validtimes);
 }
 
 // ----------------------------------------------------------------------
@@ -2236,7 +2664,7 @@ void copy_params(NFmiFastQueryInfo &info,
 
     if (options.usebufrname)
     {
-      NameMap::const_iterator it = namemap.find(value.second.name);
+      NameMap::const_iterator it = namemap.find(value.second.name.str());
       if (it != namemap.end())
         pinfo = &it->second;
     }
@@ -2262,8 +2690,9 @@ void copy_params(NFmiFastQueryInfo &info,
  */
 // ----------------------------------------------------------------------
 
+template <typename MessageRange>
 void copy_records_sounding(NFmiFastQueryInfo &info,
-                           const Messages &messages,
+                           MessageRange &messages,
                            const NameMap &namemap,
                            const CodeIndex &codeindex)
 {
@@ -2374,8 +2803,9 @@ void copy_records_sounding(NFmiFastQueryInfo &info,
  */
 // ----------------------------------------------------------------------
 
+template <typename MessageRange>
 void copy_records_amdar(NFmiFastQueryInfo &info,
-                        const Messages &messages,
+                        MessageRange &messages,
                         const NameMap &namemap,
                         const CodeIndex &codeindex,
                         const IdentTimeMap &identtimemap)
@@ -2493,8 +2923,9 @@ void copy_records_amdar(NFmiFastQueryInfo &info,
  */
 // ----------------------------------------------------------------------
 
+template <typename MessageRange>
 void copy_records_buoy_ship(NFmiFastQueryInfo &info,
-                            const Messages &messages,
+                            MessageRange &messages,
                             const NameMap &namemap,
                             const CodeIndex &codeindex)
 {
@@ -2581,8 +3012,9 @@ void copy_records_buoy_ship(NFmiFastQueryInfo &info,
  */
 // ----------------------------------------------------------------------
 
+template <typename MessageRange>
 void copy_records(NFmiFastQueryInfo& info,
-                  const Messages& messages,
+                  MessageRange& messages,
                   const NameMap& namemap,
                   BufrDataCategory category,
                   const std::map<std::string, NFmiMetTime>& messageTimes)
@@ -2677,6 +3109,38 @@ void guess_producer(BufrDataCategory category)
   }
 }
 
+// ----------------------------------------------------------------------
+/*!
+ * \brief Move a record to the primary (first) code of a remapping
+ *
+ * The record found with one of the codes is stored with the primary code
+ * and the records of all the other codes are removed. If no record was
+ * found, only the other codes are removed.
+ */
+// ----------------------------------------------------------------------
+
+void remap_codes(Message& msg, Message::const_iterator source, const std::list<int>& codes)
+{
+  const int primarycode = codes.front();
+
+  if (source == msg.end() || source->first == primarycode)
+  {
+    for (const auto code : codes)
+      if (code != primarycode)
+        msg.erase(code);
+    return;
+  }
+
+  // Erasing invalidates the iterator
+
+  const record rec = source->second;
+
+  for (const auto code : codes)
+    msg.erase(code);
+
+  msg.insert(std::make_pair(primarycode, rec));
+}
+
 // ----------------------------------------------------------------------
 /*!
  * \brief Extract phase of flight from amdar message
@@ -2713,39 +3177,12 @@ Phase get_phase_amdar(Message& msg, bool remap, int& code)
 
   code = pit->first;
 
-  if (!remap)
-    return (Phase)pit->second.value;
-
-  auto codes = options.messageremap.find(REMAP_PHASE);
-  const int msgcode = pit->first, primarycode = codes->second.front();
-
-  for (const auto code : codes->second)
-  {
-    auto it = msg.find(code);
-
-    if (code == primarycode)
-    {
-      // Primary/first code, no need to remap ?
-
-      if (code == msgcode)
-        continue;
-
-      // Erase old row with primary code if it exists
-
-      if (it != msg.end())
-        msg.erase(it);
-
-      // Insert new row with primary code
+  const Phase phase = (Phase)pit->second.value;
 
-      msg.insert(std::make_pair(code, pit->second));
+  if (remap)
+    remap_codes(msg, pit, options.messageremap.find(REMAP_PHASE)->second);
 
-      msg.erase(pit);
-    }
-    else if (it != msg.end())
-      msg.erase(it);
-  }
-
-  return (Phase)pit->second.value;
+  return phase;
 }
 
 // ----------------------------------------------------------------------
@@ -2786,37 +3223,8 @@ double get_altitude(Message& msg, bool remap)
 
   double height = hit->second.value;
 
-  if (!remap)
-    return height;
-
-  auto codes = options.messageremap.find(REMAP_ALTITUDE);
-  const int msgcode = hit->first, primarycode = codes->second.front();
-
-  for (auto const code : codes->second)
-  {
-    auto it = msg.find(code);
-
-    if (code == primarycode)
-    {
-      // Primary/first code, no need to remap ?
-
-      if (code == msgcode)
-        continue;
-
-      // Erase old row with primary code if it exists
-
-      if (it != msg.end())
-        msg.erase(it);
-
-      // Insert new row with primary code
-
-      msg.insert(std::make_pair(code, hit->second));
-
-      msg.erase(hit);
-    }
-    else if (it != msg.end())
-      msg.erase(it);
-  }
+  if (remap)
+    remap_codes(msg, hit, options.messageremap.find(REMAP_ALTITUDE)->second);
 
   return height;
 }
@@ -3192,33 +3600,7 @@ void remap_message_amdar(Message& msg)
         break;
     }
 
-    const int msgcode = ((mit != msg.end()) ? mit->first : 0), primarycode = codes.second.front();
-
-    for (const auto code : codes.second)
-    {
-      auto it = msg.find(code);
-
-      if (code == primarycode)
-      {
-        // Primary/first code, no need to remap ?
-
-        if ((mit == msg.end()) || (code == msgcode))
-          continue;
-
-        // Erase old row with primary code if it exists
-
-        if (it != msg.end())
-          msg.erase(it);
-
-        // Insert new row with primary code
-
-        msg.insert(std::make_pair(code, mit->second));
-
-        msg.erase(mit);
-      }
-      else if (it != msg.end())
-        msg.erase(it);
-    }
+    remap_codes(msg, mit, codes.second);
   }
 }
 
@@ -3490,7 +3872,6 @@ void organize_messages_amdar(const Messages& origmessages,
     for (; imt != imm->second.end(); imt++)
     {
       auto& msg = imt->second;
-      auto iit = get_ident(msg, options.messageremap, msgident);
       const std::string ident = imm->first;
       bool identchange = (ident != lastorigident);
 
@@ -3508,6 +3889,10 @@ void organize_messages_amdar(const Messages& origmessages,
                                  phasereset,
                                  lastaltitude);
 
+      // Remapping may move the records, hence the ident is located only now
+
+      auto iit = get_ident(msg, options.messageremap, msgident);
+
       if (phasereset)
       {
         // Ignore collected descending level fligth messages on phase change or Flying phase
@@ -4437,9 +4822,11 @@ void set_totalcloud_octas_from_percentage(Messages& messages)
         {
           auto r = itp->second;
           r.value = octas;
+          static const ElementString name("CLOUD AMOUNT");
+          static const ElementString units("CODE TABLE");
           r.svalue.clear();
-          r.name = "CLOUD AMOUNT";
-          r.units = "CODE TABLE";
+          r.name = name;
+          r.units = units;
 
           msg.insert(std::make_pair(20011, r));
         }
@@ -4448,6 +4835,246 @@ void set_totalcloud_octas_from_percentage(Messages& messages)
   }
 }
 
+// ----------------------------------------------------------------------
+/*!
+ * \brief Prepare land surface messages for copying
+ */
+// ----------------------------------------------------------------------
+
+void prepare_land_messages(const Messages& origmessages, Messages& messages)
+{
+  // Decode low/middle/high cloud types
+
+  decode_cloudtypes(origmessages, messages);
+
+  // Set PressureChange values's sign to match PressureTendency value and/or
+  // filter off unknown PressureTendency values
+
+  set_pressurechange_sign_from_pressuretendency(messages);
+
+  // If requested with -t, set missing totalcloudcover octas from percentage when available
+
+  if (options.totalcloudoctas)
+    set_totalcloud_octas_from_percentage(messages);
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Single pass input range over the messages of the input files
+ *
+ * Holds only the records of the BUFR message being iterated, which are
+ * prepared the same way as run() prepares all the messages.
+ */
+// ----------------------------------------------------------------------
+
+class MessageStream
+{
+ public:
+  class iterator
+  {
+   public:
+    explicit iterator(MessageStream* stream = nullptr) : itsStream(stream) {}
+    const Message& operator*() const { return *itsStream->itsPos; }
+    iterator& operator++()
+    {
+      if (!itsStream->advance())
+        itsStream = nullptr;
+      return *this;
+    }
+    bool operator!=(const iterator& other) const { return itsStream != other.itsStream; }
+
+   private:
+    MessageStream* itsStream;
+  };
+
+  MessageStream(const std::list<std::string>& files, BufrDataCategory category, bool report)
+      : itsReader(files, report), itsCategory(category)
+  {
+  }
+
+  iterator begin() { return iterator(fetch() ? this : nullptr); }
+  iterator end() { return iterator(); }
+
+ private:
+  bool fetch()
+  {
+    Messages fragment;
+    while (itsReader.next(fragment))
+    {
+      itsMessages.clear();
+      if (itsCategory == kBufrLandSurface)
+        prepare_land_messages(fragment, itsMessages);
+      else
+        itsMessages.swap(fragment);
+
+      itsPos = itsMessages.begin();
+      if (itsPos != itsMessages.end())
+        return true;
+    }
+    return false;
+  }
+
+  bool advance() { return (++itsPos != itsMessages.end() || fetch()); }
+
+  BufrReader itsReader;
+  BufrDataCategory itsCategory;
+  Messages itsMessages;
+  Messages::const_iterator itsPos;
+};
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Print the messages in debug mode
+ */
+// ----------------------------------------------------------------------
+
+void print_messages(const Messages& messages, int& counter)
+{
+  for (const Message& msg : messages)
+  {
+    std::cout << std::endl << "Message " << ++counter << std::endl << std::endl;
+
+    for (const Message::value_type& value : msg)
+      std::cout << value.first << "," << value.second.name << "," << value.second.units << ","
+                << value.second.value << "," << value.second.svalue << std::endl;
+  }
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Create empty querydata for the descriptors
+ */
+// ----------------------------------------------------------------------
+
+std::shared_ptr<NFmiQueryData> create_querydata(const NFmiParamDescriptor& pdesc,
+                                                const NFmiTimeDescriptor& tdesc,
+                                                const NFmiHPlaceDescriptor& hdesc,
+                                                const NFmiVPlaceDescriptor& vdesc)
+{
+  // Initialize the data to missing values
+
+  NFmiFastQueryInfo qi(pdesc, tdesc, hdesc, vdesc);
+  std::shared_ptr<NFmiQueryData> data(NFmiQueryDataUtil::CreateEmptyData(qi));
+  if (data.get() == 0)
+    throw std::runtime_error("Could not allocate memory for result data");
+  return data;
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Write the output querydata
+ */
+// ----------------------------------------------------------------------
+
+void write_querydata(const NFmiQueryData& data)
+{
+  if (options.outfile == "-")
+    std::cout << data;
+  else
+  {
+    std::ofstream out(options.outfile.c_str(),
+                      std::ios::out | std::ios::binary);  // VC++ vaatii että tiedosto avataan
+    // binäärisenä (Linuxissa se on default
+    // optio)
+    out << data;
+  }
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Convert the files reading only one BUFR message at a time
+ *
+ * The first pass collects the parameters, levels, times and stations
+ * needed for the descriptors, the second pass decodes the messages again
+ * and copies their values directly into the querydata.
+ */
+// ----------------------------------------------------------------------
+
+void convert_streaming(const std::list<std::string>& infiles,
+                       const NameMap& parammap,
+                       NFmiAviationStationInfoSystem& stations)
+{
+  check_table_options();
+
+  // First pass. The category is validated only once all the messages have
+  // been read, but since mixed categories are an error the category of each
+  // message decides what is collected from it.
+
+  std::set<std::string> names;
+  SoundingLevelCounter levelcounter;
+  std::set<NFmiMetTime> validtimes;
+  std::string ident;
+  StationMap stationmap;
+  BuoyShipStations buoyshipstations;
+  int counter = 0;
+
+  BufrReader reader(infiles);
+  Messages fragment;
+  Messages messages;
+  while (reader.next(fragment))
+  {
+    const BufrDataCategory msgcategory = reader.message_category();
+
+    messages.clear();
+    if (msgcategory == kBufrLandSurface)
+      prepare_land_messages(fragment, messages);
+    else
+      messages.swap(fragment);
+
+    std::set<std::string> msgnames = collect_names(messages);
+    names.insert(msgnames.begin(), msgnames.end());
+
+    for (const Message& msg : messages)
+    {
+      if (msgcategory == kBufrSounding)
+        levelcounter.add(msg);
+
+      if (msgcategory == kBufrUpperAirLevel)
+        get_validtime_amdar(validtimes, msg, ident);
+      else
+        collect_validtime(msg, validtimes);
+
+      if (msgcategory == kBufrSeaSurface)
+        collect_station_buoy_ship(msg, buoyshipstations);
+      else if (msgcategory != kBufrUpperAirLevel)
+        collect_station(msg, stationmap);
+    }
+
+    if (options.debug)
+      print_messages(messages, counter);
+  }
+
+  BufrDataCategory category = reader.category();
+  validate_category(category);
+
+  NameMap namemap = map_names(names, parammap);
+
+  if (options.autoproducer)
+    guess_producer(category);
+
+  // Build the querydata descriptors
+
+  NFmiParamDescriptor pdesc = create_pdesc(namemap, category);
+  NFmiVPlaceDescriptor vdesc = create_vdesc(levelcounter.count(), category, 0);
+  NFmiTimeDescriptor tdesc = create_tdesc(validtimes);
+  NFmiHPlaceDescriptor hdesc =
+      (category == kBufrUpperAirLevel
+           ? create_hdesc_amdar()
+           : (category == kBufrSeaSurface ? create_hdesc_buoy_ship(buoyshipstations)
+                                          : create_hdesc(stationmap, stations)));
+
+  std::shared_ptr<NFmiQueryData> data = create_querydata(pdesc, tdesc, hdesc, vdesc);
+  NFmiFastQueryInfo info(data.get());
+  info.SetProducer(NFmiProducer(options.producernumber, options.producername));
+
+  // Second pass
+
+  MessageStream stream(infiles, category, false);
+  copy_records(info, stream, namemap, category, IdentTimeMap());
+
+  write_querydata(*data);
+}
+
 // ----------------------------------------------------------------------
 /*!
  * \brief Main program without exception handling
@@ -4471,6 +5098,20 @@ int run(int argc, char* argv[])
 
   std::list<std::string> infiles = expand_input_files();
 
+  // Sorting the messages by ident requires all of them to be in memory
+
+  if (options.streaming && options.requireident)
+  {
+    std::cerr << "Warning: option --streaming is ignored when -I is used" << std::endl;
+    options.streaming = false;
+  }
+
+  if (options.streaming)
+  {
+    convert_streaming(infiles, parammap, stations);
+    return 0;
+  }
+
   // Do the bufr operations
 
   std::pair<BufrDataCategory, Messages> tmp = read_messages(infiles);
@@ -4502,21 +5143,7 @@ int run(int argc, char* argv[])
   else
   {
     if (category == kBufrLandSurface)
-    {
-      // Decode low/middle/high cloud types
-
-      decode_cloudtypes(tmp.second, preparedmessages);
-
-      // Set PressureChange values's sign to match PressureTendency value and/or
-      // filter off unknown PressureTendency values
-
-      set_pressurechange_sign_from_pressuretendency(preparedmessages);
-
-      // If requested with -t, set missing totalcloudcover octas from percentage when available
-
-      if (options.totalcloudoctas)
-        set_totalcloud_octas_from_percentage(preparedmessages);
-    }
+      prepare_land_messages(tmp.second, preparedmessages);
 
     // Build a list of all parameter names
 
@@ -4535,15 +5162,8 @@ int run(int argc, char* argv[])
 
   if (options.debug)
   {
-    int i = 0;
-    for (const Message& msg : messages)
-    {
-      std::cout << std::endl << "Message " << ++i << std::endl << std::endl;
-
-      for (const Message::value_type& value : msg)
-        std::cout << value.first << "," << value.second.name << "," << value.second.units << ","
-                  << value.second.value << "," << value.second.svalue << std::endl;
-    }
+    int counter = 0;
+    print_messages(messages, counter);
   }
 
   // Build the querydata descriptors from the file names etc
@@ -4553,12 +5173,7 @@ int run(int argc, char* argv[])
   NFmiTimeDescriptor tdesc = create_tdesc(messages, category, timeidentlist, identtimemap);
   NFmiHPlaceDescriptor hdesc = create_hdesc(messages, stations, category);
 
-  // Initialize the data to missing values
-
-  NFmiFastQueryInfo qi(pdesc, tdesc, hdesc, vdesc);
-  std::shared_ptr<NFmiQueryData> data(NFmiQueryDataUtil::CreateEmptyData(qi));
-  if (data.get() == 0)
-    throw std::runtime_error("Could not allocate memory for result data");
+  std::shared_ptr<NFmiQueryData> data = create_querydata(pdesc, tdesc, hdesc, vdesc);
 
   NFmiFastQueryInfo info(data.get());
 
@@ -4570,16 +5185,7 @@ int run(int argc, char* argv[])
 
   // Output
 
-  if (options.outfile == "-")
-    std::cout << *data;
-  else
-  {
-    std::ofstream out(options.outfile.c_str(),
-                      std::ios::out | std::ios::binary);  // VC++ vaatii että tiedosto avataan
-    // binäärisenä (Linuxissa se on default
-    // optio)
-    out << *data;
-  }
+  write_querydata(*data);
 
   return 0;
 }
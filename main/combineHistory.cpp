@@ -30,6 +30,8 @@
  *  - -o require same origintime from each candidate
  *  - -O memory mapped output file
  *  - -r use oldest origin time instead of newest for output data
+ *  - -I directory for the persistent header indexes of the data directories
+ *  - -j number of input files to copy simultaneously
  *
  * If the set of times formed by the options is not available in
  * any forecast, all data for that moment will consist of missing values.
@@ -49,6 +51,10 @@
  */
 // ======================================================================
 
+#include "QueryDataReader.h"
+#include "ThreadTools.h"
+#include <fmt/format.h>
+#include <macgyver/FileSystem.h>
 #include <macgyver/StringConversion.h>
 #include <macgyver/TimeParser.h>
 #include <newbase/NFmiCmdLine.h>
@@ -59,7 +65,16 @@
 #include <newbase/NFmiQueryInfo.h>
 #include <newbase/NFmiTimeList.h>
 
+#include <cstdint>
+#include <filesystem>
 #include <fstream>
+#include <list>
+#include <map>
+#include <memory>
+#include <set>
+#include <sstream>
+#include <stdexcept>
+#include <vector>
 
 using namespace std;
 
@@ -87,6 +102,8 @@ void Usage(void)
        << "\t-1\t\ttake only latest file from each directory" << endl
        << "\t-N <name>\tset new producer name" << endl
        << "\t-D <id>\t\tset new producer id" << endl
+       << "\t-I <dir>\tdirectory for header indexes of the data directories" << endl
+       << "\t-j <threads>\tnumber of files to copy simultaneously (default 1)" << endl
        << endl;
 }
 
@@ -112,6 +129,362 @@ static bool ConvertTimeList2TimeBag(NFmiTimeList &theTimeList, NFmiTimeBag &theT
   return false;
 }
 
+// ----------------------------------------------------------------------
+/*!
+ * \brief Read the header of a querydata file
+ *
+ * \return False if the file could not be read
+ */
+// ----------------------------------------------------------------------
+
+static bool ReadHeader(const string &theFile, NFmiQueryInfo &theInfo)
+{
+  try
+  {
+    ifstream in(theFile.c_str(), ios::in | ios::binary);
+    if (!in)
+      return false;
+    in >> theInfo;
+    in.close();
+    return true;
+  }
+  catch (...)
+  {
+    return false;
+  }
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief A time as a YYYYMMDDHHMISS number
+ *
+ * The numbers compare in the same order as the times.
+ */
+// ----------------------------------------------------------------------
+
+static int64_t TimeStamp(const NFmiTime &theTime)
+{
+  int64_t stamp = theTime.GetYear();
+  stamp = 100 * stamp + theTime.GetMonth();
+  stamp = 100 * stamp + theTime.GetDay();
+  stamp = 100 * stamp + theTime.GetHour();
+  stamp = 100 * stamp + theTime.GetMin();
+  return 100 * stamp + theTime.GetSec();
+}
+
+// FNV-1a, unlike std::hash it is stable between runs and builds
+static uint64_t Hash(const string &theText)
+{
+  uint64_t hash = 14695981039346656037ULL;
+  for (unsigned char ch : theText)
+  {
+    hash ^= ch;
+    hash *= 1099511628211ULL;
+  }
+  return hash;
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief The header information needed for selecting the files
+ */
+// ----------------------------------------------------------------------
+
+struct HeaderSummary
+{
+  bool valid = false;   // false if the file is not querydata
+  int64_t origin = 0;   // origin time stamp
+  int64_t first = 0;    // first valid time stamp
+  int64_t last = 0;     // last valid time stamp
+  uint64_t params = 0;  // hash of the parameter bag
+};
+
+static HeaderSummary Summarize(NFmiQueryInfo &theInfo)
+{
+  HeaderSummary summary;
+  summary.valid = true;
+  summary.origin = TimeStamp(theInfo.OriginTime());
+
+  bool first = true;
+  for (theInfo.ResetTime(); theInfo.NextTime();)
+  {
+    const int64_t stamp = TimeStamp(theInfo.ValidTime());
+    if (first || stamp < summary.first)
+      summary.first = stamp;
+    if (first || stamp > summary.last)
+      summary.last = stamp;
+    first = false;
+  }
+
+  ostringstream params;
+  params << *theInfo.ParamDescriptor().ParamBag();
+  summary.params = Hash(params.str());
+  return summary;
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief A persistent index of the querydata headers in a directory
+ *
+ * Reading the header of every file in a large history directory on
+ * every run dominates the run time. The index stores the summary of
+ * each file along with its modification time and size, and only new
+ * or changed files are parsed again. Files which are not querydata
+ * are remembered too, so that they are not parsed on every run.
+ *
+ * The index of each data directory is stored as a text file in a
+ * separate cache directory, since the data directories may be read
+ * only and an extra file in them would be seen as input data.
+ */
+// ----------------------------------------------------------------------
+
+class HeaderIndex
+{
+ public:
+  HeaderIndex(const string &theCacheDir, const string &theDataDir);
+  const HeaderSummary &find(const string &theName);
+  void save();
+
+ private:
+  struct Entry
+  {
+    int64_t mtime = 0;
+    uint64_t size = 0;
+    bool used = false;
+    HeaderSummary summary;
+  };
+
+  string itsDataDir;
+  string itsIndexFile;
+  map<string, Entry> itsEntries;
+  bool itsChanged = false;
+};
+
+static const char *const gIndexMagic = "COMBINEHISTORYINDEX 1";
+
+HeaderIndex::HeaderIndex(const string &theCacheDir, const string &theDataDir)
+    : itsDataDir(theDataDir)
+{
+  const string dir = filesystem::absolute(theDataDir).lexically_normal().string();
+  itsIndexFile = fmt::format("{}/combineHistory_{:016x}.idx", theCacheDir, Hash(dir));
+
+  // A missing or invalid index is simply rebuilt
+
+  ifstream in(itsIndexFile.c_str());
+  string line;
+  if (!in || !getline(in, line) || line != gIndexMagic || !getline(in, line) || line != dir)
+    return;
+
+  while (getline(in, line))
+  {
+    const auto tab = line.find('\t');
+    if (tab == string::npos)
+      break;
+    Entry entry;
+    int valid = 0;
+    istringstream fields(line.substr(tab + 1));
+    fields >> entry.mtime >> entry.size >> valid >> entry.summary.origin >> entry.summary.first >>
+        entry.summary.last >> entry.summary.params;
+    if (!fields)
+      break;
+    entry.summary.valid = (valid != 0);
+    itsEntries[line.substr(0, tab)] = entry;
+  }
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Return the summary of the given file in the directory
+ *
+ * The header is parsed only if the file is new or has changed.
+ */
+// ----------------------------------------------------------------------
+
+const HeaderSummary &HeaderIndex::find(const string &theName)
+{
+  const string path = itsDataDir + '/' + theName;
+
+  std::error_code ec;
+  const auto mtime = filesystem::last_write_time(path, ec).time_since_epoch().count();
+  const auto size = (ec ? 0 : filesystem::file_size(path, ec));
+
+  Entry &entry = itsEntries[theName];
+  entry.used = true;
+
+  if (!ec && entry.mtime == static_cast<int64_t>(mtime) && entry.size == size)
+    return entry.summary;
+
+  NFmiQueryInfo qi;
+  entry.summary = (ReadHeader(path, qi) ? Summarize(qi) : HeaderSummary());
+
+  // Unreadable files are parsed again on the next run
+
+  if (ec)
+    entry.mtime = entry.size = 0;
+  else
+  {
+    entry.mtime = mtime;
+    entry.size = size;
+  }
+  itsChanged = true;
+  return entry.summary;
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Save the index if it has changed
+ *
+ * Entries for removed files are dropped. The file is written under a
+ * temporary name and then renamed, so that simultaneous runs never see
+ * a partial index. Failing to save is not an error, the headers are
+ * merely parsed again on the next run.
+ */
+// ----------------------------------------------------------------------
+
+void HeaderIndex::save()
+{
+  for (auto it = itsEntries.begin(); it != itsEntries.end();)
+  {
+    if (it->second.used)
+      ++it;
+    else
+    {
+      it = itsEntries.erase(it);
+      itsChanged = true;
+    }
+  }
+
+  if (!itsChanged)
+    return;
+
+  filesystem::path tmp;
+  try
+  {
+    tmp = Fmi::unique_path(itsIndexFile + "_%%%%%%%%");
+    ofstream out(tmp.c_str());
+    if (!out)
+      throw runtime_error("opening '" + tmp.string() + "' for writing failed");
+
+    out << gIndexMagic << '\n'
+        << filesystem::absolute(itsDataDir).lexically_normal().string() << '\n';
+
+    for (const auto &name_entry : itsEntries)
+    {
+      const string &name = name_entry.first;
+      const Entry &entry = name_entry.second;
+      // Names which would break the line format are never cached
+      if (entry.mtime == 0 || name.find_first_of("\t\n") != string::npos)
+        continue;
+      out << name << '\t' << entry.mtime << ' ' << entry.size << ' ' << entry.summary.valid << ' '
+          << entry.summary.origin << ' ' << entry.summary.first << ' ' << entry.summary.last << ' '
+          << entry.summary.params << '\n';
+    }
+    out.close();
+    if (!out)
+      throw runtime_error("writing '" + tmp.string() + "' failed");
+
+    filesystem::rename(tmp, itsIndexFile);
+    itsChanged = false;
+  }
+  catch (std::exception &e)
+  {
+    cerr << "Warning: failed to save header index '" << itsIndexFile << "': " << e.what() << endl;
+    std::error_code ec;
+    if (!tmp.empty())
+      filesystem::remove(tmp, ec);
+  }
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief An input file and the index of its directory, if any
+ */
+// ----------------------------------------------------------------------
+
+struct InputFile
+{
+  string path;
+  string name;
+  HeaderIndex *index;
+};
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief The times to be copied from a single input file
+ */
+// ----------------------------------------------------------------------
+
+struct SourcePlan
+{
+  string filename;
+  bool slowcopy;
+  std::vector<unsigned long> input_time_indexes;
+  std::vector<unsigned long> output_time_indexes;
+};
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Copy the planned times of an input file to the output
+ *
+ * Point data whose locations differ from those of the output is
+ * copied slowly by searching the stations by their identity.
+ */
+// ----------------------------------------------------------------------
+
+static void CopyData(NFmiFastQueryInfo &theSource,
+                     NFmiFastQueryInfo &theTarget,
+                     const SourcePlan &thePlan)
+{
+  const auto &input_time_indexes = thePlan.input_time_indexes;
+  const auto &output_time_indexes = thePlan.output_time_indexes;
+
+  for (theSource.ResetParam(); theSource.NextParam();)
+  {
+    if (!theTarget.Param(theSource.Param()))
+      continue;
+
+    if (!thePlan.slowcopy)
+    {
+      for (theTarget.ResetLocation(), theSource.ResetLocation();
+           theTarget.NextLocation() && theSource.NextLocation();)
+      {
+        for (theTarget.ResetLevel(), theSource.ResetLevel();
+             theTarget.NextLevel() && theSource.NextLevel();)
+        {
+          for (size_t i = 0; i < input_time_indexes.size(); i++)
+          {
+            theSource.TimeIndex(input_time_indexes[i]);
+            theTarget.TimeIndex(output_time_indexes[i]);
+            theTarget.FloatValue(theSource.FloatValue());
+          }
+        }
+      }
+    }
+
+    else  // slow copy
+    {
+      // Resolution changes cause slow copies until
+      // old data has been forgotten
+      for (theTarget.ResetLocation(); theTarget.NextLocation();)
+      {
+        if (theSource.Location(theTarget.Location()->GetIdent()))
+        {
+          for (theTarget.ResetLevel(), theSource.ResetLevel();
+               theTarget.NextLevel() && theSource.NextLevel();)
+          {
+            for (size_t i = 0; i < input_time_indexes.size(); i++)
+            {
+              theSource.TimeIndex(input_time_indexes[i]);
+              theTarget.TimeIndex(output_time_indexes[i]);
+              theTarget.FloatValue(theSource.FloatValue());
+            }
+          }
+        }
+      }
+    }
+  }
+}
+
 // ----------------------------------------------------------------------
 /*!
  * \brief The main program
@@ -121,13 +494,15 @@ static bool ConvertTimeList2TimeBag(NFmiTimeList &theTimeList, NFmiTimeBag &theT
  *  -# read command line arguments
  *  -# check command line arguments
  *  -# establish all queryfiles
- *  -# read all queryfiles, starting from newest
- *     -# if firstnewest queryfile queryfile
+ *  -# read the headers of all queryfiles to find the output times
+ *  -# read the headers of the accepted queryfiles, starting from newest
+ *     -# if first queryfile
  *         -# initialize new querydata with new time descriptor
  *            and copies for parameter etc descriptors
  *     -# for each time that is in the queryfile
  *         -# if the time is to be output and it has not been output yet,
- *            copy the grid to the output
+ *            mark it to be copied from the queryfile
+ *  -# copy the marked times one queryfile at a time
  *  -# output the result
  *
  * \param argc The number of arguments
@@ -147,9 +522,11 @@ int main(int argc, const char *argv[])
   bool sameorigin = false;   // do not require same origintime
   bool newestorigin = true;  // pick newest origin time
   std::string outfile = "-";
+  std::string indexdir;      // header index directory
+  unsigned int threadcount = 1;
   NFmiMetTime now;
 
-  NFmiCmdLine cmdline(argc, argv, "vp!f!1otN!D!rO!S!");
+  NFmiCmdLine cmdline(argc, argv, "vp!f!1otN!D!rO!S!I!j!");
 
   if (cmdline.Status().IsError())
   {
@@ -197,6 +574,12 @@ int main(int argc, const char *argv[])
   if (cmdline.isOption('S'))
     now = Fmi::TimeParser::parse(cmdline.OptionValue('S'));
 
+  if (cmdline.isOption('I'))
+    indexdir = cmdline.OptionValue('I');
+
+  if (cmdline.isOption('j'))
+    threadcount = ThreadTools::threadCount(cmdline.OptionValue('j'));
+
   // Check arguments
 
   for (list<string>::const_iterator it = datapaths.begin(); it != datapaths.end(); ++it)
@@ -208,6 +591,12 @@ int main(int argc, const char *argv[])
     }
   }
 
+  if (!indexdir.empty() && !NFmiFileSystem::DirectoryExists(indexdir))
+  {
+    cerr << "Error: Index directory '" << indexdir << "' does not exist" << endl;
+    return 1;
+  }
+
   // Establish the minimum and maximum times to be included
   // in the output.
 
@@ -228,12 +617,13 @@ int main(int argc, const char *argv[])
 
   // Establish the query files
 
-  list<string> files;
+  list<InputFile> files;
+  vector<unique_ptr<HeaderIndex>> indexes;
 
   for (list<string>::const_iterator dir = datapaths.begin(); dir != datapaths.end(); ++dir)
   {
     if (NFmiFileSystem::FileReadable(*dir))
-      files.push_back(*dir);
+      files.push_back(InputFile{*dir, *dir, nullptr});
 
     else if (latest)
     {
@@ -243,7 +633,7 @@ int main(int argc, const char *argv[])
         cerr << "Directory '" + *dir + "' is empty" << endl;
         return 1;
       }
-      files.push_back(*dir + '/' + newest);
+      files.push_back(InputFile{*dir + '/' + newest, newest, nullptr});
     }
     else
     {
@@ -258,9 +648,16 @@ int main(int argc, const char *argv[])
       dirfiles.sort();
       dirfiles.reverse();
 
+      HeaderIndex *index = nullptr;
+      if (!indexdir.empty())
+      {
+        indexes.emplace_back(new HeaderIndex(indexdir, *dir));
+        index = indexes.back().get();
+      }
+
       for (list<string>::const_iterator fit = dirfiles.begin(); fit != dirfiles.end(); ++fit)
       {
-        files.push_back(*dir + '/' + *fit);
+        files.push_back(InputFile{*dir + '/' + *fit, *fit, index});
       }
     }
   }
@@ -271,37 +668,46 @@ int main(int argc, const char *argv[])
 
   multimap<NFmiMetTime, string> accepted_files;
 
-  NFmiMetTime origintime;
+  // The origin time is compared using the header summaries, and the
+  // exact time is read from the file which defined it
+
+  int64_t originstamp = 0;
+  string originfile;
+
+  const int64_t firststamp = TimeStamp(firsttime);
+  const int64_t laststamp = TimeStamp(lasttime);
 
   // First collect all times and parameters in the requested time range
 
   NFmiParamBag pbag;
+  set<uint64_t> combined_params;
 
-  for (list<string>::const_iterator it = files.begin(); it != files.end(); ++it)
+  for (list<InputFile>::const_iterator it = files.begin(); it != files.end(); ++it)
   {
-    const string filename = *it;
+    const string &filename = it->path;
 
     if (verbose)
       cerr << "Reading " << filename << " header" << endl;
 
     NFmiQueryInfo qi;
-    try
+    bool parsed = false;
+    HeaderSummary summary;
+
+    if (it->index != nullptr)
+      summary = it->index->find(it->name);
+    else if (ReadHeader(filename, qi))
     {
-      ifstream in(filename.c_str(), ios::in | ios::binary);
-      if (!in)
-        continue;
-      in >> qi;
-      in.close();
+      parsed = true;
+      summary = Summarize(qi);
     }
-    catch (...)
-    {
+
+    if (!summary.valid)
       continue;
-    }
 
     // discard files with different origin time
     if (sameorigin && !accepted_files.empty())
     {
-      if (origintime != qi.OriginTime())
+      if (originstamp != summary.origin)
       {
         if (verbose)
           cerr << ".. discared due to different origin time" << endl;
@@ -311,12 +717,24 @@ int main(int argc, const char *argv[])
 
     // Choose newest/oldest origin time of output
 
-    if (accepted_files.empty())
-      origintime = qi.OriginTime();
-    else if (newestorigin && qi.OriginTime() > origintime)
-      origintime = qi.OriginTime();
-    else if (!newestorigin && qi.OriginTime() < origintime)
-      origintime = qi.OriginTime();
+    if (accepted_files.empty() || (newestorigin && summary.origin > originstamp) ||
+        (!newestorigin && summary.origin < originstamp))
+    {
+      originstamp = summary.origin;
+      originfile = filename;
+    }
+
+    // Files entirely outside the time range need not be parsed
+
+    if (summary.last < firststamp || summary.first > laststamp)
+    {
+      if (verbose)
+        cerr << "\tno times in the requested range" << endl;
+      continue;
+    }
+
+    if (!parsed && !ReadHeader(filename, qi))
+      continue;
 
     int accepted_count = 0;
 
@@ -345,10 +763,15 @@ int main(int argc, const char *argv[])
     if (accepted_count > 0)
     {
       accepted_files.insert(make_pair(qi.OriginTime(), filename));
-      pbag = pbag.Combine(*qi.ParamDescriptor().ParamBag());
+      // Combining an identical parameter bag again would change nothing
+      if (combined_params.insert(summary.params).second)
+        pbag = pbag.Combine(*qi.ParamDescriptor().ParamBag());
     }
   }
 
+  for (auto &index : indexes)
+    index->save();
+
   // It is an error if there are no timestamps in the desired range
 
   if (accepted_files.empty())
@@ -357,7 +780,20 @@ int main(int argc, const char *argv[])
     return 1;
   }
 
-  // Now a second pass reads all files which contained valid time stamps
+  NFmiMetTime origintime;
+  {
+    NFmiQueryInfo qi;
+    if (!ReadHeader(originfile, qi))
+    {
+      cerr << "Error: Failed to read the header of '" << originfile << "'" << endl;
+      return 1;
+    }
+    origintime = qi.OriginTime();
+  }
+
+  // Now a second pass plans the copying using the headers of the files
+  // which contained valid time stamps. Each output time is taken from
+  // exactly one file, the first one containing it.
 
   NFmiQueryData *outqd = 0;
   NFmiFastQueryInfo *outqi = 0;
@@ -365,14 +801,20 @@ int main(int argc, const char *argv[])
   // This will contain all times that have already been handled
   set<NFmiMetTime> handled_times;
 
+  vector<SourcePlan> plans;
+
   for (auto it = accepted_files.rbegin(); it != accepted_files.rend(); ++it)
   {
     const string &filename = it->second;
     if (verbose)
       cerr << "Reading " << filename << endl;
 
-    NFmiQueryData qd(filename);
-    NFmiFastQueryInfo qi(&qd);
+    NFmiQueryInfo qi;
+    if (!ReadHeader(filename, qi))
+    {
+      cerr << "Error: Failed to read the header of '" << filename << "'" << endl;
+      return 1;
+    }
 
     // If first file, create output file
 
@@ -406,9 +848,12 @@ int main(int argc, const char *argv[])
       outqi = new NFmiFastQueryInfo(outqd);
     }
 
+    SourcePlan plan;
+    plan.filename = filename;
+
     // Check whether point data must be combined slowly
 
-    bool slowcopy = false;
+    plan.slowcopy = false;
     {
       if (!outqi->IsGrid() && !qi.IsGrid())
       {
@@ -417,85 +862,58 @@ int main(int argc, const char *argv[])
         {
           if (outqi->Location()->GetIdent() != qi.Location()->GetIdent())
           {
-            slowcopy = true;
+            plan.slowcopy = true;
             break;
           }
         }
       }
     }
 
-    if (verbose && slowcopy)
+    if (verbose && plan.slowcopy)
       cerr << "Must perform slow copy of point data, locations differ\n";
 
     // Collect time indexes which will be copied, from and to
 
-    std::vector<unsigned long> input_time_indexes;
-    std::vector<unsigned long> output_time_indexes;
-
     for (qi.ResetTime(); qi.NextTime();)
     {
       if (timelist.Find(qi.ValidTime()) &&
           handled_times.find(qi.ValidTime()) == handled_times.end() && outqi->Time(qi.ValidTime()))
       {
-        input_time_indexes.push_back(qi.TimeIndex());
-        output_time_indexes.push_back(outqi->TimeIndex());
+        plan.input_time_indexes.push_back(qi.TimeIndex());
+        plan.output_time_indexes.push_back(outqi->TimeIndex());
         handled_times.insert(qi.ValidTime());
         if (verbose)
           cerr << "\ttaking " << qi.ValidTime().ToStr(kYYYYMMDDHHMM).CharPtr() << endl;
       }
     }
 
-    // Copy
-
-    for (qi.ResetParam(); qi.NextParam();)
+    if (verbose)
     {
-      if (outqi->Param(qi.Param()))
-      {
-        if (!slowcopy)
-        {
-          for (outqi->ResetLocation(), qi.ResetLocation();
-               outqi->NextLocation() && qi.NextLocation();)
-          {
-            for (outqi->ResetLevel(), qi.ResetLevel(); outqi->NextLevel() && qi.NextLevel();)
-            {
-              for (size_t i = 0; i < input_time_indexes.size(); i++)
-              {
-                qi.TimeIndex(input_time_indexes[i]);
-                outqi->TimeIndex(output_time_indexes[i]);
-                outqi->FloatValue(qi.FloatValue());
-              }
-            }
-          }
-        }
-
-        else  // slow copy
-        {
-          // Resolution changes cause slow copies until
-          // old data has been forgotten
-          for (outqi->ResetLocation(); outqi->NextLocation();)
-          {
-            if (qi.Location(outqi->Location()->GetIdent()))
-            {
-              for (outqi->ResetLevel(), qi.ResetLevel(); outqi->NextLevel() && qi.NextLevel();)
-              {
-                for (size_t i = 0; i < input_time_indexes.size(); i++)
-                {
-                  qi.TimeIndex(input_time_indexes[i]);
-                  outqi->TimeIndex(output_time_indexes[i]);
-                  outqi->FloatValue(qi.FloatValue());
-                }
-              }
-            }
-          }
-        }
-      }
-      else if (verbose)
-      {
-        cerr << "Warning: Parameter " << qi.Param() << " is not available in all datas" << endl;
-      }
+      for (qi.ResetParam(); qi.NextParam();)
+        if (!outqi->Param(qi.Param()))
+          cerr << "Warning: Parameter " << qi.Param() << " is not available in all datas" << endl;
     }
+
+    // Files whose times are all available in newer files are not read at all
+
+    if (!plan.input_time_indexes.empty())
+      plans.push_back(plan);
   }
 
+  // Copy the data one file at a time. The files fill disjoint sets of
+  // output times, so several of them can be copied simultaneously.
+
+  ThreadTools::parallelFor(plans.size(),
+                           threadcount,
+                           [&](size_t i)
+                           {
+                             std::unique_ptr<NFmiQueryData> qd =
+                                 QueryDataReader::read(plans[i].filename);
+                             NFmiFastQueryInfo qi(qd.get());
+                             NFmiFastQueryInfo out(outqd);
+                             CopyData(qi, out, plans[i]);
+                           });
+
   // Done
 
   if (outfile == "-")
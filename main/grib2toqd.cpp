@@ -38,6 +38,7 @@
 #endif
 
 #include "GribTools.h"
+#include "LocationCacheStore.h"
 #include <boost/algorithm/string/replace.hpp>
 #include <boost/thread.hpp>
 #include <fmt/format.h>
@@ -211,6 +212,7 @@ class TotalQDataCollector
 namespace
 {
 TotalQDataCollector gTotalQDataCollector;
+LocationCacheStore gLocationCacheStore;  // source to target grid points for reprojections
 }
 
 void Usage(void);
@@ -759,6 +761,9 @@ static int GetOptions(NFmiCmdLine &theCmdLine, GribFilterOptions &theGribFilterO
   if (theCmdLine.isOption('1'))
     theGribFilterOptions.fTreatSingleLevelsAsSurfaceData = true;
 
+  if (theCmdLine.isOption('k'))
+    gLocationCacheStore.directory(theCmdLine.OptionValue('k'));
+
   return 0;  // 0 on ok paluuarvo
 }
 
@@ -1168,7 +1173,7 @@ int Run(int argc, const char **argv, bool &fReportExecutionTime)
   // Optiot:
   GribFilterOptions gribFilterOptions;
 
-  NFmiCmdLine cmdline(argc, argv, "o!m!l!g!p!fnL!G!c!dvP!D!tH!r!1");
+  NFmiCmdLine cmdline(argc, argv, "o!m!l!g!p!fnL!G!c!dvP!D!tH!r!1k!");
 
   // Tarkistetaan optioiden oikeus:
   std::string filePatternOrDirectory;  // ohjelman 1. argumentti sisältää joko tiedoston nimen,
@@ -1283,6 +1288,8 @@ void Usage(void)
        << "\t\t pressure- and hybrid-data. Give two or three projections " << endl
        << "\t\t separated by semicolons ';'. E.g." << endl
        << "\t\t proj1:gridSize1[;proj2:gridSize2][;proj3:gridSize3]" << endl
+       << "\t-k <directory>\tSave the interpolation points of -P projections to" << endl
+       << "\t\tthe directory and reuse them in later runs." << endl
 
        << endl;
 }
@@ -2039,46 +2046,20 @@ static void CropData(GridRecordData *theGridRecordData,
   }
 }
 
-static std::string MakeGridStr(const NFmiGrid &theGrid)
-{
-  std::string str;
-  str += theGrid.Area()->ProjStr();
-  str += ":";
-  str += NFmiStringTools::Convert(theGrid.XNumber());
-  str += ",";
-  str += NFmiStringTools::Convert(theGrid.YNumber());
-  return str;
-}
-
 static void ProjectData(GridRecordData *theGridRecordData,
                         NFmiDataMatrix<float> &theOrigValues,
                         bool verbose)
 {
-  static std::map<std::string, NFmiDataMatrix<NFmiLocationCache> > locationCacheMap;
-
   if (verbose)
     cerr << " p";
 
   NFmiGrid targetGrid(theGridRecordData->itsGrid.itsArea,
                       theGridRecordData->itsGrid.itsNX,
                       theGridRecordData->itsGrid.itsNY);
-  std::string targetStr = ::MakeGridStr(targetGrid);
   NFmiGrid sourceGrid(theGridRecordData->itsOrigGrid.itsArea,
                       theGridRecordData->itsOrigGrid.itsNX,
                       theGridRecordData->itsOrigGrid.itsNY);
-  std::string sourceStr = ::MakeGridStr(sourceGrid);
-
-  std::string mapKeyStr = targetStr + "+" + sourceStr;
-  std::map<std::string, NFmiDataMatrix<NFmiLocationCache> >::iterator it =
-      locationCacheMap.find(mapKeyStr);
-  NFmiDataMatrix<NFmiLocationCache> locationCacheMatrix;
-  if (it == locationCacheMap.end())
-  {
-    sourceGrid.CalcLatlonCachePoints(targetGrid, locationCacheMatrix);
-    locationCacheMap.insert(std::make_pair(mapKeyStr, locationCacheMatrix));
-  }
-  else
-    locationCacheMatrix = (*it).second;
+  const LocationCache &locationCache = gLocationCacheStore.find(sourceGrid, targetGrid);
 
   int targetXSize = theGridRecordData->itsGrid.itsNX;
   int targetYSize = theGridRecordData->itsGrid.itsNY;
@@ -2088,12 +2069,11 @@ static void ProjectData(GridRecordData *theGridRecordData,
   FmiParameterName param = FmiParameterName(theGridRecordData->itsParam.GetParam()->GetIdent());
   for (targetGrid.Reset(); targetGrid.Next(); counter++)
   {
-    NFmiLocationCache &locCache =
-        locationCacheMatrix[targetGrid.Index() % targetXSize][targetGrid.Index() / targetXSize];
+    NFmiPoint gridPoint = locationCache.gridPoint(targetGrid.Index());
     int destX = counter % theGridRecordData->itsGrid.itsNX;
     int destY = counter / theGridRecordData->itsGrid.itsNX;
     theGridRecordData->itsGridData[destX][destY] = DataMatrixUtils::InterpolatedValue(
-        theOrigValues, locCache.itsGridPoint, relativeRect, param, true);
+        theOrigValues, gridPoint, relativeRect, param, true);
   }
 }
 
@@ -2131,45 +2111,12 @@ static void FillGridData(grib_handle *theGribHandle,
     long scanningMode = 0;
     int status4 = grib_get_long(theGribHandle, "scanningMode", &scanningMode);
 
-    // BIT  VALUE   MEANING
-    // 1    0   Points scan in +i direction (128!)
-    //      1   Points scan in -i direction
-    // 2    0   Points scan in -j direction (64!)
-    //      1   Points scan in +j direction
-    // 3    0   Adjacent points in i direction are consecutive (32!)
-    //          (FORTRAN: (I,J))
-    //      1   Adjacent points in j direction are consecutive
-    //          (FORTRAN: (J,I))
-
     if (status4 == 0)
-    {
-      if (scanningMode == 0)
-      {
-        for (size_t i = 0; i < values_length; i++)
-        {
-          if (doubleValues[i] == theGridRecordData->itsMissingValue)
-            origValues[i % gridXSize][gridYSize - (i / gridXSize) - 1] = kFloatMissing;
-          else
-            origValues[i % gridXSize][gridYSize - (i / gridXSize) - 1] =
-                static_cast<float>(doubleValues[i]);
-        }
-      }
-      else if (scanningMode == 64)
-      {
-        for (size_t i = 0; i < values_length; i++)
-        {
-          if (doubleValues[i] == theGridRecordData->itsMissingValue)
-            origValues[i % gridXSize][i / gridXSize] = kFloatMissing;
-          else
-            origValues[i % gridXSize][i / gridXSize] = static_cast<float>(doubleValues[i]);
-        }
-      }
-      else  // sitten kun tulee lisää ceissejä, lisätään eri täyttö variaatioita
-      {
-        throw runtime_error("Error: Scanning mode " + boost::lexical_cast<string>(scanningMode) +
-                            " not yet implemented.");
-      }
-    }
+      UnpackGribValues(doubleValues.data(),
+                       values_length,
+                       scanningMode,
+                       theGridRecordData->itsMissingValue,
+                       origValues);
 
     ::DoGlobalFix(origValues, doGlobeFix, verbose);
     ::DoAreaManipulations(theGridRecordData, origValues, verbose);
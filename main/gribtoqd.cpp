@@ -5,6 +5,8 @@
 #endif
 
 #include "GribTools.h"
+#include "LocationCacheStore.h"
+#include "ThreadTools.h"
 #include <boost/algorithm/string/replace.hpp>
 #include <boost/thread.hpp>
 #include <fmt/format.h>
@@ -25,6 +27,10 @@
 #include <newbase/NFmiTimeList.h>
 #include <newbase/NFmiTotalWind.h>
 #include <newbase/NFmiValueString.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <deque>
 #include <functional>
 #include <grib_api.h>
 #include <iomanip>
@@ -35,15 +41,6 @@
 
 using namespace std;
 
-bool jscan_is_negative(grib_handle *theHandle)
-{
-  long direction = 0;
-  int status = grib_get_long(theHandle, "jScansPositively", &direction);
-  if (status != 0)
-    return false;
-  return (direction == 0);
-}
-
 void check_jscan_direction(grib_handle *theHandle)
 {
   long direction = 0;
@@ -121,7 +118,9 @@ struct GribFilterOptions
         itsInputFileNameStr(),
         itsInputFile(0),
         itsStepRangeCheckedParams(),
-        itsWantedStepRange(0)
+        itsWantedStepRange(0),
+        itsThreadCount(1),
+        fTwoPass(false)
   {
   }
 
@@ -188,10 +187,17 @@ struct GribFilterOptions
                                                       // on kakksi eri jaksoista parametria datassa)
   int itsWantedStepRange;  // Jos tämä on 3, valitaan NAM:in tapauksessa se 3h-sade, jos tämä on -3,
                            // valitaan se toinen (hidden feature).
+  unsigned int itsThreadCount;  // -j option: threads used for decoding files and their messages
+  bool fTwoPass;  // -M option: read the metadata first and decode the values straight into the
+                  // allocated querydata, so that all the grids are never in memory at once
 };
 
 // Poistin TotalQDataCollector -luokan, koska ainakaan grib_api ei tue multi-threaddausta näihin
-// aikoihin ja se sekoitti koodia
+// aikoihin ja se sekoitti koodia.
+//
+// Current eccodes versions support one handle per thread. With the -j option the files are
+// converted concurrently into per-file collections, which are merged in input order so that the
+// result is identical to the serial run.
 
 struct LevelLessThan
 {
@@ -211,6 +217,23 @@ struct LevelLessThan
 namespace
 {
 vector<std::shared_ptr<NFmiQueryData> > gTotalQDataCollector;
+LocationCacheStore gLocationCacheStore;  // source to target grid points for reprojections
+
+// The messages of a file converted by a worker thread, printed in file order afterwards
+thread_local std::ostringstream *tFileLog = nullptr;
+}  // namespace
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief The stream for the progress and error messages of the conversion
+ */
+// ----------------------------------------------------------------------
+
+std::ostream &Log()
+{
+  if (tFileLog)
+    return *tFileLog;
+  return cerr;
 }
 
 const unsigned long gMissLevelValue = 9999999;  // ignore levels with this value
@@ -483,7 +506,7 @@ NFmiLevel GetLevel(grib_handle *theHandle)
   bool levelValueOk = GetGribLongValue(theHandle, "vertical.level", levelValue);
 
   if (!levelValueOk)
-    cerr << "Warning: Couldn't get level from given grib_handle, assuming value zero\n.";
+    Log() << "Warning: Couldn't get level from given grib_handle, assuming value zero\n.";
 
   // Note: a missing value is encoded as a 16-bit -1, which is converted to max int by
   // grib_get_long. Bizarre API, if there is no better way to test for missing values
@@ -1708,7 +1731,7 @@ void DoErrorReporting(const std::string &theBaseString,
     errStr += "\n";
     errStr += *theErrorString;
   }
-  cerr << errStr << std::endl;
+  Log() << errStr << std::endl;
 }
 
 std::string GetParamName(grib_handle *theHandle)
@@ -2584,17 +2607,17 @@ void ChangeParamSettingsIfNeeded(vector<ParamChangeItem> &theParamChangeTable,
           {
             if (verbose)
             {
-              cerr << paramChangeItem.itsOriginalParamId << " changed to "
-                   << paramChangeItem.itsWantedParam.GetIdent() << " "
-                   << paramChangeItem.itsWantedParam.GetName().CharPtr() << " at level "
-                   << theGribData->itsLevel.LevelValue();
+              Log() << paramChangeItem.itsOriginalParamId << " changed to "
+                    << paramChangeItem.itsWantedParam.GetIdent() << " "
+                    << paramChangeItem.itsWantedParam.GetName().CharPtr() << " at level "
+                    << theGribData->itsLevel.LevelValue();
             }
 
             theGribData->ChangeParam(paramChangeItem.itsWantedParam);
             theGribData->itsLevel =
                 NFmiLevel(1, "sfc", 0);  // tarkista että tästä tulee pinta level dataa
             if (verbose)
-              cerr << " level -> sfc";
+              Log() << " level -> sfc";
             break;
           }
         }
@@ -2602,9 +2625,9 @@ void ChangeParamSettingsIfNeeded(vector<ParamChangeItem> &theParamChangeTable,
         {
           if (verbose)
           {
-            cerr << paramChangeItem.itsOriginalParamId << " changed to "
-                 << paramChangeItem.itsWantedParam.GetIdent() << " "
-                 << paramChangeItem.itsWantedParam.GetName().CharPtr();
+            Log() << paramChangeItem.itsOriginalParamId << " changed to "
+                  << paramChangeItem.itsWantedParam.GetIdent() << " "
+                  << paramChangeItem.itsWantedParam.GetName().CharPtr();
           }
           theGribData->ChangeParam(paramChangeItem.itsWantedParam);
           break;
@@ -2730,17 +2753,6 @@ bool CropParam(GridRecordData *gribData,
   return false;
 }
 
-std::string MakeGridStr(const NFmiGrid &theGrid)
-{
-  std::string str;
-  str += theGrid.Area()->ProjStr();
-  str += ":";
-  str += NFmiStringTools::Convert(theGrid.XNumber());
-  str += ",";
-  str += NFmiStringTools::Convert(theGrid.YNumber());
-  return str;
-}
-
 void DoGlobalFix(NFmiDataMatrix<float> &theOrigValues, const GribFilterOptions &theOptions)
 {
   // Nyt on siis tilanne että halutaan 'korjata' globaali data editoria varten.
@@ -2751,7 +2763,7 @@ void DoGlobalFix(NFmiDataMatrix<float> &theOrigValues, const GribFilterOptions &
   // puolelle ja toisin päin.
 
   if (theOptions.fVerbose)
-    cerr << " swapping sides";
+    Log() << " swapping sides";
   int nx = static_cast<int>(theOrigValues.NX());
   int ny = static_cast<int>(theOrigValues.NY());
   for (int j = 0; j < ny; j++)
@@ -2763,31 +2775,16 @@ void ProjectData(GridRecordData *theGridRecordData,
                  NFmiDataMatrix<float> &theOrigValues,
                  const GribFilterOptions &theOptions)
 {
-  static std::map<std::string, NFmiDataMatrix<NFmiLocationCache> > locationCacheMap;
-
   if (theOptions.fVerbose)
-    cerr << " p";
+    Log() << " p";
 
   NFmiGrid targetGrid(theGridRecordData->itsGrid.itsArea,
                       theGridRecordData->itsGrid.itsNX,
                       theGridRecordData->itsGrid.itsNY);
-  std::string targetStr = MakeGridStr(targetGrid);
   NFmiGrid sourceGrid(theGridRecordData->itsOrigGrid.itsArea,
                       theGridRecordData->itsOrigGrid.itsNX,
                       theGridRecordData->itsOrigGrid.itsNY);
-  std::string sourceStr = MakeGridStr(sourceGrid);
-
-  std::string mapKeyStr = targetStr + "+" + sourceStr;
-  std::map<std::string, NFmiDataMatrix<NFmiLocationCache> >::iterator it =
-      locationCacheMap.find(mapKeyStr);
-  NFmiDataMatrix<NFmiLocationCache> locationCacheMatrix;
-  if (it == locationCacheMap.end())
-  {
-    sourceGrid.CalcLatlonCachePoints(targetGrid, locationCacheMatrix);
-    locationCacheMap.insert(std::make_pair(mapKeyStr, locationCacheMatrix));
-  }
-  else
-    locationCacheMatrix = (*it).second;
+  const LocationCache &locationCache = gLocationCacheStore.find(sourceGrid, targetGrid);
 
   int targetXSize = theGridRecordData->itsGrid.itsNX;
   int targetYSize = theGridRecordData->itsGrid.itsNY;
@@ -2798,12 +2795,11 @@ void ProjectData(GridRecordData *theGridRecordData,
   FmiInterpolationMethod interp = theGridRecordData->itsParam.GetParam()->InterpolationMethod();
   for (targetGrid.Reset(); targetGrid.Next(); counter++)
   {
-    NFmiLocationCache &locCache =
-        locationCacheMatrix[targetGrid.Index() % targetXSize][targetGrid.Index() / targetXSize];
+    NFmiPoint gridPoint = locationCache.gridPoint(targetGrid.Index());
     int destX = counter % theGridRecordData->itsGrid.itsNX;
     int destY = counter / theGridRecordData->itsGrid.itsNX;
     theGridRecordData->itsGridData[destX][destY] = DataMatrixUtils::InterpolatedValue(
-        theOrigValues, locCache.itsGridPoint, relativeRect, param, true, interp);
+        theOrigValues, gridPoint, relativeRect, param, true, interp);
   }
 }
 
@@ -2813,7 +2809,7 @@ void CropData(GridRecordData *theGridRecordData,
 {
   // tässä raaka hila croppaus
   if (theOptions.fVerbose)
-    cerr << " c";
+    Log() << " c";
   int x1 = static_cast<int>(theGridRecordData->itsGridPointCropOffset.X());
   int y1 = static_cast<int>(theGridRecordData->itsGridPointCropOffset.Y());
   int destSizeX = theGridRecordData->itsGrid.itsNX;
@@ -2884,9 +2880,11 @@ void MakeParameterConversions(GridRecordData *theGridRecordData,
   }
 }
 
-void FillGridData(grib_handle *theHandle,
-                  GridRecordData *theGridRecordData,
-                  const GribFilterOptions &theOptions)
+// Unpacks the message values into the original grid (step 1 of FillGridData)
+void DecodeGridData(grib_handle *theHandle,
+                    GridRecordData *theGridRecordData,
+                    NFmiDataMatrix<float> &origValues,
+                    const GribFilterOptions &theOptions)
 {
   // 1. Täytetään ensin origGridin kokoinen matriisi, koska pitää pystyä tekemään mm. global fix
   size_t values_length = 0;
@@ -2895,61 +2893,45 @@ void FillGridData(grib_handle *theHandle,
   int status2 = grib_get_double_array(theHandle, "values", &doubleValues[0], &values_length);
   int gridXSize = theGridRecordData->itsOrigGrid.itsNX;
   int gridYSize = theGridRecordData->itsOrigGrid.itsNY;
-  NFmiDataMatrix<float> origValues(gridXSize, gridYSize);
+  origValues.Resize(gridXSize, gridYSize);
   if (status1 || status2)
     throw runtime_error("Couldn't get values-data from given grib_handle.");
 
   long scanningMode = 0;
   int status4 = grib_get_long(theHandle, "scanningMode", &scanningMode);
 
-  // BIT  VALUE   MEANING
-  // 1    0   Points scan in +i direction (128!)
-  //      1   Points scan in -i direction
-  // 2    0   Points scan in -j direction (64!)
-  //      1   Points scan in +j direction
-  // 3    0   Adjacent points in i direction are consecutive (32!)
-  //          (FORTRAN: (I,J))
-  //      1   Adjacent points in j direction are consecutive
-  //          (FORTRAN: (J,I))
-
+  // Without a scanning mode the grid is left zero filled as before
   if (status4 == 0)
-  {
-    if (scanningMode == 0)
-    {
-      for (size_t i = 0; i < values_length; i++)
-      {
-        if (doubleValues[i] == theGridRecordData->itsMissingValue)
-          origValues[i % gridXSize][gridYSize - (i / gridXSize) - 1] = kFloatMissing;
-        else
-          origValues[i % gridXSize][gridYSize - (i / gridXSize) - 1] =
-              static_cast<float>(doubleValues[i]);
-      }
-    }
-    else if (scanningMode == 64)
-    {
-      for (size_t i = 0; i < values_length; i++)
-      {
-        if (doubleValues[i] == theGridRecordData->itsMissingValue)
-          origValues[i % gridXSize][i / gridXSize] = kFloatMissing;
-        else
-          origValues[i % gridXSize][i / gridXSize] = static_cast<float>(doubleValues[i]);
-      }
-    }
-    else  // sitten kun tulee lisää ceissejä, lisätään eri täyttö variaatioita
-    {
-      throw runtime_error("Scanning mode " + boost::lexical_cast<string>(scanningMode) +
-                          " not yet implemented.");
-    }
-  }
+    UnpackGribValues(doubleValues.data(),
+                     values_length,
+                     scanningMode,
+                     theGridRecordData->itsMissingValue,
+                     origValues);
 
   if (theOptions.DoGlobalFix())
     DoGlobalFix(origValues, theOptions);
+}
+
+// Fills the final grid from the original one (steps 2 and 3 of FillGridData)
+void ManipulateGridData(GridRecordData *theGridRecordData,
+                        NFmiDataMatrix<float> &origValues,
+                        const GribFilterOptions &theOptions)
+{
   DoAreaManipulations(theGridRecordData, origValues, theOptions);
 
   // 3. Tarkista vielä, jos löytyy paramChangeTablesta parametrille muunnos kaavat jotka pitää tehdä
   MakeParameterConversions(theGridRecordData, theOptions.itsParamChangeTable);
 }
 
+void FillGridData(grib_handle *theHandle,
+                  GridRecordData *theGridRecordData,
+                  const GribFilterOptions &theOptions)
+{
+  NFmiDataMatrix<float> origValues;
+  DecodeGridData(theHandle, theGridRecordData, origValues, theOptions);
+  ManipulateGridData(theGridRecordData, origValues, theOptions);
+}
+
 vector<NFmiHPlaceDescriptor> GetAllHPlaceDescriptors(vector<GridRecordData *> &theGribRecordDatas,
                                                      bool useOutputFile)
 {
@@ -3148,8 +3130,8 @@ NFmiParamDescriptor GetParamDesc(vector<GridRecordData *> &theGribRecordDatas,
     }
     else if (theGribFilterOptions.fVerbose)
     {
-      cerr << "Discarding parameter " << i << " since the grid is different from the chosen one"
-           << endl;
+      Log() << "Discarding parameter " << i << " since the grid is different from the chosen one"
+            << endl;
     }
   }
 
@@ -3237,6 +3219,26 @@ NFmiTimeDescriptor GetTimeDesc(vector<GridRecordData *> &theGribRecordDatas,
   return NFmiTimeDescriptor(theGribRecordDatas[0]->itsOrigTime, timeList);
 }
 
+// Sets the info to the place of the record, returns false if the data has no place for it
+bool FindGribRecordPlace(NFmiFastQueryInfo &theInfo, GridRecordData *theGribRecordData)
+{
+  // vain samanlaisia hiloja laitetaan samaan qdataan
+  return (theGribRecordData->itsGrid == *theInfo.Grid() &&
+          theInfo.Time(theGribRecordData->itsValidTime) &&
+          theInfo.Level(theGribRecordData->itsLevel) && theInfo.Param(theGribRecordData->itsParam));
+}
+
+// Used instead of FillQDataWithGribRecords in the two-pass mode where the values are filled later
+bool HasGribRecordPlaces(std::shared_ptr<NFmiQueryData> &theQData,
+                         vector<GridRecordData *> &theGribRecordDatas)
+{
+  NFmiFastQueryInfo info(theQData.get());
+  for (GridRecordData *gribRecordData : theGribRecordDatas)
+    if (FindGribRecordPlace(info, gribRecordData))
+      return true;
+  return false;
+}
+
 bool FillQDataWithGribRecords(std::shared_ptr<NFmiQueryData> &theQData,
                               vector<GridRecordData *> &theGribRecordDatas,
                               bool verbose)
@@ -3246,24 +3248,21 @@ bool FillQDataWithGribRecords(std::shared_ptr<NFmiQueryData> &theQData,
   GridRecordData *tmp = 0;
   int filledGridCount = 0;
   if (verbose)
-    cerr << "Filling qdata grids ";
+    Log() << "Filling qdata grids ";
   for (int i = 0; i < gribCount; i++)
   {
     tmp = theGribRecordDatas[i];
-    if (tmp->itsGrid == *info.Grid())  // vain samanlaisia hiloja laitetaan samaan qdataan
+    if (FindGribRecordPlace(info, tmp))
     {
-      if (info.Time(tmp->itsValidTime) && info.Level(tmp->itsLevel) && info.Param(tmp->itsParam))
-      {
-        if (!info.SetValues(tmp->itsGridData))
-          throw runtime_error("qdatan täyttö gribi datalla epäonnistui, lopetetaan...");
-        filledGridCount++;
-        if (verbose)
-          cerr << NFmiStringTools::Convert(filledGridCount) << " ";
-      }
+      if (!info.SetValues(tmp->itsGridData))
+        throw runtime_error("qdatan täyttö gribi datalla epäonnistui, lopetetaan...");
+      filledGridCount++;
+      if (verbose)
+        Log() << NFmiStringTools::Convert(filledGridCount) << " ";
     }
   }
   if (verbose)
-    cerr << endl;
+    Log() << endl;
   return filledGridCount > 0;
 }
 
@@ -3283,8 +3282,11 @@ std::shared_ptr<NFmiQueryData> CreateQueryData(vector<GridRecordData *> &theGrib
       return qdata;  // turha jatkaa jos toinen näistä on tyhjä
     NFmiQueryInfo innerInfo(params, times, theHplace, theVplace);
     qdata = std::shared_ptr<NFmiQueryData>(NFmiQueryDataUtil::CreateEmptyData(innerInfo));
+    // In the two-pass mode the values are decoded into the data only after all have been created
     bool anyDataFilled =
-        FillQDataWithGribRecords(qdata, theGribRecordDatas, theGribFilterOptions.fVerbose);
+        (theGribFilterOptions.fTwoPass
+             ? HasGribRecordPlaces(qdata, theGribRecordDatas)
+             : FillQDataWithGribRecords(qdata, theGribRecordDatas, theGribFilterOptions.fVerbose));
 
     if (anyDataFilled == false)
       qdata = std::shared_ptr<NFmiQueryData>();
@@ -3527,7 +3529,7 @@ void CreateQueryDatas(vector<GridRecordData *> &theGribRecordDatas,
                       map<int, pair<double, double> > *theVerticalCoordinateMap)
 {
   if (theGribFilterOptions.fVerbose)
-    cerr << "Creating querydatas" << endl;
+    Log() << "Creating querydatas" << endl;
   int gribCount = static_cast<int>(theGribRecordDatas.size());
   if (gribCount > 0)
   {
@@ -3540,7 +3542,7 @@ void CreateQueryDatas(vector<GridRecordData *> &theGribRecordDatas,
       for (unsigned int i = 0; i < hPlaceDescriptors.size(); i++)
       {
         if (theGribFilterOptions.fVerbose)
-          cerr << "L" << NFmiStringTools::Convert(j) << "H" << NFmiStringTools::Convert(i) << " ";
+          Log() << "L" << NFmiStringTools::Convert(j) << "H" << NFmiStringTools::Convert(i) << " ";
         std::shared_ptr<NFmiQueryData> qdata = CreateQueryData(
             theGribRecordDatas, hPlaceDescriptors[i], vPlaceDescriptors[j], theGribFilterOptions);
         if (qdata)
@@ -3624,6 +3626,381 @@ bool IsStepRangeCorrect(grib_handle *theHandle,
   return true;  // Jos tänne päästään, on parametri ok
 }
 
+// Report a failed message like the serial loop does, or rethrow if the error should stop the run
+void ReportGribFieldError(std::exception_ptr theError, int theMessageNumber, bool fStopOnError)
+{
+  if (fStopOnError)
+    std::rethrow_exception(theError);
+
+  try
+  {
+    std::rethrow_exception(theError);
+  }
+  catch (exception &e)
+  {
+    Log() << "\nProblem with grib field " << NFmiStringTools::Convert(theMessageNumber) << ":"
+          << e.what() << endl;
+  }
+  catch (...)
+  {
+    Log() << "\nUnknown problem with grib field " << NFmiStringTools::Convert(theMessageNumber)
+          << endl;
+  }
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief A GRIB message travelling through the conversion pipeline
+ */
+// ----------------------------------------------------------------------
+
+struct PendingGribMessage
+{
+  grib_handle *itsHandle;
+  GridRecordData *itsData;
+  int itsMessageNumber;
+  bool fStopOnError;                    // executionStoppingError when the message was read
+  NFmiDataMatrix<float> itsOrigValues;  // decoded values before projection or cropping
+  std::exception_ptr itsError;
+};
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Bounded producer/consumer pipeline for the messages of one file
+ *
+ * The reading thread pushes messages whose metadata has been extracted. A
+ * pool of threads unpacks the values (DecodeGridData) and another pool
+ * projects or crops them and applies the parameter conversions
+ * (ManipulateGridData). The queues between the stages are bounded so that
+ * reading cannot run far ahead of decoding, and decoding far ahead of
+ * the interpolation. Message order is preserved in the results since
+ * every message already has its slot in the record vector.
+ */
+// ----------------------------------------------------------------------
+
+class GribMessagePipeline
+{
+ public:
+  typedef std::chrono::steady_clock Clock;
+
+  GribMessagePipeline(const GribFilterOptions &theOptions);
+  ~GribMessagePipeline();
+
+  void Push(grib_handle *theHandle,
+            GridRecordData *theData,
+            int theMessageNumber,
+            bool fStopOnError);
+  void Finish(vector<GridRecordData *> &theGribRecordDatas);
+
+  // True once a message whose error stops the conversion has failed
+  bool FatalError() const { return fFatalError; }
+
+ private:
+  GribMessagePipeline(const GribMessagePipeline &theOther);
+  GribMessagePipeline &operator=(const GribMessagePipeline &theOther);
+
+  struct StageStatistics
+  {
+    std::atomic<long> itsCount{0};
+    std::atomic<long long> itsMicroSeconds{0};
+
+    void Add(Clock::time_point theStartTime)
+    {
+      ++itsCount;
+      itsMicroSeconds += std::chrono::duration_cast<std::chrono::microseconds>(Clock::now() -
+                                                                               theStartTime)
+                             .count();
+    }
+  };
+
+  void DecodeStage();
+  void ManipulationStage();
+  void Stop();
+  void PrintStatistics() const;
+
+  const GribFilterOptions &itsOptions;
+  unsigned int itsDecodeThreadCount;
+  unsigned int itsManipulationThreadCount;
+  std::deque<PendingGribMessage> itsMessages;  // in message order, the queues point here
+  ThreadTools::BoundedQueue<PendingGribMessage *> itsDecodeQueue;
+  ThreadTools::BoundedQueue<PendingGribMessage *> itsManipulationQueue;
+  boost::thread_group itsDecodeThreads;
+  boost::thread_group itsManipulationThreads;
+  bool fStopped;
+  std::atomic<bool> fFatalError;
+
+  Clock::time_point itsReadStartTime;
+  StageStatistics itsReadStatistics;
+  StageStatistics itsDecodeStatistics;
+  StageStatistics itsManipulationStatistics;
+};
+
+// Roughly half of the threads decode and the rest do the area manipulations
+GribMessagePipeline::GribMessagePipeline(const GribFilterOptions &theOptions)
+    : itsOptions(theOptions),
+      itsDecodeThreadCount(std::max(1u, theOptions.itsThreadCount / 2)),
+      itsManipulationThreadCount(
+          std::max(1u, theOptions.itsThreadCount - theOptions.itsThreadCount / 2)),
+      itsMessages(),
+      itsDecodeQueue(2 * itsDecodeThreadCount),
+      itsManipulationQueue(2 * itsManipulationThreadCount),
+      fStopped(false),
+      fFatalError(false),
+      itsReadStartTime(Clock::now())
+{
+  for (unsigned int i = 0; i < itsDecodeThreadCount; i++)
+    itsDecodeThreads.create_thread([this]() { DecodeStage(); });
+  for (unsigned int i = 0; i < itsManipulationThreadCount; i++)
+    itsManipulationThreads.create_thread([this]() { ManipulationStage(); });
+}
+
+// The remaining messages are still processed so that all the handles get released
+GribMessagePipeline::~GribMessagePipeline()
+{
+  Stop();
+}
+
+void GribMessagePipeline::Stop()
+{
+  if (fStopped)
+    return;
+  fStopped = true;
+  itsDecodeQueue.close();
+  itsDecodeThreads.join_all();
+  itsManipulationQueue.close();
+  itsManipulationThreads.join_all();
+}
+
+// Called by the reading thread. The time since the previous push is the reading time.
+void GribMessagePipeline::Push(grib_handle *theHandle,
+                               GridRecordData *theData,
+                               int theMessageNumber,
+                               bool fStopOnError)
+{
+  itsReadStatistics.Add(itsReadStartTime);
+
+  itsMessages.push_back(PendingGribMessage{
+      theHandle, theData, theMessageNumber, fStopOnError, NFmiDataMatrix<float>(), nullptr});
+  itsDecodeQueue.push(&itsMessages.back());
+
+  itsReadStartTime = Clock::now();
+}
+
+void GribMessagePipeline::DecodeStage()
+{
+  PendingGribMessage *message = nullptr;
+  while (itsDecodeQueue.pop(message))
+  {
+    Clock::time_point startTime = Clock::now();
+    try
+    {
+      DecodeGridData(message->itsHandle, message->itsData, message->itsOrigValues, itsOptions);
+    }
+    catch (...)
+    {
+      message->itsError = std::current_exception();
+      if (message->fStopOnError)
+        fFatalError = true;
+    }
+    grib_handle_delete(message->itsHandle);
+    message->itsHandle = nullptr;
+    itsDecodeStatistics.Add(startTime);
+
+    if (!message->itsError)
+      itsManipulationQueue.push(message);
+  }
+}
+
+void GribMessagePipeline::ManipulationStage()
+{
+  PendingGribMessage *message = nullptr;
+  while (itsManipulationQueue.pop(message))
+  {
+    Clock::time_point startTime = Clock::now();
+    try
+    {
+      ManipulateGridData(message->itsData, message->itsOrigValues, itsOptions);
+    }
+    catch (...)
+    {
+      message->itsError = std::current_exception();
+      if (message->fStopOnError)
+        fFatalError = true;
+    }
+    message->itsOrigValues = NFmiDataMatrix<float>();
+    itsManipulationStatistics.Add(startTime);
+  }
+}
+
+void GribMessagePipeline::PrintStatistics() const
+{
+  auto print = [](const char *theName,
+                  const StageStatistics &theStatistics,
+                  unsigned int theThreadCount,
+                  const ThreadTools::BoundedQueue<PendingGribMessage *> *theQueue)
+  {
+    double ms = theStatistics.itsMicroSeconds / 1000.0;
+    long count = theStatistics.itsCount;
+    Log() << fmt::format("  {:<8} {:>6} messages {:>4} threads {:>10.1f} ms {:>8.2f} ms/message",
+                         theName,
+                         count,
+                         theThreadCount,
+                         ms,
+                         count > 0 ? ms / count : 0.0);
+    if (theQueue)
+      Log() << fmt::format(" queue depth mean {:.1f} max {}/{}",
+                           theQueue->meanDepth(),
+                           theQueue->maxDepth(),
+                           theQueue->capacity());
+    Log() << endl;
+  };
+
+  Log() << "Pipeline statistics:" << endl;
+  print("read", itsReadStatistics, 1, nullptr);
+  print("decode", itsDecodeStatistics, itsDecodeThreadCount, &itsDecodeQueue);
+  print("project", itsManipulationStatistics, itsManipulationThreadCount, &itsManipulationQueue);
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Wait for all the messages to be processed
+ *
+ * Failed messages are removed from theGribRecordDatas and reported in
+ * message order just like in the serial loop.
+ */
+// ----------------------------------------------------------------------
+
+void GribMessagePipeline::Finish(vector<GridRecordData *> &theGribRecordDatas)
+{
+  Stop();
+
+  if (itsOptions.fVerbose)
+    PrintStatistics();
+
+  std::deque<PendingGribMessage> messages;
+  messages.swap(itsMessages);
+
+  for (size_t i = 0; i < messages.size(); i++)
+  {
+    PendingGribMessage &message = messages[i];
+    if (!message.itsError)
+      continue;
+
+    theGribRecordDatas.erase(
+        std::find(theGribRecordDatas.begin(), theGribRecordDatas.end(), message.itsData));
+    delete message.itsData;
+
+    ReportGribFieldError(message.itsError, message.itsMessageNumber, message.fStopOnError);
+  }
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief An accepted message whose values are decoded in the second pass
+ */
+// ----------------------------------------------------------------------
+
+struct TwoPassMessage
+{
+  GridRecordData *itsData;
+  int itsMessageNumber;
+  bool fStopOnError;  // executionStoppingError when the message was read
+};
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief The second pass of the two-pass mode (-M)
+ *
+ * The first pass has read only the metadata of the messages and the
+ * querydatas have been allocated based on it. Now the file is read again
+ * and the accepted messages are decoded, projected and written straight
+ * into their places in the querydatas starting from theFirstData. Only
+ * one grid per thread is held in memory at a time instead of all of them.
+ */
+// ----------------------------------------------------------------------
+
+void FillQDatasInSecondPass(vector<TwoPassMessage> &theMessages,
+                            size_t theFirstData,
+                            GribFilterOptions &theGribFilterOptions)
+{
+  vector<std::unique_ptr<NFmiFastQueryInfo> > infos;
+  for (size_t i = theFirstData; i < theGribFilterOptions.itsGeneratedDatas.size(); i++)
+    infos.emplace_back(new NFmiFastQueryInfo(theGribFilterOptions.itsGeneratedDatas[i].get()));
+
+  if (theGribFilterOptions.fVerbose)
+    Log() << "Second pass: filling " << theMessages.size() << " grids" << endl;
+
+  rewind(theGribFilterOptions.itsInputFile);
+  grib_context *gribContext = grib_context_get_default();
+  const size_t batchSize = theGribFilterOptions.itsThreadCount;
+
+  int err = 0;
+  int counter = 0;
+  size_t next = 0;
+  vector<grib_handle *> handles;
+
+  while (next < theMessages.size())
+  {
+    // Read the next accepted messages, one for each thread
+    const size_t first = next;
+    handles.clear();
+    while (next < theMessages.size() && handles.size() < batchSize)
+    {
+      grib_handle *gribHandle =
+          grib_handle_new_from_file(gribContext, theGribFilterOptions.itsInputFile, &err);
+      if (gribHandle == nullptr || err != GRIB_SUCCESS)
+      {
+        if (gribHandle)
+          grib_handle_delete(gribHandle);
+        for (grib_handle *handle : handles)
+          grib_handle_delete(handle);
+        throw runtime_error("Failed to reread grib field " +
+                            NFmiStringTools::Convert(theMessages[next].itsMessageNumber) +
+                            " in file " + theGribFilterOptions.itsInputFileNameStr);
+      }
+
+      if (++counter == theMessages[next].itsMessageNumber)
+      {
+        handles.push_back(gribHandle);
+        ++next;
+      }
+      else
+        grib_handle_delete(gribHandle);
+    }
+
+    vector<std::exception_ptr> errors(handles.size());
+    auto decode = [&](size_t i)
+    {
+      try
+      {
+        FillGridData(handles[i], theMessages[first + i].itsData, theGribFilterOptions);
+      }
+      catch (...)
+      {
+        errors[i] = std::current_exception();
+      }
+      grib_handle_delete(handles[i]);
+    };
+    ThreadTools::parallelFor(handles.size(), theGribFilterOptions.itsThreadCount, decode);
+
+    // Written in message order so that duplicate fields end up as in the normal mode
+    for (size_t i = 0; i < handles.size(); i++)
+    {
+      TwoPassMessage &message = theMessages[first + i];
+      if (errors[i])
+        ReportGribFieldError(errors[i], message.itsMessageNumber, message.fStopOnError);
+      else
+      {
+        for (auto &info : infos)
+          if (FindGribRecordPlace(*info, message.itsData))
+            if (!info->SetValues(message.itsData->itsGridData))
+              throw runtime_error("qdatan täyttö gribi datalla epäonnistui, lopetetaan...");
+      }
+      message.itsData->itsGridData = NFmiDataMatrix<float>();
+    }
+  }
+}
+
 void ConvertGrib(GribFilterOptions &theGribFilterOptions)
 {
   vector<GridRecordData *> gribRecordDatas;
@@ -3632,6 +4009,14 @@ void ConvertGrib(GribFilterOptions &theGribFilterOptions)
 
   try
   {
+    // With -j the values are decoded and projected in a pipeline while the file is being read
+    std::unique_ptr<GribMessagePipeline> pipeline;
+    if (theGribFilterOptions.itsThreadCount > 1 && !theGribFilterOptions.fTwoPass)
+      pipeline.reset(new GribMessagePipeline(theGribFilterOptions));
+
+    // With -M only the metadata is read here and the values in FillQDatasInSecondPass
+    vector<TwoPassMessage> twoPassMessages;
+
     grib_handle *gribHandle = nullptr;
     grib_context *gribContext = grib_context_get_default();
     grib_multi_support_on(0);
@@ -3652,11 +4037,9 @@ void ConvertGrib(GribFilterOptions &theGribFilterOptions)
       counter++;
 
       if (theGribFilterOptions.fVerbose)
-        cerr << counter << " ";
+        Log() << counter << " ";
       GridRecordData *tmpData = new GridRecordData;
 
-      theGribFilterOptions.fDoYAxisFlip = jscan_is_negative(gribHandle);
-
       tmpData->itsLatlonCropRect = theGribFilterOptions.itsLatlonCropRect;
       try
       {
@@ -3673,10 +4056,10 @@ void ConvertGrib(GribFilterOptions &theGribFilterOptions)
 
         if (theGribFilterOptions.fVerbose)
         {
-          cerr << tmpData->itsValidTime.ToStr("YYYYMMDDHHmm", kEnglish).CharPtr() << ";";
-          cerr << tmpData->itsParam.GetParamName().CharPtr() << ";";
-          cerr << tmpData->itsLevel.GetIdent() << ";";
-          cerr << tmpData->itsLevel.LevelValue() << ";";
+          Log() << tmpData->itsValidTime.ToStr("YYYYMMDDHHmm", kEnglish).CharPtr() << ";";
+          Log() << tmpData->itsParam.GetParamName().CharPtr() << ";";
+          Log() << tmpData->itsLevel.GetIdent() << ";";
+          Log() << tmpData->itsLevel.LevelValue() << ";";
         }
         ChangeParamSettingsIfNeeded(
             theGribFilterOptions.itsParamChangeTable, tmpData, theGribFilterOptions.fVerbose);
@@ -3703,13 +4086,23 @@ void ConvertGrib(GribFilterOptions &theGribFilterOptions)
                                        theGribFilterOptions.itsStepRangeCheckedParams,
                                        theGribFilterOptions.itsWantedStepRange))
                 {
-                  FillGridData(gribHandle, tmpData, theGribFilterOptions);
+                  if (theGribFilterOptions.fTwoPass)
+                    twoPassMessages.push_back(
+                        TwoPassMessage{tmpData, counter, executionStoppingError});
+                  else if (pipeline)
+                  {
+                    // the pipeline releases the handle once the values have been decoded
+                    pipeline->Push(gribHandle, tmpData, counter, executionStoppingError);
+                    gribHandle = nullptr;
+                  }
+                  else
+                    FillGridData(gribHandle, tmpData, theGribFilterOptions);
                   gribRecordDatas.push_back(tmpData);  // taman voisi optimoida, luomalla aluksi
                                                        // niin iso vektori kuin tarvitaan
                   gribFieldUsed = true;
                 }
                 else if (theGribFilterOptions.fVerbose)
-                  cerr << "\nWarning: Parameter was discarded due stepRange check" << endl;
+                  Log() << "\nWarning: Parameter was discarded due stepRange check" << endl;
               }
             }
           }
@@ -3717,11 +4110,11 @@ void ConvertGrib(GribFilterOptions &theGribFilterOptions)
         if (gribFieldUsed == false)
         {
           if (theGribFilterOptions.fVerbose)
-            cerr << static_cast<long>(tmpData->itsParam.GetParamIdent()) << " (skipped)" << endl;
+            Log() << static_cast<long>(tmpData->itsParam.GetParamIdent()) << " (skipped)" << endl;
           delete tmpData;
         }
         else if (theGribFilterOptions.fVerbose)
-          cerr << endl;
+          Log() << endl;
       }
       catch (Reduced_ll_grib_exception &)
       {
@@ -3737,8 +4130,8 @@ void ConvertGrib(GribFilterOptions &theGribFilterOptions)
         if (executionStoppingError)
           throw;
         else
-          cerr << "\nProblem with grib field " << NFmiStringTools::Convert(counter) << ":"
-               << e.what() << endl;
+          Log() << "\nProblem with grib field " << NFmiStringTools::Convert(counter) << ":"
+                << e.what() << endl;
       }
       catch (...)
       {
@@ -3746,11 +4139,32 @@ void ConvertGrib(GribFilterOptions &theGribFilterOptions)
         if (executionStoppingError)
           throw;
         else
-          cerr << "\nUnknown problem with grib field " << NFmiStringTools::Convert(counter) << endl;
+          Log() << "\nUnknown problem with grib field " << NFmiStringTools::Convert(counter)
+                << endl;
       }
-      grib_handle_delete(gribHandle);
+      if (gribHandle)
+        grib_handle_delete(gribHandle);
+
+      // Stop reading like the serial loop does, Finish rethrows the error
+      if (pipeline && pipeline->FatalError())
+        break;
     }  // while-loop
-    CreateQueryDatas(gribRecordDatas, theGribFilterOptions, &verticalCoordinateMap);
+    if (pipeline)
+      pipeline->Finish(gribRecordDatas);
+
+    if (!theGribFilterOptions.fTwoPass)
+      CreateQueryDatas(gribRecordDatas, theGribFilterOptions, &verticalCoordinateMap);
+    else
+    {
+      // The hybrid pressure can be calculated only once the data has been filled
+      size_t firstData = theGribFilterOptions.itsGeneratedDatas.size();
+      CreateQueryDatas(gribRecordDatas, theGribFilterOptions, nullptr);
+      FillQDatasInSecondPass(twoPassMessages, firstData, theGribFilterOptions);
+      if (!gribRecordDatas.empty())
+        CalcHybridPressureData(theGribFilterOptions.itsGeneratedDatas,
+                               verticalCoordinateMap,
+                               theGribFilterOptions.itsHybridPressureInfo);
+    }
 
     if (err)
       throw runtime_error(grib_get_error_message(err));
@@ -3765,23 +4179,24 @@ void ConvertGrib(GribFilterOptions &theGribFilterOptions)
 }
 
 void ConvertOneGribFile(const GribFilterOptions &theGribFilterOptionsIn,
-                        const string &theGribFileName)
+                        const string &theGribFileName,
+                        vector<std::shared_ptr<NFmiQueryData> > &theQDataCollector)
 {
   GribFilterOptions gribFilterOptionsLocal = theGribFilterOptionsIn;
   gribFilterOptionsLocal.itsInputFileNameStr = theGribFileName;
   if ((gribFilterOptionsLocal.itsInputFile =
            fopen(gribFilterOptionsLocal.itsInputFileNameStr.c_str(), "rb")) == nullptr)
   {
-    cerr << "could not open input file: " << gribFilterOptionsLocal.itsInputFileNameStr << endl;
+    Log() << "could not open input file: " << gribFilterOptionsLocal.itsInputFileNameStr << endl;
     return;
   }
 
   try
   {
     ConvertGrib(gribFilterOptionsLocal);
-    gTotalQDataCollector.insert(gTotalQDataCollector.end(),
-                                gribFilterOptionsLocal.itsGeneratedDatas.begin(),
-                                gribFilterOptionsLocal.itsGeneratedDatas.end());
+    theQDataCollector.insert(theQDataCollector.end(),
+                             gribFilterOptionsLocal.itsGeneratedDatas.begin(),
+                             gribFilterOptionsLocal.itsGeneratedDatas.end());
   }
   catch (Reduced_ll_grib_exception &)
   {
@@ -3796,10 +4211,10 @@ void ConvertOneGribFile(const GribFilterOptions &theGribFilterOptionsIn,
     {
       // tyhjennetään mahd. jo kerätyt datat, koska *kaikki* grib konversiot tehdään uusiksi
       // wgrib-funktioilla
-      gTotalQDataCollector.clear();
+      theQDataCollector.clear();
       if (gribFilterOptionsLocal.fVerbose)
-        cerr << "Grib file has reduced_ll type of data, changing to use wgrib library, file was:\n"
-             << gribFilterOptionsLocal.itsInputFileNameStr << endl;
+        Log() << "Grib file has reduced_ll type of data, changing to use wgrib library, file was:\n"
+              << gribFilterOptionsLocal.itsInputFileNameStr << endl;
       throw;
     }
   }
@@ -5062,13 +5477,72 @@ void MakeTotalCombineQDatas(vector<std::shared_ptr<NFmiQueryData> > &theTotalQDa
                            theGribFilterOptionsOut.itsGroundPressureInfo);
 }
 
+// ----------------------------------------------------------------------
+/*!
+ * \brief Convert the files concurrently with eccodes
+ *
+ * Each file is converted into its own collection, and the collections are
+ * merged in input order so that the result is identical to the serial run.
+ * Threads not needed for the files are used for the messages within them.
+ * The messages of each file are collected and printed in file order too.
+ */
+// ----------------------------------------------------------------------
+
+void ConvertGribFilesInParallel(const vector<string> &theFileList,
+                                const GribFilterOptions &theGribFilterOptions)
+{
+  size_t fileCount = theFileList.size();
+  unsigned int fileThreads =
+      static_cast<unsigned int>(std::min<size_t>(theGribFilterOptions.itsThreadCount, fileCount));
+
+  GribFilterOptions fileOptions = theGribFilterOptions;
+  fileOptions.itsThreadCount = std::max(1u, theGribFilterOptions.itsThreadCount / fileThreads);
+
+  vector<vector<std::shared_ptr<NFmiQueryData> > > fileDatas(fileCount);
+  vector<std::exception_ptr> fileErrors(fileCount);
+  vector<std::ostringstream> fileLogs(fileCount);
+  ThreadTools::parallelFor(fileCount,
+                           fileThreads,
+                           [&](size_t i)
+                           {
+                             tFileLog = &fileLogs[i];
+                             try
+                             {
+                               ConvertOneGribFile(fileOptions, theFileList[i], fileDatas[i]);
+                             }
+                             catch (...)
+                             {
+                               fileErrors[i] = std::current_exception();
+                             }
+                             tFileLog = nullptr;
+                           });
+
+  for (size_t i = 0; i < fileCount; i++)
+  {
+    cerr << fileLogs[i].str() << std::flush;
+    if (fileErrors[i])
+    {
+      // Same as in the serial run: everything is redone with wgrib
+      gTotalQDataCollector.clear();
+      std::rethrow_exception(fileErrors[i]);
+    }
+    gTotalQDataCollector.insert(
+        gTotalQDataCollector.end(), fileDatas[i].begin(), fileDatas[i].end());
+  }
+}
+
 int BuildAndStoreAllDatas(vector<string> &theFileList, GribFilterOptions &theGribFilterOptions)
 {
   size_t fileCount = theFileList.size();
   try
   {
-    for (size_t i = 0; i < fileCount; i++)
-      ConvertOneGribFile(theGribFilterOptions, theFileList[i]);
+    if (theGribFilterOptions.itsThreadCount > 1 && fileCount > 1)
+      ConvertGribFilesInParallel(theFileList, theGribFilterOptions);
+    else
+    {
+      for (size_t i = 0; i < fileCount; i++)
+        ConvertOneGribFile(theGribFilterOptions, theFileList[i], gTotalQDataCollector);
+    }
   }
   catch (Reduced_ll_grib_exception &)
   {
@@ -5113,6 +5587,10 @@ void Usage(void)
        << "\t-n   Names output files by level type. E.g. output.sqd_levelType_100" << endl
        << "\t-t   Reports run-time to the stderr at the end of execution" << endl
        << "\t-v   verbose mode" << endl
+       << "\t-j <threads>\tNumber of threads used for decoding the files and their" << endl
+       << "\t\tmessages, or percentage of all cores. 0 means all cores. Default is 1." << endl
+       << "\t-M   Two-pass mode: read the metadata first and then decode the values" << endl
+       << "\t\tdirectly into the allocated data, halving the peak memory use." << endl
        << "\t-C   try to combine larger areas" << endl
        << "\t-z   read data lines in zig-zag fashion, starting left to rigth" << endl
        << "\t-i   Ignore reduced_ll data, keep using grib_api for conversion" << endl
@@ -5148,6 +5626,8 @@ void Usage(void)
        << "\t\t pressure- and hybrid-data. Give two or three projections " << endl
        << "\t\t separated by semicolons ';'. E.g." << endl
        << "\t\t proj1:gridSize1[;proj2:gridSize2][;proj3:gridSize3]" << endl
+       << "\t-k <directory>\tSave the interpolation points of -P projections to" << endl
+       << "\t\tthe directory and reuse them in later runs." << endl
        << endl;
 }
 
@@ -5325,6 +5805,15 @@ int GetOptions(NFmiCmdLine &theCmdLine, GribFilterOptions &theGribFilterOptions)
 
   GetStepRangeOptions(theCmdLine, theGribFilterOptions);
 
+  if (theCmdLine.isOption('j'))
+    theGribFilterOptions.itsThreadCount = ThreadTools::threadCount(theCmdLine.OptionValue('j'));
+
+  if (theCmdLine.isOption('k'))
+    gLocationCacheStore.directory(theCmdLine.OptionValue('k'));
+
+  if (theCmdLine.isOption('M'))
+    theGribFilterOptions.fTwoPass = true;
+
   return 0;  // 0 on ok paluuarvo
 }
 
@@ -5333,7 +5822,7 @@ int Run(int argc, const char **argv, bool &fReportExecutionTime)
   // Optiot:
   GribFilterOptions gribFilterOptions;
 
-  NFmiCmdLine cmdline(argc, argv, "o!m!l!g!p!aASnL!G!c!dvP!D!tH!r!yzCiR!");
+  NFmiCmdLine cmdline(argc, argv, "o!m!l!g!p!aASnL!G!c!dvP!D!tH!r!yzCiR!j!k!M");
 
   // Jonkin näistä avulla muodostetaan lista, jossa voi olla 0-n kpl tiedoston nimiä.
   if (::DoCommandLineCheck(cmdline) == false)
@@ -11,19 +11,29 @@
  *
  * Usage:
  * \code
- * qd2csv <querydata>
+ * qd2csv [-latlon] [-binary] [-j threads] <querydata>
  * \endcode
  *
- * The times are printed in UTC time.
+ * The times are printed in UTC time. With -binary the data is written
+ * in a binary columnar format instead, see print_binary.
  */
 // ======================================================================
 
+#include <algorithm>
+#include <charconv>
+#include <cstdint>
 #include <iostream>
+#include <limits>
 #include <sstream>
 #include <stdexcept>
+#include <string>
+#include <vector>
 
+#include "QueryDataReader.h"
+#include "ThreadTools.h"
 #include <newbase/NFmiEnumConverter.h>
-#include <newbase/NFmiStreamQueryData.h>
+#include <newbase/NFmiFastQueryInfo.h>
+#include <newbase/NFmiQueryData.h>
 
 using namespace std;
 
@@ -84,99 +94,450 @@ const string makename(const NFmiFastQueryInfo& theQ)
 
 // ----------------------------------------------------------------------
 /*!
- * \brief Main algorithm
+ * \brief A non-empty parameter and level combination
  */
 // ----------------------------------------------------------------------
 
-int domain(int argc, const char* argv[])
+struct Column
 {
-  if (argc == 1)
+  unsigned long param;
+  unsigned long level;
+  string name;
+};
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Append a number formatted as by ostream with the given precision
+ *
+ * std::to_chars is locale independent and much faster than iostreams,
+ * the general format with an explicit precision matches the output of
+ * operator<< exactly.
+ */
+// ----------------------------------------------------------------------
+
+template <typename T>
+void append(string& theOutput, T theValue, int thePrecision)
+{
+  char buffer[64];
+  auto result =
+      to_chars(buffer, buffer + sizeof(buffer), theValue, chars_format::general, thePrecision);
+  theOutput.append(buffer, result.ptr);
+}
+
+void append(string& theOutput, long theValue)
+{
+  char buffer[32];
+  auto result = to_chars(buffer, buffer + sizeof(buffer), theValue);
+  theOutput.append(buffer, result.ptr);
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Read the time series of all columns at the current location
+ *
+ * The values are indexed by column and time.
+ */
+// ----------------------------------------------------------------------
+
+void read_location(NFmiFastQueryInfo& theQ,
+                   const vector<Column>& theColumns,
+                   vector<float>& theValues)
+{
+  const unsigned long ntimes = theQ.SizeTimes();
+  theValues.resize(theColumns.size() * ntimes);
+  for (size_t c = 0; c < theColumns.size(); c++)
   {
-    cout << "Usage: qd2csv [-latlon] <querydata>" << endl;
-    return 0;
+    theQ.ParamIndex(theColumns[c].param);
+    theQ.LevelIndex(theColumns[c].level);
+    for (unsigned long t = 0; t < ntimes; t++)
+    {
+      theQ.TimeIndex(t);
+      theValues[c * ntimes + t] = theQ.FloatValue();
+    }
   }
-  else if ((argc > 3) || ((argc == 3) && (strcmp(argv[1], "-latlon") != 0)))
-    throw runtime_error("Expecting optional -latlon and one querydata argument");
-
-  // Read the querydata
+}
 
-  const string filename = argv[argc - 1];
-  bool coordOutput = (argc == 3);
+// ----------------------------------------------------------------------
+/*!
+ * \brief Format the CSV rows of the given locations
+ */
+// ----------------------------------------------------------------------
 
-  NFmiStreamQueryData qd;
-  if (!qd.SafeReadLatestData(filename))
-    throw runtime_error("Failed to read querydata from '" + filename + "'");
+void format_rows(NFmiFastQueryInfo& theQ,
+                 const vector<Column>& theColumns,
+                 const vector<string>& theTimes,
+                 unsigned long theFirst,
+                 unsigned long theLast,
+                 bool theCoordOutput,
+                 string& theOutput)
+{
+  const size_t ntimes = theTimes.size();
+  vector<float> values;
 
-  NFmiFastQueryInfo* q = qd.QueryInfoIter();
+  for (unsigned long loc = theFirst; loc < theLast; loc++)
+  {
+    theQ.LocationIndex(loc);
+    read_location(theQ, theColumns, values);
 
-  // Print the data columns. We print one station at a time,
-  // all levels and parameters in a single row
+    string prefix;
+    append(prefix, static_cast<long>(theQ.Location()->GetIdent()));
+    if (theCoordOutput)
+    {
+      auto const& p = theQ.Location()->GetLocation();
+      prefix += ',';
+      append(prefix, p.Y(), 5);
+      prefix += ',';
+      append(prefix, p.X(), 5);
+    }
+    prefix += ',';
 
-  // We omit columns with missing values only
+    for (size_t t = 0; t < ntimes; t++)
+    {
+      theOutput += prefix;
+      theOutput += theTimes[t];
+      for (size_t c = 0; c < theColumns.size(); c++)
+      {
+        theOutput += ',';
+        const float value = values[c * ntimes + t];
+        if (value == kFloatMissing)
+          theOutput += "NA";
+        else
+          append(theOutput, value, 6);
+      }
+      theOutput += '\n';
+    }
+  }
+}
 
-  vector<bool> okvariables;
+// ----------------------------------------------------------------------
+/*!
+ * \brief Print the data as CSV
+ *
+ * The rows are formatted in blocks of locations, in parallel if so
+ * requested. The blocks are printed in order as soon as a batch of
+ * them is ready, so the output is identical for any number of threads.
+ */
+// ----------------------------------------------------------------------
 
-  // First the headers
+void print_csv(NFmiQueryData& theQD,
+               const vector<Column>& theColumns,
+               bool theCoordOutput,
+               unsigned int theThreadCount)
+{
+  NFmiFastQueryInfo q(&theQD);
 
-  NFmiEnumConverter converter;
-  if (coordOutput)
+  if (theCoordOutput)
     cout << "\"id\",\"lat\",\"lon\",\"date\"";
   else
     cout << "\"id\",\"date\"";
-  for (q->ResetLevel(); q->NextLevel();)
-    for (q->ResetParam(); q->NextParam();)
-    {
-      bool flag = goodcolumn(*q);
-      okvariables.push_back(flag);
+  for (const auto& column : theColumns)
+    cout << ",\"" << column.name << '"';
+  cout << '\n';
+
+  // Rows without any printed columns are omitted
+
+  if (theColumns.empty())
+    return;
+
+  vector<string> times;
+  for (q.ResetTime(); q.NextTime();)
+    times.push_back(q.ValidTime().ToStr(kYYYYMMDDHH).CharPtr());
 
-      if (flag)
+  const unsigned long nlocations = q.SizeLocations();
+  const unsigned long blocksize = 64;
+  const size_t nblocks = (nlocations + blocksize - 1) / blocksize;
+  const size_t batchsize = 4 * max(1u, theThreadCount);
+
+  vector<string> output(batchsize);
+  for (size_t batch = 0; batch < nblocks; batch += batchsize)
+  {
+    const size_t count = min(batchsize, nblocks - batch);
+    ThreadTools::parallelFor(count,
+                             theThreadCount,
+                             [&](size_t i)
+                             {
+                               NFmiFastQueryInfo qi(&theQD);
+                               const unsigned long first = (batch + i) * blocksize;
+                               const unsigned long last = min(first + blocksize, nlocations);
+                               output[i].clear();
+                               format_rows(
+                                   qi, theColumns, times, first, last, theCoordOutput, output[i]);
+                             });
+    for (size_t i = 0; i < count; i++)
+      cout.write(output[i].data(), output[i].size());
+  }
+  cout.flush();
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Seconds since 1970-01-01 00:00:00 UTC
+ */
+// ----------------------------------------------------------------------
+
+int64_t epoch_seconds(const NFmiMetTime& theTime)
+{
+  // Days from civil, valid for the proleptic Gregorian calendar
+  const int64_t m = theTime.GetMonth();
+  const int64_t y = theTime.GetYear() - (m <= 2 ? 1 : 0);
+  const int64_t era = (y >= 0 ? y : y - 399) / 400;
+  const int64_t yoe = y - era * 400;
+  const int64_t doy = (153 * (m + (m > 2 ? -3 : 9)) + 2) / 5 + theTime.GetDay() - 1;
+  const int64_t doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+  const int64_t days = era * 146097 + doe - 719468;
+  return ((days * 24 + theTime.GetHour()) * 60 + theTime.GetMin()) * 60 + theTime.GetSec();
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Binary columnar output
+ *
+ * The file starts with a header and a directory of the columns, followed
+ * by the data of each column as one contiguous native endian array,
+ * aligned to 64 bytes for memory mapping:
+ *
+ *   char     magic[8] = "QDCOLUMN"
+ *   uint32   version = 1
+ *   uint32   number of columns
+ *   uint64   number of rows
+ *
+ * and for each column
+ *
+ *   uint32   type: 1 = int32, 2 = int64, 3 = float32, 4 = float64
+ *   uint32   length of the name
+ *   uint64   offset of the data from the start of the file
+ *   char     name[length], padded with zeros to a multiple of 8 bytes
+ *
+ * The columns are the station id, the valid time in seconds since the
+ * epoch, optionally the latitude and longitude, and the non-empty
+ * parameters as in the CSV output. Missing values are NaN.
+ */
+// ----------------------------------------------------------------------
+
+enum ColumnType : uint32_t
+{
+  kInt32 = 1,
+  kInt64 = 2,
+  kFloat32 = 3,
+  kFloat64 = 4
+};
+
+struct BinaryColumn
+{
+  string name;
+  ColumnType type;
+  size_t elementsize;
+  uint64_t offset;
+};
+
+const size_t gAlignment = 64;
+
+size_t padded(size_t theSize, size_t theAlignment)
+{
+  return (theSize + theAlignment - 1) / theAlignment * theAlignment;
+}
+
+template <typename T>
+void write_binary(ostream& theOutput, const T& theValue)
+{
+  theOutput.write(reinterpret_cast<const char*>(&theValue), sizeof(T));
+}
+
+template <typename T>
+void write_column(ostream& theOutput, const vector<T>& theValues, uint64_t& thePosition)
+{
+  const size_t bytes = theValues.size() * sizeof(T);
+  theOutput.write(reinterpret_cast<const char*>(theValues.data()), bytes);
+  const string padding(padded(bytes, gAlignment) - bytes, '\0');
+  theOutput << padding;
+  thePosition += bytes + padding.size();
+}
+
+void print_binary(NFmiQueryData& theQD,
+                  const vector<Column>& theColumns,
+                  bool theCoordOutput,
+                  unsigned int theThreadCount)
+{
+  NFmiFastQueryInfo q(&theQD);
+
+  const unsigned long nlocations = q.SizeLocations();
+  const unsigned long ntimes = q.SizeTimes();
+  const uint64_t nrows = (theColumns.empty() ? 0 : static_cast<uint64_t>(nlocations) * ntimes);
+
+  // The directory
+
+  vector<BinaryColumn> columns;
+  columns.push_back(BinaryColumn{"id", kInt32, 4, 0});
+  if (theCoordOutput)
+  {
+    columns.push_back(BinaryColumn{"lat", kFloat64, 8, 0});
+    columns.push_back(BinaryColumn{"lon", kFloat64, 8, 0});
+  }
+  columns.push_back(BinaryColumn{"time", kInt64, 8, 0});
+  for (const auto& column : theColumns)
+    columns.push_back(BinaryColumn{column.name, kFloat32, 4, 0});
+
+  size_t headersize = 8 + 4 + 4 + 8;
+  for (const auto& column : columns)
+    headersize += 4 + 4 + 8 + padded(column.name.size(), 8);
+
+  uint64_t position = padded(headersize, gAlignment);
+  for (auto& column : columns)
+  {
+    column.offset = position;
+    position += padded(nrows * column.elementsize, gAlignment);
+  }
+
+  cout.write("QDCOLUMN", 8);
+  write_binary(cout, static_cast<uint32_t>(1));
+  write_binary(cout, static_cast<uint32_t>(columns.size()));
+  write_binary(cout, nrows);
+  for (const auto& column : columns)
+  {
+    write_binary(cout, static_cast<uint32_t>(column.type));
+    write_binary(cout, static_cast<uint32_t>(column.name.size()));
+    write_binary(cout, column.offset);
+    cout << column.name << string(padded(column.name.size(), 8) - column.name.size(), '\0');
+  }
+  cout << string(padded(headersize, gAlignment) - headersize, '\0');
+  position = padded(headersize, gAlignment);
+
+  if (nrows == 0)
+  {
+    cout.flush();
+    return;
+  }
+
+  // The station and time columns
+
+  vector<int32_t> ids(nrows);
+  vector<double> lats;
+  vector<double> lons;
+  if (theCoordOutput)
+  {
+    lats.resize(nrows);
+    lons.resize(nrows);
+  }
+  unsigned long loc = 0;
+  for (q.ResetLocation(); q.NextLocation(); ++loc)
+  {
+    const NFmiPoint p = q.Location()->GetLocation();
+    for (unsigned long t = 0; t < ntimes; t++)
+    {
+      ids[loc * ntimes + t] = static_cast<int32_t>(q.Location()->GetIdent());
+      if (theCoordOutput)
       {
-        string name = makename(*q);
-        cout << ",\"" << name << '"';
+        lats[loc * ntimes + t] = p.Y();
+        lons[loc * ntimes + t] = p.X();
       }
     }
-  cout << endl;
+  }
+  write_column(cout, ids, position);
+  if (theCoordOutput)
+  {
+    write_column(cout, lats, position);
+    write_column(cout, lons, position);
+  }
 
-  // Then the data columns
+  vector<int64_t> times(nrows);
+  vector<int64_t> validtimes;
+  for (q.ResetTime(); q.NextTime();)
+    validtimes.push_back(epoch_seconds(q.ValidTime()));
+  for (uint64_t row = 0; row < nrows; row++)
+    times[row] = validtimes[row % ntimes];
+  write_column(cout, times, position);
+
+  // The parameter columns, gathered in parallel and written in order
+
+  const size_t batchsize = max(1u, theThreadCount);
+  vector<vector<float> > data(batchsize);
+  for (size_t batch = 0; batch < theColumns.size(); batch += batchsize)
+  {
+    const size_t count = min(batchsize, theColumns.size() - batch);
+    ThreadTools::parallelFor(count,
+                             theThreadCount,
+                             [&](size_t i)
+                             {
+                               NFmiFastQueryInfo qi(&theQD);
+                               const Column& column = theColumns[batch + i];
+                               qi.ParamIndex(column.param);
+                               qi.LevelIndex(column.level);
+                               vector<float>& values = data[i];
+                               values.resize(nrows);
+                               for (unsigned long l = 0; l < nlocations; l++)
+                               {
+                                 qi.LocationIndex(l);
+                                 for (unsigned long t = 0; t < ntimes; t++)
+                                 {
+                                   qi.TimeIndex(t);
+                                   const float value = qi.FloatValue();
+                                   values[l * ntimes + t] =
+                                       (value == kFloatMissing ? numeric_limits<float>::quiet_NaN()
+                                                               : value);
+                                 }
+                               }
+                             });
+    for (size_t i = 0; i < count; i++)
+      write_column(cout, data[i], position);
+  }
+  cout.flush();
+}
 
-  for (q->ResetLocation(); q->NextLocation();)
+// ----------------------------------------------------------------------
+/*!
+ * \brief Main algorithm
+ */
+// ----------------------------------------------------------------------
+
+int domain(int argc, const char* argv[])
+{
+  if (argc == 1)
   {
-    for (q->ResetTime(); q->NextTime();)
+    cout << "Usage: qd2csv [-latlon] [-binary] [-j threads] <querydata>" << endl;
+    return 0;
+  }
+
+  bool coordOutput = false;
+  bool binaryOutput = false;
+  unsigned int threadcount = 1;
+
+  for (int i = 1; i < argc - 1; i++)
+  {
+    const string opt = argv[i];
+    if (opt == "-latlon")
+      coordOutput = true;
+    else if (opt == "-binary")
+      binaryOutput = true;
+    else if (opt == "-j" && i + 1 < argc - 1)
+      threadcount = ThreadTools::threadCount(argv[++i]);
+    else
+      throw runtime_error(
+          "Expecting optional -latlon, -binary and -j threads options and one querydata argument");
+  }
+
+  // Read the querydata
+
+  const string filename = argv[argc - 1];
+
+  std::unique_ptr<NFmiQueryData> qd = QueryDataReader::read(filename);
+  NFmiFastQueryInfo info(qd.get());
+  NFmiFastQueryInfo* q = &info;
+
+  // We print one station at a time, all levels and parameters in a
+  // single row. We omit columns with missing values only.
+
+  vector<Column> columns;
+  for (q->ResetLevel(); q->NextLevel();)
+    for (q->ResetParam(); q->NextParam();)
     {
-      NFmiString timestr = q->ValidTime().ToStr(kYYYYMMDDHH);
-
-      int column = 0;
-      int printedcolumns = 0;
-      auto prec = cout.precision();
-      for (q->ResetLevel(); q->NextLevel();)
-        for (q->ResetParam(); q->NextParam();)
-        {
-          if (okvariables[column])
-          {
-            if (++printedcolumns == 1)
-            {
-              if (coordOutput)
-              {
-                auto const& p = q->Location()->GetLocation();
-                cout << q->Location()->GetIdent() << ',' << setprecision(5) << p.Y() << "," << p.X()
-                     << setprecision(prec) << "," << timestr.CharPtr();
-              }
-              else
-                cout << q->Location()->GetIdent() << ',' << timestr.CharPtr();
-            }
-            cout << ',';
-            float value = q->FloatValue();
-            if (value == kFloatMissing)
-              cout << "NA";
-            else
-              cout << value;
-          }
-          ++column;
-        }
-      if (printedcolumns > 0)
-        cout << endl;
+      if (goodcolumn(*q))
+        columns.push_back(Column{q->ParamIndex(), q->LevelIndex(), makename(*q)});
     }
-  }
+
+  if (binaryOutput)
+    print_binary(*qd, columns, coordOutput, threadcount);
+  else
+    print_csv(*qd, columns, coordOutput, threadcount);
 
   return 0;
 }
@@ -5,6 +5,8 @@
  */
 // ======================================================================
 
+#include "ThreadTools.h"
+
 #include <calculator/Acceptor.h>
 #include <calculator/AnalysisSources.h>
 #include <calculator/GridForecaster.h>
@@ -23,6 +25,7 @@
 #include <calculator/WeatherParameter.h>
 #include <calculator/WeatherPeriod.h>
 #include <calculator/WeatherResult.h>
+#include <calculator/WeatherSource.h>
 
 #include <newbase/NFmiArea.h>
 #include <newbase/NFmiCmdLine.h>
@@ -38,6 +41,7 @@
 #include <iostream>
 #include <list>
 #include <map>
+#include <mutex>
 #include <vector>
 
 using namespace std;
@@ -395,6 +399,7 @@ void usage()
        << "   -E\t\t\tPrint times in Epoch seconds" << endl
        << "   -v\t\t\tVerbose mode on" << endl
        << "   -Q\t\t\tQuiet mode on - do not print mere warnings" << endl
+       << "   -j <threads>\t\tNumber of threads, or a percentage of the cores (default 1)" << endl
        << endl
        << "For example:" << endl
        << endl
@@ -420,6 +425,7 @@ struct options_list
   bool quiet;
   bool php;
   bool epoch_time;
+  unsigned int threadcount;
   vector<string> php_names;
 
   vector<AnalysisSources> sources;
@@ -672,6 +678,7 @@ void parse_command_line(int argc, const char* argv[])
   options.verbose = false;
   options.php = false;
   options.epoch_time = false;
+  options.threadcount = 1;
   options.timezone = Settings::optional_string("qdarea::timezone", "local");
   options.querydata = NFmiStringTools::Split(Settings::optional_string("qdarea::querydata", ""));
   options.coordinatefile =
@@ -679,7 +686,7 @@ void parse_command_line(int argc, const char* argv[])
 
   // Parse the command line
 
-  NFmiCmdLine cmdline(argc, argv, "P!p!T!t!q!c!S!EsvhQ");
+  NFmiCmdLine cmdline(argc, argv, "P!p!T!t!q!c!S!EsvhQj!");
 
   if (cmdline.Status().IsError())
     throw runtime_error(cmdline.Status().ErrorLog().CharPtr());
@@ -704,6 +711,9 @@ void parse_command_line(int argc, const char* argv[])
   if (cmdline.isOption('E'))
     options.epoch_time = true;
 
+  if (cmdline.isOption('j'))
+    options.threadcount = ThreadTools::threadCount(cmdline.OptionValue('j'));
+
   // -q option must be parsed before -T option
   if (cmdline.isOption('q'))
     options.querydata = NFmiStringTools::Split<vector<string> >(cmdline.OptionValue('q'));
@@ -800,7 +810,7 @@ static AreaResults results;
 
 // ----------------------------------------------------------------------
 /*!
- * \brief Establish the data source for the given area
+ * \brief Establish the index of the data source for the given area
  *
  * Note that expansion radiuses are not taken into account
  * in the insidedness test, they are considered to be small
@@ -808,7 +818,7 @@ static AreaResults results;
  */
 // ----------------------------------------------------------------------
 
-AnalysisSources find_source(const WeatherArea& theArea)
+unsigned int find_source(const WeatherArea& theArea)
 {
   unsigned int idx = 0;
 
@@ -864,8 +874,90 @@ AnalysisSources find_source(const WeatherArea& theArea)
       throw runtime_error("The area is not fully contained in any querydata");
   }
 
-  Settings::set("textgen::default_forecast", options.querydata[idx]);
-  return options.sources[idx];
+  return idx;
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Initialize the settings of a worker thread
+ *
+ * The calculator settings and the time zone are thread specific, hence
+ * each thread doing analyses must be set up like the main thread.
+ */
+// ----------------------------------------------------------------------
+
+void init_thread()
+{
+  thread_local bool initialized = false;
+  if (initialized)
+    return;
+
+  Settings::set(NFmiSettings::ToString());
+  Settings::set("textgen::coordinates", options.coordinatefile);
+  TextGenPosixTime::SetThreadTimeZone(options.timezone);
+  initialized = true;
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief A weather source safe to use from several threads
+ *
+ * The latest weather source caches the data it has loaded and may
+ * replace it if a newer file appears. Access to it is serialized, the
+ * returned data itself is only read by the analyses and is kept alive by
+ * the shared pointer even if the cache is updated.
+ */
+// ----------------------------------------------------------------------
+
+class SynchronizedWeatherSource : public WeatherSource
+{
+ public:
+  SynchronizedWeatherSource(const std::shared_ptr<WeatherSource>& theSource) : itsSource(theSource)
+  {
+  }
+
+  std::shared_ptr<NFmiQueryData> data(const string& theName) const override
+  {
+    std::lock_guard<std::mutex> lock(itsMutex);
+    return itsSource->data(theName);
+  }
+
+  WeatherId id(const string& theName) const override
+  {
+    std::lock_guard<std::mutex> lock(itsMutex);
+    return itsSource->id(theName);
+  }
+
+ private:
+  std::shared_ptr<WeatherSource> itsSource;
+  mutable std::mutex itsMutex;
+};
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief The analysis sources for the current thread
+ *
+ * The masks are cached by the mask source, which therefore is not shared
+ * between threads. Each thread keeps its own mask source for each data
+ * source, hence a mask is calculated at most once per thread.
+ *
+ * \param theSource The index of the data source
+ * \return The sources to be used by the current thread
+ */
+// ----------------------------------------------------------------------
+
+AnalysisSources thread_sources(unsigned int theSource)
+{
+  AnalysisSources sources = options.sources[theSource];
+  if (options.threadcount > 1)
+  {
+    thread_local map<unsigned int, std::shared_ptr<MaskSource> > masksources;
+    std::shared_ptr<MaskSource>& masksource = masksources[theSource];
+    if (!masksource)
+      masksource.reset(new RegularMaskSource());
+    sources.setMaskSource(masksource);
+  }
+  return sources;
 }
 
 // ----------------------------------------------------------------------
@@ -874,52 +966,101 @@ AnalysisSources find_source(const WeatherArea& theArea)
  *
  * Algorithm:
  *
- *   -# For each generated period
- *     -# For each requested function
- *       -# Calculate the result and store it
+ *   -# Establish the data source of each area
+ *   -# For each area, generated period and requested function,
+ *      possibly in parallel
+ *     -# Calculate the result
+ *   -# Store the results in area, period and function order
+ *
+ * The data sources are established first so that any warnings and
+ * errors are reported in area order, and so that all data is loaded
+ * before the analyses start. With several threads the weather sources
+ * are synchronized and each thread has its own mask sources.
  */
 // ----------------------------------------------------------------------
 
 void calculate_results()
 {
-  GridForecaster forecaster;
-
   const WeatherPeriodGenerator::size_type n = options.generator->size();
 
+  vector<WeatherPeriod> periods;
+  for (WeatherPeriodGenerator::size_type i = 1; i <= n; ++i)
+    periods.push_back(options.generator->period(i));
+
+  vector<map<string, WeatherArea>::const_iterator> areas;
+  vector<unsigned int> sources;
   for (map<string, WeatherArea>::const_iterator at = options.areas.begin();
        at != options.areas.end();
        ++at)
   {
-    TimedResults timedresults;
+    areas.push_back(at);
+    sources.push_back(find_source(at->second));
+  }
 
-    const WeatherArea& area = at->second;
+  vector<const ParameterRequest*> parameters;
+  for (list<ParameterRequest>::const_iterator it = options.parameters.begin();
+       it != options.parameters.end();
+       ++it)
+    parameters.push_back(&*it);
 
-    AnalysisSources sources = find_source(area);
+  if (options.threadcount > 1)
+  {
+    for (vector<AnalysisSources>::iterator it = options.sources.begin();
+         it != options.sources.end();
+         ++it)
+    {
+      std::shared_ptr<WeatherSource> weathersource(
+          new SynchronizedWeatherSource(it->getWeatherSource()));
+      it->setWeatherSource(weathersource);
+    }
+  }
 
-    for (WeatherPeriodGenerator::size_type i = 1; i <= n; ++i)
+  // One task for each area, period and function, in the order they are printed
+
+  const size_t nperiods = periods.size();
+  const size_t nparameters = parameters.size();
+  vector<std::unique_ptr<WeatherResult> > taskresults(areas.size() * nperiods * nparameters);
+
+  ThreadTools::parallelFor(taskresults.size(),
+                           options.threadcount,
+                           [&](size_t theTask)
+                           {
+                             if (options.threadcount > 1)
+                               init_thread();
+
+                             const size_t area = theTask / (nperiods * nparameters);
+                             const size_t period = theTask / nparameters % nperiods;
+                             const ParameterRequest& request = *parameters[theTask % nparameters];
+
+                             Settings::set("textgen::default_forecast",
+                                           options.querydata[sources[area]]);
+                             AnalysisSources analysissources = thread_sources(sources[area]);
+
+                             GridForecaster forecaster;
+                             taskresults[theTask].reset(
+                                 new WeatherResult(forecaster.analyze(analysissources,
+                                                                      request.parameter,
+                                                                      request.areafunction,
+                                                                      request.timefunction,
+                                                                      areas[area]->second,
+                                                                      periods[period],
+                                                                      DefaultAcceptor(),
+                                                                      DefaultAcceptor(),
+                                                                      *(request.tester))));
+                           });
+
+  size_t task = 0;
+  for (size_t i = 0; i < areas.size(); i++)
+  {
+    TimedResults timedresults;
+    for (size_t j = 0; j < nperiods; j++)
     {
-      const WeatherPeriod period = options.generator->period(i);
       Results newresults;
-
-      for (list<ParameterRequest>::const_iterator it = options.parameters.begin();
-           it != options.parameters.end();
-           ++it)
-      {
-        WeatherResult result = forecaster.analyze(sources,
-                                                  it->parameter,
-                                                  it->areafunction,
-                                                  it->timefunction,
-                                                  area,
-                                                  period,
-                                                  DefaultAcceptor(),
-                                                  DefaultAcceptor(),
-                                                  *(it->tester));
-        newresults.push_back(result);
-      }
-
-      timedresults.insert(TimedResults::value_type(period, newresults));
+      for (size_t k = 0; k < nparameters; k++)
+        newresults.push_back(*taskresults[task++]);
+      timedresults.insert(TimedResults::value_type(periods[j], newresults));
     }
-    results.insert(AreaResults::value_type(at->first, timedresults));
+    results.insert(AreaResults::value_type(areas[i]->first, timedresults));
   }
 }
 
@@ -12,6 +12,7 @@
 
 #include "NFmiParamCheckData.h"
 #include "NFmiQueryDataChecker.h"
+#include "ThreadTools.h"
 #include <boost/filesystem/operations.hpp>
 #include <boost/program_options.hpp>
 #include <newbase/NFmiCommentStripper.h>
@@ -37,10 +38,11 @@ struct Options
 {
   Options();
 
-  bool check_tdew;      // --check-tdew
-  std::string config;   // arg 1
-  std::string infile;   // arg 2
-  std::string outfile;  // arg 3
+  bool check_tdew;           // --check-tdew
+  unsigned int threadcount;  // --threads
+  std::string config;        // arg 1
+  std::string infile;        // arg 2
+  std::string outfile;       // arg 3
 };
 
 Options options;
@@ -51,7 +53,7 @@ Options options;
  */
 // ----------------------------------------------------------------------
 
-Options::Options() : check_tdew(false), config(), infile(), outfile() {}
+Options::Options() : check_tdew(false), threadcount(1), config(), infile(), outfile() {}
 // ----------------------------------------------------------------------
 /*!
  * \brief Parse the command line
@@ -73,11 +75,16 @@ bool ParseOptions(int argc, char *argv[], Options &options)
   const int desc_width = 100;
 #endif
 
+  std::string threads = "1";
+
   po::options_description desc("Allowed options", desc_width);
   desc.add_options()("help,h", "print out help message")("version,V", "display version number")(
       "check-dewpoint-difference",
       po::bool_switch(&options.check_tdew),
       "enable temperature >= dew point check")(
+      "threads,j",
+      po::value(&threads),
+      "number of threads, or a percentage of the cores, 0 for all (default=1)")(
       "config", po::value(&options.config), "configuration file")(
       "infile", po::value(&options.infile), "input querydata")(
       "outfile", po::value(&options.outfile), "output report filename");
@@ -92,6 +99,8 @@ bool ParseOptions(int argc, char *argv[], Options &options)
 
   po::notify(opt);
 
+  options.threadcount = ThreadTools::threadCount(threads);
+
   if (opt.count("version") != 0)
   {
     std::cout << "qdcheck v1.2 (" << __DATE__ << ' ' << __TIME__ << ')' << std::endl;
@@ -348,6 +357,7 @@ int run(int argc, char *argv[])
   dataChecker.ParamBag(params);
   dataChecker.CheckOnlyWantedTimes(false);
   dataChecker.CheckList(1 + 2 + 4);  // 1=missing data check ja 2=suoraa dataa
+  dataChecker.ThreadCount(options.threadcount);
   if (ohjausData.itsLocationCheckingType == 2)
     dataChecker.RandomlyCheckedLocationCount(ohjausData.itsRandomPointCount);
   else                                 // tarkistetaan tässä vaiheessa muuten vain kaikki pisteet
@@ -3,6 +3,8 @@
 // aikojen/parametrien/leveleiden mukaan ja tuottaa niistä yksi
 // yhteinen data tiedosto.
 
+#include "QueryDataReader.h"
+#include "ThreadTools.h"
 #include <newbase/NFmiArea.h>
 #include <newbase/NFmiAreaFactory.h>
 #include <newbase/NFmiCmdLine.h>
@@ -15,8 +17,11 @@
 #include <newbase/NFmiTimeList.h>
 #include <newbase/NFmiTotalWind.h>
 #include <newbase/NFmiWeatherAndCloudiness.h>
+#include <algorithm>
 #include <iostream>
+#include <memory>
 #include <utility>
+#include <vector>
 
 using namespace std;
 
@@ -50,6 +55,8 @@ void Usage(void)
           "data)."
        << endl
        << "   -p producer_id,name  Set producer id and name (for example 240,ecmwf)." << endl
+       << "   -j threads           Number of threads, or a percentage of the cores (default 1)"
+       << endl
        << endl;
 }
 
@@ -66,9 +73,9 @@ static void ReadGridData(vector<string> &theDataFileNames, MyGrid &theUsedGrid)
 {
   for (unsigned int i = 0; i < theDataFileNames.size(); i++)
   {
-    NFmiQueryData qd(theDataFileNames[i]);
+    unique_ptr<NFmiQueryData> qd = QueryDataReader::read(theDataFileNames[i]);
 
-    const NFmiGrid *grid = qd.Info()->Grid();
+    const NFmiGrid *grid = qd->Info()->Grid();
 
     if (grid)
     {
@@ -79,20 +86,122 @@ static void ReadGridData(vector<string> &theDataFileNames, MyGrid &theUsedGrid)
   }
 }
 
+typedef std::pair<unsigned int, unsigned int> IndexPair;
+typedef std::vector<IndexPair> Indexes;
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Fill the missing values of the output from a single source
+ *
+ * The values are processed one grid (or set of stations) at a time,
+ * gathering and storing each with a single strided copy instead of
+ * positioning both infos for every value. Output parameters are
+ * independent of each other and are filled in parallel. Source
+ * parameters mapped to the same output parameter are handled by the
+ * same task in their original order, so the result is the same as
+ * with a single thread.
+ *
+ * \param theLocations Location index pairs for point data, or null if
+ *                     the locations are the same grid points
+ */
+// ----------------------------------------------------------------------
+
+static void FillFromSource(NFmiFastQueryInfo &theSource,
+                           NFmiFastQueryInfo &theInfo,
+                           const Indexes &theParams,
+                           const Indexes &theLevels,
+                           const Indexes &theTimes,
+                           const Indexes *theLocations,
+                           unsigned int theThreadCount)
+{
+  // Group the source parameters by output parameter
+
+  vector<pair<unsigned int, vector<unsigned int> > > groups;
+  for (const IndexPair &param : theParams)
+  {
+    auto it = find_if(groups.begin(),
+                      groups.end(),
+                      [&param](const pair<unsigned int, vector<unsigned int> > &group)
+                      { return group.first == param.second; });
+    if (it == groups.end())
+      groups.push_back(make_pair(param.second, vector<unsigned int>(1, param.first)));
+    else
+      it->second.push_back(param.first);
+  }
+
+  ThreadTools::parallelFor(
+      groups.size(),
+      theThreadCount,
+      [&](size_t g)
+      {
+        NFmiFastQueryInfo sourceInfo(theSource);
+        NFmiFastQueryInfo info(theInfo);
+        vector<float> sourceValues;
+        vector<float> values;
+
+        info.ParamIndex(groups[g].first);
+        for (unsigned int sourceParam : groups[g].second)
+        {
+          sourceInfo.ParamIndex(sourceParam);
+
+          for (const IndexPair &level : theLevels)
+          {
+            sourceInfo.LevelIndex(level.first);
+            info.LevelIndex(level.second);
+
+            for (const IndexPair &time : theTimes)
+            {
+              sourceInfo.TimeIndex(time.first);
+              info.TimeIndex(time.second);
+
+              if (!info.GetLevelToVec(values) || !sourceInfo.GetLevelToVec(sourceValues))
+                throw runtime_error("Failed to read a grid while combining data");
+
+              bool changed = false;
+              if (theLocations == nullptr)
+              {
+                const size_t n = min(values.size(), sourceValues.size());
+                for (size_t i = 0; i < n; i++)
+                {
+                  const bool fill = (values[i] == kFloatMissing);
+                  changed |= fill;
+                  values[i] = (fill ? sourceValues[i] : values[i]);
+                }
+              }
+              else
+              {
+                for (const IndexPair &loc : *theLocations)
+                {
+                  if (values[loc.second] == kFloatMissing)
+                  {
+                    values[loc.second] = sourceValues[loc.first];
+                    changed = true;
+                  }
+                }
+              }
+
+              // Untouched grids are not written back to avoid dirtying mapped pages
+              if (changed && !info.SetLevelFromVec(values))
+                throw runtime_error("Failed to write a grid while combining data");
+            }  // times
+          }    // levels
+        }      // params
+      });
+}
+
 static void FillCombinedData(const vector<string> &theDataFileNames,
                              NFmiFastQueryInfo &theInfo,
-                             NFmiLevel *theForcedLevel)
+                             NFmiLevel *theForcedLevel,
+                             unsigned int theThreadCount)
 {
   MyGrid usedGrid(*theInfo.Grid());
   for (unsigned int i = 0; i < theDataFileNames.size(); i++)
   {
-    NFmiQueryData qd(theDataFileNames[i]);
-    NFmiFastQueryInfo sourceInfo(&qd);
+    unique_ptr<NFmiQueryData> qd = QueryDataReader::read(theDataFileNames[i]);
+    NFmiFastQueryInfo sourceInfo(qd.get());
 
     if (sourceInfo.Grid() && usedGrid == *sourceInfo.Grid())
     {
-      typedef std::pair<unsigned int, unsigned int> IndexPair;
-      typedef std::vector<IndexPair> Indexes;
       Indexes params, times, levels;
 
       // Collect indexes for common parameters, times and levels
@@ -111,54 +220,28 @@ static void FillCombinedData(const vector<string> &theDataFileNames,
       // We avoid unnecessary location loops with this extra test
 
       if (!params.empty() && !times.empty() && !levels.empty())
-      {
-        for (const IndexPair &param : params)
-        {
-          sourceInfo.ParamIndex(param.first);
-          theInfo.ParamIndex(param.second);
-
-          for (sourceInfo.ResetLocation(), theInfo.ResetLocation();
-               sourceInfo.NextLocation() && theInfo.NextLocation();)
-          {
-            for (const IndexPair &level : levels)
-            {
-              sourceInfo.LevelIndex(level.first);
-              theInfo.LevelIndex(level.second);
-
-              for (const IndexPair &time : times)
-              {
-                sourceInfo.TimeIndex(time.first);
-                theInfo.TimeIndex(time.second);
-
-                if (theInfo.FloatValue() == kFloatMissing)
-                  theInfo.FloatValue(sourceInfo.FloatValue());
-              }  // times
-            }    // levels
-          }      // locations
-        }        // params
-      }          // if !empty
-    }            // if same grid
-  }              // for files
+        FillFromSource(sourceInfo, theInfo, params, levels, times, nullptr, theThreadCount);
+    }  // if same grid
+  }    // for files
 }
 
 static void FillCombinedData(const vector<string> &theDataFileNames,
                              bool use_point_data,
                              NFmiFastQueryInfo &theInfo,
-                             NFmiLevel *theForcedLevel)
+                             NFmiLevel *theForcedLevel,
+                             unsigned int theThreadCount)
 {
   if (!use_point_data)
-    FillCombinedData(theDataFileNames, theInfo, theForcedLevel);
+    FillCombinedData(theDataFileNames, theInfo, theForcedLevel, theThreadCount);
   else
   {
     for (unsigned int i = 0; i < theDataFileNames.size(); i++)
     {
-      NFmiQueryData qd(theDataFileNames[i]);
-      NFmiFastQueryInfo sourceInfo(&qd);
+      unique_ptr<NFmiQueryData> qd = QueryDataReader::read(theDataFileNames[i]);
+      NFmiFastQueryInfo sourceInfo(qd.get());
 
       if (!sourceInfo.Grid())
       {
-        typedef std::pair<unsigned int, unsigned int> IndexPair;
-        typedef std::vector<IndexPair> Indexes;
         Indexes params, times, levels, locations;
 
         // Collect indexes for common parameters, times, levels and locations
@@ -181,36 +264,9 @@ static void FillCombinedData(const vector<string> &theDataFileNames,
         // We avoid unnecessary location loops with this extra test
 
         if (!params.empty() && !times.empty() && !levels.empty() && !locations.empty())
-        {
-          for (const IndexPair &param : params)
-          {
-            sourceInfo.ParamIndex(param.first);
-            theInfo.ParamIndex(param.second);
-
-            for (const IndexPair &loc : locations)
-            {
-              sourceInfo.LocationIndex(loc.first);
-              theInfo.LocationIndex(loc.second);
-
-              for (const IndexPair &level : levels)
-              {
-                sourceInfo.LevelIndex(level.first);
-                theInfo.LevelIndex(level.second);
-
-                for (const IndexPair &time : times)
-                {
-                  sourceInfo.TimeIndex(time.first);
-                  theInfo.TimeIndex(time.second);
-
-                  if (theInfo.FloatValue() == kFloatMissing)
-                    theInfo.FloatValue(sourceInfo.FloatValue());
-                }  // times
-              }    // levels
-            }      // locations
-          }        // params
-        }          // if !empty
-      }            // if same grid
-    }              // for files
+          FillFromSource(sourceInfo, theInfo, params, levels, times, &locations, theThreadCount);
+      }  // if same grid
+    }    // for files
   }
 }
 
@@ -244,8 +300,8 @@ static NFmiQueryInfo MakeCombinedInnerInfo(const vector<string> &dataFileNames,
     allLevels.insert(*theForcedLevel);
   // otetaan 1. datasta tuottaja ellei ole annettu pakotettua tuottajaa
 
-  NFmiQueryData qd(dataFileNames[0]);
-  NFmiFastQueryInfo qi(&qd);
+  unique_ptr<NFmiQueryData> qd = QueryDataReader::read(dataFileNames[0]);
+  NFmiFastQueryInfo qi(qd.get());
 
   NFmiMetTime originTime = qi.OriginTime();
 
@@ -263,8 +319,8 @@ static NFmiQueryInfo MakeCombinedInnerInfo(const vector<string> &dataFileNames,
 
   for (unsigned int i = 0; i < dataFileNames.size(); i++)
   {
-    NFmiQueryData data(dataFileNames[i]);
-    NFmiFastQueryInfo info(&data);
+    unique_ptr<NFmiQueryData> data = QueryDataReader::read(dataFileNames[i]);
+    NFmiFastQueryInfo info(data.get());
 
     bool ok = false;
     if (use_point_data)
@@ -366,7 +422,7 @@ static NFmiQueryInfo MakeCombinedInnerInfo(const vector<string> &dataFileNames,
 
 int Run(int argc, const char *argv[])
 {
-  NFmiCmdLine cmdline(argc, argv, "l!p!o!O!P");
+  NFmiCmdLine cmdline(argc, argv, "l!p!o!O!Pj!");
 
   // Tarkistetaan optioiden oikeus:
 
@@ -418,6 +474,10 @@ int Run(int argc, const char *argv[])
   std::string outfile = "-";
   bool mmapped = false;
 
+  unsigned int threadcount = 1;
+  if (cmdline.isOption('j'))
+    threadcount = ThreadTools::threadCount(cmdline.OptionValue('j'));
+
   if (cmdline.isOption('o'))
     outfile = cmdline.OptionValue('o');
 
@@ -474,7 +534,7 @@ int Run(int argc, const char *argv[])
     if (newData)
     {
       NFmiFastQueryInfo info(newData);
-      ::FillCombinedData(dataFileNames, use_point_data, info, forcedLevel);
+      ::FillCombinedData(dataFileNames, use_point_data, info, forcedLevel, threadcount);
       newData->Write(outfile);
     }
     delete newData;
@@ -483,7 +543,7 @@ int Run(int argc, const char *argv[])
   {
     NFmiQueryData *newData = NFmiQueryDataUtil::CreateEmptyData(innerInfo, outfile, true);
     NFmiFastQueryInfo info(newData);
-    ::FillCombinedData(dataFileNames, use_point_data, info, forcedLevel);
+    ::FillCombinedData(dataFileNames, use_point_data, info, forcedLevel, threadcount);
     delete newData;
   }
 
@@ -115,6 +115,7 @@
  */
 // ======================================================================
 
+#include "QueryDataReader.h"
 #include <boost/algorithm/string.hpp>
 #include <macgyver/StringConversion.h>
 #include <newbase/NFmiAreaFactory.h>
@@ -127,6 +128,8 @@
 #include <newbase/NFmiQueryDataUtil.h>
 #include <newbase/NFmiStringTools.h>
 #include <newbase/NFmiTimeList.h>
+#include <algorithm>
+#include <cmath>
 #include <ctime>
 #include <deque>
 #include <fstream>
@@ -134,6 +137,8 @@
 #include <sstream>
 #include <stdexcept>
 #include <string>
+#include <utility>
+#include <vector>
 
 using namespace std;
 using namespace boost;
@@ -1097,6 +1102,146 @@ void CopyAnalysisParameters(NFmiFastQueryInfo& theSrc,
   }
 }
 
+// ----------------------------------------------------------------------
+/*!
+ * \brief The ranges of source values needed for the output
+ *
+ * The values are stored with the time index running fastest, followed by
+ * the level, location and parameter indices. Only the output parameters,
+ * levels and times are needed, and for grids only the rows and columns
+ * around the output grid. Levels and times are selected individually only
+ * if that skips whole pages, and ranges less than a page apart are merged.
+ *
+ * \param theSrc The source data
+ * \param theDst The output data
+ * \param theOriginTime True if the first time is needed for all parameters
+ * \return The ranges, empty if the layout is not the expected one
+ */
+// ----------------------------------------------------------------------
+
+QueryDataReader::IndexRanges SourceRanges(NFmiFastQueryInfo& theSrc,
+                                          NFmiFastQueryInfo& theDst,
+                                          bool theOriginTime)
+{
+  QueryDataReader::IndexRanges ranges;
+
+  const size_t ntimes = theSrc.SizeTimes();
+  const size_t nlevels = theSrc.SizeLevels();
+  const size_t nlocations = theSrc.SizeLocations();
+
+  if (theSrc.Index(1, 1, 1, 1) != ((nlocations + 1) * nlevels + 1) * ntimes + 1)
+    return ranges;
+
+  // Source indices of the output parameters, levels and times
+
+  set<size_t> params;
+  for (theDst.ResetParam(); theDst.NextParam(false);)
+    if (theSrc.Param(theDst.Param()))
+      params.insert(theSrc.ParamIndex());
+
+  set<size_t> levels;
+  for (theDst.ResetLevel(); theDst.NextLevel();)
+  {
+    if (!theSrc.Level(*theDst.Level()))
+    {
+      levels.clear();
+      break;
+    }
+    levels.insert(theSrc.LevelIndex());
+  }
+  if (levels.empty())
+    for (size_t i = 0; i < nlevels; i++)
+      levels.insert(i);
+
+  // Times not in the source are interpolated from any time
+  set<size_t> times;
+  for (theDst.ResetTime(); theDst.NextTime();)
+  {
+    if (!theSrc.Time(theDst.ValidTime()))
+    {
+      times.clear();
+      break;
+    }
+    times.insert(theSrc.TimeIndex());
+  }
+  if (times.empty())
+    for (size_t i = 0; i < ntimes; i++)
+      times.insert(i);
+  else if (theOriginTime)
+    times.insert(0);
+
+  // Runs of consecutive times
+
+  vector<pair<size_t, size_t> > timeruns;
+  for (size_t t : times)
+  {
+    if (!timeruns.empty() && timeruns.back().second == t - 1)
+      timeruns.back().second = t;
+    else
+      timeruns.push_back(make_pair(t, t));
+  }
+
+  // Runs of source locations covering the output grid, with a margin for interpolation
+
+  vector<pair<size_t, size_t> > locationruns;
+  if (theSrc.Grid() != nullptr && theDst.Grid() != nullptr)
+  {
+    const long nx = theSrc.Grid()->XNumber();
+    const long ny = theSrc.Grid()->YNumber();
+    double xmin = nx, xmax = -1, ymin = ny, ymax = -1;
+    for (theDst.ResetLocation(); theDst.NextLocation();)
+    {
+      const NFmiPoint xy = theSrc.Grid()->LatLonToGrid(theDst.LatLon());
+      xmin = min(xmin, xy.X());
+      xmax = max(xmax, xy.X());
+      ymin = min(ymin, xy.Y());
+      ymax = max(ymax, xy.Y());
+    }
+    const long i1 = max(0L, static_cast<long>(floor(xmin)) - 1);
+    const long i2 = min(nx - 1, static_cast<long>(ceil(xmax)) + 1);
+    const long j1 = max(0L, static_cast<long>(floor(ymin)) - 1);
+    const long j2 = min(ny - 1, static_cast<long>(ceil(ymax)) + 1);
+    for (long j = j1; j <= j2 && i1 <= i2; j++)
+      locationruns.push_back(make_pair(j * nx + i1, j * nx + i2));
+  }
+  else
+    locationruns.push_back(make_pair(0, nlocations - 1));
+
+  // Collect the ranges in increasing order
+
+  const size_t page = 4096 / sizeof(float);
+
+  auto add = [&](size_t first, size_t last)
+  {
+    if (!ranges.empty() && first <= ranges.back().second + page)
+      ranges.back().second = max(ranges.back().second, last);
+    else
+      ranges.push_back(make_pair(first, last));
+  };
+
+  for (size_t p : params)
+    for (const auto& locations : locationruns)
+    {
+      if (nlevels * ntimes <= page)
+      {
+        add(theSrc.Index(p, locations.first, 0, 0),
+            theSrc.Index(p, locations.second, nlevels - 1, ntimes - 1) + 1);
+        continue;
+      }
+      for (size_t loc = locations.first; loc <= locations.second; loc++)
+        for (size_t lev : levels)
+        {
+          if (ntimes <= page)
+            add(theSrc.Index(p, loc, lev, 0), theSrc.Index(p, loc, lev, ntimes - 1) + 1);
+          else
+            for (const auto& run : timeruns)
+              add(theSrc.Index(p, loc, lev, run.first), theSrc.Index(p, loc, lev, run.second) + 1);
+        }
+    }
+
+  return ranges;
+}
+
 // ----------------------------------------------------------------------
 /*!
  * \brief The main work subroutine for the main program
@@ -1341,7 +1486,7 @@ int run(int argc, const char* argv[])
   }
   else
   {
-    qd = new NFmiQueryData(opt_infile);
+    qd = QueryDataReader::read(opt_infile).release();
     srcinfo = new NFmiFastQueryInfo(qd);
   }
 
@@ -1423,6 +1568,13 @@ int run(int argc, const char* argv[])
 
   bool same_stations = (opt_stations.empty() && opt_nostations.empty());
 
+  // Advise the kernel to read the needed parts of the input in advance instead
+  // of paging them in one page at a time as they are being copied
+
+  if (!opt_multifile)
+    QueryDataReader::prefetch(opt_infile,
+                              SourceRanges(*srcinfo, dstinfo, !opt_analysisparameters.empty()));
+
   if ((!dstinfo.Grid()) || opt_multifile)
     CopyNonGridData(*srcinfo, dstinfo, same_stations || opt_multifile);
   else
@@ -31,11 +31,13 @@
  */
 // ======================================================================
 
+#include "QueryDataReader.h"
 #include <macgyver/Join.h>
 #include <newbase/NFmiCmdLine.h>
 #include <newbase/NFmiEnumConverter.h>
+#include <newbase/NFmiFastQueryInfo.h>
 #include <newbase/NFmiFileSystem.h>
-#include <newbase/NFmiStreamQueryData.h>
+#include <newbase/NFmiQueryData.h>
 #include <newbase/NFmiStringTools.h>
 
 #include <boost/lexical_cast.hpp>
@@ -648,16 +650,13 @@ int domain(int argc, const char* argv[])
 
   // Read the querydata
 
-  NFmiStreamQueryData sqd1;
-  if (!sqd1.SafeReadLatestData(options.inputfile1))
-    throw runtime_error("Unable to read '" + options.inputfile1 + "'");
+  std::unique_ptr<NFmiQueryData> qd1 = QueryDataReader::read(options.inputfile1);
+  std::unique_ptr<NFmiQueryData> qd2 = QueryDataReader::read(options.inputfile2);
 
-  NFmiStreamQueryData sqd2;
-  if (!sqd2.SafeReadLatestData(options.inputfile2))
-    throw runtime_error("Unable to read '" + options.inputfile2 + "'");
-
-  NFmiFastQueryInfo* q1 = sqd1.QueryInfoIter();
-  NFmiFastQueryInfo* q2 = sqd2.QueryInfoIter();
+  NFmiFastQueryInfo info1(qd1.get());
+  NFmiFastQueryInfo info2(qd2.get());
+  NFmiFastQueryInfo* q1 = &info1;
+  NFmiFastQueryInfo* q2 = &info2;
 
   validate_comparison(*q1, *q2);
 
@@ -60,6 +60,8 @@
  * <dd>Define the hour to be extracted (local time)</dd>
  * <dt>-I [hour,...]</dt>
  * <dd>Define the hour to be extracted (UTC time)</dd>
+ * <dt>-j [threads]</dt>
+ * <dd>The number of threads to use, or a percentage of the cores</dd>
  * </dd>
  * </dl>
  *
@@ -71,6 +73,8 @@
  */
 // ======================================================================
 
+#include "QueryDataReader.h"
+#include "ThreadTools.h"
 #include <newbase/NFmiCalculator.h>
 #include <newbase/NFmiCmdLine.h>
 #include <newbase/NFmiDataIntegrator.h>
@@ -93,11 +97,13 @@
 #include <newbase/NFmiTimeList.h>
 
 #include <boost/lexical_cast.hpp>
+#include <algorithm>
 #include <deque>
 #include <memory>
 #include <sstream>
 #include <stdexcept>
 #include <string>
+#include <vector>
 
 using namespace std;
 using namespace boost;
@@ -134,6 +140,9 @@ void usage()
        << "\tUse all files in the directory (multifile mode)" << endl
        << "-o <outfile>" << endl
        << "\tThe output filename instead of standard output" << endl
+       << "-j <threads>" << endl
+       << "\tThe number of threads to use, or a percentage of the cores such as 50%." << endl
+       << "\tZero means all cores. The default is one thread." << endl
        << endl
        << "-p <param1,param2,...,paramN>" << endl
        << endl
@@ -385,6 +394,320 @@ std::shared_ptr<NFmiDataModifier> create_modifier(const string& theName)
   throw runtime_error("Unknown function: '" + theName + "'");
 }
 
+// ----------------------------------------------------------------------
+/*!
+ * \brief Source time index range [first,last] for one output time
+ *
+ * The range is empty if first > last.
+ */
+// ----------------------------------------------------------------------
+
+struct TimeWindow
+{
+  long first;
+  long last;
+};
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Find the source times integrated for each output time
+ *
+ * The windows match the times NFmiDataIntegrator::Integrate would
+ * visit, the source times in the closed interval formed by the offsets.
+ * Since output times are increasing, so are both ends of the windows.
+ */
+// ----------------------------------------------------------------------
+
+vector<TimeWindow> MakeTimeWindows(NFmiFastQueryInfo& theSrc,
+                                   NFmiFastQueryInfo& theDst,
+                                   int theStartOffset,
+                                   int theEndOffset)
+{
+  vector<NFmiMetTime> srctimes;
+  for (theSrc.ResetTime(); theSrc.NextTime();)
+    srctimes.push_back(theSrc.ValidTime());
+
+  const long n = static_cast<long>(srctimes.size());
+
+  vector<TimeWindow> windows;
+  long first = 0;
+  long last = -1;
+  for (theDst.ResetTime(); theDst.NextTime();)
+  {
+    NFmiMetTime starttime = theDst.ValidTime();
+    NFmiMetTime endtime = theDst.ValidTime();
+    starttime.ChangeByMinutes(theStartOffset);
+    endtime.ChangeByMinutes(theEndOffset);
+
+    while (first < n && srctimes[first].IsLessThan(starttime))
+      ++first;
+    while (last + 1 < n && !endtime.IsLessThan(srctimes[last + 1]))
+      ++last;
+
+    TimeWindow w = {first, last};
+    windows.push_back(w);
+  }
+  return windows;
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Reductions with a faster implementation than the generic modifier
+ */
+// ----------------------------------------------------------------------
+
+enum class Reduction
+{
+  Generic,
+  Min,
+  Max
+};
+
+Reduction ReductionType(const string& theName)
+{
+  if (theName == "min")
+    return Reduction::Min;
+  if (theName == "max")
+    return Reduction::Max;
+  return Reduction::Generic;
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Buffers reused by a thread for consecutive time series
+ */
+// ----------------------------------------------------------------------
+
+struct SeriesWork
+{
+  vector<float> series;
+  vector<float> results;
+  deque<long> candidates;
+};
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Integrate one window of a time series with the modifier
+ */
+// ----------------------------------------------------------------------
+
+float Integrate(const vector<float>& theSeries,
+                const TimeWindow& theWindow,
+                NFmiDataModifier& theModifier)
+{
+  theModifier.Clear();
+  for (long i = theWindow.first; i <= theWindow.last; i++)
+    theModifier.Calculate(theSeries[i]);
+  return theModifier.CalculationResult();
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Sliding window minimum or maximum of a time series
+ *
+ * The candidates are the indices of the valid values in the window which
+ * may still become its extremum, kept in monotonic order so that the
+ * extremum is always at the front. Each value is added and removed once.
+ * Windows with no valid values are left to the modifier so that the
+ * result for them is exactly what the modifier would give.
+ */
+// ----------------------------------------------------------------------
+
+void SlidingExtremum(const vector<TimeWindow>& theWindows,
+                     bool theMaximum,
+                     NFmiDataModifier& theModifier,
+                     SeriesWork& theWork)
+{
+  const vector<float>& series = theWork.series;
+  deque<long>& candidates = theWork.candidates;
+  candidates.clear();
+
+  long next = 0;
+  for (size_t i = 0; i < theWindows.size(); i++)
+  {
+    const TimeWindow& w = theWindows[i];
+
+    for (; next <= w.last; ++next)
+    {
+      const float value = series[next];
+      if (value == kFloatMissing)
+        continue;
+      while (!candidates.empty() &&
+             (theMaximum ? series[candidates.back()] <= value
+                         : series[candidates.back()] >= value))
+        candidates.pop_back();
+      candidates.push_back(next);
+    }
+    while (!candidates.empty() && candidates.front() < w.first)
+      candidates.pop_front();
+
+    if (candidates.empty())
+      theWork.results[i] = Integrate(series, w, theModifier);
+    else
+      theWork.results[i] = series[candidates.front()];
+  }
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Calculate the results for all windows of one time series
+ */
+// ----------------------------------------------------------------------
+
+void FilterSeries(const vector<TimeWindow>& theWindows,
+                  Reduction theReduction,
+                  NFmiDataModifier& theModifier,
+                  SeriesWork& theWork)
+{
+  theWork.results.resize(theWindows.size());
+
+  switch (theReduction)
+  {
+    case Reduction::Min:
+      SlidingExtremum(theWindows, false, theModifier, theWork);
+      break;
+    case Reduction::Max:
+      SlidingExtremum(theWindows, true, theModifier, theWork);
+      break;
+    case Reduction::Generic:
+      for (size_t i = 0; i < theWindows.size(); i++)
+        theWork.results[i] = Integrate(theWork.series, theWindows[i], theModifier);
+      break;
+  }
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Filter querydata held in memory
+ *
+ * The time series of each parameter, location and level is read once
+ * and all output times are calculated from it. The work is split into
+ * blocks of locations of one parameter, each processed by one thread
+ * with its own query infos and modifier. The blocks write to disjoint
+ * parts of the result.
+ */
+// ----------------------------------------------------------------------
+
+void Filter(NFmiQueryData& theSource,
+            NFmiQueryData& theResult,
+            int theStartOffset,
+            int theEndOffset,
+            const string& theFunction,
+            unsigned int theThreadCount)
+{
+  NFmiFastQueryInfo srcinfo(&theSource);
+  NFmiFastQueryInfo dstinfo(&theResult);
+
+  vector<TimeWindow> windows = MakeTimeWindows(srcinfo, dstinfo, theStartOffset, theEndOffset);
+  if (windows.empty())
+    return;
+
+  // Read only the source times some window needs, and index the series from the first of them
+
+  const long firsttime = windows.front().first;
+  const long lasttime = std::max(windows.back().last, firsttime - 1);
+  for (auto& w : windows)
+  {
+    w.first -= firsttime;
+    w.last -= firsttime;
+  }
+
+  const Reduction reduction = ReductionType(theFunction);
+
+  const size_t blocksize = 256;
+  const size_t locations = dstinfo.SizeLocations();
+  const size_t blocks = (locations + blocksize - 1) / blocksize;
+  const size_t tasks = dstinfo.SizeParams() * blocks;
+
+  ThreadTools::parallelFor(
+      tasks,
+      theThreadCount,
+      [&](size_t theTask)
+      {
+        NFmiFastQueryInfo src(&theSource);
+        NFmiFastQueryInfo dst(&theResult);
+        std::shared_ptr<NFmiDataModifier> modifier = create_modifier(theFunction);
+        SeriesWork work;
+        work.series.resize(lasttime - firsttime + 1);
+
+        dst.ParamIndex(theTask / blocks);
+        if (!src.Param(dst.Param()))
+          throw runtime_error("Internal error in parameter loop");
+
+        const size_t first = (theTask % blocks) * blocksize;
+        const size_t last = std::min(first + blocksize, locations);
+
+        // We assume levels and locations are identical
+        for (size_t loc = first; loc < last; loc++)
+        {
+          src.LocationIndex(loc);
+          dst.LocationIndex(loc);
+          for (src.ResetLevel(), dst.ResetLevel(); src.NextLevel() && dst.NextLevel();)
+          {
+            for (long t = firsttime; t <= lasttime; t++)
+            {
+              src.TimeIndex(t);
+              work.series[t - firsttime] = src.FloatValue();
+            }
+
+            FilterSeries(windows, reduction, *modifier, work);
+
+            for (size_t t = 0; t < windows.size(); t++)
+            {
+              dst.TimeIndex(t);
+              dst.FloatValue(work.results[t]);
+            }
+          }
+        }
+      });
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Filter multifile data
+ *
+ * Each value is integrated separately, since NFmiMultiQueryInfo does
+ * not provide direct access to the underlying data.
+ */
+// ----------------------------------------------------------------------
+
+void FilterMultiFile(NFmiFastQueryInfo& theSource,
+                     NFmiQueryData& theResult,
+                     int theStartOffset,
+                     int theEndOffset,
+                     const string& theFunction)
+{
+  NFmiFastQueryInfo dstinfo(&theResult);
+  std::shared_ptr<NFmiDataModifier> modifier = create_modifier(theFunction);
+
+  for (dstinfo.ResetTime(); dstinfo.NextTime();)
+  {
+    NFmiMetTime starttime = dstinfo.ValidTime();
+    NFmiMetTime endtime = dstinfo.ValidTime();
+
+    starttime.ChangeByMinutes(theStartOffset);
+    endtime.ChangeByMinutes(theEndOffset);
+
+    for (dstinfo.ResetParam(); dstinfo.NextParam();)
+    {
+      if (!theSource.Param(dstinfo.Param()))
+        throw runtime_error("Internal error in parameter loop");
+
+      // We assume levels and locations are identical
+
+      for (dstinfo.ResetLocation(), theSource.ResetLocation();
+           dstinfo.NextLocation() && theSource.NextLocation();)
+        for (dstinfo.ResetLevel(), theSource.ResetLevel();
+             dstinfo.NextLevel() && theSource.NextLevel();)
+        {
+          modifier->Clear();
+          float value = NFmiDataIntegrator::Integrate(theSource, starttime, endtime, *modifier);
+          dstinfo.FloatValue(value);
+        }
+    }
+  }
+}
+
 // ----------------------------------------------------------------------
 /*!
  * \brief The main work subroutine for the main program
@@ -410,10 +733,11 @@ int run(int argc, const char* argv[])
   int opt_endoffset = 0;
   string opt_function = "";
   string opt_outfile = "-";
+  unsigned int opt_threads = 1;  // option -j
 
   // Read command line arguments
 
-  NFmiCmdLine cmdline(argc, argv, "hQap!t!T!i!I!o!");
+  NFmiCmdLine cmdline(argc, argv, "hQap!t!T!i!I!o!j!");
   if (cmdline.Status().IsError())
     throw runtime_error(cmdline.Status().ErrorLog().CharPtr());
 
@@ -483,6 +807,9 @@ int run(int argc, const char* argv[])
   if (cmdline.isOption('a'))
     opt_lasttime = true;
 
+  if (cmdline.isOption('j'))
+    opt_threads = ThreadTools::threadCount(cmdline.OptionValue('j'));
+
   if (opt_lasttime && (cmdline.isOption('t') || cmdline.isOption('T') || cmdline.isOption('i') ||
                        cmdline.isOption('I')))
     throw runtime_error("Cannot use option -a with options -tTiI");
@@ -494,7 +821,7 @@ int run(int argc, const char* argv[])
 
   if (!opt_multifile)
   {
-    qd.reset(new NFmiQueryData(opt_infile));
+    qd = QueryDataReader::read(opt_infile);
     srcinfo.reset(new NFmiFastQueryInfo(qd.get()));
   }
   else
@@ -549,35 +876,13 @@ int run(int argc, const char* argv[])
       opt_startoffset = -minutes;
   }
 
-  // set the data modifier
-  std::shared_ptr<NFmiDataModifier> modifier = create_modifier(opt_function);
+  // Validate the function before doing any work
+  create_modifier(opt_function);
 
-  for (dstinfo.ResetTime(); dstinfo.NextTime();)
-  {
-    NFmiMetTime starttime = dstinfo.ValidTime();
-    NFmiMetTime endtime = dstinfo.ValidTime();
-
-    starttime.ChangeByMinutes(opt_startoffset);
-    endtime.ChangeByMinutes(opt_endoffset);
-
-    for (dstinfo.ResetParam(); dstinfo.NextParam();)
-    {
-      if (!srcinfo->Param(dstinfo.Param()))
-        throw runtime_error("Internal error in parameter loop");
-
-      // We assume levels and locations are identical
-
-      for (dstinfo.ResetLocation(), srcinfo->ResetLocation();
-           dstinfo.NextLocation() && srcinfo->NextLocation();)
-        for (dstinfo.ResetLevel(), srcinfo->ResetLevel();
-             dstinfo.NextLevel() && srcinfo->NextLevel();)
-        {
-          modifier->Clear();
-          float value = NFmiDataIntegrator::Integrate(*srcinfo, starttime, endtime, *modifier);
-          dstinfo.FloatValue(value);
-        }
-    }
-  }
+  if (!opt_multifile)
+    Filter(*qd, *data, opt_startoffset, opt_endoffset, opt_function, opt_threads);
+  else
+    FilterMultiFile(*srcinfo, *data, opt_startoffset, opt_endoffset, opt_function);
 
   // finish up by printing the result
 
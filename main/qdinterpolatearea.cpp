@@ -20,6 +20,7 @@
  *  parametreille.
  */
 
+#include "QueryDataReader.h"
 #include <macgyver/StringConversion.h>
 #include <newbase/NFmiAreaFactory.h>
 #include <newbase/NFmiCmdLine.h>
@@ -169,10 +170,10 @@ void run(int argc, const char *argv[])
   }
   wantedGrid->Area()->SetGridSize(wantedGrid->XNumber(), wantedGrid->YNumber());
 
-  NFmiQueryData qd(inputfile);
+  std::unique_ptr<NFmiQueryData> qd = QueryDataReader::read(inputfile);
 
   std::shared_ptr<NFmiQueryData> newData(
-      NFmiQueryDataUtil::Interpolate2OtherGrid(&qd, wantedGrid, nullptr, maxthreads));
+      NFmiQueryDataUtil::Interpolate2OtherGrid(qd.get(), wantedGrid, nullptr, maxthreads));
 
   // Temporary fix until newbase interpolation has been corrected
   NFmiWindFix::FixWinds(*newData);
@@ -22,6 +22,7 @@
  *  parametreille.
  */
 
+#include "QueryDataReader.h"
 #include <macgyver/StringConversion.h>
 #include <newbase/NFmiCmdLine.h>
 #include <newbase/NFmiQueryData.h>
@@ -91,11 +92,11 @@ int run(int argc, const char* argv[])
     generalInterpolationMethod = FmiInterpolationMethod(interp);
   }
 
-  NFmiQueryData qd(inputfile);
+  std::unique_ptr<NFmiQueryData> qd = QueryDataReader::read(inputfile);
 
   // tähän toiminnot
 
-  NFmiQueryData* newData = NFmiQueryDataUtil::InterpolateTimes(&qd,
+  NFmiQueryData* newData = NFmiQueryDataUtil::InterpolateTimes(qd.get(),
                                                                timeResolutionInMinutes,
                                                                startTimeResolutionInMinutes,
                                                                0,
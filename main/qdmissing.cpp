@@ -23,18 +23,17 @@
  *   - -n check for number of NaN values instead of % of kFloatMissing
  *   - -N for printing the count instead of the percentage
  *   - -t for analyzing each timestep separately
+ *   - -l for analyzing each level separately
  *   - -w for analyzing each station separately
  *   - -T [zone] for specifying the timezone
  *   - -P [param1,param2..] for specifying the parameters
  *   - -Z do not print a result if the result is zero
- *
- * Note! The code relies on the g++ macro definition for NAN.
- * For other compilers we must define the constant by ourselves.
- * Note that the bit pattern is different on Big Endian and Little
- * Endian machines, better leave the problem to GCC.
+ *   - -j [threads] for the number of threads
  */
 // ======================================================================
 
+#include "QueryDataReader.h"
+#include "ThreadTools.h"
 #include "TimeTools.h"
 
 #include <newbase/NFmiCmdLine.h>
@@ -47,15 +46,11 @@
 
 #include <ctime>
 #include <iostream>
+#include <memory>
 #include <numeric>
 #include <stdexcept>
 #include <vector>
 
-// Windows _isnan definition is here
-#ifndef UNIX
-#include <float.h>
-#endif
-
 using namespace std;
 
 // ----------------------------------------------------------------------
@@ -73,9 +68,11 @@ struct Options
   bool printcount;
   bool alltimesteps;
   bool allstations;
+  bool alllevels;
   bool checkErrorLimit;
   bool printzero;
   double errorLimit;
+  unsigned int threadcount;
 
   Options()
       : inputfile(),
@@ -85,9 +82,11 @@ struct Options
         printcount(false),
         alltimesteps(false),
         allstations(false),
+        alllevels(false),
         checkErrorLimit(false),
         printzero(true),
-        errorLimit()
+        errorLimit(),
+        threadcount(1)
   {
   }
 };
@@ -127,11 +126,13 @@ void usage()
        << "\t-N\t\t\tprint count instead of percentage" << endl
        << "\t-t\t\t\tanalyze all timesteps separately" << endl
        << "\t-w\t\t\tanalyze all stations separately" << endl
+       << "\t-l\t\t\tanalyze all levels separately" << endl
        << "\t-e [limit]\t\tstops running the program if there's more than [limit] missing values "
        << endl
        << "\t-T [zone]\t\tthe timezone" << endl
        << "\t-P [param1,param2...]\tthe desired parameters" << endl
        << "\t-Z\tdisable printing of results whose value is zero" << endl
+       << "\t-j [threads]\t\tnumber of threads, or a percentage of the cores (default 1)" << endl
        << endl;
 }
 
@@ -145,7 +146,7 @@ void usage()
 
 bool parse_command_line(int argc, const char* argv[])
 {
-  NFmiCmdLine cmdline(argc, argv, "htwnZNP!T!e!");
+  NFmiCmdLine cmdline(argc, argv, "htwlnZNP!T!e!j!");
 
   if (cmdline.Status().IsError())
     throw runtime_error(cmdline.Status().ErrorLog().CharPtr());
@@ -173,6 +174,9 @@ bool parse_command_line(int argc, const char* argv[])
   if (cmdline.isOption('w'))
     options.allstations = true;
 
+  if (cmdline.isOption('l'))
+    options.alllevels = true;
+
   if (cmdline.isOption('n'))
     options.checknan = true;
 
@@ -203,50 +207,292 @@ bool parse_command_line(int argc, const char* argv[])
     options.errorLimit = NFmiStringTools::Convert<double>(cmdline.OptionValue('e'));
   }
 
+  if (cmdline.isOption('j'))
+    options.threadcount = ThreadTools::threadCount(cmdline.OptionValue('j'));
+
   if (options.alltimesteps && options.allstations)
     throw runtime_error("Options -t and -w are mutually exclusive");
 
+  if (options.alllevels && (options.alltimesteps || options.allstations))
+    throw runtime_error("Option -l cannot be used with options -t or -w");
+
   return true;
 }
 
 // ----------------------------------------------------------------------
 /*!
- * \brief Calculate percentage of missing values
+ * \brief Missing value counts of the analyzed parameters
+ *
+ * The parameters are either all parameters including the subparameters
+ * of combined parameters, or the ones given with option -P in the given
+ * order. All results printed are derived from these counts.
  */
 // ----------------------------------------------------------------------
 
-int analyze_all_parameters(NFmiFastQueryInfo& theQ)
+struct MissingCounts
 {
+  size_t params = 0;
+  size_t levels = 0;
+  size_t times = 0;
+  size_t locations = 0;
+  vector<char> found;        // [param]
+  vector<size_t> grids;      // [param][level][time], summed over locations
+  vector<size_t> stations;   // [param][location], summed over levels and times, only for -w
+
+  size_t grid(size_t theParam, size_t theLevel, size_t theTime) const
+  {
+    return grids[(theParam * levels + theLevel) * times + theTime];
+  }
+};
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Set the info to the given analyzed parameter
+ *
+ * \return False if the parameter is not in the data
+ */
+// ----------------------------------------------------------------------
+
+bool select_param(NFmiFastQueryInfo& theQ, size_t theIndex)
+{
+  if (!options.parameters.empty())
+    return theQ.Param(options.parameters[theIndex]);
+
   bool ignoresubs = false;
-  size_t total_count = 0;
-  size_t missing_count = 0;
+  theQ.ResetParam();
+  for (size_t i = 0; i <= theIndex; i++)
+    if (!theQ.NextParam(ignoresubs))
+      return false;
+  return true;
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Read the values of the current parameter, level and time
+ *
+ * Regular parameters are copied from the data as is, subparameters
+ * of combined parameters must be extracted value by value.
+ */
+// ----------------------------------------------------------------------
+
+void read_grid(NFmiFastQueryInfo& theQ, vector<float>& theValues)
+{
+  if (!theQ.IsSubParamUsed())
+  {
+    if (!theQ.GetLevelToVec(theValues))
+      throw runtime_error("Failed to read the values of a time step");
+    return;
+  }
+
+  theValues.resize(theQ.SizeLocations());
+  for (theQ.ResetLocation(); theQ.NextLocation();)
+    theValues[theQ.LocationIndex()] = theQ.FloatValue();
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Count the missing values
+ *
+ * The loops are branch free so that the compiler can vectorize them.
+ * Comparing a value with itself is the NaN test isnan would do.
+ */
+// ----------------------------------------------------------------------
+
+size_t count_missing(const vector<float>& theValues)
+{
+  const float* values = theValues.data();
+  const size_t n = theValues.size();
+  size_t count = 0;
+  if (options.checknan)
+    for (size_t i = 0; i < n; i++)
+      count += (values[i] != values[i]);
+  else
+    for (size_t i = 0; i < n; i++)
+      count += (values[i] == kFloatMissing);
+  return count;
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Add the missing values to the counts of the individual locations
+ */
+// ----------------------------------------------------------------------
 
-  for (theQ.ResetParam(); theQ.NextParam(ignoresubs);)
-    for (theQ.ResetLocation(); theQ.NextLocation();)
-      for (theQ.ResetLevel(); theQ.NextLevel();)
-        for (theQ.ResetTime(); theQ.NextTime();)
-        {
-          ++total_count;
-          if (options.checknan)
-          {
-#ifdef UNIX
-            if (isnan(theQ.FloatValue()))
-#else
-            if (_isnan(theQ.FloatValue()))
-#endif
-              ++missing_count;
-          }
-          else if (theQ.FloatValue() == kFloatMissing)
-            ++missing_count;
-        }
+void count_missing(const vector<float>& theValues, vector<size_t>& theCounts)
+{
+  const float* values = theValues.data();
+  size_t* counts = theCounts.data();
+  const size_t n = theValues.size();
+  if (options.checknan)
+    for (size_t i = 0; i < n; i++)
+      counts[i] += (values[i] != values[i]);
+  else
+    for (size_t i = 0; i < n; i++)
+      counts[i] += (values[i] == kFloatMissing);
+}
 
+// ----------------------------------------------------------------------
+/*!
+ * \brief Count the missing values of all analyzed parameters in one pass
+ *
+ * Each parameter and level is scanned by its own task one grid at a
+ * time. The tasks write only their own counts, the station counts are
+ * summed once all tasks are done.
+ */
+// ----------------------------------------------------------------------
+
+MissingCounts count_missing_values(NFmiQueryData& theQD, bool theStationCounts)
+{
+  NFmiFastQueryInfo q(&theQD);
+
+  MissingCounts counts;
+  counts.levels = q.SizeLevels();
+  counts.times = q.SizeTimes();
+  counts.locations = q.SizeLocations();
+
+  counts.params = options.parameters.size();
+  if (options.parameters.empty())
+  {
+    bool ignoresubs = false;
+    for (q.ResetParam(); q.NextParam(ignoresubs);)
+      ++counts.params;
+  }
+
+  counts.found.resize(counts.params);
+  for (size_t p = 0; p < counts.params; p++)
+    counts.found[p] = select_param(q, p);
+
+  counts.grids.resize(counts.params * counts.levels * counts.times, 0);
+
+  const size_t ntasks = counts.params * counts.levels;
+  vector<vector<size_t> > stations(theStationCounts ? ntasks : 0);
+
+  ThreadTools::parallelFor(ntasks,
+                           options.threadcount,
+                           [&](size_t task)
+                           {
+                             const size_t p = task / counts.levels;
+                             const size_t lev = task % counts.levels;
+                             if (!counts.found[p])
+                               return;
+
+                             NFmiFastQueryInfo info(&theQD);
+                             select_param(info, p);
+                             info.LevelIndex(lev);
+
+                             if (theStationCounts)
+                               stations[task].resize(counts.locations, 0);
+
+                             vector<float> values;
+                             for (size_t t = 0; t < counts.times; t++)
+                             {
+                               info.TimeIndex(t);
+                               read_grid(info, values);
+                               counts.grids[task * counts.times + t] = count_missing(values);
+                               if (theStationCounts)
+                                 count_missing(values, stations[task]);
+                             }
+                           });
+
+  if (theStationCounts)
+  {
+    counts.stations.resize(counts.params * counts.locations, 0);
+    for (size_t task = 0; task < stations.size(); task++)
+    {
+      const size_t p = task / counts.levels;
+      for (size_t loc = 0; loc < stations[task].size(); loc++)
+        counts.stations[p * counts.locations + loc] += stations[task][loc];
+    }
+  }
+
+  return counts;
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief The result for all parameters combined
+ */
+// ----------------------------------------------------------------------
+
+int all_parameters_result(size_t theMissingCount, size_t theTotalCount)
+{
   if (options.checknan || options.printcount)
-    return missing_count;
+    return theMissingCount;
 
-  if (total_count == 0)
+  if (theTotalCount == 0)
     return 100;
 
-  return static_cast<int>((100.0 * missing_count) / total_count);
+  return static_cast<int>((100.0 * theMissingCount) / theTotalCount);
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief The result of a single given parameter
+ */
+// ----------------------------------------------------------------------
+
+float given_parameter_result(size_t theMissingCount, size_t theTotalCount)
+{
+  if (options.checknan || options.printcount)
+    return theMissingCount;
+  if (theTotalCount == 0)
+    return 100.0;
+  return 100.0 * theMissingCount / theTotalCount;
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief The result for the given parameters combined
+ */
+// ----------------------------------------------------------------------
+
+int given_parameters_result(const vector<float>& thePercentages)
+{
+  if (thePercentages.size() == 0)
+    return (options.checknan || options.printcount ? 0 : 100);
+
+  float sum = accumulate(thePercentages.begin(), thePercentages.end(), 0.0);
+  if (options.checknan || options.printcount)
+    return static_cast<int>(sum);
+  else
+    return static_cast<int>(sum / thePercentages.size());
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Missing values of a parameter summed over the given levels and times
+ */
+// ----------------------------------------------------------------------
+
+size_t sum_missing(const MissingCounts& theCounts,
+                   size_t theParam,
+                   size_t theFirstLevel,
+                   size_t theLastLevel,
+                   size_t theFirstTime,
+                   size_t theLastTime)
+{
+  size_t count = 0;
+  for (size_t lev = theFirstLevel; lev < theLastLevel; lev++)
+    for (size_t t = theFirstTime; t < theLastTime; t++)
+      count += theCounts.grid(theParam, lev, t);
+  return count;
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Calculate percentage of missing values
+ */
+// ----------------------------------------------------------------------
+
+int analyze_all_parameters(const MissingCounts& theCounts)
+{
+  size_t missing_count = 0;
+  for (size_t p = 0; p < theCounts.params; p++)
+    missing_count += sum_missing(theCounts, p, 0, theCounts.levels, 0, theCounts.times);
+
+  const size_t total_count =
+      theCounts.params * theCounts.locations * theCounts.levels * theCounts.times;
+  return all_parameters_result(missing_count, total_count);
 }
 
 // ----------------------------------------------------------------------
@@ -255,13 +501,13 @@ int analyze_all_parameters(NFmiFastQueryInfo& theQ)
  */
 // ----------------------------------------------------------------------
 
-int analyze_given_parameters(NFmiFastQueryInfo& theQ)
+int analyze_given_parameters(const MissingCounts& theCounts)
 {
   vector<float> percentages;
 
-  for (unsigned int i = 0; i < options.parameters.size(); i++)
+  for (size_t p = 0; p < theCounts.params; p++)
   {
-    if (!theQ.Param(options.parameters[i]))
+    if (!theCounts.found[p])
     {
       if (options.printcount)
         percentages.push_back(kFloatMissing);
@@ -270,49 +516,14 @@ int analyze_given_parameters(NFmiFastQueryInfo& theQ)
     }
     else
     {
-      size_t total_count = 0;
-      size_t missing_count = 0;
-
-      for (theQ.ResetLocation(); theQ.NextLocation();)
-        for (theQ.ResetLevel(); theQ.NextLevel();)
-          for (theQ.ResetTime(); theQ.NextTime();)
-          {
-            ++total_count;
-            if (options.checknan)
-            {
-#ifdef UNIX
-              if (isnan(theQ.FloatValue()))
-#else
-              if (_isnan(theQ.FloatValue()))
-#endif
-                ++missing_count;
-            }
-            else if (theQ.FloatValue() == kFloatMissing)
-              ++missing_count;
-          }
-
-      if (options.checknan || options.printcount)
-        percentages.push_back(missing_count);
-      else if (total_count == 0)
-        percentages.push_back(100.0);
-      else
-        percentages.push_back(100.0 * missing_count / total_count);
+      const size_t missing_count =
+          sum_missing(theCounts, p, 0, theCounts.levels, 0, theCounts.times);
+      const size_t total_count = theCounts.locations * theCounts.levels * theCounts.times;
+      percentages.push_back(given_parameter_result(missing_count, total_count));
     }
   }
 
-  if (percentages.size() == 0)
-  {
-    if (options.checknan || options.printcount)
-      return 0;
-    else
-      return 100;
-  }
-
-  float sum = accumulate(percentages.begin(), percentages.end(), 0.0);
-  if (options.checknan || options.printcount)
-    return static_cast<int>(sum);
-  else
-    return static_cast<int>(sum / percentages.size());
+  return given_parameters_result(percentages);
 }
 
 // ----------------------------------------------------------------------
@@ -321,37 +532,14 @@ int analyze_given_parameters(NFmiFastQueryInfo& theQ)
  */
 // ----------------------------------------------------------------------
 
-int analyze_all_station_parameters(NFmiFastQueryInfo& theQ)
+int analyze_all_station_parameters(const MissingCounts& theCounts, size_t theLocation)
 {
-  bool ignoresubs = false;
-  size_t total_count = 0;
   size_t missing_count = 0;
+  for (size_t p = 0; p < theCounts.params; p++)
+    missing_count += theCounts.stations[p * theCounts.locations + theLocation];
 
-  for (theQ.ResetParam(); theQ.NextParam(ignoresubs);)
-    for (theQ.ResetLevel(); theQ.NextLevel();)
-      for (theQ.ResetTime(); theQ.NextTime();)
-      {
-        ++total_count;
-        if (options.checknan)
-        {
-#ifdef UNIX
-          if (isnan(theQ.FloatValue()))
-#else
-          if (_isnan(theQ.FloatValue()))
-#endif
-            ++missing_count;
-        }
-        else if (theQ.FloatValue() == kFloatMissing)
-          ++missing_count;
-      }
-
-  if (options.checknan || options.printcount)
-    return missing_count;
-
-  if (total_count == 0)
-    return 100;
-
-  return static_cast<int>((100.0 * missing_count) / total_count);
+  const size_t total_count = theCounts.params * theCounts.levels * theCounts.times;
+  return all_parameters_result(missing_count, total_count);
 }
 
 // ----------------------------------------------------------------------
@@ -360,13 +548,13 @@ int analyze_all_station_parameters(NFmiFastQueryInfo& theQ)
  */
 // ----------------------------------------------------------------------
 
-int analyze_given_station_parameters(NFmiFastQueryInfo& theQ)
+int analyze_given_station_parameters(const MissingCounts& theCounts, size_t theLocation)
 {
   vector<float> percentages;
 
-  for (unsigned int i = 0; i < options.parameters.size(); i++)
+  for (size_t p = 0; p < theCounts.params; p++)
   {
-    if (!theQ.Param(options.parameters[i]))
+    if (!theCounts.found[p])
     {
       if (options.checknan)
         percentages.push_back(0);
@@ -375,45 +563,13 @@ int analyze_given_station_parameters(NFmiFastQueryInfo& theQ)
     }
     else
     {
-      size_t total_count = 0;
-      size_t missing_count = 0;
-
-      for (theQ.ResetLevel(); theQ.NextLevel();)
-        for (theQ.ResetTime(); theQ.NextTime();)
-        {
-          ++total_count;
-          if (options.checknan)
-          {
-#ifdef UNIX
-            if (isnan(theQ.FloatValue()))
-#else
-            if (_isnan(theQ.FloatValue()))
-#endif
-              ++missing_count;
-          }
-          else if (theQ.FloatValue() == kFloatMissing)
-            ++missing_count;
-        }
-
-      if (options.checknan || options.printcount)
-        percentages.push_back(missing_count);
-      else if (total_count == 0)
-        percentages.push_back(100.0);
-      else
-        percentages.push_back(100.0 * missing_count / total_count);
+      const size_t missing_count = theCounts.stations[p * theCounts.locations + theLocation];
+      const size_t total_count = theCounts.levels * theCounts.times;
+      percentages.push_back(given_parameter_result(missing_count, total_count));
     }
   }
 
-  if (percentages.size() == 0)
-  {
-    return (options.checknan || options.printcount ? 0 : 100);
-  }
-
-  float sum = accumulate(percentages.begin(), percentages.end(), 0.0);
-  if (options.checknan || options.printcount)
-    return static_cast<int>(sum);
-  else
-    return static_cast<int>(sum / percentages.size());
+  return given_parameters_result(percentages);
 }
 
 // ----------------------------------------------------------------------
@@ -422,37 +578,14 @@ int analyze_given_station_parameters(NFmiFastQueryInfo& theQ)
  */
 // ----------------------------------------------------------------------
 
-int analyze_all_parameters_now(NFmiFastQueryInfo& theQ)
+int analyze_all_parameters_now(const MissingCounts& theCounts, size_t theTime)
 {
-  bool ignoresubs = false;
-  size_t total_count = 0;
   size_t missing_count = 0;
+  for (size_t p = 0; p < theCounts.params; p++)
+    missing_count += sum_missing(theCounts, p, 0, theCounts.levels, theTime, theTime + 1);
 
-  for (theQ.ResetParam(); theQ.NextParam(ignoresubs);)
-    for (theQ.ResetLocation(); theQ.NextLocation();)
-      for (theQ.ResetLevel(); theQ.NextLevel();)
-      {
-        ++total_count;
-        if (options.checknan)
-        {
-#ifdef UNIX
-          if (isnan(theQ.FloatValue()))
-#else
-          if (_isnan(theQ.FloatValue()))
-#endif
-            ++missing_count;
-        }
-        else if (theQ.FloatValue() == kFloatMissing)
-          ++missing_count;
-      }
-
-  if (options.checknan || options.printcount)
-    return missing_count;
-
-  if (total_count == 0)
-    return 100;
-
-  return static_cast<int>((100.0 * missing_count) / total_count);
+  const size_t total_count = theCounts.params * theCounts.locations * theCounts.levels;
+  return all_parameters_result(missing_count, total_count);
 }
 
 // ----------------------------------------------------------------------
@@ -461,13 +594,13 @@ int analyze_all_parameters_now(NFmiFastQueryInfo& theQ)
  */
 // ----------------------------------------------------------------------
 
-int analyze_given_parameters_now(NFmiFastQueryInfo& theQ)
+int analyze_given_parameters_now(const MissingCounts& theCounts, size_t theTime)
 {
   vector<float> percentages;
 
-  for (unsigned int i = 0; i < options.parameters.size(); i++)
+  for (size_t p = 0; p < theCounts.params; p++)
   {
-    if (!theQ.Param(options.parameters[i]))
+    if (!theCounts.found[p])
     {
       if (options.checknan)
         percentages.push_back(0);
@@ -476,45 +609,61 @@ int analyze_given_parameters_now(NFmiFastQueryInfo& theQ)
     }
     else
     {
-      size_t total_count = 0;
-      size_t missing_count = 0;
-
-      for (theQ.ResetLocation(); theQ.NextLocation();)
-        for (theQ.ResetLevel(); theQ.NextLevel();)
-        {
-          ++total_count;
-          if (options.checknan)
-          {
-#ifdef UNIX
-            if (isnan(theQ.FloatValue()))
-#else
-            if (_isnan(theQ.FloatValue()))
-#endif
-              ++missing_count;
-          }
-          else if (theQ.FloatValue() == kFloatMissing)
-            ++missing_count;
-        }
-
-      if (options.checknan || options.printcount)
-        percentages.push_back(missing_count);
-      else if (total_count == 0)
-        percentages.push_back(100.0);
-      else
-        percentages.push_back(100.0 * missing_count / total_count);
+      const size_t missing_count =
+          sum_missing(theCounts, p, 0, theCounts.levels, theTime, theTime + 1);
+      const size_t total_count = theCounts.locations * theCounts.levels;
+      percentages.push_back(given_parameter_result(missing_count, total_count));
     }
   }
 
-  if (percentages.size() == 0)
+  return given_parameters_result(percentages);
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Calculate percentage of missing values on a level
+ */
+// ----------------------------------------------------------------------
+
+int analyze_all_parameters_on_level(const MissingCounts& theCounts, size_t theLevel)
+{
+  size_t missing_count = 0;
+  for (size_t p = 0; p < theCounts.params; p++)
+    missing_count += sum_missing(theCounts, p, theLevel, theLevel + 1, 0, theCounts.times);
+
+  const size_t total_count = theCounts.params * theCounts.locations * theCounts.times;
+  return all_parameters_result(missing_count, total_count);
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Calculate percentage of missing values from specified parameters on a level
+ */
+// ----------------------------------------------------------------------
+
+int analyze_given_parameters_on_level(const MissingCounts& theCounts, size_t theLevel)
+{
+  vector<float> percentages;
+
+  for (size_t p = 0; p < theCounts.params; p++)
   {
-    return (options.checknan || options.printcount ? 0 : 100);
+    if (!theCounts.found[p])
+    {
+      if (options.checknan)
+        percentages.push_back(0);
+      else
+        percentages.push_back(100.0);
+    }
+    else
+    {
+      const size_t missing_count =
+          sum_missing(theCounts, p, theLevel, theLevel + 1, 0, theCounts.times);
+      const size_t total_count = theCounts.locations * theCounts.times;
+      percentages.push_back(given_parameter_result(missing_count, total_count));
+    }
   }
 
-  float sum = accumulate(percentages.begin(), percentages.end(), 0.0);
-  if (options.checknan || options.printcount)
-    return static_cast<int>(sum);
-  else
-    return static_cast<int>(sum / percentages.size());
+  return given_parameters_result(percentages);
 }
 
 // ----------------------------------------------------------------------
@@ -533,8 +682,15 @@ int run(int argc, const char* argv[])
 
   // Read the querydata
 
-  NFmiQueryData qd(options.inputfile);
-  NFmiFastQueryInfo q(&qd);
+  unique_ptr<NFmiQueryData> qd = QueryDataReader::read(options.inputfile);
+  NFmiFastQueryInfo q(qd.get());
+
+  if (options.allstations && q.IsGrid())
+    throw runtime_error("Option -w can be used only for point data");
+
+  // Count the missing values in one pass
+
+  const MissingCounts counts = count_missing_values(*qd, options.allstations);
 
   // Establish what to do
 
@@ -543,9 +699,9 @@ int run(int argc, const char* argv[])
     for (q.ResetTime(); q.NextTime();)
     {
       if (options.parameters.empty())
-        percentage = analyze_all_parameters_now(q);
+        percentage = analyze_all_parameters_now(counts, q.TimeIndex());
       else
-        percentage = analyze_given_parameters_now(q);
+        percentage = analyze_given_parameters_now(counts, q.TimeIndex());
 
       NFmiTime t = TimeTools::timezone_time(q.ValidTime(), options.timezone);
       if (options.printzero || percentage != 0)
@@ -554,16 +710,29 @@ int run(int argc, const char* argv[])
         throw runtime_error("Given error limit has been exceeded, exiting.");
     }
   }
+  else if (options.alllevels)
+  {
+    for (q.ResetLevel(); q.NextLevel();)
+    {
+      if (options.parameters.empty())
+        percentage = analyze_all_parameters_on_level(counts, q.LevelIndex());
+      else
+        percentage = analyze_given_parameters_on_level(counts, q.LevelIndex());
+
+      if (options.printzero || percentage != 0)
+        cout << q.Level()->LevelValue() << ' ' << percentage << endl;
+      if (options.checkErrorLimit && percentage >= options.errorLimit)
+        throw runtime_error("Given error limit has been exceeded, exiting.");
+    }
+  }
   else if (options.allstations)
   {
-    if (q.IsGrid())
-      throw runtime_error("Option -w can be used only for point data");
     for (q.ResetLocation(); q.NextLocation();)
     {
       if (options.parameters.empty())
-        percentage = analyze_all_station_parameters(q);
+        percentage = analyze_all_station_parameters(counts, q.LocationIndex());
       else
-        percentage = analyze_given_station_parameters(q);
+        percentage = analyze_given_station_parameters(counts, q.LocationIndex());
       const NFmiLocation* loc = q.Location();
       if (options.printzero || percentage != 0)
         cout << loc->GetIdent() << '\t' << loc->GetName().CharPtr() << '\t' << loc->GetLongitude()
@@ -575,9 +744,9 @@ int run(int argc, const char* argv[])
   else
   {
     if (options.parameters.empty())
-      percentage = analyze_all_parameters(q);
+      percentage = analyze_all_parameters(counts);
     else
-      percentage = analyze_given_parameters(q);
+      percentage = analyze_given_parameters(counts);
     if (options.printzero || percentage != 0)
       cout << percentage << endl;
     if (options.checkErrorLimit && percentage >= options.errorLimit)
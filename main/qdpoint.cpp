@@ -39,6 +39,7 @@
 #include <newbase/NFmiDataModifierProb.h>
 #include <newbase/NFmiEnumConverter.h>
 #include <newbase/NFmiFileSystem.h>
+#include <newbase/NFmiGrid.h>
 #include <newbase/NFmiIndexMask.h>
 #include <newbase/NFmiIndexMaskTools.h>
 #include <newbase/NFmiLocation.h>
@@ -48,9 +49,13 @@
 #include <newbase/NFmiSettings.h>
 #include <newbase/NFmiStringTools.h>
 #include <newbase/NFmiValueString.h>
+#include <algorithm>
+#include <cstdio>
 #include <list>
+#include <map>
 #include <ogr_geometry.h>
 #include <optional>
+#include <set>
 #include <sstream>
 #include <stdexcept>
 #include <string>
@@ -148,12 +153,15 @@ struct Options
   bool validate = false;
   bool future = false;
   bool multimode = false;
+  bool memorymap = true;
   double max_distance = 100;  // km
   int nearest_stations = 1;
   string locationfile = "";
   LocationList locations;
   string missingvalue = "-";
   string uid;
+  string batchfile;
+  string format = "csv";
 };
 
 Options options;
@@ -211,6 +219,9 @@ bool parse_options(int argc, char* argv[])
                                                                       "display version number")(
       "querydata,q", po::value(&options.queryfile), "input querydata (qdpoint::querydata_file)")(
       "multidata,Q", po::bool_switch(&options.multimode), "use all files from input directories")(
+      "mmap",
+      po::value(&options.memorymap)->default_value(true)->implicit_value(true),
+      "memory map input files, --mmap=false reads them into memory")(
       "coordinatefile,c",
       po::value(&options.coordinatefile),
       "location configuration file (qdpoint::coordinates or "
@@ -245,7 +256,13 @@ bool parse_options(int argc, char* argv[])
       po::value(&options.max_missing_gap),
       "maximum time gap in minutes to fill with interpolation")(
       "future,F", po::bool_switch(&options.future), "print only times in the future")(
-      "uid,u", po::value(&options.uid), "unused legacy option");
+      "uid,u", po::value(&options.uid), "unused legacy option")(
+      "batch",
+      po::value(&options.batchfile),
+      "extract all points listed in the file in one pass, one name,lon,lat per line")(
+      "format",
+      po::value(&options.format),
+      "batch output format: csv or json (default: csv)");
 
   po::positional_options_description p;
   p.add("querydata", 1);
@@ -1290,6 +1307,323 @@ void ReportParams(QueryDataManager& theMgr,
   }
 }
 
+// ----------------------------------------------------------------------
+// Batch mode: a parameter to extract from one querydata
+// ----------------------------------------------------------------------
+
+struct BatchParam
+{
+  string name;
+  FmiParameterName ident = kFmiBadParameter;
+  unsigned long level = 0;
+  bool found = false;
+  NFmiString precision;
+};
+
+// ----------------------------------------------------------------------
+// Batch mode: a point to extract and where it was found
+// ----------------------------------------------------------------------
+
+struct BatchPoint
+{
+  const Location* location = nullptr;
+  QueryDataManager::Position position;
+  string timezone;
+};
+
+// ----------------------------------------------------------------------
+// Batch mode: the times and parameters extracted from one querydata
+// ----------------------------------------------------------------------
+
+struct BatchData
+{
+  vector<unsigned long> times;
+  vector<NFmiMetTime> validtimes;
+  vector<BatchParam> params;
+};
+
+// ----------------------------------------------------------------------
+// Resolve the parameters of the batch mode in the given data
+// ----------------------------------------------------------------------
+
+vector<BatchParam> BatchParams(NFmiFastQueryInfo& qd)
+{
+  vector<BatchParam> ret;
+
+  if (options.params.empty())
+  {
+    const bool ignoresubs = false;
+    qd.FirstLevel();
+    for (qd.ResetParam(); qd.NextParam(ignoresubs);)
+    {
+      BatchParam param;
+      param.ident = FmiParameterName(qd.Param().GetParamIdent());
+      param.name = converter.ToString(param.ident);
+      if (param.name.empty())
+        param.name = Fmi::to_string(param.ident);
+      param.level = qd.LevelIndex();
+      param.found = true;
+      param.precision = qd.Param().GetParam()->Precision();
+      ret.push_back(param);
+    }
+    return ret;
+  }
+
+  for (const string& spec : options.params)
+  {
+    BatchParam param;
+    param.name = spec;
+
+    const string name = ParamName(spec);
+    if (name.substr(0, 4) == "Meta")
+      throw runtime_error("Meta parameters are not supported in batch mode: " + name);
+
+    const long level = ParamLevel(spec);
+    if (level < 0)
+      param.found = qd.FirstLevel();
+    else
+    {
+      for (qd.ResetLevel(); !param.found && qd.NextLevel();)
+        param.found = (qd.Level()->LevelValue() == static_cast<unsigned int>(level));
+    }
+
+    param.ident = ParamEnum(name);
+    if (param.found)
+    {
+      param.level = qd.LevelIndex();
+      param.found = qd.Param(param.ident);
+    }
+    if (param.found)
+      param.precision = qd.Param().GetParam()->Precision();
+    ret.push_back(param);
+  }
+  return ret;
+}
+
+// ----------------------------------------------------------------------
+// Extract the values of one point
+//
+// The grid interpolation of the point is calculated once, after which
+// the values are read parameter by parameter with the times innermost
+// as they are stored in memory. The result is indexed by time and
+// parameter.
+// ----------------------------------------------------------------------
+
+vector<float> BatchValues(NFmiFastQueryInfo& qd,
+                          const BatchPoint& thePoint,
+                          const BatchData& theData)
+{
+  const bool grid = qd.IsGrid();
+  const NFmiPoint& lonlat = thePoint.location->latlon;
+
+  NFmiLocationCache cache;
+  if (grid)
+    cache = qd.CalcLocationCache(lonlat);
+
+  const size_t ntimes = theData.times.size();
+  const size_t nparams = theData.params.size();
+  vector<float> values(ntimes * nparams, kFloatMissing);
+
+  for (size_t k = 0; k < nparams; k++)
+  {
+    const BatchParam& param = theData.params[k];
+    if (!param.found)
+      continue;
+    qd.Param(param.ident);
+    qd.LevelIndex(param.level);
+    if (!grid)
+      qd.LocationIndex(thePoint.position.location);
+
+    for (size_t t = 0; t < ntimes; t++)
+    {
+      qd.TimeIndex(theData.times[t]);
+      float value = (grid ? qd.CachedInterpolation(cache) : qd.FloatValue());
+      if (value == kFloatMissing && options.max_missing_gap > 0)
+      {
+        if (grid)
+          value = InterpolatedValue(qd, options.max_missing_gap, lonlat);
+        else
+          value = InterpolatedValue(qd, options.max_missing_gap);
+      }
+      values[t * nparams + k] = value;
+    }
+  }
+
+  return values;
+}
+
+// ----------------------------------------------------------------------
+// Format a value in batch mode, the missing value is left for the caller
+// ----------------------------------------------------------------------
+
+string BatchValue(float value, const BatchParam& param)
+{
+  // Pyöristetään negatiivinen nolla nollaksi
+  if (value == -0)
+    value = 0;
+  return NFmiValueString(value, param.precision).CharPtr();
+}
+
+// ----------------------------------------------------------------------
+// Quote a string for JSON output
+// ----------------------------------------------------------------------
+
+string JsonString(const string& theString)
+{
+  string ret = "\"";
+  for (char ch : theString)
+  {
+    if (ch == '"' || ch == '\\')
+      ret += '\\';
+    if (static_cast<unsigned char>(ch) < 0x20)
+    {
+      char code[8];
+      snprintf(code, sizeof(code), "\\u%04x", static_cast<int>(ch));
+      ret += code;
+    }
+    else
+      ret += ch;
+  }
+  return ret + '"';
+}
+
+// ----------------------------------------------------------------------
+// Batch mode: extract all parameters and times for all points
+//
+// Output is one CSV row per point and time, or a JSON array with one
+// object per point, in the order of the points in the batch file. Each
+// point is printed as soon as it has been extracted, so the memory use
+// does not depend on the number of points.
+// ----------------------------------------------------------------------
+
+int RunBatch(QueryDataManager& qmgr, const Fmi::WorldTimeZones& zones)
+{
+  if (options.format != "csv" && options.format != "json")
+    throw runtime_error("Unknown batch output format '" + options.format + "'");
+
+  const LocationList locations = read_locationlist(options.batchfile);
+
+  vector<NFmiPoint> lonlats;
+  for (const Location& location : locations)
+    lonlats.push_back(location.latlon);
+
+  vector<QueryDataManager::Position> positions =
+      qmgr.locate(lonlats, 1000 * options.max_distance);
+
+  // Points outside the data are skipped only if forced to
+
+  vector<BatchPoint> points;
+  LocationList::const_iterator loc = locations.begin();
+  for (size_t i = 0; i < positions.size(); i++, ++loc)
+  {
+    if (positions[i].file < 0)
+    {
+      if (options.force)
+        continue;
+      qmgr.setposition(positions[i]);  // throws
+    }
+    BatchPoint point;
+    point.location = &(*loc);
+    point.position = positions[i];
+    if (options.timezone == "local")
+      point.timezone = zones.zone_name(loc->latlon.X(), loc->latlon.Y());
+    else
+      point.timezone = options.timezone;
+    points.push_back(point);
+  }
+
+  // Establish the times and parameters of each querydata
+
+  const NFmiMetTime now(1);
+
+  map<int, BatchData> files;
+  for (const BatchPoint& point : points)
+    if (files.find(point.position.file) == files.end())
+    {
+      qmgr.setposition(point.position);
+      NFmiFastQueryInfo& qd = qmgr.info();
+
+      BatchData& data = files[point.position.file];
+      for (qd.ResetTime(); qd.NextTime();)
+      {
+        if (options.future && qd.ValidTime().IsLessThan(now))
+          continue;
+        data.times.push_back(qd.TimeIndex());
+        data.validtimes.push_back(qd.ValidTime());
+      }
+      if (options.rows >= 0 && data.times.size() > static_cast<size_t>(options.rows))
+      {
+        data.times.erase(data.times.begin(), data.times.end() - options.rows);
+        data.validtimes.erase(data.validtimes.begin(), data.validtimes.end() - options.rows);
+      }
+
+      data.params = BatchParams(qd);
+    }
+
+  if (files.size() > 1 && options.params.empty())
+    throw runtime_error("Batch mode with several querydata files requires option -P");
+
+  // Extract and print the values one point at a time
+
+  const bool json = (options.format == "json");
+
+  if (json)
+    cout << '[';
+  else if (!points.empty())
+  {
+    cout << "name,time";
+    for (const BatchParam& param : files[points.front().position.file].params)
+      cout << ',' << param.name;
+    cout << '\n';
+  }
+
+  for (size_t i = 0; i < points.size(); i++)
+  {
+    const BatchPoint& point = points[i];
+    const BatchData& data = files[point.position.file];
+    const vector<BatchParam>& columns = data.params;
+    const size_t nparams = columns.size();
+
+    qmgr.setposition(point.position);
+    const vector<float> values = BatchValues(qmgr.info(), point, data);
+
+    if (json)
+      cout << (i > 0 ? ",\n" : "\n") << "{\"name\":" << JsonString(point.location->name)
+           << ",\"lon\":" << point.location->latlon.X() << ",\"lat\":" << point.location->latlon.Y()
+           << ",\"values\":[";
+
+    for (size_t t = 0; t < data.validtimes.size(); t++)
+    {
+      const string timestr = TimeTools::timezone_time(data.validtimes[t], point.timezone)
+                                 .ToStr(kYYYYMMDDHHMM)
+                                 .CharPtr();
+
+      if (json)
+        cout << (t > 0 ? "," : "") << "{\"time\":\"" << timestr << '"';
+      else
+        cout << point.location->name << ',' << timestr;
+
+      for (size_t k = 0; k < nparams; k++)
+      {
+        const float value = values[t * nparams + k];
+        if (json)
+          cout << ',' << JsonString(columns[k].name) << ':'
+               << (value == kFloatMissing ? "null" : BatchValue(value, columns[k]));
+        else
+          cout << ','
+               << (value == kFloatMissing ? options.missingvalue : BatchValue(value, columns[k]));
+      }
+      cout << (json ? "}" : "\n");
+    }
+    if (json)
+      cout << "]}";
+  }
+  if (json)
+    cout << "\n]\n";
+
+  return 0;
+}
+
 // ----------------------------------------------------------------------
 // Paaohjelma
 //
@@ -1315,11 +1649,21 @@ int run(int argc, char* argv[])
 
   if (options.multimode)
     qmgr.multimode();
+  qmgr.memorymap(options.memorymap);
 
   // Initialize timezone finder
 
   Fmi::WorldTimeZones zones(options.timezonefile);
 
+  if (!options.batchfile.empty())
+  {
+    if (!options.places.empty() || !options.stations.empty() || options.all_stations ||
+        !options.locations.empty() || options.longitude != kFloatMissing ||
+        options.latitude != kFloatMissing)
+      throw runtime_error("Option --batch cannot be used with options -p, -x, -y, -w or -l");
+    return RunBatch(qmgr, zones);
+  }
+
   // Muodostetaan paikka -x ja -y koordinaateista
 
   if (options.longitude != kFloatMissing && options.latitude != kFloatMissing)
@@ -1462,13 +1806,24 @@ int run(int argc, char* argv[])
   }
   else if (!options.locations.empty())
   {
+    // Search all the locations at once, file by file
+
+    vector<NFmiPoint> lonlats;
     for (LocationList::const_iterator it = options.locations.begin(); it != options.locations.end();
          ++it)
+      lonlats.push_back(it->latlon);
+
+    vector<QueryDataManager::Position> positions =
+        qmgr.locate(lonlats, 1000 * options.max_distance);
+
+    vector<QueryDataManager::Position>::const_iterator pos = positions.begin();
+    for (LocationList::const_iterator it = options.locations.begin(); it != options.locations.end();
+         ++it, ++pos)
     {
       NFmiPoint lonlat = it->latlon;
       try
       {
-        qmgr.setpoint(lonlat, 1000 * options.max_distance);
+        qmgr.setposition(*pos);
         qi = &qmgr.info();
       }
       catch (...)
@@ -1512,7 +1867,15 @@ int run(int argc, char* argv[])
   }
   else
   {
+    vector<NFmiPoint> lonlats;
     for (PlacesType::const_iterator it = places.begin(); it != places.end(); ++it)
+      lonlats.push_back(it->second);
+
+    vector<QueryDataManager::Position> positions =
+        qmgr.locate(lonlats, 1000 * options.max_distance);
+
+    vector<QueryDataManager::Position>::const_iterator pos = positions.begin();
+    for (PlacesType::const_iterator it = places.begin(); it != places.end(); ++it, ++pos)
     {
       if (places.size() > 1)
         cout << "Location: " << it->first << endl;
@@ -1520,7 +1883,7 @@ int run(int argc, char* argv[])
       NFmiPoint lonlat = it->second;
       try
       {
-        qmgr.setpoint(lonlat, 1000 * options.max_distance);
+        qmgr.setposition(*pos);
         qi = &qmgr.info();
       }
       catch (...)
@@ -107,6 +107,7 @@
  */
 // ======================================================================
 
+#include "ThreadTools.h"
 #include <newbase/NFmiCmdLine.h>
 #include <newbase/NFmiEnumConverter.h>
 #include <newbase/NFmiFastQueryInfo.h>
@@ -123,6 +124,7 @@
 #include <fstream>
 #include <stdexcept>
 #include <string>
+#include <vector>
 
 using namespace std;
 
@@ -149,6 +151,7 @@ void usage()
        << "\t-h\tPrint this help information" << endl
        << "\t-v\tVerbose mode" << endl
        << "\t\tBy default all data is smoothened" << endl
+       << "\t-j <threads>\tNumber of threads, or a percentage of the cores such as 50%" << endl
        << endl;
 }
 
@@ -161,12 +164,13 @@ void usage()
 struct Options
 {
   bool verbose;
+  unsigned int threadcount;
 
   string config;
   string inputdata;
   string outputdata;
 
-  Options() : verbose(false) {}
+  Options() : verbose(false), threadcount(1) {}
 };
 
 // ----------------------------------------------------------------------
@@ -187,7 +191,7 @@ Options options;
 
 bool parse_command_line(int argc, const char* argv[])
 {
-  NFmiCmdLine cmdline(argc, argv, "hvf");
+  NFmiCmdLine cmdline(argc, argv, "hvfj!");
 
   if (cmdline.Status().IsError())
     throw runtime_error(cmdline.Status().ErrorLog().CharPtr());
@@ -214,6 +218,9 @@ bool parse_command_line(int argc, const char* argv[])
   if (cmdline.isOption('v'))
     options.verbose = !options.verbose;
 
+  if (cmdline.isOption('j'))
+    options.threadcount = ThreadTools::threadCount(cmdline.OptionValue('j'));
+
   return true;
 }
 
@@ -360,57 +367,104 @@ const NFmiTimeDescriptor make_time_descriptor(NFmiFastQueryInfo& theQ)
 
 // ----------------------------------------------------------------------
 /*!
- * \brief Smoothen data from source to destination
+ * \brief Smoothening settings of a parameter
  */
 // ----------------------------------------------------------------------
 
-void smoothen_data(NFmiQueryData& theQD, NFmiFastQueryInfo& theQ)
+struct SmootherSettings
 {
-  NFmiEnumConverter converter;
-
-  NFmiFastQueryInfo q(&theQD);
+  string method;
+  double radius;
+  int factor;
+};
 
-  auto coordinates = theQ.LocationsWorldXY(*theQ.Area());
+// ----------------------------------------------------------------------
+/*!
+ * \brief Read the smoothening settings of the current parameter
+ */
+// ----------------------------------------------------------------------
 
-  for (q.ResetParam(); q.NextParam();)
-  {
-    if (!theQ.Param(q.Param()))
-      throw runtime_error("Parameter not available in source data");
+SmootherSettings smoother_settings(NFmiFastQueryInfo& theQ)
+{
+  NFmiEnumConverter converter;
 
-    // Establish the smoothening options
+  const int paramnum = theQ.Param().GetParamIdent();
+  const string paramname = converter.ToString(paramnum);
 
-    const int paramnum = q.Param().GetParamIdent();
-    const string paramname = converter.ToString(paramnum);
+  const string var = "smoother::" + paramname;
+  const string typevar = var + "::type";
+  const string radiusvar = var + "::radius";
+  const string factorvar = var + "::factor";
 
-    const string var = "smoother::" + paramname;
-    const string typevar = var + "::type";
-    const string radiusvar = var + "::radius";
-    const string factorvar = var + "::factor";
+  SmootherSettings settings;
+  settings.method = NFmiSettings::Optional<string>(typevar.c_str(), "None");
+  settings.radius = NFmiSettings::Optional<double>(radiusvar.c_str(), 0);
+  settings.factor = NFmiSettings::Optional<int>(factorvar.c_str(), 0);
 
-    const string method = NFmiSettings::Optional<string>(typevar.c_str(), "None");
-    const double radius = NFmiSettings::Optional<double>(radiusvar.c_str(), 0);
-    const int factor = NFmiSettings::Optional<int>(factorvar.c_str(), 0);
+  if (options.verbose)
+    cout << "   " << paramname << " (" << paramnum << ") with method " << settings.method << '('
+         << settings.radius << ',' << settings.factor << ')' << endl;
 
-    if (options.verbose)
-      cout << "   " << paramname << " (" << paramnum << ") with method " << method << '(' << radius
-           << ',' << factor << ')' << endl;
+  return settings;
+}
 
-    for (q.ResetLevel(); q.NextLevel();)
-    {
-      if (!theQ.Level(*q.Level()))
-        throw runtime_error("Level not available in source data");
+// ----------------------------------------------------------------------
+/*!
+ * \brief Smoothen data from source to destination
+ *
+ * The settings are read and the grid coordinates calculated before
+ * smoothing, after which every parameter, level and time is an
+ * independent task writing to its own part of the destination. The
+ * tasks are run in parallel with their own query infos and smoothers.
+ */
+// ----------------------------------------------------------------------
 
-      for (q.ResetTime(); q.NextTime();)
-      {
-        auto values = theQ.Values(q.ValidTime());
+void smoothen_data(NFmiQueryData& theQD, NFmiFastQueryInfo& theQ)
+{
+  NFmiFastQueryInfo q(&theQD);
 
-        NFmiSmoother smoother(method, factor, 1000 * radius);
-        values = smoother.Smoothen(coordinates, values);
+  const auto coordinates = theQ.LocationsWorldXY(*theQ.Area());
 
-        q.SetValues(values);
-      }
-    }
+  vector<SmootherSettings> settings;
+  for (q.ResetParam(); q.NextParam();)
+  {
+    if (!theQ.Param(q.Param()))
+      throw runtime_error("Parameter not available in source data");
+    settings.push_back(smoother_settings(q));
   }
+
+  for (q.ResetLevel(); q.NextLevel();)
+    if (!theQ.Level(*q.Level()))
+      throw runtime_error("Level not available in source data");
+
+  const size_t ntimes = q.SizeTimes();
+  const size_t nlevels = q.SizeLevels();
+
+  ThreadTools::parallelFor(settings.size() * nlevels * ntimes,
+                           options.threadcount,
+                           [&](size_t theTask)
+                           {
+                             const size_t param = theTask / (nlevels * ntimes);
+                             const size_t level = theTask / ntimes % nlevels;
+                             const size_t time = theTask % ntimes;
+
+                             NFmiFastQueryInfo dst(&theQD);
+                             dst.ParamIndex(param);
+                             dst.LevelIndex(level);
+                             dst.TimeIndex(time);
+
+                             NFmiFastQueryInfo src(theQ);
+                             src.Param(dst.Param());
+                             src.Level(*dst.Level());
+
+                             const SmootherSettings& setting = settings[param];
+                             NFmiSmoother smoother(
+                                 setting.method, setting.factor, 1000 * setting.radius);
+
+                             auto values = src.Values(dst.ValidTime());
+                             values = smoother.Smoothen(coordinates, values);
+                             dst.SetValues(values);
+                           });
 }
 
 // ----------------------------------------------------------------------
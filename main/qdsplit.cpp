@@ -23,12 +23,14 @@
  *   - -s use timestamp only in the name, not the original name
  *   - -t [n] split several times simultaneously
  *   - -T [n] split several times simultaneously using memory mapping
+ *   - -j [n] number of threads for filling and writing the simultaneous times
  *   - -m limit for assigning a limit on the amount of missing data (%)
  *   - -O set origin time equal to output valid time
  *
  */
 // ======================================================================
 
+#include "ThreadTools.h"
 #include <macgyver/StringConversion.h>
 #include <newbase/NFmiCmdLine.h>
 #include <newbase/NFmiFastQueryInfo.h>
@@ -38,12 +40,13 @@
 #include <newbase/NFmiTimeDescriptor.h>
 #include <newbase/NFmiTimeList.h>
 
+#include <algorithm>
 #include <filesystem>
-
 #include <fstream>
 #include <stdexcept>
 #include <string>
 #include <utility>
+#include <vector>
 
 using namespace std;
 
@@ -60,6 +63,7 @@ struct Options
   bool setorigintime;
   bool memorymapping;
   int simultaneoustimes;
+  unsigned int threadcount;
   float missinglimit;
   string inputfile;
   string outputdir;
@@ -70,6 +74,7 @@ struct Options
         setorigintime(false),
         memorymapping(false),
         simultaneoustimes(1),
+        threadcount(1),
         missinglimit(100),
         inputfile(),
         outputdir()
@@ -105,6 +110,7 @@ void usage()
        << "\t-s\tcreate short filenames" << endl
        << "\t-t [n]\thow many times to process simultaneously (default is 1)" << endl
        << "\t-T [n]\thow many times to process simultaneously with memory mapping" << endl
+       << "\t-j [n]\thow many threads to use for the simultaneous times (default is 1)" << endl
        << "\t-m limit\thow much data is allowed to be missing (%, default is 100)" << endl
        << "\t-O\tset origin time = valid time" << endl
        << endl;
@@ -120,7 +126,7 @@ void usage()
 
 bool parse_command_line(int argc, const char* argv[])
 {
-  NFmiCmdLine cmdline(argc, argv, "hvst!T!m!O");
+  NFmiCmdLine cmdline(argc, argv, "hvst!T!m!Oj!");
 
   if (cmdline.Status().IsError())
     throw runtime_error(cmdline.Status().ErrorLog().CharPtr());
@@ -169,6 +175,15 @@ bool parse_command_line(int argc, const char* argv[])
   if (options.simultaneoustimes < 1)
     throw runtime_error("Option t/T argument must be at least 1");
 
+  // Without t/T each thread processes one time at a time
+
+  if (cmdline.isOption('j'))
+  {
+    options.threadcount = ThreadTools::threadCount(cmdline.OptionValue('j'));
+    if (!cmdline.isOption('t') && !cmdline.isOption('T'))
+      options.simultaneoustimes = static_cast<int>(options.threadcount);
+  }
+
   return true;
 }
 
@@ -191,35 +206,67 @@ NFmiTimeDescriptor make_timedescriptor(const NFmiFastQueryInfo theQ)
 
 // ----------------------------------------------------------------------
 /*!
- * \brief Calculate percentage of missing values
+ * \brief Copy a single time step to a single time querydata
+ *
+ * Since time is the innermost dimension of querydata, the values of a
+ * time step are scattered throughout the source. Each grid of a
+ * parameter and a level is gathered with a single strided copy, and
+ * written to the output, where the grids are contiguous. Parameters
+ * are copied as raw values, so combined parameters need not be split
+ * into subparameters and joined back together.
+ *
+ * Missing values of combined parameters are counted both from the raw
+ * values and from the decoded values of their subparameters.
+ *
+ * \return The percentage of missing values, or -1 if not needed
  */
-//----------------------------------------------------------------------
+// ----------------------------------------------------------------------
 
-float calc_missing(NFmiFastQueryInfo& info)
+float copy_time(NFmiFastQueryInfo& theQ, unsigned long theTimeIndex, NFmiFastQueryInfo& theDst)
 {
-  if (options.missinglimit >= 100)
-    return -1;
+  const bool count = (options.missinglimit < 100);
+
+  std::vector<float> values;
+  std::size_t total = 0;
+  std::size_t missing = 0;
 
-  int total = 0;
-  int missing = 0;
+  theQ.TimeIndex(theTimeIndex);
+  theDst.FirstTime();
 
-  for (info.ResetParam(); info.NextParam(false);)
+  for (theQ.ResetParam(), theDst.ResetParam(); theQ.NextParam() && theDst.NextParam();)
   {
-    for (info.ResetLocation(); info.NextLocation();)
+    for (theQ.ResetLevel(), theDst.ResetLevel(); theQ.NextLevel() && theDst.NextLevel();)
     {
-      for (info.ResetLevel(); info.NextLevel();)
+      if (!theQ.GetLevelToVec(values) || !theDst.SetLevelFromVec(values))
+        throw runtime_error("Failed to copy a grid to the output data");
+
+      if (count)
       {
-        for (info.ResetTime(); info.NextTime();)
-        {
-          float value = info.FloatValue();
-          if (value == kFloatMissing)
-            ++missing;
-          ++total;
-        }
+        missing += std::count(values.begin(), values.end(), kFloatMissing);
+        total += values.size();
       }
     }
   }
 
+  if (!count)
+    return -1;
+
+  // Subparameters have no values of their own, they are decoded one at a time
+
+  for (theQ.ResetParam(); theQ.NextParam(false);)
+  {
+    if (!theQ.IsSubParamUsed())
+      continue;
+
+    for (theQ.ResetLevel(); theQ.NextLevel();)
+      for (theQ.ResetLocation(); theQ.NextLocation();)
+      {
+        if (theQ.FloatValue() == kFloatMissing)
+          ++missing;
+        ++total;
+      }
+  }
+
   return (total > 0 ? 100.0 * missing / total : 0);
 }
 
@@ -277,24 +324,9 @@ void extract_time(NFmiFastQueryInfo& theQ)
   if (data.get() == 0)
     throw runtime_error("Could not allocate memory for result data");
 
-  // copy the data for time selected time
+  // copy the data for time selected time and count the amount of missing values if needed
 
-  for (dstinfo.ResetParam(), theQ.ResetParam(); dstinfo.NextParam() && theQ.NextParam();)
-  {
-    for (dstinfo.ResetLocation(), theQ.ResetLocation();
-         dstinfo.NextLocation() && theQ.NextLocation();)
-    {
-      for (dstinfo.ResetLevel(), theQ.ResetLevel(); dstinfo.NextLevel() && theQ.NextLevel();)
-      {
-        float value = theQ.FloatValue();
-        dstinfo.FloatValue(value);
-      }
-    }
-  }
-
-  // Count the amount of missing values if needed
-
-  float misses = calc_missing(dstinfo);
+  float misses = copy_time(theQ, theQ.TimeIndex(), dstinfo);
 
   pair<string, string> names = make_outnames(dstinfo);
   const string& outname = names.first;
@@ -336,6 +368,7 @@ void extract_times(NFmiFastQueryInfo& theQ, unsigned long index1, unsigned long
 
   std::vector<NFmiQueryData*> datas;
   std::vector<NFmiFastQueryInfo*> infos;
+  std::vector<pair<string, string> > outnames;
 
   for (unsigned long idx = index1; idx < index2; ++idx)
   {
@@ -347,13 +380,12 @@ void extract_times(NFmiFastQueryInfo& theQ, unsigned long index1, unsigned long
 
     NFmiQueryData* qd = 0;
 
+    outnames.push_back(make_outnames(theQ));
+
     if (!options.memorymapping)
       qd = NFmiQueryDataUtil::CreateEmptyData(tmpinfo);
     else
-    {
-      pair<string, string> names = make_outnames(theQ);
-      qd = NFmiQueryDataUtil::CreateEmptyData(tmpinfo, names.second, false);
-    }
+      qd = NFmiQueryDataUtil::CreateEmptyData(tmpinfo, outnames.back().second, false);
 
     NFmiFastQueryInfo* info = new NFmiFastQueryInfo(qd);
 
@@ -361,73 +393,55 @@ void extract_times(NFmiFastQueryInfo& theQ, unsigned long index1, unsigned long
     infos.push_back(info);
   }
 
-  // copy the data for time selected times
+  // copy the data for time selected times, counting the amount of missing values if
+  // needed, and write the accepted datas under their temporary names. Each thread
+  // handles different output datas, and only reads the input.
 
-  for (theQ.ResetParam(); theQ.NextParam();)
-  {
-    for (std::size_t i = 0; i < infos.size(); i++)
-      infos[i]->ParamIndex(theQ.ParamIndex());
+  std::vector<float> misses(datas.size());
 
-    for (theQ.ResetLocation(); theQ.NextLocation();)
-    {
-      for (std::size_t i = 0; i < infos.size(); i++)
-        infos[i]->LocationIndex(theQ.LocationIndex());
+  ThreadTools::parallelFor(datas.size(),
+                           options.threadcount,
+                           [&](std::size_t i)
+                           {
+                             NFmiFastQueryInfo srcinfo(theQ);
+                             misses[i] = copy_time(srcinfo, index1 + i, *infos[i]);
 
-      for (theQ.ResetLevel(); theQ.NextLevel();)
-      {
-        for (std::size_t i = 0; i < infos.size(); i++)
-          infos[i]->LevelIndex(theQ.LevelIndex());
-        {
-          for (unsigned long i = index1; i < index2; ++i)
-          {
-            theQ.TimeIndex(i);
-            float value = theQ.FloatValue();
-            infos[i - index1]->FloatValue(value);
-          }
-        }
-      }
-    }
-  }
+                             if (!options.memorymapping &&
+                                 !(options.missinglimit < 100 && misses[i] > options.missinglimit))
+                             {
+                               // Use dotfile to prevent for example roadmodel crashes
+                               datas[i]->Write(outnames[i].second);
+                             }
+                           });
 
-  // Write the datas
+  // Report and rename the datas in time order
 
   for (std::size_t i = 0; i < datas.size(); i++)
   {
-    // Count the amount of missing values if needed
-
-    float misses = calc_missing(*infos[i]);
-
-    infos[i]->FirstTime();
-    pair<string, string> names = make_outnames(*infos[i]);
-    const string& outname = names.first;
-    const string& tmpname = names.second;
+    const string& outname = outnames[i].first;
+    const string& tmpname = outnames[i].second;
 
-    if (options.missinglimit < 100 && misses > options.missinglimit)
+    if (options.missinglimit < 100 && misses[i] > options.missinglimit)
     {
       if (options.verbose)
       {
-        cout << "Skipping " << outname << " since missing percentage is " << misses << endl;
+        cout << "Skipping " << outname << " since missing percentage is " << misses[i] << endl;
         if (options.memorymapping)
           std::filesystem::remove(tmpname);
       }
     }
     else
     {
-      // write the data out
+      // the data was written out above
 
       if (options.verbose)
       {
-        if (misses >= 0)
-          cout << "Writing '" << outname << " (missing " << misses << "%)" << endl;
+        if (misses[i] >= 0)
+          cout << "Writing '" << outname << " (missing " << misses[i] << "%)" << endl;
         else
           cout << "Writing '" << outname << endl;
       }
 
-      // Use dotfile to prevent for example roadmodel crashes
-
-      if (!options.memorymapping)
-        datas[i]->Write(tmpname);
-
       if (std::filesystem::exists(outname))
         std::filesystem::remove(outname);
       std::filesystem::rename(tmpname, outname);
@@ -1,3 +1,5 @@
+#include "QueryDataReader.h"
+#include "ThreadTools.h"
 #include "TimeTools.h"
 #include <boost/algorithm/string.hpp>
 #include <boost/filesystem/operations.hpp>
@@ -11,21 +13,32 @@
 #include <newbase/NFmiMetTime.h>
 #include <newbase/NFmiParameterName.h>
 #include <newbase/NFmiQueryData.h>
+#include <algorithm>
 #include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <functional>
 #include <iomanip>
 #include <limits>
 #include <list>
 #include <map>
+#include <memory>
+#include <mutex>
 #include <set>
 #include <sstream>
 #include <stdexcept>
 #include <string>
 #include <unordered_map>
+#include <vector>
 
 #ifdef UNIX
 #include <sys/ioctl.h>
 #endif
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
 // This is global so that we can not just parse but also print errors quickly
 NFmiEnumConverter converter;
 
@@ -55,8 +68,11 @@ struct Options
   bool all_levels = false;
   bool percentages = false;
   bool distribution = false;
+  bool exact = false;
+  bool memorymap = true;
   std::size_t bins = 20;
   std::size_t barsize = 60;
+  unsigned int threadcount = 1;
   double ignored_value = std::numeric_limits<double>::quiet_NaN();  // never compares ==
 
   std::set<Fmi::DateTime> these_times;
@@ -182,6 +198,7 @@ bool parse_options(int argc, char* argv[])
   std::string opt_params;
   std::string opt_stations;
   std::string opt_levels;
+  std::string opt_threads = "1";
 
 #ifdef UNIX
   struct winsize wsz;
@@ -194,6 +211,9 @@ bool parse_options(int argc, char* argv[])
   po::options_description desc("Available options", desc_width);
   desc.add_options()("help,h", "print out help message")("version,V", "display version number")(
       "infile,i", po::value(&options.infile), "input querydata")(
+      "mmap",
+      po::value(&options.memorymap)->default_value(true)->implicit_value(true),
+      "memory map the input file, --mmap=false reads it into memory")(
       "alltimes,T", po::bool_switch(&options.all_times), "for all times")(
       "allstations,W", po::bool_switch(&options.all_stations), "for all stations")(
       "allevels,Z", po::bool_switch(&options.all_levels), "for all levels")(
@@ -201,13 +221,19 @@ bool parse_options(int argc, char* argv[])
       po::bool_switch(&options.percentages),
       "print percentages instead of counts")(
       "distribution,d", po::bool_switch(&options.distribution), "print distribution of values")(
+      "exact,e",
+      po::bool_switch(&options.exact),
+      "count every distinct value for exact mode, median and distribution")(
       "ignore,I", po::value(&options.ignored_value), "ignore this value in statistics")(
       "bins,b", po::value(&options.bins), "max number of bins in the distribution")(
       "barsize,B", po::value(&options.barsize), "width of the bar distribution")(
       "times,t", po::value(&opt_stamps), "times to process")(
       "params,p", po::value(&opt_params), "parameters to process")(
       "stations,w", po::value(&opt_stations), "stations to process")(
-      "levels,z", po::value(&opt_levels), "levels to process");
+      "levels,z", po::value(&opt_levels), "levels to process")(
+      "threads,j",
+      po::value(&opt_threads),
+      "number of threads, or a percentage of the cores, 0 for all (default=1)");
 
   po::positional_options_description p;
   p.add("infile", 1);
@@ -231,7 +257,13 @@ bool parse_options(int argc, char* argv[])
                  "\n"
                  "Calculate statistics on querydata values.\n"
                  "\n"
-              << desc << std::endl;
+              << desc
+              << "\n"
+                 "Parameters with only a few distinct values are always counted exactly. For\n"
+                 "other parameters the mode, median and distribution are by default counted\n"
+                 "in a histogram of 65536 equal width bins, and are estimates only if two\n"
+                 "distinct values share a bin. Use option -e for exact values.\n"
+              << std::endl;
     return false;
   }
 
@@ -247,6 +279,7 @@ bool parse_options(int argc, char* argv[])
   options.these_params = parse_params(opt_params);
   options.these_stations = parse_stations(opt_stations);
   options.these_levels = parse_levels(opt_levels);
+  options.threadcount = ThreadTools::threadCount(opt_threads);
 
   // Check invalid values
 
@@ -270,9 +303,372 @@ bool parse_options(int argc, char* argv[])
   return true;
 }
 
+// ----------------------------------------------------------------------
+/*!
+ * \brief Counts of distinct values, as long as there are only a few of them
+ *
+ * An open addressing hash table of the float bit patterns, which is much
+ * cheaper than a node based map. Stops counting once the limit is exceeded,
+ * the counts until then remain available.
+ */
+// ----------------------------------------------------------------------
+
+class DistinctValues
+{
+ public:
+  explicit DistinctValues(std::size_t theLimit) : itsLimit(theLimit)
+  {
+    std::size_t capacity = 16;
+    while (capacity < 4 * theLimit)
+      capacity *= 2;
+    itsKeys.resize(capacity);
+    itsCounts.resize(capacity, 0);
+  }
+
+  bool overflow() const { return itsOverflow; }
+
+  void operator()(float theValue)
+  {
+    if (itsOverflow)
+      return;
+
+    if (theValue == 0)
+      theValue = 0;  // -0 and +0 are the same value
+
+    std::uint32_t key;
+    std::memcpy(&key, &theValue, sizeof(key));
+
+    const std::size_t mask = itsKeys.size() - 1;
+    for (std::size_t pos = (key * 2654435761U) & mask;; pos = (pos + 1) & mask)
+    {
+      if (itsCounts[pos] == 0)
+      {
+        if (++itsSize > itsLimit)
+        {
+          itsOverflow = true;
+          return;
+        }
+        itsKeys[pos] = key;
+        itsCounts[pos] = 1;
+        return;
+      }
+      if (itsKeys[pos] == key)
+      {
+        ++itsCounts[pos];
+        return;
+      }
+    }
+  }
+
+  void clear()
+  {
+    std::vector<std::uint32_t>().swap(itsKeys);
+    std::vector<std::size_t>().swap(itsCounts);
+  }
+
+  std::map<double, std::size_t> counts() const
+  {
+    std::map<double, std::size_t> ret;
+    for (std::size_t pos = 0; pos < itsCounts.size(); pos++)
+      if (itsCounts[pos] > 0)
+      {
+        float value;
+        std::memcpy(&value, &itsKeys[pos], sizeof(value));
+        ret[value] = itsCounts[pos];
+      }
+    return ret;
+  }
+
+ private:
+  std::size_t itsLimit;
+  std::size_t itsSize = 0;
+  bool itsOverflow = false;
+  std::vector<std::uint32_t> itsKeys;
+  std::vector<std::size_t> itsCounts;
+};
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Histogram with a fixed number of equal width bins
+ *
+ * The range adapts to the data by doubling the bin width as necessary,
+ * hence the bins are at most twice as wide as they would be if the
+ * range was known in advance. The bin edges are multiples of the bin
+ * width so that neighbouring bins can always be merged exactly.
+ *
+ * Each bin also remembers its value as long as it holds only one
+ * distinct value, so the counts are exact unless two distinct values
+ * share a bin. Data stored with a fixed precision rarely does.
+ */
+// ----------------------------------------------------------------------
+
+class Histogram
+{
+ public:
+  static const std::size_t bin_count = 65536;
+
+  // Make room for values in the given range
+  void reserve(double theMin, double theMax)
+  {
+    if (itsBins.empty())
+    {
+      itsBins.resize(bin_count, 0);
+      itsValues.resize(bin_count, 0);
+      const double magnitude = std::max(std::abs(theMin), std::abs(theMax));
+      itsWidth = std::max({(theMax - theMin) / (bin_count / 2),
+                           std::ldexp(magnitude, -40),
+                           static_cast<double>(std::numeric_limits<float>::min())});
+      itsFirst = static_cast<std::int64_t>(std::floor(theMin / itsWidth));
+      itsUsedMin = bin_count;
+      itsUsedMax = 0;
+    }
+
+    // Calculated in floating point since the bin numbers may be huge before merging
+    for (;;)
+    {
+      double lo = std::floor(theMin / itsWidth);
+      double hi = std::floor(theMax / itsWidth);
+      if (itsUsedMin <= itsUsedMax)
+      {
+        lo = std::min<double>(lo, itsFirst + static_cast<std::int64_t>(itsUsedMin));
+        hi = std::max<double>(hi, itsFirst + static_cast<std::int64_t>(itsUsedMax));
+      }
+      if (hi - lo < bin_count)
+      {
+        if (lo < itsFirst || hi >= itsFirst + static_cast<double>(bin_count))
+          shift(static_cast<std::int64_t>(lo));
+        return;
+      }
+      merge();
+    }
+  }
+
+  // The value must be within the reserved range
+  void operator()(double theValue, std::size_t theCount = 1)
+  {
+    std::int64_t pos = first_bin(theValue) - itsFirst;
+    pos = std::max<std::int64_t>(0, std::min<std::int64_t>(pos, bin_count - 1));
+    add(pos, theValue, theCount);
+    itsUsedMin = std::min<std::size_t>(itsUsedMin, pos);
+    itsUsedMax = std::max<std::size_t>(itsUsedMax, pos);
+  }
+
+  // Counts of the non-empty bins at their value or midpoint limited to the given range
+  std::map<double, std::size_t> counts(double theMin, double theMax) const
+  {
+    std::map<double, std::size_t> ret;
+    for (std::size_t i = itsUsedMin; i <= itsUsedMax && i < itsBins.size(); i++)
+      if (itsBins[i] > 0)
+      {
+        if (!std::isnan(itsValues[i]))
+          ret[itsValues[i]] += itsBins[i];
+        else
+        {
+          const double mid = (itsFirst + static_cast<double>(i) + 0.5) * itsWidth;
+          ret[std::max(theMin, std::min(theMax, mid))] += itsBins[i];
+        }
+      }
+    return ret;
+  }
+
+ private:
+  // Add values to a bin, which no longer has a single value if they differ
+  void add(std::size_t thePos, double theValue, std::size_t theCount)
+  {
+    if (itsBins[thePos] == 0)
+      itsValues[thePos] = theValue;
+    else if (itsValues[thePos] != theValue)
+      itsValues[thePos] = std::numeric_limits<double>::quiet_NaN();
+    itsBins[thePos] += theCount;
+  }
+
+  std::int64_t first_bin(double theValue) const
+  {
+    return static_cast<std::int64_t>(std::floor(theValue / itsWidth));
+  }
+
+  // Move the first bin so that the used bins stay in range
+  void shift(std::int64_t theFirst)
+  {
+    std::vector<std::size_t> bins(bin_count, 0);
+    std::vector<double> values(bin_count, 0);
+    for (std::size_t i = itsUsedMin; i <= itsUsedMax && i < itsBins.size(); i++)
+    {
+      bins[i + itsFirst - theFirst] = itsBins[i];
+      values[i + itsFirst - theFirst] = itsValues[i];
+    }
+    if (itsUsedMin <= itsUsedMax)
+    {
+      itsUsedMin += itsFirst - theFirst;
+      itsUsedMax += itsFirst - theFirst;
+    }
+    itsFirst = theFirst;
+    itsBins.swap(bins);
+    itsValues.swap(values);
+  }
+
+  // Double the width of the bins
+  void merge()
+  {
+    // Floor division so that the new edges are multiples of the new width
+    const std::int64_t first = (itsFirst >= 0 ? itsFirst / 2 : -((1 - itsFirst) / 2));
+    const std::int64_t offset = itsFirst - 2 * first;  // 0 or 1
+
+    std::vector<std::size_t> bins(bin_count, 0);
+    std::vector<double> values(bin_count, 0);
+    bins.swap(itsBins);
+    values.swap(itsValues);
+    for (std::size_t i = itsUsedMin; i <= itsUsedMax && i < bins.size(); i++)
+      if (bins[i] > 0)
+        add((i + offset) / 2, values[i], bins[i]);
+    if (itsUsedMin <= itsUsedMax)
+    {
+      itsUsedMin = (itsUsedMin + offset) / 2;
+      itsUsedMax = (itsUsedMax + offset) / 2;
+    }
+    itsFirst = first;
+    itsWidth *= 2;
+  }
+
+  std::vector<std::size_t> itsBins;
+  std::vector<double> itsValues;  // the value of the bin, NaN if it has several
+  double itsWidth = 0;
+  std::int64_t itsFirst = 0;  // index of the first bin in multiples of the width
+  std::size_t itsUsedMin = 0;
+  std::size_t itsUsedMax = 0;
+};
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Summary of a block of values
+ */
+// ----------------------------------------------------------------------
+
+struct BlockSummary
+{
+  std::size_t count = 0;
+  std::size_t valid = 0;
+  std::size_t missing = 0;
+  std::size_t nan = 0;
+  std::size_t inf = 0;
+  double sum = 0;
+  float min = std::numeric_limits<float>::infinity();
+  float max = -std::numeric_limits<float>::infinity();
+};
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Classify a block of values and reduce the valid ones
+ *
+ * The compiler does not vectorize the plain loop since the comparisons
+ * may trap, hence SSE2 is used explicitly when available. The per lane
+ * counters cannot overflow since blocks are small.
+ */
+// ----------------------------------------------------------------------
+
+void summarize(const float* theValues,
+               std::size_t theCount,
+               bool theIgnoring,
+               float theIgnoredValue,
+               BlockSummary& theSummary)
+{
+  std::size_t k = 0;
+#ifdef __SSE2__
+  const __m128 ignored = _mm_set1_ps(theIgnoredValue);
+  const __m128 missing = _mm_set1_ps(kFloatMissing);
+  const __m128 posinf = _mm_set1_ps(std::numeric_limits<float>::infinity());
+  const __m128 neginf = _mm_set1_ps(-std::numeric_limits<float>::infinity());
+  const __m128 absmask = _mm_castsi128_ps(_mm_set1_epi32(0x7fffffff));
+  const __m128 all = _mm_castsi128_ps(_mm_set1_epi32(-1));
+
+  __m128 vmin = posinf;
+  __m128 vmax = neginf;
+  __m128d sumlo = _mm_setzero_pd();
+  __m128d sumhi = _mm_setzero_pd();
+  __m128i ncount = _mm_setzero_si128();
+  __m128i nvalid = _mm_setzero_si128();
+  __m128i nmissing = _mm_setzero_si128();
+  __m128i nnan = _mm_setzero_si128();
+  __m128i ninf = _mm_setzero_si128();
+
+  for (; k + 4 <= theCount; k += 4)
+  {
+    const __m128 v = _mm_loadu_ps(theValues + k);
+    const __m128 counted = (theIgnoring ? _mm_cmpneq_ps(v, ignored) : all);
+    const __m128 isnan = _mm_and_ps(_mm_cmpunord_ps(v, v), counted);
+    const __m128 isinf = _mm_and_ps(_mm_cmpeq_ps(_mm_and_ps(v, absmask), posinf), counted);
+    const __m128 ismissing = _mm_and_ps(_mm_cmpeq_ps(v, missing), counted);
+    const __m128 isvalid = _mm_andnot_ps(_mm_or_ps(_mm_or_ps(isnan, isinf), ismissing), counted);
+
+    vmin = _mm_min_ps(vmin, _mm_or_ps(_mm_and_ps(isvalid, v), _mm_andnot_ps(isvalid, posinf)));
+    vmax = _mm_max_ps(vmax, _mm_or_ps(_mm_and_ps(isvalid, v), _mm_andnot_ps(isvalid, neginf)));
+
+    const __m128 vv = _mm_and_ps(isvalid, v);
+    sumlo = _mm_add_pd(sumlo, _mm_cvtps_pd(vv));
+    sumhi = _mm_add_pd(sumhi, _mm_cvtps_pd(_mm_movehl_ps(vv, vv)));
+
+    // Masks are -1 when set
+    ncount = _mm_sub_epi32(ncount, _mm_castps_si128(counted));
+    nvalid = _mm_sub_epi32(nvalid, _mm_castps_si128(isvalid));
+    nmissing = _mm_sub_epi32(nmissing, _mm_castps_si128(ismissing));
+    nnan = _mm_sub_epi32(nnan, _mm_castps_si128(isnan));
+    ninf = _mm_sub_epi32(ninf, _mm_castps_si128(isinf));
+  }
+
+  float lanes[4];
+  _mm_storeu_ps(lanes, vmin);
+  for (float lane : lanes)
+    theSummary.min = std::min(theSummary.min, lane);
+  _mm_storeu_ps(lanes, vmax);
+  for (float lane : lanes)
+    theSummary.max = std::max(theSummary.max, lane);
+
+  double sums[2];
+  _mm_storeu_pd(sums, _mm_add_pd(sumlo, sumhi));
+  theSummary.sum += sums[0] + sums[1];
+
+  auto lanesum = [](__m128i theCounts)
+  {
+    std::int32_t n[4];
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(n), theCounts);
+    return static_cast<std::size_t>(n[0]) + n[1] + n[2] + n[3];
+  };
+  theSummary.count += lanesum(ncount);
+  theSummary.valid += lanesum(nvalid);
+  theSummary.missing += lanesum(nmissing);
+  theSummary.nan += lanesum(nnan);
+  theSummary.inf += lanesum(ninf);
+#endif
+
+  for (; k < theCount; k++)
+  {
+    const float value = theValues[k];
+    if (theIgnoring && value == theIgnoredValue)
+      continue;
+    ++theSummary.count;
+    if (value == kFloatMissing)
+      ++theSummary.missing;
+    else if (std::isnan(value))
+      ++theSummary.nan;
+    else if (std::isinf(value))
+      ++theSummary.inf;
+    else
+    {
+      ++theSummary.valid;
+      theSummary.min = std::min(theSummary.min, value);
+      theSummary.max = std::max(theSummary.max, value);
+      theSummary.sum += value;
+    }
+  }
+}
+
 // ----------------------------------------------------------------------
 /*!
  * \brief Statistics collector
+ *
+ * Values are processed in blocks. The counts, extrema and sum are
+ * reduced for the whole block at once, only the distribution needs to
+ * look at the values one at a time.
  */
 // ----------------------------------------------------------------------
 
@@ -280,7 +676,8 @@ class Stats
 {
  public:
   Stats();
-  void operator()(double value);
+  void operator()(float value) { (*this)(&value, 1); }
+  void operator()(const float* values, std::size_t count);
   static std::string header();
   std::string report() const;
   void param(FmiParameterName theParam) { itsParam = theParam; }
@@ -288,6 +685,9 @@ class Stats
   const char* desc(double value) const;
 
  private:
+  void count_values(const float* values, std::size_t count, const BlockSummary& summary);
+  std::map<double, std::size_t> value_counts() const;
+
   FmiParameterName itsParam;                      // parameter name
   FmiInterpolationMethod itsInterpolationMethod;  // interpolation method (NearestPoint/other)
   std::size_t itsCount;                           // total count
@@ -298,9 +698,17 @@ class Stats
   double itsSum;
   double itsMin;
   double itsMax;
-  std::unordered_map<double, std::size_t> itsCounts;
+  std::unordered_map<double, std::size_t> itsCounts;  // exact mode
+  DistinctValues itsDistinct;                         // otherwise exact if only a few values
+  Histogram itsHistogram;                             // and estimated if more
 };
 
+// The largest number of distinct values printed individually in the distribution
+const std::size_t max_parameter_values = 50;
+
+// Number of values summarized at a time
+const std::size_t block_size = 4096;
+
 Stats::Stats()
     : itsParam(kFmiBadParameter),
       itsInterpolationMethod(kNearestPoint),
@@ -309,45 +717,101 @@ Stats::Stats()
       itsMissingCount(0),
       itsInfCount(0),
       itsNaNCount(0),
-      itsSum(std::numeric_limits<double>::quiet_NaN()),
+      itsSum(0),
       itsMin(std::numeric_limits<double>::quiet_NaN()),
-      itsMax(std::numeric_limits<double>::quiet_NaN())
+      itsMax(std::numeric_limits<double>::quiet_NaN()),
+      itsDistinct(std::max(options.bins, max_parameter_values))
 {
 }
 
-void Stats::operator()(double value)
+void Stats::operator()(const float* values, std::size_t count)
 {
-  if (value == options.ignored_value)
-    return;
+  // A value which is not representable as a float cannot be equal to any value
+  const bool ignoring = (static_cast<float>(options.ignored_value) == options.ignored_value);
+  const float ignored_value = (ignoring ? static_cast<float>(options.ignored_value) : 0);
 
-  ++itsCount;
-  if (value == kFloatMissing)
-    ++itsMissingCount;
-  if (std::isnan(value))
-    ++itsNaNCount;
-  if (std::isinf(value))
-    ++itsInfCount;
-  if (std::isfinite(value) && value != kFloatMissing)
+  for (std::size_t pos = 0; pos < count; pos += block_size)
   {
+    const std::size_t n = std::min(block_size, count - pos);
+
+    BlockSummary summary;
+    summarize(values + pos, n, ignoring, ignored_value, summary);
+
+    itsCount += summary.count;
+    itsMissingCount += summary.missing;
+    itsNaNCount += summary.nan;
+    itsInfCount += summary.inf;
+
+    if (summary.valid == 0)
+      continue;
+
     if (itsValidCount == 0)
     {
-      itsValidCount = 1;
-      itsMin = value;
-      itsMax = value;
-      itsSum = value;
+      itsMin = summary.min;
+      itsMax = summary.max;
     }
     else
     {
-      ++itsValidCount;
-      itsMin = std::min(itsMin, value);
-      itsMax = std::max(itsMax, value);
-      itsSum += value;
+      itsMin = std::min<double>(itsMin, summary.min);
+      itsMax = std::max<double>(itsMax, summary.max);
     }
+    itsValidCount += summary.valid;
+    itsSum += summary.sum;
+
+    count_values(values + pos, n, summary);
   }
+}
 
-  // Count only normal values
-  if (std::isfinite(value) && value != kFloatMissing)
-    ++itsCounts[value];
+// Count only normal values
+void Stats::count_values(const float* values, std::size_t count, const BlockSummary& summary)
+{
+  const bool ignoring = (static_cast<float>(options.ignored_value) == options.ignored_value);
+  const float ignored_value = static_cast<float>(options.ignored_value);
+
+  if (!options.exact && itsDistinct.overflow())
+    itsHistogram.reserve(summary.min, summary.max);
+
+  for (std::size_t i = 0; i < count; i++)
+  {
+    const float value = values[i];
+    if (!std::isfinite(value) || value == kFloatMissing || (ignoring && value == ignored_value))
+      continue;
+
+    if (options.exact)
+      ++itsCounts[value];
+    else if (!itsDistinct.overflow())
+    {
+      itsDistinct(value);
+      if (itsDistinct.overflow())
+      {
+        // Too many values to count exactly, continue with a histogram
+        itsHistogram.reserve(itsMin, itsMax);
+        for (const auto& value_count : itsDistinct.counts())
+          itsHistogram(value_count.first, value_count.second);
+        itsDistinct.clear();
+        itsHistogram(value);
+      }
+    }
+    else
+      itsHistogram(value);
+  }
+}
+
+// The counts of the values, or of the histogram bins when not counted exactly
+std::map<double, std::size_t> Stats::value_counts() const
+{
+  if (options.exact)
+  {
+    std::map<double, std::size_t> counts;
+    for (const auto& value_count : itsCounts)
+      counts.insert(std::make_pair(value_count.first, value_count.second));
+    return counts;
+  }
+
+  if (!itsDistinct.overflow())
+    return itsDistinct.counts();
+
+  return itsHistogram.counts(itsMin, itsMax);
 }
 
 std::string Stats::header()
@@ -1007,11 +1471,10 @@ std::string Stats::report() const
   double mode = std::numeric_limits<double>::quiet_NaN();
   double median = std::numeric_limits<double>::quiet_NaN();
 
-  // Convert unordered to ordered for stats
+  // Ordered counts for stats, the counts are exact unless there are many values
 
-  std::map<double, std::size_t> counts;
-  for (const auto& value_count : itsCounts)
-    counts.insert(std::make_pair(value_count.first, value_count.second));
+  const std::map<double, std::size_t> counts = value_counts();
+  const bool exact_counts = (options.exact || !itsDistinct.overflow());
 
   if (itsValidCount > 0)
   {
@@ -1079,9 +1542,7 @@ std::string Stats::report() const
     // happens only for enumerated values. 50 is enough for example to cover wind direction
     // in steps of 10 degrees.
 
-    const int max_parameter_values = 50;
-
-    if (counts.size() < options.bins || counts.size() < max_parameter_values)
+    if (exact_counts && (counts.size() < options.bins || counts.size() < max_parameter_values))
     {
       const int precision = estimate_precision(counts);
 
@@ -1216,6 +1677,165 @@ void set_level(NFmiFastQueryInfo& qi, float levelvalue)
                            " not available in the data");
 }
 
+// ----------------------------------------------------------------------
+/*!
+ * \brief Add the values of all locations for the current parameter, level and time
+ *
+ * Grids are extracted as a whole, which is much faster than iterating
+ * over the locations one value at a time.
+ */
+// ----------------------------------------------------------------------
+
+class SliceReader
+{
+ public:
+  void operator()(NFmiFastQueryInfo& qi, Stats& stats)
+  {
+    if (qi.IsGrid())
+    {
+      qi.Values(itsMatrix);
+      for (const auto& column : itsMatrix)
+        stats(column.data(), column.size());
+    }
+    else
+    {
+      itsValues.clear();
+      for (qi.ResetLocation(); qi.NextLocation();)
+        itsValues.push_back(qi.FloatValue());
+      stats(itsValues.data(), itsValues.size());
+    }
+  }
+
+ private:
+  NFmiDataMatrix<float> itsMatrix;
+  std::vector<float> itsValues;
+};
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Ordered output of independently calculated reports
+ *
+ * The tasks are run in parallel when so requested, each thread using its
+ * own copy of the iterator over the shared querydata. Each output is
+ * printed as soon as all the outputs before it have been printed, hence
+ * the order is the same as when running serially.
+ */
+// ----------------------------------------------------------------------
+
+class Reports
+{
+ public:
+  typedef std::function<void(NFmiFastQueryInfo&, std::ostream&)> Task;
+
+  explicit Reports(NFmiFastQueryInfo& qi) : itsInfo(qi) {}
+
+  // Fixed text such as a header
+  void text(const std::string& theText)
+  {
+    itsTexts.push_back(theText);
+    itsTasks.push_back(Task());
+  }
+
+  void task(const Task& theTask)
+  {
+    itsTexts.push_back(std::string());
+    itsTasks.push_back(theTask);
+  }
+
+  void print();
+
+ private:
+  void finish(std::size_t theIndex, const std::string& theOutput);
+
+  NFmiFastQueryInfo& itsInfo;
+  std::vector<std::string> itsTexts;
+  std::vector<Task> itsTasks;
+
+  std::mutex itsMutex;
+  std::vector<std::unique_ptr<NFmiFastQueryInfo>> itsFreeInfos;
+  std::vector<bool> itsFinished;
+  std::size_t itsNextOutput = 0;
+};
+
+void Reports::print()
+{
+  if (options.threadcount <= 1)
+  {
+    for (std::size_t i = 0; i < itsTasks.size(); i++)
+    {
+      if (itsTasks[i])
+        itsTasks[i](itsInfo, std::cout);
+      else
+        std::cout << itsTexts[i];
+    }
+    return;
+  }
+
+  itsFinished.assign(itsTasks.size(), false);
+  itsNextOutput = 0;
+
+  ThreadTools::parallelFor(itsTasks.size(),
+                           options.threadcount,
+                           [this](std::size_t i)
+                           {
+                             if (!itsTasks[i])
+                             {
+                               finish(i, itsTexts[i]);
+                               return;
+                             }
+
+                             std::unique_ptr<NFmiFastQueryInfo> info;
+                             {
+                               std::lock_guard<std::mutex> lock(itsMutex);
+                               if (!itsFreeInfos.empty())
+                               {
+                                 info = std::move(itsFreeInfos.back());
+                                 itsFreeInfos.pop_back();
+                               }
+                             }
+                             if (!info)
+                               info.reset(new NFmiFastQueryInfo(itsInfo));
+
+                             std::ostringstream out;
+                             itsTasks[i](*info, out);
+
+                             {
+                               std::lock_guard<std::mutex> lock(itsMutex);
+                               itsFreeInfos.push_back(std::move(info));
+                             }
+                             finish(i, out.str());
+                           });
+}
+
+// Store the output and print all outputs which are now next in order
+void Reports::finish(std::size_t theIndex, const std::string& theOutput)
+{
+  std::lock_guard<std::mutex> lock(itsMutex);
+  itsTexts[theIndex] = theOutput;
+  itsFinished[theIndex] = true;
+  for (; itsNextOutput < itsFinished.size() && itsFinished[itsNextOutput]; ++itsNextOutput)
+  {
+    std::cout << itsTexts[itsNextOutput];
+    std::string().swap(itsTexts[itsNextOutput]);
+  }
+  std::cout.flush();
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Parameter name for printing
+ */
+// ----------------------------------------------------------------------
+
+std::string param_name(NFmiFastQueryInfo& qi, FmiParameterName p)
+{
+  qi.Param(p);
+  std::string name = converter.ToString(qi.Param().GetParam()->GetIdent());
+  if (name.empty())
+    name = Fmi::to_string(qi.Param().GetParam()->GetIdent());
+  return name;
+}
+
 // ----------------------------------------------------------------------
 /*!
  * \brief Analysis over all locations and times
@@ -1233,46 +1853,58 @@ void stat_locations_times(NFmiFastQueryInfo& qi)
     std::cout << std::setw(param_width) << std::right << "Parameter" << std::setw(column_width)
               << "Level" << Stats::header() << std::endl;
 
+  Reports reports(qi);
+
   for (auto p : options.these_params)
   {
-    qi.Param(p);
-    std::string name = converter.ToString(qi.Param().GetParam()->GetIdent());
-    if (name.empty())
-      name = Fmi::to_string(qi.Param().GetParam()->GetIdent());
+    const std::string name = param_name(qi, p);
 
     if (ignore_param(name))
       continue;
 
     if (options.these_levels.empty())
     {
-      Stats stats;
-      stats.param(p);
-      stats.interpolation(qi.Param().GetParam()->InterpolationMethod());
-
-      for (qi.ResetLocation(); qi.NextLocation();)
-        for (qi.ResetLevel(); qi.NextLevel();)
-          for (qi.ResetTime(); qi.NextTime();)
-            stats(qi.FloatValue());
-      std::cout << std::setw(param_width) << name << stats.report() << std::endl;
+      reports.task(
+          [=](NFmiFastQueryInfo& info, std::ostream& out)
+          {
+            info.Param(p);
+
+            Stats stats;
+            stats.param(p);
+            stats.interpolation(info.Param().GetParam()->InterpolationMethod());
+
+            SliceReader read_slice;
+            for (info.ResetLevel(); info.NextLevel();)
+              for (info.ResetTime(); info.NextTime();)
+                read_slice(info, stats);
+            out << std::setw(param_width) << name << stats.report() << std::endl;
+          });
     }
     else
     {
       for (auto levelvalue : options.these_levels)
       {
-        set_level(qi, levelvalue);
-
-        Stats stats;
-        stats.param(p);
-        stats.interpolation(qi.Param().GetParam()->InterpolationMethod());
-
-        for (qi.ResetLocation(); qi.NextLocation();)
-          for (qi.ResetTime(); qi.NextTime();)
-            stats(qi.FloatValue());
-        std::cout << std::setw(param_width) << name << std::setw(column_width) << levelvalue
+        reports.task(
+            [=](NFmiFastQueryInfo& info, std::ostream& out)
+            {
+              info.Param(p);
+              set_level(info, levelvalue);
+
+              Stats stats;
+              stats.param(p);
+              stats.interpolation(info.Param().GetParam()->InterpolationMethod());
+
+              SliceReader read_slice;
+              for (info.ResetTime(); info.NextTime();)
+                read_slice(info, stats);
+              out << std::setw(param_width) << name << std::setw(column_width) << levelvalue
                   << stats.report() << std::endl;
+            });
       }
     }
   }
+
+  reports.print();
 }
 
 // ----------------------------------------------------------------------
@@ -1285,62 +1917,77 @@ void stat_locations_these_times(NFmiFastQueryInfo& qi)
 {
   int param_width = max_param_width(qi);
 
+  Reports reports(qi);
+
   for (auto p : options.these_params)
   {
-    qi.Param(p);
-    std::string name = converter.ToString(qi.Param().GetParam()->GetIdent());
-    if (name.empty())
-      name = Fmi::to_string(qi.Param().GetParam()->GetIdent());
+    const std::string name = param_name(qi, p);
 
     if (ignore_param(name))
       continue;
 
+    std::ostringstream header;
     if (options.these_levels.empty())
-      std::cout << std::setw(param_width) << std::right << "Parameter" << std::setw(18)
-                << std::right << "Time" << Stats::header() << std::endl;
+      header << std::setw(param_width) << std::right << "Parameter" << std::setw(18) << std::right
+             << "Time" << Stats::header() << std::endl;
     else
-      std::cout << std::setw(param_width) << std::right << "Parameter" << std::setw(column_width)
-                << "Level" << std::setw(18) << std::right << "Time" << Stats::header() << std::endl;
+      header << std::setw(param_width) << std::right << "Parameter" << std::setw(column_width)
+             << "Level" << std::setw(18) << std::right << "Time" << Stats::header() << std::endl;
+    reports.text(header.str());
 
     for (const auto& pt : options.these_times)
     {
-      NFmiMetTime t = pt;
-      qi.Time(t);
-
       if (options.these_levels.empty())
       {
-        Stats stats;
-        stats.param(p);
-        stats.interpolation(qi.Param().GetParam()->InterpolationMethod());
-
-        for (qi.ResetLocation(); qi.NextLocation();)
-          for (qi.ResetLevel(); qi.NextLevel();)
-            stats(qi.FloatValue());
-
-        std::cout << std::setw(param_width) << std::right << name << std::setw(18) << std::right
+        reports.task(
+            [=](NFmiFastQueryInfo& info, std::ostream& out)
+            {
+              NFmiMetTime t = pt;
+              info.Param(p);
+              info.Time(t);
+
+              Stats stats;
+              stats.param(p);
+              stats.interpolation(info.Param().GetParam()->InterpolationMethod());
+
+              SliceReader read_slice;
+              for (info.ResetLevel(); info.NextLevel();)
+                read_slice(info, stats);
+
+              out << std::setw(param_width) << std::right << name << std::setw(18) << std::right
                   << to_iso_string(t.PosixTime()) << stats.report() << std::endl;
+            });
       }
       else
       {
         for (auto levelvalue : options.these_levels)
         {
-          set_level(qi, levelvalue);
-
-          Stats stats;
-          stats.param(p);
-          stats.interpolation(qi.Param().GetParam()->InterpolationMethod());
-
-          for (qi.ResetLocation(); qi.NextLocation();)
-            stats(qi.FloatValue());
-
-          std::cout << std::setw(param_width) << std::right << name << std::setw(column_width)
+          reports.task(
+              [=](NFmiFastQueryInfo& info, std::ostream& out)
+              {
+                NFmiMetTime t = pt;
+                info.Param(p);
+                info.Time(t);
+                set_level(info, levelvalue);
+
+                Stats stats;
+                stats.param(p);
+                stats.interpolation(info.Param().GetParam()->InterpolationMethod());
+
+                SliceReader read_slice;
+                read_slice(info, stats);
+
+                out << std::setw(param_width) << std::right << name << std::setw(column_width)
                     << levelvalue << std::setw(18) << std::right << to_iso_string(t.PosixTime())
                     << stats.report() << std::endl;
+              });
         }
       }
     }
-    std::cout << std::endl;
+    reports.text("\n");
   }
+
+  reports.print();
 }
 
 // ----------------------------------------------------------------------
@@ -1351,40 +1998,48 @@ void stat_locations_these_times(NFmiFastQueryInfo& qi)
 
 void stat_these_stations_these_times(NFmiFastQueryInfo& qi)
 {
+  Reports reports(qi);
+
   for (auto p : options.these_params)
   {
-    std::cout << std::setw(20) << "" << Stats::header() << std::endl;
+    std::ostringstream header;
+    header << std::setw(20) << "" << Stats::header() << std::endl;
+    reports.text(header.str());
 
-    qi.Param(p);
-    std::string name = converter.ToString(qi.Param().GetParam()->GetIdent());
-    if (name.empty())
-      name = Fmi::to_string(qi.Param().GetParam()->GetIdent());
+    const std::string name = param_name(qi, p);
     if (ignore_param(name))
       continue;
 
-    std::cout << name << std::endl;
+    reports.text(name + "\n");
 
     for (int wmo : options.these_stations)
     {
-      qi.Location(wmo);
-
-      std::cout << "  " << station_header(qi) << std::endl;
-
-      for (const auto& pt : options.these_times)
-      {
-        NFmiMetTime t = pt;
-        qi.Time(t);
-
-        Stats stats;
-        stats.param(p);
-        stats.interpolation(qi.Param().GetParam()->InterpolationMethod());
-
-        for (qi.ResetLevel(); qi.NextLevel();)
-          stats(qi.FloatValue());
-        std::cout << "    " << to_iso_string(t.PosixTime()) << ' ' << stats.report() << std::endl;
-      }
+      reports.task(
+          [=](NFmiFastQueryInfo& info, std::ostream& out)
+          {
+            info.Param(p);
+            info.Location(wmo);
+
+            out << "  " << station_header(info) << std::endl;
+
+            for (const auto& pt : options.these_times)
+            {
+              NFmiMetTime t = pt;
+              info.Time(t);
+
+              Stats stats;
+              stats.param(p);
+              stats.interpolation(info.Param().GetParam()->InterpolationMethod());
+
+              for (info.ResetLevel(); info.NextLevel();)
+                stats(info.FloatValue());
+              out << "    " << to_iso_string(t.PosixTime()) << ' ' << stats.report() << std::endl;
+            }
+          });
     }
   }
+
+  reports.print();
 }
 
 // ----------------------------------------------------------------------
@@ -1401,31 +2056,38 @@ void stat_these_stations_times(NFmiFastQueryInfo& qi)
   std::cout << std::setw(station_width) << std::right << "Station" << std::setw(param_width + 1)
             << std::right << "Parameter" << Stats::header() << std::endl;
 
+  Reports reports(qi);
+
   for (auto p : options.these_params)
   {
-    qi.Param(p);
-    std::string name = converter.ToString(qi.Param().GetParam()->GetIdent());
-    if (name.empty())
-      name = Fmi::to_string(qi.Param().GetParam()->GetIdent());
+    const std::string name = param_name(qi, p);
 
     if (ignore_param(name))
       continue;
 
     for (int wmo : options.these_stations)
     {
-      qi.Location(wmo);
-
-      Stats stats;
-      stats.param(p);
-      stats.interpolation(qi.Param().GetParam()->InterpolationMethod());
-
-      for (qi.ResetLevel(); qi.NextLevel();)
-        for (qi.ResetTime(); qi.NextTime();)
-          stats(qi.FloatValue());
-      std::cout << std::setw(station_width) << std::right << station_header(qi)
-                << std::setw(param_width + 1) << std::right << name << stats.report() << std::endl;
+      reports.task(
+          [=](NFmiFastQueryInfo& info, std::ostream& out)
+          {
+            info.Param(p);
+            info.Location(wmo);
+
+            Stats stats;
+            stats.param(p);
+            stats.interpolation(info.Param().GetParam()->InterpolationMethod());
+
+            for (info.ResetLevel(); info.NextLevel();)
+              for (info.ResetTime(); info.NextTime();)
+                stats(info.FloatValue());
+            out << std::setw(station_width) << std::right << station_header(info)
+                << std::setw(param_width + 1) << std::right << name << stats.report()
+                << std::endl;
+          });
     }
   }
+
+  reports.print();
 }
 
 // ----------------------------------------------------------------------
@@ -1439,8 +2101,8 @@ int run(int argc, char* argv[])
   if (!parse_options(argc, argv))
     return 0;
 
-  NFmiQueryData qd(options.infile);
-  NFmiFastQueryInfo qi(&qd);
+  std::unique_ptr<NFmiQueryData> qd = QueryDataReader::read(options.infile, options.memorymap);
+  NFmiFastQueryInfo qi(qd.get());
 
   // Some initial checks
 
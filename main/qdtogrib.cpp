@@ -1,6 +1,7 @@
 // Example encoding program.
 
 #include "GribTools.h"
+#include "ThreadTools.h"
 #include <boost/filesystem/operations.hpp>
 #include <boost/lexical_cast.hpp>
 #include <boost/program_options.hpp>
@@ -12,13 +13,16 @@
 #include <newbase/NFmiFileString.h>
 #include <newbase/NFmiGrid.h>
 #include <newbase/NFmiQueryData.h>
+#include <algorithm>
 #include <cassert>
 #include <cstdio>
 #include <cstdlib>
 #include <grib_api.h>
 #include <map>
+#include <memory>
 #include <optional>
 #include <string>
+#include <vector>
 
 #ifdef UNIX
 #include <sys/ioctl.h>
@@ -44,6 +48,7 @@ struct Options
   std::string infile = "-";        // -i --infile
   std::string outfile = "-";       // -o --outfile
   std::string packing = "";        // -p --packing, empty implies use ECCODES default
+  unsigned int threadcount = 1;    // -j --threads
   bool grib1 = false;              // -1, --grib1
   bool grib2 = false;              // -2, --grib2
   bool split = false;              // -s --split
@@ -262,6 +267,7 @@ bool parse_options(int argc, char *argv[])
 
   std::string params;
   std::string level;
+  std::string threads = "1";
 #ifdef UNIX
   std::string config = "/usr/share/smartmet/formats/grib.conf";
 #else
@@ -287,7 +293,8 @@ bool parse_options(int argc, char *argv[])
       "outfile,o", po::value(&options.outfile), "output grib file")(
       "grib1,1", po::bool_switch(&options.grib1), "output GRIB1")(
       "grib2,2", po::bool_switch(&options.grib2), "output GRIB2 (the default)")(
-      "packing,p", po::value(&options.packing), "packing method (grid_simple, grid_ieee, grid_second_order, grid_jpeg etc)")(
+      "packing,p", po::value(&options.packing), "packing method (grid_simple, grid_ieee, grid_second_order, grid_jpeg, grid_ccsds etc)")(
+      "threads,j", po::value(&threads), "number of encoding threads, or a percentage of the cores, 0 for all (default=1)")(
       "centre,C", po::value(&options.centre), "originating centre (default = none)")(
       "subcentre,S", po::value(&options.subcentre), "subcentre (default = 0)")(
       "list-centres,L", po::bool_switch(&options.list_centres), "list known centres")(
@@ -358,6 +365,13 @@ bool parse_options(int argc, char *argv[])
   if (!options.grib1)
     options.grib2 = true;
 
+  // CCSDS (AEC) compression is defined only for GRIB2
+
+  if (options.grib1 && options.packing == "grid_ccsds")
+    throw std::runtime_error("Packing grid_ccsds is available only for GRIB2");
+
+  options.threadcount = ThreadTools::threadCount(threads);
+
   // Read the configuration file
 
   if (!config.empty())
@@ -865,11 +879,15 @@ void set_level(grib_handle *gribHandle, const NFmiLevel &theLevelFromData)
 
 // ----------------------------------------------------------------------
 
-// kopioidaan kurrentti aika/param/level hila annettuun grib-handeliin.
-bool copy_values(NFmiFastQueryInfo &theInfo,
-                 grib_handle *gribHandle,
-                 std::vector<double> &theValueArray,
-                 bool use_minutes)
+// ----------------------------------------------------------------------
+/*!
+ * \brief The lead time of the current time step in minutes or hours
+ *
+ * A negative lead time means the time step cannot be encoded.
+ */
+// ----------------------------------------------------------------------
+
+long lead_time(NFmiFastQueryInfo &theInfo, bool use_minutes)
 {
   // NOTE: This froecastTime part is not edition independent
   const NFmiMetTime oTime = get_origintime(theInfo);
@@ -878,18 +896,54 @@ bool copy_values(NFmiFastQueryInfo &theInfo,
   long mdiff = vTime.DifferenceInMinutes(oTime);
 
   // Note that we round up and origin time is rounded down in set_times
-  long diff = (use_minutes ? mdiff : std::ceil(mdiff / 60.0));
+  return (use_minutes ? mdiff : std::ceil(mdiff / 60.0));
+}
 
-  // Forecast time cannot be negative. This may happen for example
-  // when using the SmartMet Editor. We simply ignore such lines.
+// ----------------------------------------------------------------------
+/*!
+ * \brief Convert a grid to GRIB units
+ *
+ * The values are first gathered from the data, and then converted in a
+ * separate loop over the contiguous buffer.
+ *
+ * \return True if there are missing values
+ */
+// ----------------------------------------------------------------------
+
+bool convert_values(NFmiFastQueryInfo &theInfo,
+                    float theScale,
+                    float theOffset,
+                    std::vector<float> &theBuffer,
+                    std::vector<double> &theValueArray)
+{
+  theBuffer.resize(theValueArray.size());
 
-  if (diff < 0)
+  std::size_t n = 0;
+  for (theInfo.ResetLocation(); theInfo.NextLocation();)
+    theBuffer[n++] = theInfo.FloatValue();
+
+  const float *values = theBuffer.data();
+  double *output = theValueArray.data();
+
+  int missing = 0;
+  for (std::size_t i = 0; i < n; i++)
   {
-    if (options.verbose)
-      std::cout << "Ignoring timestep " << vTime << " for having a negative lead time" << std::endl;
-    return false;
+    const bool ok = (values[i] != kFloatMissing);
+    output[i] = (ok ? (values[i] - theOffset) / theScale : 9999);  // GRIB1 missing value by default
+    missing |= !ok;
   }
+  return missing != 0;
+}
+
+// ----------------------------------------------------------------------
 
+// kopioidaan kurrentti aika/param/level hila annettuun grib-handeliin.
+void copy_values(NFmiFastQueryInfo &theInfo,
+                 grib_handle *gribHandle,
+                 std::vector<double> &theValueArray,
+                 long diff,
+                 bool use_minutes)
+{
   if (options.grib1)
   {
     if (!use_minutes)
@@ -913,31 +967,81 @@ bool copy_values(NFmiFastQueryInfo &theInfo,
   float offset = 0.0;
   get_conversion(param.GetIdent(), &scale, &offset);
 
-  int i = 0;
-  bool missingValuesExist = false;
-
-  for (theInfo.ResetLocation(); theInfo.NextLocation();)
-  {
-    float value = theInfo.FloatValue();
-    if (value != kFloatMissing)
-    {
-      theValueArray[i] = (value - offset) / scale;
-    }
-    else
-    {
-      theValueArray[i] = 9999;  // GRIB1 missing value by default
-      missingValuesExist = true;
-    }
-    i++;
-  }
+  std::vector<float> buffer;
+  const bool missingValuesExist = convert_values(theInfo, scale, offset, buffer, theValueArray);
 
   if (missingValuesExist)
   {
     grib_set_long(gribHandle, "bitmapPresent", 1);
   }
   grib_set_double_array(gribHandle, "values", &theValueArray[0], theValueArray.size());
+}
 
-  return true;
+// ----------------------------------------------------------------------
+/*!
+ * \brief A single GRIB message to be written
+ */
+// ----------------------------------------------------------------------
+
+struct Message
+{
+  unsigned long level;
+  unsigned long param;
+  unsigned long time;
+  long diff;  // lead time
+};
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Establish the messages to be written in output order
+ */
+// ----------------------------------------------------------------------
+
+std::vector<Message> plan_messages(NFmiFastQueryInfo &qi, bool use_minutes)
+{
+  std::vector<Message> messages;
+
+  for (qi.ResetLevel(); qi.NextLevel();)
+  {
+    for (qi.ResetParam(); qi.NextParam(false);)
+    {
+      if (ignore_param(qi.Param().GetParamIdent()))
+      {
+        // if(options.verbose)
+        std::cout << "Ignoring parameter " << qi.Param().GetParamName().CharPtr() << " ("
+                  << qi.Param().GetParamIdent() << ")" << std::endl;
+      }
+      else
+      {
+        for (qi.ResetTime(); qi.NextTime();)
+        {
+          const long diff = lead_time(qi, use_minutes);
+
+          // Forecast time cannot be negative. This may happen for example
+          // when using the SmartMet Editor. We simply ignore such lines.
+
+          if (diff < 0)
+          {
+            if (options.verbose)
+              std::cout << "Ignoring timestep " << qi.ValidTime()
+                        << " for having a negative lead time" << std::endl;
+          }
+          else
+            messages.push_back(Message{qi.LevelIndex(), qi.ParamIndex(), qi.TimeIndex(), diff});
+        }
+      }
+    }
+  }
+  return messages;
+}
+
+// ----------------------------------------------------------------------
+
+void select_message(NFmiFastQueryInfo &theInfo, const Message &theMessage)
+{
+  theInfo.LevelIndex(theMessage.level);
+  theInfo.ParamIndex(theMessage.param);
+  theInfo.TimeIndex(theMessage.time);
 }
 
 // ----------------------------------------------------------------------
@@ -979,6 +1083,52 @@ void write_grib(NFmiFastQueryInfo &theInfo, grib_handle *gribHandle, const std::
   fclose(out);
 }
 
+// ----------------------------------------------------------------------
+/*!
+ * \brief Encode a message on a copy of the template handle
+ *
+ * Safe to call from several threads, since only copies of the shared
+ * info and template handle are modified.
+ */
+// ----------------------------------------------------------------------
+
+grib_handle *encode_message(const NFmiFastQueryInfo &theInfo,
+                            grib_handle *theTemplate,
+                            const Message &theMessage,
+                            bool use_minutes)
+{
+  NFmiFastQueryInfo info(theInfo);
+  select_message(info, theMessage);
+
+  grib_handle *gribHandle = grib_handle_clone(theTemplate);
+  if (gribHandle == nullptr)
+    throw std::runtime_error("ERROR: Unable to clone grib handle");
+
+  try
+  {
+    std::vector<double> values(info.SizeLocations());
+    copy_values(info, gribHandle, values, theMessage.diff, use_minutes);
+    return gribHandle;
+  }
+  catch (...)
+  {
+    grib_handle_delete(gribHandle);
+    throw;
+  }
+}
+
+// ----------------------------------------------------------------------
+
+void write_message(NFmiFastQueryInfo &theInfo, grib_handle *gribHandle, FILE *out, int option_flags)
+{
+  if (options.dump)
+    grib_dump_content(gribHandle, stdout, "serialize", option_flags, nullptr);
+  if (!options.split)
+    write_grib(out, gribHandle);
+  else
+    write_grib(theInfo, gribHandle, options.outfile);
+}
+
 // ----------------------------------------------------------------------
 
 int run(const int argc, char *argv[])
@@ -1040,32 +1190,62 @@ int run(const int argc, char *argv[])
     if (options.verbose)
       std::cout << "Smallest timestep = " << timestep << std::endl;
 
-    for (qi.ResetLevel(); qi.NextLevel();)
+    const std::vector<Message> messages = plan_messages(qi, use_minutes);
+
+    if (options.threadcount <= 1)
+    {
+      for (const auto &message : messages)
+      {
+        select_message(qi, message);
+        copy_values(qi, gribHandle, valueArray, message.diff, use_minutes);
+        write_message(qi, gribHandle, out, option_flags);
+      }
+    }
+    else
     {
-      for (qi.ResetParam(); qi.NextParam(false);)
+      // Each message is encoded on a fresh copy of the template handle so
+      // that the result does not depend on which thread encoded it. The
+      // messages are written in order once the whole batch is ready.
+
+      const std::size_t batchsize = 4 * options.threadcount;
+      std::vector<grib_handle *> handles(batchsize, nullptr);
+
+      auto delete_handles = [&handles]()
       {
-        if (ignore_param(qi.Param().GetParamIdent()))
+        for (auto &h : handles)
         {
-          // if(options.verbose)
-          std::cout << "Ignoring parameter " << qi.Param().GetParamName().CharPtr() << " ("
-                    << qi.Param().GetParamIdent() << ")" << std::endl;
+          if (h)
+            grib_handle_delete(h);
+          h = nullptr;
         }
-        else
+      };
+
+      try
+      {
+        for (std::size_t batch = 0; batch < messages.size(); batch += batchsize)
         {
-          for (qi.ResetTime(); qi.NextTime();)
+          const std::size_t count = std::min(batchsize, messages.size() - batch);
+          ThreadTools::parallelFor(count,
+                                   options.threadcount,
+                                   [&](std::size_t i)
+                                   {
+                                     handles[i] = encode_message(
+                                         qi, gribHandle, messages[batch + i], use_minutes);
+                                   });
+
+          for (std::size_t i = 0; i < count; i++)
           {
-            if (copy_values(qi, gribHandle, valueArray, use_minutes))
-            {
-              if (options.dump)
-                grib_dump_content(gribHandle, stdout, "serialize", option_flags, nullptr);
-              if (!options.split)
-                write_grib(out, gribHandle);
-              else
-                write_grib(qi, gribHandle, options.outfile);
-            }
+            select_message(qi, messages[batch + i]);
+            write_message(qi, handles[i], out, option_flags);
           }
+          delete_handles();
         }
       }
+      catch (...)
+      {
+        delete_handles();
+        throw;
+      }
     }
   }
   catch (...)
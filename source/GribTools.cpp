@@ -8,8 +8,14 @@
 #include <macgyver/StringConversion.h>
 #include <newbase/NFmiCommentStripper.h>
 
+#include <algorithm>
 #include <iostream>
 #include <stdexcept>
+#include <vector>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 // ----------------------------------------------------------------------
 // Dump the given namespace attributes
@@ -153,6 +159,133 @@ void gset(grib_handle *g, const char *name, const std::string &value)
     throw std::runtime_error(std::string("Failed to set ") + name + " to value " + value);
 }
 
+// ----------------------------------------------------------------------
+// Unpacking of decoded values
+// ----------------------------------------------------------------------
+
+namespace
+{
+// Number of rows converted at a time before being scattered to the columns of the grid
+const std::size_t unpack_block_rows = 32;
+
+// Convert to floats replacing missing values. The compiler does not vectorize the
+// plain loop since the comparison may trap, hence SSE2 is used explicitly when
+// available. Both versions give identical results.
+void convert_values(const double *theValues,
+                    float *theResult,
+                    std::size_t theCount,
+                    double theMissingValue)
+{
+  std::size_t k = 0;
+#ifdef __SSE2__
+  const __m128d missing = _mm_set1_pd(theMissingValue);
+  const __m128d replacement = _mm_set1_pd(kFloatMissing);
+  for (; k + 4 <= theCount; k += 4)
+  {
+    __m128d lo = _mm_loadu_pd(theValues + k);
+    __m128d hi = _mm_loadu_pd(theValues + k + 2);
+    const __m128d lomask = _mm_cmpeq_pd(lo, missing);
+    const __m128d himask = _mm_cmpeq_pd(hi, missing);
+    lo = _mm_or_pd(_mm_and_pd(lomask, replacement), _mm_andnot_pd(lomask, lo));
+    hi = _mm_or_pd(_mm_and_pd(himask, replacement), _mm_andnot_pd(himask, hi));
+    _mm_storeu_ps(theResult + k, _mm_movelh_ps(_mm_cvtpd_ps(lo), _mm_cvtpd_ps(hi)));
+  }
+#endif
+  for (; k < theCount; k++)
+  {
+    const double value = theValues[k];
+    theResult[k] = (value == theMissingValue ? kFloatMissing : static_cast<float>(value));
+  }
+}
+}  // namespace
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Copy decoded GRIB values to a grid
+ *
+ * The matrix must already have the size of the grid. Missing values are
+ * replaced by kFloatMissing. The scanning mode flags are
+ *
+ *   128 Points scan in -i direction
+ *    64 Points scan in +j direction
+ *    32 Adjacent points in j direction are consecutive
+ *    16 Adjacent rows scan in opposite directions
+ *
+ * The values are converted to floats a block of rows (or columns) at a
+ * time with SIMD instructions and then copied to their final places,
+ * instead of calculating the grid index of each value separately.
+ */
+// ----------------------------------------------------------------------
+
+void UnpackGribValues(const double *theValues,
+                      std::size_t theCount,
+                      long theScanningMode,
+                      double theMissingValue,
+                      NFmiDataMatrix<float> &theMatrix)
+{
+  if ((theScanningMode & 0x0F) != 0 || theScanningMode < 0 || theScanningMode > 255)
+    throw std::runtime_error("Scanning mode " + Fmi::to_string(theScanningMode) +
+                             " not yet implemented.");
+
+  const std::size_t nx = theMatrix.NX();
+  const std::size_t ny = theMatrix.NY();
+  if (theCount != nx * ny)
+    throw std::runtime_error("Grid size " + Fmi::to_string(nx) + "x" + Fmi::to_string(ny) +
+                             " does not match the number of values " + Fmi::to_string(theCount));
+  if (theCount == 0)
+    return;
+
+  const bool negative_i = ((theScanningMode & 128) != 0);
+  const bool positive_j = ((theScanningMode & 64) != 0);
+  const bool j_consecutive = ((theScanningMode & 32) != 0);
+  const bool alternating = ((theScanningMode & 16) != 0);
+
+  if (j_consecutive)
+  {
+    // Columns are stored consecutively just like in NFmiDataMatrix
+    std::vector<float> column(ny);
+    for (std::size_t c = 0; c < nx; c++)
+    {
+      const std::size_t i = (negative_i ? nx - 1 - c : c);
+      const bool reverse = (!positive_j != (alternating && c % 2 == 1));
+      float *result = &theMatrix[i][0];
+      if (!reverse)
+        convert_values(theValues + c * ny, result, ny, theMissingValue);
+      else
+      {
+        convert_values(theValues + c * ny, column.data(), ny, theMissingValue);
+        std::reverse_copy(column.begin(), column.end(), result);
+      }
+    }
+    return;
+  }
+
+  // Rows are stored consecutively and must be transposed to columns
+  std::vector<float> block(unpack_block_rows * nx);
+  for (std::size_t row0 = 0; row0 < ny; row0 += unpack_block_rows)
+  {
+    const std::size_t rows = std::min(unpack_block_rows, ny - row0);
+    convert_values(theValues + row0 * nx, block.data(), rows * nx, theMissingValue);
+
+    if (negative_i || alternating)
+      for (std::size_t r = 0; r < rows; r++)
+        if (negative_i != (alternating && (row0 + r) % 2 == 1))
+          std::reverse(block.begin() + r * nx, block.begin() + (r + 1) * nx);
+
+    for (std::size_t i = 0; i < nx; i++)
+    {
+      float *result = &theMatrix[i][0];
+      const float *source = block.data() + i;
+      if (positive_j)
+        for (std::size_t r = 0; r < rows; r++)
+          result[row0 + r] = source[r * nx];
+      else
+        for (std::size_t r = 0; r < rows; r++)
+          result[ny - 1 - row0 - r] = source[r * nx];
+    }
+  }
+}
+
 // ----------------------------------------------------------------------
 // Parameter change item
 // ----------------------------------------------------------------------
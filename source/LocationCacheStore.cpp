@@ -0,0 +1,261 @@
+// ======================================================================
+/*!
+ * \file
+ * \brief Implementation of the LocationCacheStore class
+ */
+// ======================================================================
+
+#include "LocationCacheStore.h"
+#include <fmt/format.h>
+#include <macgyver/FileSystem.h>
+#include <newbase/NFmiArea.h>
+#include <newbase/NFmiGrid.h>
+
+#include <cstdint>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <stdexcept>
+
+using namespace std;
+
+namespace
+{
+const char gMagic[8] = {'Q', 'D', 'L', 'C', 'A', 'C', 'H', 'E'};
+const uint32_t gVersion = 1;
+
+// Fixed size part of the file, followed by the key padded to 8 bytes and the points
+struct FileHeader
+{
+  char magic[8];
+  uint32_t version;
+  uint32_t keylength;
+  uint64_t size;
+};
+
+size_t padded(size_t theLength)
+{
+  return (theLength + 7) / 8 * 8;
+}
+
+// FNV-1a, chosen since unlike std::hash it is stable between runs and builds
+uint64_t hash_key(const string &theKey)
+{
+  uint64_t hash = 14695981039346656037ULL;
+  for (unsigned char ch : theKey)
+  {
+    hash ^= ch;
+    hash *= 1099511628211ULL;
+  }
+  return hash;
+}
+
+// Unlike MakeGridStr in the converters the description includes the extent of the area
+string grid_description(const NFmiGrid &theGrid)
+{
+  const NFmiArea *area = theGrid.Area();
+  const NFmiRect rect = area->WorldRect();
+  return fmt::format("{}:{},{}:{},{},{},{}",
+                     area->ProjStr(),
+                     theGrid.XNumber(),
+                     theGrid.YNumber(),
+                     rect.Left(),
+                     rect.Bottom(),
+                     rect.Right(),
+                     rect.Top());
+}
+
+}  // namespace
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Set the directory for saving and loading the caches
+ *
+ * An empty directory disables the disk storage.
+ */
+// ----------------------------------------------------------------------
+
+void LocationCacheStore::directory(const string &theDirectory)
+{
+  boost::mutex::scoped_lock lock(itsMutex);
+  itsDirectory = theDirectory;
+  if (!itsDirectory.empty() && !filesystem::is_directory(itsDirectory))
+    throw runtime_error("Location cache directory '" + itsDirectory + "' does not exist");
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Return the cache for the given grid pair
+ *
+ * The cache is loaded from disk or calculated on first use.
+ */
+// ----------------------------------------------------------------------
+
+const LocationCache &LocationCacheStore::find(const NFmiGrid &theSourceGrid,
+                                              const NFmiGrid &theTargetGrid)
+{
+  const string key = grid_description(theTargetGrid) + "+" + grid_description(theSourceGrid);
+
+  LocationCache *cache = nullptr;
+  {
+    boost::mutex::scoped_lock lock(itsMutex);
+    auto &ptr = itsCaches[key];
+    if (!ptr)
+      ptr.reset(new LocationCache);
+    cache = ptr.get();
+  }
+
+  // Other threads needing the same cache wait here while it is being made
+  std::call_once(cache->itsOnceFlag,
+                 [&]()
+                 {
+                   const size_t size = theTargetGrid.XNumber() * theTargetGrid.YNumber();
+                   if (load(*cache, key, size))
+                     return;
+                   calculate(*cache, theSourceGrid, theTargetGrid);
+                   save(*cache, key);
+                 });
+
+  return *cache;
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Calculate the target grid points in source grid coordinates
+ */
+// ----------------------------------------------------------------------
+
+void LocationCacheStore::calculate(LocationCache &theCache,
+                                   const NFmiGrid &theSourceGrid,
+                                   const NFmiGrid &theTargetGrid) const
+{
+  NFmiGrid sourceGrid(theSourceGrid);
+  NFmiGrid targetGrid(theTargetGrid);
+  NFmiDataMatrix<NFmiLocationCache> matrix;
+  sourceGrid.CalcLatlonCachePoints(targetGrid, matrix);
+
+  const size_t nx = targetGrid.XNumber();
+  const size_t ny = targetGrid.YNumber();
+  theCache.itsMemory.resize(2 * nx * ny);
+  for (size_t j = 0; j < ny; j++)
+    for (size_t i = 0; i < nx; i++)
+    {
+      const NFmiPoint &point = matrix[i][j].itsGridPoint;
+      theCache.itsMemory[2 * (j * nx + i)] = point.X();
+      theCache.itsMemory[2 * (j * nx + i) + 1] = point.Y();
+    }
+
+  theCache.itsSize = nx * ny;
+  theCache.itsPoints = theCache.itsMemory.data();
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief The file for the cache of the given grid pair
+ */
+// ----------------------------------------------------------------------
+
+string LocationCacheStore::filename(const string &theKey) const
+{
+  return fmt::format("{}/locationcache_{:016x}.bin", itsDirectory, hash_key(theKey));
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Memory map a previously saved cache
+ *
+ * \return False if there is no valid file for the grid pair
+ */
+// ----------------------------------------------------------------------
+
+bool LocationCacheStore::load(LocationCache &theCache, const string &theKey, size_t theSize) const
+{
+  if (itsDirectory.empty())
+    return false;
+
+  const string file = filename(theKey);
+  if (!filesystem::exists(file))
+    return false;
+
+  try
+  {
+    boost::iostreams::mapped_file_source mapping(file);
+    const char *data = mapping.data();
+    const size_t offset = sizeof(FileHeader) + padded(theKey.size());
+    const size_t expected = offset + 2 * theSize * sizeof(double);
+
+    if (mapping.size() != expected)
+      return false;
+
+    FileHeader header;
+    memcpy(&header, data, sizeof(header));
+    if (memcmp(header.magic, gMagic, sizeof(gMagic)) != 0 || header.version != gVersion ||
+        header.keylength != theKey.size() || header.size != theSize ||
+        theKey.compare(0, string::npos, data + sizeof(FileHeader), theKey.size()) != 0)
+      return false;
+
+    theCache.itsFile = mapping;
+    theCache.itsSize = theSize;
+    theCache.itsPoints = reinterpret_cast<const double *>(theCache.itsFile.data() + offset);
+    return true;
+  }
+  catch (std::exception &e)
+  {
+    cerr << "Warning: failed to read location cache '" << file << "': " << e.what() << endl;
+    return false;
+  }
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Save the cache if a directory has been set
+ *
+ * The file is written under a temporary name and then renamed, so that
+ * simultaneous runs never see a partial file. Failing to save is not an
+ * error, the cache is merely recalculated next time.
+ */
+// ----------------------------------------------------------------------
+
+void LocationCacheStore::save(const LocationCache &theCache, const string &theKey) const
+{
+  if (itsDirectory.empty())
+    return;
+
+  const string file = filename(theKey);
+  filesystem::path tmp;
+  try
+  {
+    tmp = Fmi::unique_path(file + "_%%%%%%%%");
+
+    FileHeader header;
+    memcpy(header.magic, gMagic, sizeof(gMagic));
+    header.version = gVersion;
+    header.keylength = static_cast<uint32_t>(theKey.size());
+    header.size = theCache.itsSize;
+
+    const string padding(padded(theKey.size()) - theKey.size(), '\0');
+
+    ofstream out(tmp.c_str(), ios::binary | ios::out);
+    if (!out)
+      throw runtime_error("opening '" + tmp.string() + "' for writing failed");
+    out.write(reinterpret_cast<const char *>(&header), sizeof(header));
+    out << theKey << padding;
+    out.write(reinterpret_cast<const char *>(theCache.itsPoints),
+              2 * theCache.itsSize * sizeof(double));
+    out.close();
+    if (!out)
+      throw runtime_error("writing '" + tmp.string() + "' failed");
+
+    filesystem::rename(tmp, file);
+  }
+  catch (std::exception &e)
+  {
+    cerr << "Warning: failed to save location cache '" << file << "': " << e.what() << endl;
+    std::error_code ec;
+    if (!tmp.empty())
+      filesystem::remove(tmp, ec);
+  }
+}
+
+// ======================================================================
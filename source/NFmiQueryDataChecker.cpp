@@ -23,6 +23,7 @@
 #include "NFmiQueryDataChecker.h"
 #include "NFmiDataModifierDataChecking.h"
 #include "NFmiParamCheckData.h"
+#include "ThreadTools.h"
 
 #include <newbase/NFmiDataModifier.h>
 #include <newbase/NFmiDataModifierMinMax.h>
@@ -33,6 +34,126 @@
 #include <fstream>
 #include <set>
 #include <time.h>
+#include <utility>
+
+namespace
+{
+// Tarkistettava parametri ja sen indeksi ohjausdatassa
+typedef std::pair<NFmiDataIdent, int> CheckedParam;
+
+// Tarkistettava paikkaindeksi, tai negatiivisella indeksillä hilaan interpoloitava piste
+struct CheckedPoint
+{
+  CheckedPoint(long theIndex, const NFmiPoint& theLatLon) : itsIndex(theIndex), itsLatLon(theLatLon)
+  {
+  }
+  long itsIndex;
+  NFmiPoint itsLatLon;
+};
+
+// Yhden parametrin yhden pistelohkon tulokset
+struct BlockResult
+{
+  BlockResult(void)
+      : itsCheckedCount(0),
+        itsMissingCount(0),
+        itsStraightCount(0),
+        itsFirstValue(kFloatMissing),
+        itsLastValue(kFloatMissing),
+        itsMinValue(kFloatMissing),
+        itsMaxValue(kFloatMissing)
+  {
+  }
+  long itsCheckedCount;
+  long itsMissingCount;
+  long itsStraightCount;  // lohkon sisällä edellisen kanssa samat arvot
+  float itsFirstValue;
+  float itsLastValue;
+  float itsMinValue;
+  float itsMaxValue;
+};
+
+// Tarkistettavat pisteet paikkojen tarkistustavan mukaan:
+// 0=kaikki, 1=halutut locationit, 2=random locationindex
+std::vector<CheckedPoint> CheckedPoints(NFmiFastQueryInfo& theInfo,
+                                        int theLocationCheckType,
+                                        NFmiLocationBag& theCheckedLocations,
+                                        const std::vector<int>& theRandomLocationIndexies)
+{
+  std::vector<CheckedPoint> points;
+  const NFmiPoint dummy;
+  switch (theLocationCheckType)
+  {
+    case 0:
+      for (theInfo.ResetLocation(); theInfo.NextLocation();)
+        points.push_back(CheckedPoint(theInfo.LocationIndex(), dummy));
+      break;
+    case 1:
+      for (theCheckedLocations.Reset(); theCheckedLocations.Next();)
+      {
+        if (theInfo.IsGrid())
+          points.push_back(CheckedPoint(-1, theCheckedLocations.Location()->GetLocation()));
+        else if (theInfo.Location(*theCheckedLocations.Location()))
+          points.push_back(CheckedPoint(theInfo.LocationIndex(), dummy));
+      }
+      break;
+    case 2:
+      for (std::size_t i = 0; i < theRandomLocationIndexies.size(); i++)
+        if (theInfo.LocationIndex(theRandomLocationIndexies[i]))
+          points.push_back(CheckedPoint(theInfo.LocationIndex(), dummy));
+      break;
+  }
+  return points;
+}
+
+// Tarkistettavien aikojen indeksit datassa
+std::vector<unsigned long> CheckedTimeIndexes(NFmiFastQueryInfo& theInfo,
+                                              NFmiTimeDescriptor& theCheckedTimeDescriptor)
+{
+  std::vector<unsigned long> times;
+  for (theCheckedTimeDescriptor.Reset(); theCheckedTimeDescriptor.Next();)
+    if (theInfo.Time(theCheckedTimeDescriptor.Time()))
+      times.push_back(theInfo.TimeIndex());
+  return times;
+}
+
+// Käy läpi pisteet [theFirst,theLast) infon nykyiselle parametrille. Ajan pitää
+// juosta sisimmässä loopissa, että voidaan tarkistaa 'suoraa' dataa!!!!
+void CheckBlock(NFmiFastQueryInfo& theInfo,
+                const std::vector<CheckedPoint>& thePoints,
+                std::size_t theFirst,
+                std::size_t theLast,
+                const std::vector<unsigned long>& theTimes,
+                BlockResult& theResult)
+{
+  NFmiDataModifierMinMax minMax;
+  minMax.Clear();
+  for (std::size_t i = theFirst; i < theLast; i++)
+  {
+    const CheckedPoint& point = thePoints[i];
+    if (point.itsIndex >= 0)
+      theInfo.LocationIndex(point.itsIndex);
+    for (std::size_t j = 0; j < theTimes.size(); j++)
+    {
+      theInfo.TimeIndex(theTimes[j]);
+      const float value = (point.itsIndex >= 0 ? theInfo.FloatValue()
+                                               : theInfo.InterpolatedValue(point.itsLatLon));
+      if (theResult.itsCheckedCount == 0)
+        theResult.itsFirstValue = value;
+      else if (value == theResult.itsLastValue)
+        theResult.itsStraightCount++;
+      theResult.itsLastValue = value;
+      theResult.itsCheckedCount++;
+      if (value == kFloatMissing)
+        theResult.itsMissingCount++;
+      minMax.Calculate(value);
+    }
+  }
+  theResult.itsMinValue = minMax.MinValue();
+  theResult.itsMaxValue = minMax.MaxValue();
+}
+
+}  // namespace
 
 //--------------------------------------------------------
 // Constructor/Destructor
@@ -50,7 +171,8 @@ NFmiQueryDataChecker::NFmiQueryDataChecker(NFmiOhjausData* theOhjausData)
       itsInfo(0),
       itsRandomLocationIndexies(),
       fDoIndexRandomizing(true),
-      itsOhjausData(theOhjausData)
+      itsOhjausData(theOhjausData),
+      itsThreadCount(1)
 {
 }
 NFmiQueryDataChecker::~NFmiQueryDataChecker(void)
@@ -70,12 +192,8 @@ bool NFmiQueryDataChecker::DoTotalCheck(void)
 
   if (fDoIndexRandomizing)
     MakeRandomLocationIndexies();
-  if (itsCheckList & 1)
-    status &= DoMissingDataCheck();
-  if (itsCheckList & 2)
-    status &= DoStraightDataCheck();
-  if (itsCheckList & 4)
-    status &= DoOutOfLimitsDataCheck();
+  if (itsCheckList & (1 + 2 + 4))
+    status &= GoThroughData();
 
   return status;
 }
@@ -214,92 +332,103 @@ void NFmiQueryDataChecker::CheckOnlyWantedTimes(bool value)
 }
 
 //--------------------------------------------------------
-// DoMissingDataCheck
+// GoThroughData
 //--------------------------------------------------------
-bool NFmiQueryDataChecker::DoMissingDataCheck(void)
+// Kaikki halutut tarkistukset tehdään yhdellä läpikäynnillä. Parametrit ja
+// niiden tarkistettavien pisteiden lohkot käydään läpi rinnakkain, ja lohkojen
+// tulokset yhdistetään järjestyksessä, joten tulokset ovat samat kuin jos
+// jokainen tarkistus käytäisiin läpi erikseen yhdellä säikeellä.
+// ei käy läpi leveleitä!!!!
+bool NFmiQueryDataChecker::GoThroughData(void)
 {
-  NFmiDataModifierDataMissing modifier;
-  itsCheckOperationIndex = 1;
+  if (!itsInfo)
+    return false;
 
-  return GoThroughData(&modifier);
-}
-//--------------------------------------------------------
-// DoStraightDataCheck
-//--------------------------------------------------------
-bool NFmiQueryDataChecker::DoStraightDataCheck(void)
-{
-  NFmiDataModifierDataStraight modifier;
-  itsCheckOperationIndex = 2;
-  return GoThroughData(&modifier);
-}
-//--------------------------------------------------------
-// DoOutOfLimitsDataCheck
-//--------------------------------------------------------
-bool NFmiQueryDataChecker::DoOutOfLimitsDataCheck(void)
-{
-  NFmiDataModifierMinMax modifier;
-  itsCheckOperationIndex = 4;
-  return GoThroughData(&modifier);
-}
+  itsInfo->First();
 
-// ei käy läpi leveleitä!!!!
-bool NFmiQueryDataChecker::GoThroughData(NFmiDataModifier* theModifier)
-{
-  if (itsInfo)
+  // parametrien pitää olla ulommaisia loopissa!!!!
+  std::vector<CheckedParam> params;
+  for (itsParamBag.Reset(); itsParamBag.Next(false);)
   {
-    itsInfo->First();
-    for (itsParamBag.Reset();
-         itsParamBag.Next(false);)  // parametrien pitää olla ulommaisia loopissa!!!!
+    if (itsParamBag.Current(false)->IsActive())
     {
-      if (itsParamBag.Current(false)->IsActive())
+      if (itsInfo->Param(*itsParamBag.Current(false)))
       {
-        if (itsInfo->Param(*itsParamBag.Current(false)))
+        int parId = itsInfo->Param().GetParamIdent();
+        int paramIdIndex = itsOhjausData->ParamIdIndex(parId);
+        if (paramIdIndex >= 0)  // tämän pitää onnistua!!!
+          params.push_back(CheckedParam(*itsParamBag.Current(false), paramIdIndex));
+        else
         {
-          int parId = itsInfo->Param().GetParamIdent();
-          int itsParamIdIndex = itsOhjausData->ParamIdIndex(parId);
-          if (itsParamIdIndex >= 0)  // tämän pitää onnistua!!!
-          {
-            theModifier->Clear();
-            switch (itsLocationCheckType)
-            {
-              case 0:  // kaikki
-                GoThroughAllLocationsDataInTime(theModifier);
-                break;
-              case 1:  // halutut locationit
-                GoThroughLocationDataDataInTime(theModifier);
-                break;
-              case 2:  // random locationindex
-                GoThroughRandomLocationsDataInTime(theModifier);
-                break;
-            }
-
-            float result = theModifier->CalculationResult();
-            switch (itsCheckOperationIndex)
-            {
-              case 1:  // missing data
-                itsOhjausData->itsParamIdCheckList[itsParamIdIndex]
-                    .itsCheckedParamMissingDataMaxProcent = result;
-                break;
-              case 2:  // straight data
-                itsOhjausData->itsParamIdCheckList[itsParamIdIndex]
-                    .itsCheckedParamStraightDataMaxProcent = result;
-                break;
-              case 4:  // out-of-limit
-                CheckOutOfLimitsTerms(itsOhjausData->itsParamIdCheckList[itsParamIdIndex],
-                                      theModifier);
-                break;
-            }
-          }
-          else
-          {
-            // mitä ihmettä, ei sen tänne pitänyt mennä (VIRHETILANNE!!!)
-          }
+          // mitä ihmettä, ei sen tänne pitänyt mennä (VIRHETILANNE!!!)
         }
       }
     }
-    return true;
   }
-  return false;
+
+  const std::vector<CheckedPoint> points = CheckedPoints(
+      *itsInfo, itsLocationCheckType, itsCheckedLocations, itsRandomLocationIndexies);
+  const std::vector<unsigned long> times = CheckedTimeIndexes(*itsInfo, itsCheckedTimeDescriptor);
+
+  // Lohkoja tehdään vain sen verran, että kaikilla säikeillä riittää työtä,
+  // koska jokainen lohko tarvitsee oman kopion infosta.
+  std::size_t blocks = 1;
+  if (itsThreadCount > 1 && !params.empty())
+    blocks = (4 * itsThreadCount + params.size() - 1) / params.size();
+  blocks = std::max<std::size_t>(1, std::min(blocks, points.size()));
+  const std::size_t blocksize = (points.size() + blocks - 1) / blocks;
+
+  std::vector<BlockResult> results(params.size() * blocks);
+  ThreadTools::parallelFor(results.size(),
+                           itsThreadCount,
+                           [&](std::size_t task)
+                           {
+                             const std::size_t first = (task % blocks) * blocksize;
+                             const std::size_t last = std::min(first + blocksize, points.size());
+                             if (first >= last)
+                               return;
+                             NFmiFastQueryInfo info(*itsInfo);
+                             info.Param(params[task / blocks].first);
+                             CheckBlock(info, points, first, last, times, results[task]);
+                           });
+
+  for (std::size_t i = 0; i < params.size(); i++)
+  {
+    // lohkot yhdistetään kuten modifierit olisivat käyneet arvot läpi järjestyksessä
+    long checkedCount = 0;
+    long missingCount = 0;
+    long straightCount = 0;
+    float lastValue = kFloatMissing;
+    NFmiDataModifierMinMax minMax;
+    minMax.Clear();
+    for (std::size_t j = 0; j < blocks; j++)
+    {
+      const BlockResult& result = results[i * blocks + j];
+      if (result.itsCheckedCount == 0)
+        continue;
+      checkedCount += result.itsCheckedCount;
+      missingCount += result.itsMissingCount;
+      straightCount += result.itsStraightCount + (result.itsFirstValue == lastValue ? 1 : 0);
+      lastValue = result.itsLastValue;
+      // puuttuvien lohkojen min ja max ovat modifierin alkuarvoja, ei dataa
+      if (result.itsMissingCount < result.itsCheckedCount)
+      {
+        minMax.Calculate(result.itsMinValue);
+        minMax.Calculate(result.itsMaxValue);
+      }
+    }
+
+    NFmiParamCheckData& checkData = itsOhjausData->itsParamIdCheckList[params[i].second];
+    if (itsCheckList & 1)  // missing data
+      checkData.itsCheckedParamMissingDataMaxProcent =
+          NFmiDataModifierDataChecking::Percentage(missingCount, checkedCount);
+    if (itsCheckList & 2)  // straight data
+      checkData.itsCheckedParamStraightDataMaxProcent =
+          NFmiDataModifierDataChecking::Percentage(straightCount, checkedCount);
+    if (itsCheckList & 4)  // out-of-limit
+      CheckOutOfLimitsTerms(checkData, &minMax);
+  }
+  return true;
 }
 
 // asetetaan varoitus ja error flagit päälle, jos tapahtunut rajojen yli/alituksia
@@ -334,76 +463,6 @@ void NFmiQueryDataChecker::CheckOutOfLimitsTerms(NFmiParamCheckData& theParamChe
   }
 }
 
-// HUOM!! tätä funktiota pitää kutsua GoThroughData():sta
-bool NFmiQueryDataChecker::GoThroughLocationDataDataInTime(NFmiDataModifier* theModifier)
-{
-  for (itsCheckedLocations.Reset(); itsCheckedLocations.Next();)
-  {
-    if (itsInfo->IsGrid())
-    {
-      // ajan pitää juosta sisimmässä loopissa, että voidaan tarkistaa 'suoraa' dataa!!!!
-      for (itsCheckedTimeDescriptor.Reset(); itsCheckedTimeDescriptor.Next();)
-      {
-        if (itsInfo->Time(itsCheckedTimeDescriptor.Time()))
-        {
-          theModifier->Calculate(
-              itsInfo->InterpolatedValue(itsCheckedLocations.Location()->GetLocation()));
-        }
-      }
-    }
-    else if (itsInfo->Location(*itsCheckedLocations.Location()))
-    {
-      // ajan pitää juosta sisimmässä loopissa, että voidaan tarkistaa 'suoraa' dataa!!!!
-      for (itsCheckedTimeDescriptor.Reset(); itsCheckedTimeDescriptor.Next();)
-      {
-        if (itsInfo->Time(itsCheckedTimeDescriptor.Time()))
-        {
-          theModifier->Calculate(itsInfo->FloatValue());
-        }
-      }
-    }
-  }
-  return true;
-}
-
-// HUOM!! tätä funktiota pitää kutsua GoThroughData():sta
-bool NFmiQueryDataChecker::GoThroughRandomLocationsDataInTime(NFmiDataModifier* theModifier)
-{
-  int locationIndexSize = itsRandomLocationIndexies.size();
-  for (int i = 0; i < locationIndexSize; i++)
-  {
-    if (itsInfo->LocationIndex(itsRandomLocationIndexies[i]))
-    {
-      // ajan pitää juosta sisimmässä loopissa, että voidaan tarkistaa 'suoraa' dataa!!!!
-      for (itsCheckedTimeDescriptor.Reset(); itsCheckedTimeDescriptor.Next();)
-      {
-        if (itsInfo->Time(itsCheckedTimeDescriptor.Time()))
-        {
-          theModifier->Calculate(itsInfo->FloatValue());
-        }
-      }
-    }
-  }
-  return true;
-}
-
-// HUOM!! tätä funktiota pitää kutsua GoThroughData():sta
-bool NFmiQueryDataChecker::GoThroughAllLocationsDataInTime(NFmiDataModifier* theModifier)
-{
-  for (itsInfo->ResetLocation(); itsInfo->NextLocation();)
-  {
-    // ajan pitää juosta sisimmässä loopissa, että voidaan tarkistaa 'suoraa' dataa!!!!
-    for (itsCheckedTimeDescriptor.Reset(); itsCheckedTimeDescriptor.Next();)
-    {
-      if (itsInfo->Time(itsCheckedTimeDescriptor.Time()))
-      {
-        theModifier->Calculate(itsInfo->FloatValue());
-      }
-    }
-  }
-  return true;
-}
-
 // HUOM!!! laita tämä viimeiseksi niin varoitukset tulevat loppuun.
 // tyhjentää ja tayttää paikkaindex listan
 // Käytetään apuna set luokkaa, että ei tule samoja indeksejä vahingossa.
@@ -10,10 +10,13 @@
 #endif
 
 #include "QueryDataManager.h"
+#include "QueryDataReader.h"
 
 #include <newbase/NFmiFileSystem.h>
 #include <newbase/NFmiQueryData.h>
 
+#include <algorithm>
+#include <limits>
 #include <sstream>
 #include <stdexcept>
 
@@ -58,7 +61,8 @@ bool locationvalid(NFmiFastQueryInfo& theQD)
  */
 // ----------------------------------------------------------------------
 
-QueryDataManager::QueryDataManager() : itsSearchPath(), itsData(), itsCurrentData()
+QueryDataManager::QueryDataManager()
+    : itsSearchPath(), itsMultiMode(false), itsMemoryMap(true), itsData(), itsCurrentData()
 {
   itsCurrentData = itsData.end();
 }
@@ -78,6 +82,7 @@ QueryDataManager::~QueryDataManager()
   {
     delete it->get<1>();  // querydata
     delete it->get<2>();  // fastqueryinfo
+    delete it->get<3>();  // station index
   }
 }
 
@@ -114,7 +119,7 @@ void QueryDataManager::searchpath(const std::string& theSearchPath)
 
 void QueryDataManager::addfile(const std::string& theFile)
 {
-  itsData.push_back(value_type(theFile, 0));
+  itsData.push_back(value_type(theFile, 0, 0, 0));
 }
 
 // ----------------------------------------------------------------------
@@ -183,15 +188,7 @@ void QueryDataManager::setstation(int theWmoNumber)
 
   for (storage_type::iterator it = itsData.begin(); it != itsData.end(); ++it)
   {
-    if (!it->get<1>())
-    {
-      std::string filename = NFmiFileSystem::FileComplete(it->get<0>(), itsSearchPath);
-      NFmiQueryData* qd = new NFmiQueryData(filename);
-      it->get<1>() = qd;
-      it->get<2>() = new NFmiFastQueryInfo(qd);
-    }
-
-    if (it->get<2>()->Location(theWmoNumber))
+    if (require(it).Location(theWmoNumber))
     {
       itsCurrentData = it;
       return;
@@ -214,41 +211,93 @@ void QueryDataManager::setstation(int theWmoNumber)
 // ----------------------------------------------------------------------
 
 void QueryDataManager::setpoint(const NFmiPoint& theLonLat, double theMaxDistance)
+{
+  setposition(locate(theLonLat, theMaxDistance));
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Set location based on a position found earlier
+ *
+ * This will throw if the position was not found in any data file.
+ *
+ * \param thePosition The position from locate()
+ */
+// ----------------------------------------------------------------------
+
+void QueryDataManager::setposition(const Position& thePosition)
 {
   // Set "no data" condition until we've found the coordinate
   itsCurrentData = itsData.end();
 
-  double smallest_distance = -1;
+  if (thePosition.file < 0)
+  {
+    std::ostringstream os;
+    os << "Coordinate (" << thePosition.lonlat.X() << ',' << thePosition.lonlat.Y()
+       << ") is too far (" << thePosition.distance / 1000 << " km) from the data";
+    throw std::runtime_error(os.str());
+  }
+
+  itsCurrentData = itsData.begin() + thePosition.file;
+  itsCurrentData->get<2>()->LocationIndex(thePosition.location);
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Find a coordinate from the data files
+ *
+ * The first file with a location within the maximum distance is used,
+ * as in setpoint.
+ *
+ * \param theLonLat The coordinate
+ * \param theMaxDistance The maximum distance
+ * \return The position, possibly not found
+ */
+// ----------------------------------------------------------------------
+
+QueryDataManager::Position QueryDataManager::locate(const NFmiPoint& theLonLat,
+                                                    double theMaxDistance)
+{
+  Position position;
+  position.lonlat = theLonLat;
 
   for (storage_type::iterator it = itsData.begin(); it != itsData.end(); ++it)
-  {
-    if (!it->get<1>())
-    {
-      std::string filename = NFmiFileSystem::FileComplete(it->get<0>(), itsSearchPath);
-      NFmiQueryData* qd = new NFmiQueryData(filename);
-      it->get<1>() = qd;
-      it->get<2>() = new NFmiFastQueryInfo(qd);
-    }
+    if (find(it, position, theMaxDistance))
+      break;
 
-    NFmiFastQueryInfo& qi = *(it->get<2>());
+  return position;
+}
 
-    if (qi.NearestLocation(theLonLat, theMaxDistance))
-    {
-      itsCurrentData = it;
-      return;
-    }
+// ----------------------------------------------------------------------
+/*!
+ * \brief Find many coordinates from the data files
+ *
+ * The results are the same as when locating each coordinate separately,
+ * but all coordinates are searched from one file before moving on to
+ * the next one.
+ *
+ * \param theLonLats The coordinates
+ * \param theMaxDistance The maximum distance
+ * \return The positions in the same order as the coordinates
+ */
+// ----------------------------------------------------------------------
 
-    qi.NearestPoint(theLonLat);
-    double distance = qi.Location()->Distance(theLonLat);
-    if (smallest_distance < 0)
-      smallest_distance = distance;
-    else
-      smallest_distance = std::min(smallest_distance, distance);
+std::vector<QueryDataManager::Position> QueryDataManager::locate(
+    const std::vector<NFmiPoint>& theLonLats, double theMaxDistance)
+{
+  std::vector<Position> positions(theLonLats.size());
+  for (std::size_t i = 0; i < theLonLats.size(); i++)
+    positions[i].lonlat = theLonLats[i];
+
+  std::size_t remaining = positions.size();
+  for (storage_type::iterator it = itsData.begin(); it != itsData.end() && remaining > 0; ++it)
+  {
+    for (Position& position : positions)
+      if (position.file < 0 && find(it, position, theMaxDistance))
+        --remaining;
   }
-  std::ostringstream os;
-  os << "Coordinate (" << theLonLat.X() << ',' << theLonLat.Y() << ") is too far ("
-     << smallest_distance / 1000 << " km) from the data";
-  throw std::runtime_error(os.str());
+
+  return positions;
 }
 
 // ----------------------------------------------------------------------
@@ -267,15 +316,7 @@ std::set<int> QueryDataManager::stations()
 
   for (storage_type::iterator it = itsData.begin(); it != itsData.end(); ++it)
   {
-    if (!it->get<1>())
-    {
-      std::string filename = NFmiFileSystem::FileComplete(it->get<0>(), itsSearchPath);
-      NFmiQueryData* qd = new NFmiQueryData(filename);
-      it->get<1>() = qd;
-      it->get<2>() = new NFmiFastQueryInfo(qd);
-    }
-
-    NFmiFastQueryInfo& qi = *(it->get<2>());
+    NFmiFastQueryInfo& qi = require(it);
 
     qi.ResetLocation();
     while (qi.NextLocation())
@@ -314,29 +355,42 @@ std::map<double, int> QueryDataManager::nearest(const NFmiPoint& theLonLat,
 
   for (storage_type::iterator it = itsData.begin(); it != itsData.end(); ++it)
   {
-    if (!it->get<1>())
-    {
-      std::string filename = NFmiFileSystem::FileComplete(it->get<0>(), itsSearchPath);
-      NFmiQueryData* qd = new NFmiQueryData(filename);
-      it->get<1>() = qd;
-      it->get<2>() = new NFmiFastQueryInfo(qd);
-    }
-
-    NFmiFastQueryInfo& qi = *(it->get<2>());
+    NFmiFastQueryInfo& qi = require(it);
 
     // Won't find nearest points from grids
     if (qi.IsGrid())
       continue;
 
-    qi.ResetLocation();
-    while (qi.NextLocation())
+    const StationIndex& stations = index(it);
+
+    // Ask for more candidates until enough of them pass the checks, or there are no more.
+    // The candidates are inserted in location order as when looping over all locations.
+
+    std::size_t count = (theMaxNumber > 0 ? theMaxNumber : stations.size());
+    ReturnType found;
+    while (true)
     {
-      int wmo = qi.Location()->GetIdent();
-      double dist = qi.Location()->Distance(theLonLat);
-      if (dist <= theMaxDistance)
-        if (!theCheckingFlag || locationvalid(qi))
-          ret.insert(std::map<double, int>::value_type(dist, wmo));
+      std::vector<unsigned long> candidates = stations.nearest(theLonLat, count, theMaxDistance);
+      const bool exhausted = (candidates.size() < count);
+      std::sort(candidates.begin(), candidates.end());
+
+      found.clear();
+      for (unsigned long idx : candidates)
+      {
+        qi.LocationIndex(idx);
+        int wmo = qi.Location()->GetIdent();
+        double dist = qi.Location()->Distance(theLonLat);
+        if (dist <= theMaxDistance)
+          if (!theCheckingFlag || locationvalid(qi))
+            found.insert(ReturnType::value_type(dist, wmo));
+      }
+
+      if (exhausted || theMaxNumber <= 0 || found.size() >= static_cast<std::size_t>(theMaxNumber))
+        break;
+      count *= 2;
     }
+
+    ret.insert(found.begin(), found.end());
   }
 
   if (theMaxNumber > 0 && ret.size() > static_cast<unsigned long>(theMaxNumber))
@@ -352,4 +406,85 @@ std::map<double, int> QueryDataManager::nearest(const NFmiPoint& theLonLat,
   return ret;
 }
 
+// ----------------------------------------------------------------------
+/*!
+ * \brief Return the query info of the given file, reading it if necessary
+ */
+// ----------------------------------------------------------------------
+
+NFmiFastQueryInfo& QueryDataManager::require(storage_type::iterator it)
+{
+  if (!it->get<1>())
+  {
+    std::string filename = NFmiFileSystem::FileComplete(it->get<0>(), itsSearchPath);
+    NFmiQueryData* qd = QueryDataReader::read(filename, itsMemoryMap).release();
+    it->get<1>() = qd;
+    it->get<2>() = new NFmiFastQueryInfo(qd);
+  }
+  return *it->get<2>();
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Return the station index of the given file, building it if necessary
+ */
+// ----------------------------------------------------------------------
+
+const StationIndex& QueryDataManager::index(storage_type::iterator it)
+{
+  if (!it->get<3>())
+    it->get<3>() = new StationIndex(require(it));
+  return *it->get<3>();
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Search a coordinate from the given file
+ *
+ * Grids are searched with NearestLocation, point data with the station
+ * index. If the coordinate is not found, the distance of the position
+ * is updated to the smallest distance to the data so far.
+ *
+ * \return True if the position was found
+ */
+// ----------------------------------------------------------------------
+
+bool QueryDataManager::find(storage_type::iterator it, Position& thePosition, double theMaxDistance)
+{
+  NFmiFastQueryInfo& qi = require(it);
+
+  if (qi.IsGrid())
+  {
+    if (qi.NearestLocation(thePosition.lonlat, theMaxDistance))
+    {
+      thePosition.file = static_cast<int>(it - itsData.begin());
+      thePosition.location = qi.LocationIndex();
+      return true;
+    }
+    qi.NearestPoint(thePosition.lonlat);
+  }
+  else
+  {
+    const double unlimited = std::numeric_limits<double>::infinity();
+    const std::vector<unsigned long> nearest = index(it).nearest(thePosition.lonlat, 1, unlimited);
+    if (nearest.empty())
+      return false;
+
+    qi.LocationIndex(nearest.front());
+    if (qi.Location()->Distance(thePosition.lonlat) <= theMaxDistance)
+    {
+      thePosition.file = static_cast<int>(it - itsData.begin());
+      thePosition.location = nearest.front();
+      return true;
+    }
+  }
+
+  const double distance = qi.Location()->Distance(thePosition.lonlat);
+  if (thePosition.distance < 0)
+    thePosition.distance = distance;
+  else
+    thePosition.distance = std::min(thePosition.distance, distance);
+  return false;
+}
+
 // ======================================================================
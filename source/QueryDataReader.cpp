@@ -0,0 +1,151 @@
+// ======================================================================
+/*!
+ * \file
+ * \brief Implementation of namespace QueryDataReader
+ */
+// ======================================================================
+
+#include "QueryDataReader.h"
+#include <newbase/NFmiQueryData.h>
+#include <newbase/NFmiQueryInfo.h>
+
+#include <fcntl.h>
+#include <filesystem>
+#include <fstream>
+#include <stdexcept>
+#include <unistd.h>
+
+using namespace std;
+
+namespace QueryDataReader
+{
+// ----------------------------------------------------------------------
+/*!
+ * \brief Test whether the input can be memory mapped
+ *
+ * A directory is accepted too, since newbase then reads the newest file
+ * in it, which is always a regular file.
+ *
+ * \param theFile The input file, "-" for standard input
+ * \return True if the input is a regular file or a directory
+ */
+// ----------------------------------------------------------------------
+
+bool mappable(const string &theFile)
+{
+  if (theFile.empty() || theFile == "-")
+    return false;
+
+  std::error_code ec;
+  const auto status = filesystem::status(theFile, ec);
+  if (ec)
+    return false;
+  return (filesystem::is_regular_file(status) || filesystem::is_directory(status));
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Read querydata, memory mapping it if possible
+ *
+ * \param theFile The input file, "-" for standard input
+ * \param theMemoryMap False if the data should always be read into memory
+ * \return The querydata
+ */
+// ----------------------------------------------------------------------
+
+unique_ptr<NFmiQueryData> read(const string &theFile, bool theMemoryMap)
+{
+  const bool mmap = (theMemoryMap && mappable(theFile));
+  try
+  {
+    return unique_ptr<NFmiQueryData>(new NFmiQueryData(theFile, mmap));
+  }
+  catch (std::exception &e)
+  {
+    throw runtime_error("Failed to read querydata from '" + theFile + "': " + e.what());
+  }
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Ask the kernel to read the given values of the file in advance
+ *
+ * The offset of the values is found by reading the header the same way
+ * newbase does before mapping the data: the header is followed by the
+ * number of values, the binary flag and a single separator character.
+ * This is only advice, hence nothing is done unless the file is an
+ * uncompressed binary querydata file whose size matches the header.
+ *
+ * \param theFile The querydata file
+ * \param theRanges The value index ranges needed
+ * \return True if the advice was given
+ */
+// ----------------------------------------------------------------------
+
+bool prefetch(const string &theFile, const IndexRanges &theRanges)
+{
+  if (theRanges.empty() || !mappable(theFile) || filesystem::is_directory(theFile))
+    return false;
+
+  size_t offset = 0;
+  try
+  {
+    ifstream in(theFile.c_str(), ios::binary);
+    if (!in)
+      return false;
+
+    NFmiQueryInfo info;
+    in >> info;
+
+    size_t size = 0;
+    int binary = 0;
+    in >> size >> binary;
+    in.get();
+    if (!in || binary == 0 || size != info.Size())
+      return false;
+
+    offset = static_cast<size_t>(in.tellg());
+    if (offset + size * sizeof(float) > filesystem::file_size(theFile))
+      return false;
+  }
+  catch (...)
+  {
+    // Not a plain querydata file, newbase will handle it
+    return false;
+  }
+
+  int fd = open(theFile.c_str(), O_RDONLY);
+  if (fd < 0)
+    return false;
+
+  for (const auto &range : theRanges)
+    posix_fadvise(fd,
+                  static_cast<off_t>(offset + range.first * sizeof(float)),
+                  static_cast<off_t>((range.second - range.first) * sizeof(float)),
+                  POSIX_FADV_WILLNEED);
+
+  close(fd);
+  return true;
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief The resident set size of the process
+ *
+ * \return The size in bytes, or zero if not available
+ */
+// ----------------------------------------------------------------------
+
+size_t residentMemory()
+{
+  ifstream in("/proc/self/statm");
+  size_t total = 0;
+  size_t resident = 0;
+  if (!(in >> total >> resident))
+    return 0;
+  return resident * static_cast<size_t>(sysconf(_SC_PAGESIZE));
+}
+
+}  // namespace QueryDataReader
+
+// ======================================================================
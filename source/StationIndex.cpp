@@ -0,0 +1,262 @@
+// ======================================================================
+/*!
+ * \file
+ * \brief Implementation of the StationIndex class
+ */
+// ======================================================================
+
+#include "StationIndex.h"
+#include <newbase/NFmiFastQueryInfo.h>
+#include <newbase/NFmiLocation.h>
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+
+namespace
+{
+// The distance limit is converted to a chord length using the polar radius
+// of the earth and a safety margin, so that no station within the limit
+// with any reasonable earth model is left out
+
+const double gMinEarthRadius = 6356752.0;
+const double gMargin = 1.01;
+
+void unit_vector(const NFmiPoint &theLonLat, double *theXYZ)
+{
+  const double lon = theLonLat.X() * M_PI / 180;
+  const double lat = theLonLat.Y() * M_PI / 180;
+  theXYZ[0] = std::cos(lat) * std::cos(lon);
+  theXYZ[1] = std::cos(lat) * std::sin(lon);
+  theXYZ[2] = std::sin(lat);
+}
+
+double squared_distance(const double *theA, const double *theB)
+{
+  const double dx = theA[0] - theB[0];
+  const double dy = theA[1] - theB[1];
+  const double dz = theA[2] - theB[2];
+  return dx * dx + dy * dy + dz * dz;
+}
+
+// Squared chord length covering the given distance in meters, negative for no stations
+double chord_limit(double theDistance)
+{
+  if (theDistance < 0)
+    return -1;
+  const double angle = gMargin * theDistance / gMinEarthRadius;
+  if (angle >= M_PI)
+    return std::numeric_limits<double>::infinity();
+  const double chord = 2 * std::sin(angle / 2);
+  return chord * chord;
+}
+
+}  // namespace
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Build the index from longitude-latitude points
+ *
+ * The indices returned by the queries are positions in the vector.
+ */
+// ----------------------------------------------------------------------
+
+StationIndex::StationIndex(const std::vector<NFmiPoint> &theLonLats)
+{
+  build(theLonLats);
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Build the index from all locations of the data
+ *
+ * The indices returned by the queries are location indices.
+ */
+// ----------------------------------------------------------------------
+
+StationIndex::StationIndex(NFmiFastQueryInfo &theInfo)
+{
+  std::vector<NFmiPoint> lonlats;
+  lonlats.reserve(theInfo.SizeLocations());
+  for (theInfo.ResetLocation(); theInfo.NextLocation();)
+    lonlats.push_back(theInfo.Location()->GetLocation());
+  build(lonlats);
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Build the tree
+ */
+// ----------------------------------------------------------------------
+
+void StationIndex::build(const std::vector<NFmiPoint> &theLonLats)
+{
+  itsNodes.resize(theLonLats.size());
+  for (std::size_t i = 0; i < theLonLats.size(); i++)
+  {
+    unit_vector(theLonLats[i], itsNodes[i].xyz);
+    itsNodes[i].index = i;
+    itsNodes[i].axis = 0;
+  }
+  split(0, itsNodes.size());
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Split the nodes in the given range recursively
+ *
+ * The node in the middle of the range is the median along the axis of
+ * the largest spread, the nodes before it are below it and the nodes
+ * after it above it along that axis.
+ */
+// ----------------------------------------------------------------------
+
+void StationIndex::split(std::size_t theFirst, std::size_t theLast)
+{
+  if (theLast - theFirst <= 1)
+    return;
+
+  double minimum[3] = {2, 2, 2};
+  double maximum[3] = {-2, -2, -2};
+  for (std::size_t i = theFirst; i < theLast; i++)
+    for (int k = 0; k < 3; k++)
+    {
+      minimum[k] = std::min(minimum[k], itsNodes[i].xyz[k]);
+      maximum[k] = std::max(maximum[k], itsNodes[i].xyz[k]);
+    }
+
+  int axis = 0;
+  for (int k = 1; k < 3; k++)
+    if (maximum[k] - minimum[k] > maximum[axis] - minimum[axis])
+      axis = k;
+
+  const std::size_t middle = theFirst + (theLast - theFirst) / 2;
+  std::nth_element(itsNodes.begin() + theFirst,
+                   itsNodes.begin() + middle,
+                   itsNodes.begin() + theLast,
+                   [axis](const Node &theA, const Node &theB)
+                   { return theA.xyz[axis] < theB.xyz[axis]; });
+  itsNodes[middle].axis = axis;
+
+  split(theFirst, middle);
+  split(middle + 1, theLast);
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Collect the nearest stations in the given range into the heap
+ *
+ * The heap holds at most theMaxNumber candidates with the farthest one
+ * on top. Subtrees are skipped only if they are strictly farther than
+ * the current limit, so that stations at equal distances are compared
+ * by their index.
+ */
+// ----------------------------------------------------------------------
+
+void StationIndex::search(std::size_t theFirst,
+                          std::size_t theLast,
+                          const double *theXYZ,
+                          std::size_t theMaxNumber,
+                          double theLimit,
+                          std::vector<Candidate> &theHeap) const
+{
+  if (theFirst >= theLast)
+    return;
+
+  const std::size_t middle = theFirst + (theLast - theFirst) / 2;
+  const Node &node = itsNodes[middle];
+
+  const double dist = squared_distance(theXYZ, node.xyz);
+  if (dist <= theLimit)
+  {
+    const Candidate candidate(dist, node.index);
+    if (theHeap.size() < theMaxNumber)
+    {
+      theHeap.push_back(candidate);
+      std::push_heap(theHeap.begin(), theHeap.end());
+    }
+    else if (candidate < theHeap.front())
+    {
+      std::pop_heap(theHeap.begin(), theHeap.end());
+      theHeap.back() = candidate;
+      std::push_heap(theHeap.begin(), theHeap.end());
+    }
+  }
+
+  if (theLast - theFirst == 1)
+    return;
+
+  const double delta = theXYZ[node.axis] - node.xyz[node.axis];
+
+  // Search the side containing the point first to tighten the limit quickly
+
+  if (delta < 0)
+    search(theFirst, middle, theXYZ, theMaxNumber, theLimit, theHeap);
+  else
+    search(middle + 1, theLast, theXYZ, theMaxNumber, theLimit, theHeap);
+
+  double limit = theLimit;
+  if (theHeap.size() >= theMaxNumber)
+    limit = std::min(limit, theHeap.front().first);
+
+  if (delta * delta <= limit)
+  {
+    if (delta < 0)
+      search(middle + 1, theLast, theXYZ, theMaxNumber, theLimit, theHeap);
+    else
+      search(theFirst, middle, theXYZ, theMaxNumber, theLimit, theHeap);
+  }
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Find the nearest stations
+ *
+ * \param theLonLat The coordinate
+ * \param theMaxNumber The maximum number of stations
+ * \param theMaxDistance The maximum distance in meters, negative for none
+ * \return The indices of the stations in order of increasing distance
+ */
+// ----------------------------------------------------------------------
+
+std::vector<unsigned long> StationIndex::nearest(const NFmiPoint &theLonLat,
+                                                 std::size_t theMaxNumber,
+                                                 double theMaxDistance) const
+{
+  std::vector<unsigned long> ret;
+  const double limit = chord_limit(theMaxDistance);
+  if (limit < 0 || theMaxNumber == 0)
+    return ret;
+
+  double xyz[3];
+  unit_vector(theLonLat, xyz);
+
+  std::vector<Candidate> heap;
+  search(0, itsNodes.size(), xyz, theMaxNumber, limit, heap);
+
+  std::sort_heap(heap.begin(), heap.end());
+  ret.reserve(heap.size());
+  for (const auto &candidate : heap)
+    ret.push_back(candidate.second);
+  return ret;
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Find all stations within the given distance
+ *
+ * \param theLonLat The coordinate
+ * \param theMaxDistance The maximum distance in meters, negative for none
+ * \return The indices of the stations in increasing order
+ */
+// ----------------------------------------------------------------------
+
+std::vector<unsigned long> StationIndex::within(const NFmiPoint &theLonLat,
+                                                double theMaxDistance) const
+{
+  std::vector<unsigned long> ret = nearest(theLonLat, itsNodes.size(), theMaxDistance);
+  std::sort(ret.begin(), ret.end());
+  return ret;
+}
+
+// ======================================================================
@@ -0,0 +1,54 @@
+// ======================================================================
+/*!
+ * \file
+ * \brief Implementation of namespace ThreadTools
+ */
+// ======================================================================
+
+#include "ThreadTools.h"
+#include <macgyver/StringConversion.h>
+#include <stdexcept>
+
+using namespace std;
+
+namespace ThreadTools
+{
+// ----------------------------------------------------------------------
+/*!
+ * \brief Parse a thread count option
+ *
+ * The option is either an absolute number of threads or a percentage
+ * of all cores, for example "8" or "50%". Zero means all cores.
+ *
+ * \param theOption The option value
+ * \return The number of threads to use, at least one
+ */
+// ----------------------------------------------------------------------
+
+unsigned int threadCount(const string &theOption)
+{
+  if (theOption.empty())
+    throw runtime_error("Empty thread count");
+
+  const unsigned int max_hardware = max(1u, boost::thread::hardware_concurrency());
+
+  int n = 0;
+  if (theOption.back() == '%')
+  {
+    n = Fmi::stoi(theOption.substr(0, theOption.size() - 1));
+    if (n < 0)
+      throw runtime_error("Negative thread percentage: " + theOption);
+    return max(1u, n * max_hardware / 100);
+  }
+
+  n = Fmi::stoi(theOption);
+  if (n < 0)
+    throw runtime_error("Negative thread count: " + theOption);
+  if (n == 0)
+    return max_hardware;
+  return static_cast<unsigned int>(n);
+}
+
+}  // namespace ThreadTools
+
+// ======================================================================
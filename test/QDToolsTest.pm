@@ -17,6 +17,8 @@ our @EXPORT = qw(
     FindResult
     EqualFiles
     CheckQuerydataEqual
+    RunName
+    RunFile
 );
 
 our $_wgs84;
@@ -166,7 +168,7 @@ sub EqualFiles($$)
     my ($fd1, $fd2);
 
     open ($fd1, CatCmd($file1) . " $file1 |");
-    open ($fd2, CatCmd($file2) . " $file1 |");
+    open ($fd2, CatCmd($file2) . " $file2 |");
     binmode($fd1);
     binmode($fd2);
 
@@ -219,4 +221,44 @@ sub CheckQuerydataEqual($$$)
     }
 }
 
+# ----------------------------------------------------------------------
+# Register the name of a test run. A run compared against the expected
+# result of another test, for example the same conversion with more
+# threads, gives a run name of its own so that its files do not collide
+# with those of the other test. Returns the run name.
+# ----------------------------------------------------------------------
+
+sub RunName($$$)
+{
+    my $usednames = shift;
+    my $name = shift;
+    my $runname = shift;
+
+    $runname = $name unless defined($runname);
+
+    if (exists($usednames->{$runname})) {
+        print "Error: $runname used more than once\n";
+        exit(1);
+    }
+    $usednames->{$runname} = 1;
+    return $runname;
+}
+
+# ----------------------------------------------------------------------
+# The temporary output file of a test run: the expected result file
+# without compression extension, with the test name replaced by the run
+# name and .tmp appended
+# ----------------------------------------------------------------------
+
+sub RunFile($$$)
+{
+    my $resultfile = shift;
+    my $name = shift;
+    my $runname = shift;
+
+    my $tmpfile = RemoveCompressionExt($resultfile);
+    $tmpfile =~ s/^(.*)\Q$name\E/$1$runname/;
+    return "$tmpfile.tmp";
+}
+
 1;
@@ -0,0 +1,124 @@
+// ======================================================================
+/*!
+ * \file
+ * \brief Micro-benchmark for UnpackGribValues
+ *
+ * Compares UnpackGribValues with the per value loop formerly used in
+ * gribtoqd and grib2toqd for scanning modes 0 and 64, and checks that
+ * both produce identical grids.
+ *
+ * Usage: gribunpack [nx] [ny] [rounds]
+ */
+// ======================================================================
+
+#include "GribTools.h"
+#include <fmt/format.h>
+
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <random>
+#include <stdexcept>
+#include <vector>
+
+namespace
+{
+// The original loops of FillGridData
+void UnpackReference(const std::vector<double> &theValues,
+                     long theScanningMode,
+                     double theMissingValue,
+                     NFmiDataMatrix<float> &theMatrix)
+{
+  const std::size_t gridXSize = theMatrix.NX();
+  const std::size_t gridYSize = theMatrix.NY();
+  if (theScanningMode == 0)
+  {
+    for (std::size_t i = 0; i < theValues.size(); i++)
+    {
+      if (theValues[i] == theMissingValue)
+        theMatrix[i % gridXSize][gridYSize - (i / gridXSize) - 1] = kFloatMissing;
+      else
+        theMatrix[i % gridXSize][gridYSize - (i / gridXSize) - 1] =
+            static_cast<float>(theValues[i]);
+    }
+  }
+  else
+  {
+    for (std::size_t i = 0; i < theValues.size(); i++)
+    {
+      if (theValues[i] == theMissingValue)
+        theMatrix[i % gridXSize][i / gridXSize] = kFloatMissing;
+      else
+        theMatrix[i % gridXSize][i / gridXSize] = static_cast<float>(theValues[i]);
+    }
+  }
+}
+
+template <typename Function>
+double Milliseconds(int theRounds, Function theFunction)
+{
+  auto start = std::chrono::steady_clock::now();
+  for (int round = 0; round < theRounds; round++)
+    theFunction();
+  auto end = std::chrono::steady_clock::now();
+  return std::chrono::duration<double, std::milli>(end - start).count() / theRounds;
+}
+
+}  // namespace
+
+int main(int argc, char *argv[])
+try
+{
+  const std::size_t nx = (argc > 1 ? std::stoul(argv[1]) : 1440);
+  const std::size_t ny = (argc > 2 ? std::stoul(argv[2]) : 721);
+  const int rounds = (argc > 3 ? std::stoi(argv[3]) : 20);
+  const double missing = 9999;
+
+  // Smooth field with roughly 10% missing values
+  std::mt19937 generator(12345);
+  std::uniform_real_distribution<double> distribution(0, 1);
+  std::vector<double> values(nx * ny);
+  for (std::size_t i = 0; i < values.size(); i++)
+    values[i] = (distribution(generator) < 0.1 ? missing : 273.15 + 20 * distribution(generator));
+
+  NFmiDataMatrix<float> reference(nx, ny);
+  NFmiDataMatrix<float> result(nx, ny);
+
+  std::cout << fmt::format("Grid {}x{}, {} rounds\n", nx, ny, rounds);
+  for (long mode : {0L, 64L})
+  {
+    const double t1 = Milliseconds(
+        rounds, [&]() { UnpackReference(values, mode, missing, reference); });
+    const double t2 = Milliseconds(
+        rounds,
+        [&]() { UnpackGribValues(values.data(), values.size(), mode, missing, result); });
+
+    for (std::size_t i = 0; i < nx; i++)
+      for (std::size_t j = 0; j < ny; j++)
+        if (reference[i][j] != result[i][j])
+          throw std::runtime_error(
+              fmt::format("Scanning mode {}: results differ at {},{}", mode, i, j));
+
+    std::cout << fmt::format(
+        "Scanning mode {:3}: loop {:8.3f} ms, unpack {:8.3f} ms, speedup {:.2f}\n",
+        mode,
+        t1,
+        t2,
+        t1 / t2);
+  }
+
+  // The remaining modes have no reference implementation
+  for (long mode : {32L, 96L, 128L, 144L, 192L, 224L})
+  {
+    const double t = Milliseconds(
+        rounds,
+        [&]() { UnpackGribValues(values.data(), values.size(), mode, missing, result); });
+    std::cout << fmt::format("Scanning mode {:3}: unpack {:8.3f} ms\n", mode, t);
+  }
+  return 0;
+}
+catch (std::exception &e)
+{
+  std::cerr << "Error: " << e.what() << std::endl;
+  return 1;
+}
@@ -0,0 +1,154 @@
+// ======================================================================
+/*!
+ * \file
+ * \brief Benchmark for memory mapped querydata input
+ *
+ * Writes a synthetic grid to a temporary file and reads it back both
+ * memory mapped and fully into memory, as the tools using
+ * QueryDataReader do. Reports the time to open the data and the
+ * resident set size after opening it and after reading one time step
+ * of one parameter, which is typical for qdcrop and qdpoint.
+ *
+ * Usage: qdread [nx] [ny] [times] [params]
+ */
+// ======================================================================
+
+#include "QueryDataReader.h"
+#include <fmt/format.h>
+#include <newbase/NFmiAreaFactory.h>
+#include <newbase/NFmiFastQueryInfo.h>
+#include <newbase/NFmiGrid.h>
+#include <newbase/NFmiQueryData.h>
+#include <newbase/NFmiQueryDataUtil.h>
+#include <newbase/NFmiTimeList.h>
+
+#include <chrono>
+#include <filesystem>
+#include <iostream>
+#include <memory>
+#include <stdexcept>
+#include <unistd.h>
+
+namespace
+{
+double Megabytes(std::size_t theBytes)
+{
+  return theBytes / (1024.0 * 1024.0);
+}
+
+// Grid covering the globe, with the values of each time step in a single parameter differing
+void CreateData(const std::string &theFile,
+                std::size_t theWidth,
+                std::size_t theHeight,
+                int theTimes,
+                int theParams)
+{
+  NFmiParamBag pbag;
+  for (int p = 0; p < theParams; p++)
+    pbag.Add(NFmiDataIdent(NFmiParam(kFmiTemperature + p, fmt::format("Param{}", p))));
+
+  NFmiMetTime origintime(2026, 1, 1, 0, 0, 0);
+  NFmiTimeList tlist;
+  for (int t = 0; t < theTimes; t++)
+  {
+    auto *validtime = new NFmiMetTime(origintime);
+    validtime->ChangeByHours(t);
+    tlist.Add(validtime);
+  }
+
+  std::shared_ptr<NFmiArea> area = NFmiAreaFactory::Create("latlon:-180,-90,180,90");
+  NFmiGrid grid(area->Clone(), theWidth, theHeight);
+
+  NFmiLevelBag lbag;
+  lbag.AddLevel(NFmiLevel(kFmiGroundSurface, "Ground", 0));
+
+  NFmiFastQueryInfo qi(NFmiParamDescriptor(pbag),
+                       NFmiTimeDescriptor(origintime, tlist),
+                       NFmiHPlaceDescriptor(grid),
+                       NFmiVPlaceDescriptor(lbag));
+  std::unique_ptr<NFmiQueryData> data(NFmiQueryDataUtil::CreateEmptyData(qi));
+  if (!data)
+    throw std::runtime_error("Could not allocate memory for the test data");
+
+  NFmiFastQueryInfo info(data.get());
+  for (info.ResetParam(); info.NextParam();)
+    for (info.ResetTime(); info.NextTime();)
+      for (info.ResetLocation(); info.NextLocation();)
+        info.FloatValue(static_cast<float>(info.TimeIndex() + info.LocationIndex() % 100));
+
+  data->Write(theFile);
+}
+
+void Measure(const std::string &theFile, bool theMemoryMap)
+{
+  const std::size_t before = QueryDataReader::residentMemory();
+
+  auto start = std::chrono::steady_clock::now();
+  std::unique_ptr<NFmiQueryData> qd = QueryDataReader::read(theFile, theMemoryMap);
+  auto end = std::chrono::steady_clock::now();
+  const double ms = std::chrono::duration<double, std::milli>(end - start).count();
+
+  const std::size_t opened = QueryDataReader::residentMemory();
+
+  NFmiFastQueryInfo info(qd.get());
+  info.FirstParam();
+  info.FirstLevel();
+  info.FirstTime();
+  double sum = 0;
+  for (info.ResetLocation(); info.NextLocation();)
+    sum += info.FloatValue();
+
+  const std::size_t sliced = QueryDataReader::residentMemory();
+
+  std::cout << fmt::format(
+      "{:8}: open {:9.2f} ms, RSS before {:8.1f} MB, after open {:8.1f} MB, after slice "
+      "{:8.1f} MB (checksum {})\n",
+      (theMemoryMap ? "mmap" : "read"),
+      ms,
+      Megabytes(before),
+      Megabytes(opened),
+      Megabytes(sliced),
+      sum);
+}
+
+}  // namespace
+
+int main(int argc, char *argv[])
+try
+{
+  const std::size_t nx = (argc > 1 ? std::stoul(argv[1]) : 720);
+  const std::size_t ny = (argc > 2 ? std::stoul(argv[2]) : 361);
+  const int times = (argc > 3 ? std::stoi(argv[3]) : 24);
+  const int params = (argc > 4 ? std::stoi(argv[4]) : 4);
+
+  const std::string file = (std::filesystem::temp_directory_path() /
+                            fmt::format("qdread_{}.sqd", static_cast<long>(getpid())))
+                               .string();
+
+  CreateData(file, nx, ny, times, params);
+  std::cout << fmt::format("Grid {}x{}, {} times, {} parameters, file size {:.1f} MB\n",
+                           nx,
+                           ny,
+                           times,
+                           params,
+                           Megabytes(std::filesystem::file_size(file)));
+
+  try
+  {
+    // The memory mapped case first so that freed heap memory does not hide its footprint
+    Measure(file, true);
+    Measure(file, false);
+  }
+  catch (...)
+  {
+    std::filesystem::remove(file);
+    throw;
+  }
+  std::filesystem::remove(file);
+  return 0;
+}
+catch (std::exception &e)
+{
+  std::cerr << "Error: " << e.what() << std::endl;
+  return 1;
+}
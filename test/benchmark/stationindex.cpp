@@ -0,0 +1,165 @@
+// ======================================================================
+/*!
+ * \file
+ * \brief Micro-benchmark for StationIndex
+ *
+ * Compares nearest station and radius queries of StationIndex with the
+ * loop over all stations formerly used in QueryDataManager, and checks
+ * that both find the same stations.
+ *
+ * Usage: stationindex [stations] [queries] [radius_km]
+ */
+// ======================================================================
+
+#include "StationIndex.h"
+#include <fmt/format.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <iostream>
+#include <limits>
+#include <memory>
+#include <random>
+#include <stdexcept>
+#include <vector>
+
+namespace
+{
+// Great circle distance in meters
+double Distance(const NFmiPoint &theA, const NFmiPoint &theB)
+{
+  const double rad = M_PI / 180;
+  const double dlat = (theB.Y() - theA.Y()) * rad;
+  const double dlon = (theB.X() - theA.X()) * rad;
+  const double a = std::sin(dlat / 2) * std::sin(dlat / 2) + std::cos(theA.Y() * rad) *
+                                                                 std::cos(theB.Y() * rad) *
+                                                                 std::sin(dlon / 2) *
+                                                                 std::sin(dlon / 2);
+  return 2 * 6371220.0 * std::asin(std::min(1.0, std::sqrt(a)));
+}
+
+unsigned long NearestReference(const std::vector<NFmiPoint> &theStations,
+                               const NFmiPoint &theLonLat)
+{
+  unsigned long best = 0;
+  double bestdist = -1;
+  for (unsigned long i = 0; i < theStations.size(); i++)
+  {
+    const double dist = Distance(theStations[i], theLonLat);
+    if (bestdist < 0 || dist < bestdist)
+    {
+      best = i;
+      bestdist = dist;
+    }
+  }
+  return best;
+}
+
+std::vector<unsigned long> WithinReference(const std::vector<NFmiPoint> &theStations,
+                                           const NFmiPoint &theLonLat,
+                                           double theMaxDistance)
+{
+  std::vector<unsigned long> ret;
+  for (unsigned long i = 0; i < theStations.size(); i++)
+    if (Distance(theStations[i], theLonLat) <= theMaxDistance)
+      ret.push_back(i);
+  return ret;
+}
+
+template <typename Function>
+double Milliseconds(Function theFunction)
+{
+  auto start = std::chrono::steady_clock::now();
+  theFunction();
+  auto end = std::chrono::steady_clock::now();
+  return std::chrono::duration<double, std::milli>(end - start).count();
+}
+
+}  // namespace
+
+int main(int argc, char *argv[])
+try
+{
+  const std::size_t nstations = (argc > 1 ? std::stoul(argv[1]) : 20000);
+  const std::size_t nqueries = (argc > 2 ? std::stoul(argv[2]) : 2000);
+  const double radius = 1000 * (argc > 3 ? std::stod(argv[3]) : 50);
+
+  // Stations and queries concentrated on Europe, as in typical observation data
+  std::mt19937 generator(12345);
+  std::uniform_real_distribution<double> lon(-10, 40);
+  std::uniform_real_distribution<double> lat(35, 72);
+
+  std::vector<NFmiPoint> stations;
+  for (std::size_t i = 0; i < nstations; i++)
+    stations.push_back(NFmiPoint(lon(generator), lat(generator)));
+
+  std::vector<NFmiPoint> queries;
+  for (std::size_t i = 0; i < nqueries; i++)
+    queries.push_back(NFmiPoint(lon(generator), lat(generator)));
+
+  std::unique_ptr<StationIndex> index;
+  const double tbuild = Milliseconds([&]() { index.reset(new StationIndex(stations)); });
+
+  std::vector<unsigned long> nearest1(nqueries);
+  std::vector<unsigned long> nearest2(nqueries);
+  std::vector<std::vector<unsigned long> > within1(nqueries);
+  std::vector<std::vector<unsigned long> > within2(nqueries);
+
+  const double t1 = Milliseconds(
+      [&]()
+      {
+        for (std::size_t i = 0; i < nqueries; i++)
+          nearest1[i] = NearestReference(stations, queries[i]);
+      });
+  const double unlimited = std::numeric_limits<double>::infinity();
+  const double t2 = Milliseconds(
+      [&]()
+      {
+        for (std::size_t i = 0; i < nqueries; i++)
+          nearest2[i] = index->nearest(queries[i], 1, unlimited).front();
+      });
+  const double t3 = Milliseconds(
+      [&]()
+      {
+        for (std::size_t i = 0; i < nqueries; i++)
+          within1[i] = WithinReference(stations, queries[i], radius);
+      });
+  const double t4 = Milliseconds(
+      [&]()
+      {
+        // The index returns a superset, the caller checks the exact distances
+        for (std::size_t i = 0; i < nqueries; i++)
+          for (unsigned long idx : index->within(queries[i], radius))
+            if (Distance(stations[idx], queries[i]) <= radius)
+              within2[i].push_back(idx);
+      });
+
+  for (std::size_t i = 0; i < nqueries; i++)
+  {
+    if (nearest1[i] != nearest2[i])
+      throw std::runtime_error(fmt::format("Nearest stations differ for query {}", i));
+    if (within1[i] != within2[i])
+      throw std::runtime_error(fmt::format("Stations within radius differ for query {}", i));
+  }
+
+  std::cout << fmt::format("{} stations, {} queries, index built in {:.3f} ms\n",
+                           nstations,
+                           nqueries,
+                           tbuild)
+            << fmt::format("Nearest: loop {:9.3f} ms, index {:9.3f} ms, speedup {:.1f}\n",
+                           t1,
+                           t2,
+                           t1 / t2)
+            << fmt::format("Within {:.0f} km: loop {:9.3f} ms, index {:9.3f} ms, speedup {:.1f}\n",
+                           radius / 1000,
+                           t3,
+                           t4,
+                           t3 / t4);
+  return 0;
+}
+catch (std::exception &e)
+{
+  std::cerr << "Error: " << e.what() << std::endl;
+  return 1;
+}